@@ -5,9 +5,15 @@
 #include <sys/stat.h>
 #include <stdarg.h>
 #include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
 #include <pthread.h>
 #include <stx/btree_multimap.h>
 #include <iostream>
+#include <vector>
+#include <algorithm>
+#include <iterator>
 #include "bptree.h"
 
 using namespace std;
@@ -16,156 +22,2550 @@ FILE *stderrfile;
 pthread_mutex_t ILINK_LOCK = PTHREAD_MUTEX_INITIALIZER;
 //const char NULL_PAYLOAD[MAX_PAYLOAD_LEN + 1];
 
-
+//the transaction this thread has open, a thread may only have one
+static __thread TXNState *threadTxn;
 
 //list of index for  each data type
 DBLink  *dbLookup;
 
+//commit timestamps: the last one handed out, and the last one whose writes
+//are all in the trees. Snapshots are taken at the stable one.
+static uint64_t lastCommitTs;
+static uint64_t stableTs;
+static pthread_mutex_t TS_LOCK = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t TS_PUBLISHED = PTHREAD_COND_INITIALIZER;
+//snapshots of open transactions whose thread got no snapshot slot
+static std::multiset<uint64_t> activeSnapshots;
+
+//a transaction pins its snapshot in a slot of the thread running it, so
+//beginning one takes no lock. Slots are claimed once per thread and given
+//back when the thread exits.
+#define SNAPSHOT_SLOTS 256
+
+struct SnapshotSlot
+{
+    //pinned snapshot, TS_INFINITY when the thread has no transaction open
+    volatile uint64_t ts;
+    int inUse;
+    //a slot per cache line, pinning does not bounce a neighbour's line
+    char pad[64 - sizeof(uint64_t) - sizeof(int)];
+};
+
+static SnapshotSlot snapshotSlots[SNAPSHOT_SLOTS];
+//slots ever claimed, garbage collection scans no further
+static int snapshotSlotsHigh;
+static pthread_key_t snapshotSlotKey;
+static pthread_once_t snapshotSlotOnce = PTHREAD_ONCE_INIT;
+//-1 not claimed yet, -2 all slots were taken
+static __thread int threadSlot = -1;
+
+//TXNState::snapshotPin, otherwise the number of the slot it is pinned in
+#define PIN_NONE -1
+#define PIN_SHARED -2
+
+//transaction ids, 0 is never handed out
+static uint32_t lastTid;
+
+//finished transactions kept for reuse by the thread that ran them, freed
+//when the thread exits
+#define TXN_FREELIST_MAX 8
+static __thread TXNState *freeTxns;
+static __thread int freeTxnCount;
+static pthread_key_t freeTxnKey;
+static pthread_once_t freeTxnOnce = PTHREAD_ONCE_INIT;
+//freeTxnKey is set on this thread
+static __thread int freeTxnKeySet;
+
+//cursors of the READ_ONLY transaction open on this thread, which take no
+//allocation unless it reads more indexes than there are slots
+#define READ_ONLY_CURSORS 4
+static __thread CursorLink readOnlyCursors[READ_ONLY_CURSORS];
+static __thread int readOnlyCursorCount;
+
+//most ended versions a commit reclaims per index beyond the ones it ended
+#define GC_BATCH 32
+
+//versions commits insert into an index's mem before it is frozen for the
+//merge thread
+#define MEMTABLE_MAX 4096
+//pairs the merge thread moves from frozen to nbt per hold of the latch
+#define MERGE_BATCH 256
+//nbt, frozen and mem, as p_layer numbers them
+#define INDEX_LAYERS 3
+
+//the merge thread sleeps until a commit freezes a mem
+static pthread_mutex_t MERGE_LOCK = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t MERGE_WAKE = PTHREAD_COND_INITIALIZER;
+static bool mergePending;
+
+//write-ahead log records. A commit is one log frame: LOG_COMMIT with its
+//timestamp, then the LOG_INSERT, LOG_DELETE and LOG_DELETE_ALL records of
+//every index it wrote in the order commit applied them. Only committed
+//writes are logged, so replay never has to undo anything.
+#define LOG_CREATE 1
+#define LOG_COMMIT 2
+#define LOG_INSERT 3
+#define LOG_DELETE 4
+#define LOG_DELETE_ALL 5
+
+//the log is replayed and opened by the first call that needs it
+static pthread_once_t storageOnce = PTHREAD_ONCE_INIT;
+static ErrCode storageStatus;
+//id the next index created gets, guarded by ILINK_LOCK
+static uint32_t nextIndexId;
+
+//most threads replaying the log at startup
+#define RECOVERY_THREADS_MAX 16
+
+//page map of the last checkpoint in ENV_DIRECTORY, written to
+//CHECKPOINT_TMP first, and the prefix of the page file of each index
+#define CHECKPOINT_FILE "checkpoint"
+#define CHECKPOINT_TMP "checkpoint.tmp"
+#define CHECKPOINT_MAGIC "NWTCKPT2"
+#define CHECKPOINT_PAGES "pages."
+//page bytes written per second at most, so checkpoints leave the disk to
+//the log
+#define CHECKPOINT_RATE (16 << 20)
+//leaves copied per index latch hold
+#define CHECKPOINT_BATCH 512
+//log growth that makes the background checkpointer take a checkpoint
+#define CHECKPOINT_LOG_BYTES (4 * (Lsn) WAL_SEGMENT_BYTES)
+//end of the page map
+#define CKPT_END 0
+
+//one checkpoint at a time; the commit timestamp and log position the last
+//one covers
+static pthread_mutex_t CKPT_LOCK = PTHREAD_MUTEX_INITIALIZER;
+static uint64_t checkpointTs;
+static Lsn checkpointLsn;
+
+/**
+ *convert between the API Key and the key type stored in each tree
+ * */
+static inline void p_nativeKey(const Key *k, int32_t *out)
+{
+    *out = k->keyval.shortkey;
+}
+
+static inline void p_nativeKey(const Key *k, int64_t *out)
+{
+    *out = k->keyval.intkey;
+}
+
+static inline void p_nativeKey(const Key *k, string *out)
+{
+    out->assign(k->keyval.charkey);
+}
+
+static inline void p_setKey(Key *k, int32_t v)
+{
+    k->type = SHORT;
+    k->keyval.shortkey = v;
+}
+
+static inline void p_setKey(Key *k, int64_t v)
+{
+    k->type = INT;
+    k->keyval.intkey = v;
+}
+
+static inline void p_setKey(Key *k, const string &v)
+{
+    k->type = VARCHAR;
+    strncpy(k->keyval.charkey, v.c_str(), MAX_VARCHAR_LEN);
+    k->keyval.charkey[MAX_VARCHAR_LEN] = '\0';
+}
+
 /**
- *get key, from the bdbimpl *
+ *Commit timestamp bookkeeping
  * */
-int p_setKeyDataFromKey(Key *k, void *key)
+/**
+ * Fields of log records, in host byte order. Keys and payloads are at most
+ * MAX_VARCHAR_LEN and MAX_PAYLOAD_LEN long, their length fits a byte.
+ */
+static inline void p_logU8(std::string &out, uint8_t v)
+{
+    out.push_back((char) v);
+}
+
+static inline void p_logU32(std::string &out, uint32_t v)
+{
+    out.append((const char *) &v, sizeof(v));
+}
+
+static inline void p_logU64(std::string &out, uint64_t v)
+{
+    out.append((const char *) &v, sizeof(v));
+}
+
+static inline void p_logString(std::string &out, const char *p, size_t len)
 {
+    p_logU8(out, (uint8_t) len);
+    out.append(p, len);
+}
 
+static void p_logKey(std::string &out, const Key *k)
+{
     switch (k->type) {
         case SHORT:
-        {
-            //the key is a 32-bit integer
-            //hack: put the converted int after the plain int
-            uint8_t *data = ((uint8_t *) k->keyval.charkey) + 4;
-            uint32_t i = k->keyval.shortkey;
-            data[3] = (i & 0xFF);
-            data[2] = (i & 0xFF00) >> 8;
-            data[1] = (i & 0xFF0000) >> 16;
-            data[0] = (i & 0xFF000000) >> 24;
-            data[0] ^= 0x80;
-	    key = new short;
-            key = data;
-	    return 1;
-            break;  
-        }
+            p_logU32(out, (uint32_t) k->keyval.shortkey);
+            break;
+        case INT:
+            p_logU64(out, (uint64_t) k->keyval.intkey);
+            break;
+        case VARCHAR:
+            p_logString(out, k->keyval.charkey, strlen(k->keyval.charkey));
+            break;
+        default:
+            break;
+    }
+}
+
+/**
+ * Position in a log frame being replayed
+ */
+struct LogReader
+{
+    const char *p;
+    const char *end;
+};
+
+static bool p_readBytes(LogReader *r, void *out, size_t len)
+{
+    if ((size_t) (r->end - r->p) < len)
+        return false;
+    memcpy(out, r->p, len);
+    r->p += len;
+    return true;
+}
+
+static bool p_readString(LogReader *r, char *out)
+{
+    uint8_t len;
+    if (!p_readBytes(r, &len, 1) || !p_readBytes(r, out, len))
+        return false;
+    out[len] = '\0';
+    return true;
+}
+
+static bool p_readKey(LogReader *r, KeyType type, Key *k)
+{
+    memset(k, 0, sizeof(Key));
+    k->type = type;
+    switch (type) {
+        case SHORT:
+            return p_readBytes(r, &(k->keyval.shortkey), sizeof(int32_t));
         case INT:
-        {
-            //the key is a 64-bit integer
-            //hack: put the converted int after the plain int
-            uint8_t *data = ((uint8_t *) k->keyval.charkey) + 8;
-            uint64_t i = k->keyval.intkey;
-            data[7] = (i & 0xFFLL);
-            data[6] = (i & 0xFF00LL) >> 8;
-            data[5] = (i & 0xFF0000LL) >> 16;
-            data[4] = (i & 0xFF000000LL) >> 24;
-            data[3] = (i & 0xFF00000000LL) >> 32;
-            data[2] = (i & 0xFF0000000000LL) >> 40;
-            data[1] = (i & 0xFF000000000000LL) >> 48;
-            data[0] = (i & 0xFF00000000000000LL) >> 56;
-            data[0] ^= 0x80;
-            key = new int;
-	    key = data;
-	    return 2;
+            return p_readBytes(r, &(k->keyval.intkey), sizeof(int64_t));
+        case VARCHAR:
+            return p_readString(r, k->keyval.charkey);
+        default:
+            return false;
+    }
+}
+
+static inline uint64_t p_stableTs()
+{
+    return __sync_add_and_fetch(&stableTs, 0);
+}
+
+static void p_releaseSlot(void *arg)
+{
+    SnapshotSlot *slot = (SnapshotSlot *) arg;
+    slot->ts = TS_INFINITY;
+    __sync_synchronize();
+    slot->inUse = 0;
+}
+
+static void p_initSlotKey()
+{
+    pthread_key_create(&snapshotSlotKey, p_releaseSlot);
+}
+
+static void p_releaseFreeTxns(void *arg)
+{
+    TXNState **list = (TXNState **) arg;
+    while (*list != NULL) {
+        TXNState *next = (*list)->nextFree;
+        delete *list;
+        *list = next;
+    }
+    freeTxnCount = 0;
+}
+
+static void p_initFreeTxnKey()
+{
+    pthread_key_create(&freeTxnKey, p_releaseFreeTxns);
+}
+
+static void p_claimSlot()
+{
+    threadSlot = -2;
+    pthread_once(&snapshotSlotOnce, p_initSlotKey);
+    for (int i = 0; i < SNAPSHOT_SLOTS; i++) {
+        if (snapshotSlots[i].inUse || !__sync_bool_compare_and_swap(&(snapshotSlots[i].inUse), 0, 1))
+            continue;
+        snapshotSlots[i].ts = TS_INFINITY;
+        int high = snapshotSlotsHigh;
+        while (high < i + 1 && !__sync_bool_compare_and_swap(&snapshotSlotsHigh, high, i + 1))
+            high = snapshotSlotsHigh;
+        pthread_setspecific(snapshotSlotKey, &(snapshotSlots[i]));
+        threadSlot = i;
+        return;
+    }
+}
+
+/**
+ * Take the transaction's snapshot and keep garbage collection from removing
+ * anything it can see. The slot gets a value read before the store is
+ * visible, the transaction one read after: a collector that missed the
+ * store computed its horizon no later than that, so the snapshot is safe.
+ */
+static void p_takeSnapshot(TXNState *txne)
+{
+    if (threadSlot == -1)
+        p_claimSlot();
+    if (threadSlot >= 0) {
+        SnapshotSlot *slot = &(snapshotSlots[threadSlot]);
+        slot->ts = p_stableTs();
+        __sync_synchronize();
+        txne->snapshotTs = p_stableTs();
+        txne->snapshotPin = threadSlot;
+        return;
+    }
+    pthread_mutex_lock(&TS_LOCK);
+    txne->snapshotTs = stableTs;
+    activeSnapshots.insert(txne->snapshotTs);
+    pthread_mutex_unlock(&TS_LOCK);
+    txne->snapshotPin = PIN_SHARED;
+}
+
+static void p_releaseSnapshot(TXNState *txne)
+{
+    if (txne->snapshotPin >= 0) {
+        __sync_synchronize();
+        snapshotSlots[txne->snapshotPin].ts = TS_INFINITY;
+    } else if (txne->snapshotPin == PIN_SHARED) {
+        pthread_mutex_lock(&TS_LOCK);
+        std::multiset<uint64_t>::iterator it = activeSnapshots.find(txne->snapshotTs);
+        if (it != activeSnapshots.end())
+            activeSnapshots.erase(it);
+        pthread_mutex_unlock(&TS_LOCK);
+    }
+    txne->snapshotPin = PIN_NONE;
+}
+
+/**
+ * Hand out the next commit timestamp and log the commit's frame under it.
+ * Both happen under TS_LOCK, so the log holds commits in timestamp order
+ * and a log position tells a checkpoint which commits came before it.
+ */
+static uint64_t p_nextCommitTs(std::string &frame, Lsn *lsn)
+{
+    pthread_mutex_lock(&TS_LOCK);
+    uint64_t ts = ++lastCommitTs;
+    memcpy(&frame[1], &ts, sizeof(ts));
+    *lsn = walAppend(frame.data(), frame.size());
+    pthread_mutex_unlock(&TS_LOCK);
+    return ts;
+}
+
+/**
+ * Make commit ts visible to new snapshots. Commits publish in timestamp
+ * order, so a snapshot never sees a later commit without an earlier one.
+ */
+static void p_publish(uint64_t ts)
+{
+    pthread_mutex_lock(&TS_LOCK);
+    while (stableTs != ts - 1)
+        pthread_cond_wait(&TS_PUBLISHED, &TS_LOCK);
+    stableTs = ts;
+    pthread_cond_broadcast(&TS_PUBLISHED);
+    pthread_mutex_unlock(&TS_LOCK);
+}
+
+/**
+ * Versions that ended at or before this timestamp are seen by no snapshot
+ */
+static uint64_t p_gcHorizon()
+{
+    uint64_t ts = p_stableTs();
+    __sync_synchronize();
+    int high = snapshotSlotsHigh;
+    for (int i = 0; i < high; i++) {
+        uint64_t pinned = snapshotSlots[i].ts;
+        if (snapshotSlots[i].inUse && pinned < ts)
+            ts = pinned;
+    }
+    pthread_mutex_lock(&TS_LOCK);
+    if (!activeSnapshots.empty() && *(activeSnapshots.begin()) < ts)
+        ts = *(activeSnapshots.begin());
+    pthread_mutex_unlock(&TS_LOCK);
+    return ts;
+}
+
+/**
+ * Timestamp a transaction reads at. A serializable or optimistic transaction
+ * reads the latest committed data, its shared locks or its commit time
+ * validation keep that from changing under it.
+ */
+static inline uint64_t p_readTs(TXNState *txne)
+{
+    if (txne == NULL || txne->isolation == SERIALIZABLE || txne->isolation == OPTIMISTIC)
+        return p_stableTs();
+    return txne->snapshotTs;
+}
+
+/**
+ *Find the write set a transaction has on an index, optionally making it.
+ * */
+static IndexWriteSet *p_findWriteSet(TXNState *txne, DBLink *db, int create)
+{
+    if (txne == NULL)
+        return NULL;
+    IndexWriteSet *ws = txne->writeSet;
+    while (ws != NULL) {
+        if (ws->db == db)
+            return ws;
+        ws = ws->link;
+    }
+    if (!create)
+        return NULL;
+    ws = new IndexWriteSet;
+    ws->db = db;
+    ws->link = txne->writeSet;
+    txne->writeSet = ws;
+    return ws;
+}
+
+static const KeyWrite *p_findKeyWrite(IndexWriteSet *ws, const Key &k)
+{
+    if (ws == NULL)
+        return NULL;
+    KeyWriteMap::iterator it = ws->keys.find(k);
+    if (it == ws->keys.end())
+        return NULL;
+    return &(it->second);
+}
+
+/**
+ * Layer i of an index: nbt, then frozen, then mem. NULL when there is no
+ * frozen memtable.
+ */
+template <typename tree_type>
+static inline tree_type *p_layer(DBLink *db, int i)
+{
+    return (tree_type *) ((i == 0) ? db->nbt : ((i == 1) ? db->frozen : db->mem));
+}
+
+/**
+ * Payloads visible under key nk: the versions committed as of snapshot, as
+ * changed by the transaction's own pending writes. Caller holds the index
+ * latch.
+ */
+template <typename tree_type, typename key_type>
+static void p_visiblePayloads(DBLink *db, const key_type &nk, const KeyWrite *w,
+        uint64_t snapshot, std::vector<std::string> &out)
+{
+    out.clear();
+    for (int l = 0; (l < INDEX_LAYERS) && (w == NULL || !w->deleteAll); l++) {
+        tree_type *t = p_layer<tree_type>(db, l);
+        if (t == NULL)
+            continue;
+        for (typename tree_type::iterator it = t->lower_bound(nk);
+                (it != t->end()) && (it.key() == nk); ++it) {
+            const PayloadVersion &v = it.data();
+            if (!v.visible(snapshot))
+                continue;
+            if (w == NULL || w->deleted.count(v.payload) == 0)
+                out.push_back(v.payload);
+        }
+    }
+    if (w != NULL)
+        out.insert(out.end(), w->inserted.begin(), w->inserted.end());
+    //duplicates come back in payload order so a cursor can resume in them
+    std::sort(out.begin(), out.end());
+}
+
+/**
+ * Smallest key after *after (or the smallest key at all when after is NULL)
+ * in any layer of the index. Caller holds the index latch.
+ */
+template <typename tree_type, typename key_type>
+static bool p_indexNextKey(DBLink *db, const key_type *after, key_type *out)
+{
+    bool found = false;
+    for (int l = 0; l < INDEX_LAYERS; l++) {
+        tree_type *t = p_layer<tree_type>(db, l);
+        if (t == NULL)
+            continue;
+        typename tree_type::iterator it = (after != NULL) ? t->upper_bound(*after) : t->begin();
+        if ((it != t->end()) && (!found || it.key() < *out)) {
+            *out = it.key();
+            found = true;
+        }
+    }
+    return found;
+}
+
+/**
+ * Smallest key after *after (or the smallest key at all when after is NULL)
+ * that is in the index or was inserted by the transaction. The key may have
+ * no version visible to the caller's snapshot.
+ */
+template <typename tree_type, typename key_type>
+static bool p_nextKey(DBLink *db, IndexWriteSet *ws, const key_type *after, key_type *out)
+{
+    bool found = p_indexNextKey<tree_type, key_type>(db, after, out);
+    if (ws != NULL) {
+        KeyWriteMap::iterator oit = ws->keys.begin();
+        if (after != NULL) {
+            Key ak;
+            p_setKey(&ak, *after);
+            oit = ws->keys.upper_bound(ak);
+        }
+        for (; oit != ws->keys.end(); ++oit) {
+            if (oit->second.inserted.empty())
+                continue;
+            key_type ok;
+            p_nativeKey(&(oit->first), &ok);
+            if (!found || ok < *out) {
+                *out = ok;
+                found = true;
+            }
+            break;
+        }
+    }
+    return found;
+}
+
+/**
+ *Cursor get/getNext use: the handle's own outside a transaction, otherwise
+ *the one the transaction keeps for this handle, in a slot of the thread for
+ *a READ_ONLY one
+ * */
+static IndexCursor *p_cursorFor(STXDBState *state, TXNState *txne)
+{
+    if (txne == NULL) {
+        //a transaction used the handle since the last call without one
+        if (state->tid != 0) {
+            state->tid = 0;
+            memset(&(state->cursor), 0, sizeof(IndexCursor));
+        }
+        return &(state->cursor);
+    }
+    state->tid = txne->tid;
+    if (txne->threadCursors) {
+        for (int i = 0; i < readOnlyCursorCount; i++) {
+            if (readOnlyCursors[i].idx == state)
+                return &(readOnlyCursors[i].cursor);
+        }
+    }
+    CursorLink *c = txne->cursorLink;
+    while (c != NULL) {
+        if (c->idx == state)
+            return &(c->cursor);
+        c = c->cursorLink;
+    }
+    if (txne->isolation == READ_ONLY && readOnlyCursorCount < READ_ONLY_CURSORS) {
+        c = &(readOnlyCursors[readOnlyCursorCount++]);
+        txne->threadCursors = 1;
+        memset(c, 0, sizeof(CursorLink));
+        c->idx = state;
+        return &(c->cursor);
+    }
+    c = new CursorLink;
+    memset(c, 0, sizeof(CursorLink));
+    c->idx = state;
+    c->cursorLink = txne->cursorLink;
+    txne->cursorLink = c;
+    return &(c->cursor);
+}
+
+//what a RangeLock covers
+#define RANGE_KEY 0
+#define RANGE_GAP 1
+#define RANGE_END 2
+
+/**
+ * A key, the gap before a key, or the gap after the last key, that a read
+ * depends on or an insert goes into
+ */
+struct RangeLock
+{
+    DBLink *db;
+    int on;
+    Key key;
+};
+
+static bool p_sameRange(const RangeLock &a, const RangeLock &b)
+{
+    keyless less;
+    if (a.db != b.db || a.on != b.on)
+        return false;
+    return (a.on == RANGE_END) || (!less(a.key, b.key) && !less(b.key, a.key));
+}
+
+static void p_addKeyRange(DBLink *db, const Key &k, std::vector<RangeLock> &out)
+{
+    RangeLock r;
+    r.db = db;
+    r.on = RANGE_KEY;
+    memcpy(&(r.key), &k, sizeof(Key));
+    out.push_back(r);
+}
+
+/**
+ * The gap following *after in the index (the first gap when after is NULL),
+ * named by the key that ends it. Caller holds the index latch.
+ */
+template <typename tree_type, typename key_type>
+static void p_addGapAfter(DBLink *db, const key_type *after, std::vector<RangeLock> &out)
+{
+    RangeLock r;
+    key_type next;
+    r.db = db;
+    memset(&(r.key), 0, sizeof(Key));
+    if (!p_indexNextKey<tree_type, key_type>(db, after, &next)) {
+        r.on = RANGE_END;
+    } else {
+        r.on = RANGE_GAP;
+        p_setKey(&(r.key), next);
+    }
+    out.push_back(r);
+}
+
+static bool p_rangesHeld(const std::vector<RangeLock> &need, const std::vector<RangeLock> &held)
+{
+    for (size_t i = 0; i < need.size(); i++) {
+        size_t j = 0;
+        while (j < held.size() && !p_sameRange(need[i], held[j]))
+            j++;
+        if (j == held.size())
+            return false;
+    }
+    return true;
+}
+
+/**
+ * Lock every range in need that is not in held yet, adding it to held.
+ * *added counts the new ones.
+ */
+static ErrCode p_lockRanges(TXNState *txne, const std::vector<RangeLock> &need,
+        std::vector<RangeLock> &held, LockMode mode, int *added)
+{
+    ErrCode ret;
+    for (size_t i = 0; i < need.size(); i++) {
+        std::vector<RangeLock> one(1, need[i]);
+        if (p_rangesHeld(one, held))
+            continue;
+        const RangeLock &r = need[i];
+        if (r.on == RANGE_KEY)
+            ret = lockAcquire(&(txne->locks), r.db, &(r.key), mode);
+        else
+            ret = lockAcquireGap(&(txne->locks), r.db, (r.on == RANGE_GAP) ? &(r.key) : NULL, mode);
+        if (ret != SUCCESS)
+            return ret;
+        held.push_back(r);
+        (*added)++;
+    }
+    return SUCCESS;
+}
+
+/**
+ * Leaves a lookup of range meets, in order, with the versions they had
+ */
+struct ReadProbe
+{
+    RangeLock range;
+    std::vector<std::pair<const void *, unsigned long long> > leaves;
+    struct ReadProbe *link;
+};
+
+/**
+ * Leaves a change to range would touch in each layer: the one the lookup
+ * lands in, the one before it when it lands on the first slot (an insert
+ * can go to either side of a leaf boundary), and for a key every leaf its
+ * pairs span. A merge replaces the layers, so it counts as a change. Caller
+ * holds the index latch.
+ */
+template <typename tree_type, typename key_type>
+static void p_probeLeaves(DBLink *db, const RangeLock &r,
+        std::vector<std::pair<const void *, unsigned long long> > &out)
+{
+    key_type nk;
+
+    out.clear();
+    if (r.on != RANGE_END)
+        p_nativeKey(&(r.key), &nk);
+    for (int l = 0; l < INDEX_LAYERS; l++) {
+        tree_type *t = p_layer<tree_type>(db, l);
+        if (t == NULL) {
+            out.push_back(std::make_pair((const void *) NULL, 0ULL));
+            continue;
+        }
+        typename tree_type::iterator it = (r.on != RANGE_END) ? t->lower_bound(nk) : t->end();
+        if (it.getslot() == 0 && it != t->begin()) {
+            typename tree_type::iterator prev = it;
+            --prev;
+            out.push_back(std::make_pair((const void *) prev.getleafNode(), prev.leafversion()));
+        }
+        out.push_back(std::make_pair((const void *) it.getleafNode(), it.leafversion()));
+        if (r.on != RANGE_KEY)
+            continue;
+        while (it != t->end() && it.key() == nk) {
+            ++it;
+            if ((const void *) it.getleafNode() != out.back().first)
+                out.push_back(std::make_pair((const void *) it.getleafNode(), it.leafversion()));
+        }
+    }
+}
+
+/**
+ * Remember what an optimistic read depended on. Caller holds the index latch.
+ */
+template <typename tree_type, typename key_type>
+static void p_recordReads(DBLink *db, TXNState *txne, const std::vector<RangeLock> &ranges)
+{
+    for (size_t i = 0; i < ranges.size(); i++) {
+        ReadProbe *p = new ReadProbe;
+        p->range = ranges[i];
+        p_probeLeaves<tree_type, key_type>(db, ranges[i], p->leaves);
+        p->link = txne->readSet;
+        txne->readSet = p;
+    }
+}
+
+template <typename tree_type, typename key_type>
+static bool p_probeUnchanged(const ReadProbe *p)
+{
+    std::vector<std::pair<const void *, unsigned long long> > now;
+    p_probeLeaves<tree_type, key_type>(p->range.db, p->range, now);
+    return now == p->leaves;
+}
+
+/**
+ * Check nothing an optimistic transaction read has changed. Caller holds
+ * the latch of every index in the read set.
+ */
+static bool p_validateReads(TXNState *txne)
+{
+    for (ReadProbe *p = txne->readSet; p != NULL; p = p->link) {
+        bool same;
+        switch (p->range.db->type) {
+            case SHORT:
+                same = p_probeUnchanged<nbtree_st, int32_t>(p);
+                break;
+            case INT:
+                same = p_probeUnchanged<nbtree_int, int64_t>(p);
+                break;
+            case VARCHAR:
+                same = p_probeUnchanged<nbtree_ch, string>(p);
+                break;
+            default:
+                same = false;
+        }
+        if (!same)
+            return false;
+    }
+    return true;
+}
+
+/**
+ * Serializable reads first look, then lock what they looked at, and look
+ * again until a look needs no lock they do not already hold. Index latches
+ * are never held while waiting for a lock, a committer holding a lock may
+ * need the latch. Optimistic reads collect the same ranges but only record
+ * the leaves behind them.
+ */
+static inline bool p_serializable(TXNState *txne)
+{
+    return (txne != NULL) && (txne->isolation == SERIALIZABLE);
+}
+
+static inline bool p_optimistic(TXNState *txne)
+{
+    return (txne != NULL) && (txne->isolation == OPTIMISTIC);
+}
+
+static inline bool p_tracksReads(TXNState *txne)
+{
+    return p_serializable(txne) || p_optimistic(txne);
+}
+
+template <typename tree_type, typename key_type>
+static ErrCode p_get(STXDBState *state, TXNState *txne, Record *record)
+{
+    DBLink *db = state->link;
+    IndexCursor *c = p_cursorFor(state, txne);
+    IndexWriteSet *ws = p_findWriteSet(txne, state->link, 0);
+    std::vector<RangeLock> need, held;
+    std::vector<std::string> payloads;
+    key_type nk;
+    ErrCode ret;
+
+    p_nativeKey(&(record->key), &nk);
+    for (;;) {
+        int added = 0;
+        need.clear();
+        pthread_rwlock_rdlock(&(state->link->latch));
+        p_visiblePayloads<tree_type>(db, nk, p_findKeyWrite(ws, record->key), p_readTs(txne), payloads);
+        if (p_tracksReads(txne)) {
+            p_addKeyRange(db, record->key, need);
+            //a missing key must stay missing, lock the gap it would go into
+            if (payloads.empty())
+                p_addGapAfter<tree_type>(db, &nk, need);
+        }
+        if (p_optimistic(txne)) {
+            p_recordReads<tree_type, key_type>(db, txne, need);
+            need.clear();
+        }
+        pthread_rwlock_unlock(&(state->link->latch));
+        if ((ret = p_lockRanges(txne, need, held, LOCK_S, &added)) != SUCCESS)
+            return ret;
+        if (added == 0)
             break;
+    }
+
+    memcpy(&(c->lastKey), &(record->key), sizeof(Key));
+    c->scanStarted = 1;
+    if (payloads.empty()) {
+        //getNext continues with the first key after this one
+        c->keyNotFound = 1;
+        c->lastPayload[0] = '\0';
+        return KEY_NOTFOUND;
+    }
+    c->keyNotFound = 0;
+    strcpy(record->payload, payloads[0].c_str());
+    strcpy(c->lastPayload, record->payload);
+    return SUCCESS;
+}
+
+/**
+ * Find the record after cursor c without moving it. With need set, every
+ * key and gap passed on the way is added to it. Caller holds the index latch.
+ */
+template <typename tree_type, typename key_type>
+static ErrCode p_scanStep(DBLink *db, IndexWriteSet *ws, const IndexCursor *c,
+        uint64_t snapshot, Record *record, std::vector<RangeLock> *need)
+{
+    std::vector<std::string> payloads;
+    key_type cur, next;
+    const key_type *after = NULL;
+
+    if (c->scanStarted) {
+        p_nativeKey(&(c->lastKey), &cur);
+        after = &cur;
+        if (need != NULL)
+            p_addKeyRange(db, c->lastKey, *need);
+        //more payloads under the key the cursor is on, after a missed get
+        //that is any pair inserted under that key since
+        p_visiblePayloads<tree_type>(db, cur, p_findKeyWrite(ws, c->lastKey), snapshot, payloads);
+        std::vector<std::string>::iterator pit = payloads.begin();
+        if (!c->keyNotFound)
+            pit = std::upper_bound(payloads.begin(), payloads.end(), std::string(c->lastPayload));
+        if (pit != payloads.end()) {
+            memcpy(&(record->key), &(c->lastKey), sizeof(Key));
+            strcpy(record->payload, pit->c_str());
+            return SUCCESS;
+        }
+    }
+
+    //keys the transaction deleted completely are skipped
+    while (p_nextKey<tree_type>(db, ws, after, &next)) {
+        Key k;
+        p_setKey(&k, next);
+        if (need != NULL) {
+            p_addGapAfter<tree_type>(db, after, *need);
+            p_addKeyRange(db, k, *need);
+        }
+        p_visiblePayloads<tree_type>(db, next, p_findKeyWrite(ws, k), snapshot, payloads);
+        if (!payloads.empty()) {
+            memcpy(&(record->key), &k, sizeof(Key));
+            strcpy(record->payload, payloads[0].c_str());
+            return SUCCESS;
+        }
+        cur = next;
+        after = &cur;
+    }
+    if (need != NULL)
+        p_addGapAfter<tree_type>(db, after, *need);
+    return DB_END;
+}
+
+template <typename tree_type, typename key_type>
+static ErrCode p_getNext(STXDBState *state, TXNState *txne, Record *record)
+{
+    DBLink *db = state->link;
+    IndexCursor *c = p_cursorFor(state, txne);
+    IndexWriteSet *ws = p_findWriteSet(txne, state->link, 0);
+    std::vector<RangeLock> need, held;
+    ErrCode ret, lockRet;
+
+    for (;;) {
+        int added = 0;
+        need.clear();
+        pthread_rwlock_rdlock(&(state->link->latch));
+        //outside a transaction each call reads the latest committed state
+        ret = p_scanStep<tree_type, key_type>(db, ws, c, p_readTs(txne), record,
+                p_tracksReads(txne) ? &need : NULL);
+        if (p_optimistic(txne)) {
+            p_recordReads<tree_type, key_type>(db, txne, need);
+            need.clear();
+        }
+        pthread_rwlock_unlock(&(state->link->latch));
+        if ((lockRet = p_lockRanges(txne, need, held, LOCK_S, &added)) != SUCCESS)
+            return lockRet;
+        if (added == 0)
+            break;
+    }
+
+    if (ret == SUCCESS) {
+        memcpy(&(c->lastKey), &(record->key), sizeof(Key));
+        strcpy(c->lastPayload, record->payload);
+        c->scanStarted = 1;
+        c->keyNotFound = 0;
+    }
+    return ret;
+}
+
+/**
+ *Record an insert in the transaction's write set
+ * */
+template <typename tree_type, typename key_type>
+static ErrCode p_insert(STXDBState *state, TXNState *txne, Key *k, const char *payload)
+{
+    IndexWriteSet *ws = p_findWriteSet(txne, state->link, 1);
+    std::vector<std::string> payloads;
+    std::string value(payload);
+    key_type nk;
+
+    //an optimistic transaction only locks what it writes while it commits
+    if (!p_optimistic(txne)) {
+        ErrCode ret = lockAcquire(&(txne->locks), state->link, k, LOCK_X);
+        if (ret != SUCCESS)
+            return ret;
+    }
+    p_nativeKey(k, &nk);
+    KeyWrite &w = ws->keys[*k];
+
+    pthread_rwlock_rdlock(&(state->link->latch));
+    p_visiblePayloads<tree_type>(state->link, nk, &w, p_readTs(txne), payloads);
+    if (p_optimistic(txne)) {
+        std::vector<RangeLock> read;
+        p_addKeyRange(state->link, *k, read);
+        p_recordReads<tree_type, key_type>(state->link, txne, read);
+    }
+    pthread_rwlock_unlock(&(state->link->latch));
+
+    if (std::binary_search(payloads.begin(), payloads.end(), value))
+        return ENTRY_EXISTS;
+    //putting back a committed pair this transaction deleted just undoes the delete
+    if (w.deleted.erase(value) == 0)
+        w.inserted.insert(value);
+    return SUCCESS;
+}
+
+/**
+ *Record a delete in the transaction's write set
+ * */
+template <typename tree_type, typename key_type>
+static ErrCode p_delete(STXDBState *state, TXNState *txne, Record *record)
+{
+    IndexWriteSet *ws = p_findWriteSet(txne, state->link, 1);
+    std::vector<std::string> payloads;
+    std::string value(record->payload);
+    key_type nk;
+
+    if (!p_optimistic(txne)) {
+        ErrCode ret = lockAcquire(&(txne->locks), state->link, &(record->key), LOCK_X);
+        if (ret != SUCCESS)
+            return ret;
+    }
+    p_nativeKey(&(record->key), &nk);
+    KeyWrite &w = ws->keys[record->key];
+
+    pthread_rwlock_rdlock(&(state->link->latch));
+    p_visiblePayloads<tree_type>(state->link, nk, &w, p_readTs(txne), payloads);
+    if (p_optimistic(txne)) {
+        std::vector<RangeLock> read;
+        p_addKeyRange(state->link, record->key, read);
+        p_recordReads<tree_type, key_type>(state->link, txne, read);
+    }
+    pthread_rwlock_unlock(&(state->link->latch));
+
+    if (value.empty()) {
+        if (payloads.empty())
+            return KEY_NOTFOUND;
+        w.inserted.clear();
+        w.deleted.clear();
+        w.deleteAll = true;
+        return SUCCESS;
+    }
+    if (!std::binary_search(payloads.begin(), payloads.end(), value))
+        return ENTRY_DNE;
+    if (w.inserted.erase(value) == 0)
+        w.deleted.insert(value);
+    return SUCCESS;
+}
+
+/**
+ * Live version of payload p under nk that snapshot sees, with the layer it
+ * is in stored in *in; *in is NULL when another transaction ended or
+ * replaced it since. Caller holds the latch.
+ */
+template <typename tree_type, typename key_type>
+static typename tree_type::iterator p_findLive(DBLink *db, const key_type &nk,
+        const std::string &p, uint64_t snapshot, tree_type **in)
+{
+    typename tree_type::iterator vit;
+    *in = NULL;
+    for (int l = 0; l < INDEX_LAYERS; l++) {
+        tree_type *t = p_layer<tree_type>(db, l);
+        if (t == NULL)
+            continue;
+        for (vit = t->lower_bound(nk); (vit != t->end()) && (vit.key() == nk); ++vit) {
+            if (vit.data().payload == p && vit.data().visible(snapshot)) {
+                if (vit.data().endTs == TS_INFINITY)
+                    *in = t;
+                return vit;
+            }
+        }
+    }
+    return vit;
+}
+
+/**
+ * Check that one index's write set still applies: every pair it deletes is
+ * still the live version the transaction saw, a key it deletes whole got no
+ * pair the transaction did not see, and no pair it inserts was inserted by
+ * someone else meanwhile. Nothing is changed, so a conflict in
+ * any index of a commit leaves all of them untouched. Caller holds the
+ * index latch for writing.
+ */
+template <typename tree_type, typename key_type>
+static ErrCode p_checkWrites(IndexWriteSet *ws, uint64_t snapshotTs)
+{
+    tree_type *in;
+
+    for (KeyWriteMap::iterator it = ws->keys.begin(); it != ws->keys.end(); ++it) {
+        const KeyWrite &w = it->second;
+        key_type nk;
+        p_nativeKey(&(it->first), &nk);
+
+        for (std::set<std::string>::const_iterator d = w.deleted.begin(); d != w.deleted.end(); ++d) {
+            p_findLive(ws->db, nk, *d, snapshotTs, &in);
+            if (in == NULL)
+                return DEADLOCK;
+        }
+        if (!w.deleteAll && w.inserted.empty())
+            continue;
+        //a delete of the whole key ends every live pair, which must all have
+        //been in the snapshot; the inserts then cannot clash with any
+        for (int l = 0; l < INDEX_LAYERS; l++) {
+            tree_type *t = p_layer<tree_type>(ws->db, l);
+            if (t == NULL)
+                continue;
+            for (typename tree_type::iterator vit = t->lower_bound(nk);
+                    (vit != t->end()) && (vit.key() == nk); ++vit) {
+                if (vit.data().endTs != TS_INFINITY)
+                    continue;
+                if (w.deleteAll ? (vit.data().beginTs > snapshotTs)
+                        : (w.inserted.count(vit.data().payload) != 0))
+                    return DEADLOCK;
+            }
+        }
+    }
+    return SUCCESS;
+}
+
+/**
+ * Wake the merge thread for a frozen memtable
+ */
+static void p_wakeMerger()
+{
+    pthread_mutex_lock(&MERGE_LOCK);
+    mergePending = true;
+    pthread_cond_signal(&MERGE_WAKE);
+    pthread_mutex_unlock(&MERGE_LOCK);
+}
+
+/**
+ * Apply one index's write set, already checked, in key order as versions
+ * stamped with commitTs. New versions go into the index's mem, which stays
+ * small enough to sit in cache, so a commit never descends or splits the
+ * full tree to insert. Deleted pairs are not removed, their live version
+ * is ended wherever it is and handed back in ended for garbage collection.
+ * Caller holds the index latch for writing.
+ */
+template <typename tree_type, typename key_type>
+static void p_applyWrites(IndexWriteSet *ws, uint64_t snapshotTs, uint64_t commitTs,
+        std::vector<GarbageVersion> &ended)
+{
+    DBLink *db = ws->db;
+    tree_type *mem = (tree_type *) db->mem;
+    typename tree_type::iterator vit;
+    tree_type *in;
+    GarbageVersion g;
+
+    for (KeyWriteMap::iterator it = ws->keys.begin(); it != ws->keys.end(); ++it) {
+        const KeyWrite &w = it->second;
+        key_type nk;
+        p_nativeKey(&(it->first), &nk);
+        memcpy(&(g.key), &(it->first), sizeof(Key));
+
+        for (int l = 0; (l < INDEX_LAYERS) && w.deleteAll; l++) {
+            tree_type *t = p_layer<tree_type>(db, l);
+            if (t == NULL)
+                continue;
+            for (vit = t->lower_bound(nk); (vit != t->end()) && (vit.key() == nk); ++vit) {
+                if (vit.data().endTs != TS_INFINITY)
+                    continue;
+                vit.data().endTs = commitTs;
+                t->touchleaf(vit.getleafNode());
+                g.version = vit.data();
+                ended.push_back(g);
+            }
+        }
+        for (std::set<std::string>::const_iterator d = w.deleted.begin(); d != w.deleted.end(); ++d) {
+            vit = p_findLive(db, nk, *d, snapshotTs, &in);
+            vit.data().endTs = commitTs;
+            in->touchleaf(vit.getleafNode());
+            g.version = vit.data();
+            ended.push_back(g);
+        }
+        for (std::set<std::string>::const_iterator i = w.inserted.begin(); i != w.inserted.end(); ++i)
+            mem->insert(nk, PayloadVersion(*i, commitTs, TS_INFINITY));
+    }
+
+    //while the last frozen one is still being merged mem keeps growing
+    if (mem->size() >= MEMTABLE_MAX && db->frozen == NULL) {
+        db->frozen = mem;
+        db->mem = new tree_type;
+        p_wakeMerger();
+    }
+}
+
+/**
+ * Queue the versions a commit ended and physically remove the oldest
+ * queued ones no snapshot can see any more, a bounded number per commit so
+ * the work is spread over the writers. Caller holds the index latch for
+ * writing.
+ */
+template <typename tree_type, typename key_type>
+static void p_collectGarbage(DBLink *db, const std::vector<GarbageVersion> &ended, uint64_t horizon)
+{
+    std::deque<GarbageVersion> *q = db->garbage;
+    size_t budget = ended.size() + GC_BATCH;
+
+    q->insert(q->end(), ended.begin(), ended.end());
+    //ended in commit order under the latch, so the queue is sorted by endTs
+    while (!q->empty() && budget > 0 && q->front().version.endTs <= horizon) {
+        key_type nk;
+        p_nativeKey(&(q->front().key), &nk);
+        //in whichever layer it was ended in or merged into since
+        for (int l = 0; l < INDEX_LAYERS; l++) {
+            tree_type *t = p_layer<tree_type>(db, l);
+            if (t != NULL && t->erasepair(nk, q->front().version) >= 0)
+                break;
+        }
+        q->pop_front();
+        budget--;
+    }
+}
+
+/**
+ * Gaps the new keys of a write set go into. Keys already in the index need
+ * none, the key lock covers them. Caller holds the index latch.
+ */
+template <typename tree_type, typename key_type>
+static void p_insertGaps(IndexWriteSet *ws, std::vector<RangeLock> &out)
+{
+    for (KeyWriteMap::iterator it = ws->keys.begin(); it != ws->keys.end(); ++it) {
+        if (it->second.inserted.empty())
+            continue;
+        key_type nk;
+        bool present = false;
+        p_nativeKey(&(it->first), &nk);
+        for (int l = 0; (l < INDEX_LAYERS) && !present; l++) {
+            tree_type *t = p_layer<tree_type>(ws->db, l);
+            if (t == NULL)
+                continue;
+            typename tree_type::iterator tit = t->lower_bound(nk);
+            present = (tit != t->end()) && (tit.key() == nk);
+        }
+        if (!present)
+            p_addGapAfter<tree_type>(ws->db, &nk, out);
+    }
+}
+
+/**
+ * Log records for one index's write set, in the order p_applyWrites
+ * installs it
+ */
+static void p_logWrites(std::string &frame, IndexWriteSet *ws)
+{
+    for (KeyWriteMap::iterator it = ws->keys.begin(); it != ws->keys.end(); ++it) {
+        const KeyWrite &w = it->second;
+        if (w.deleteAll) {
+            p_logU8(frame, LOG_DELETE_ALL);
+            p_logU32(frame, ws->db->id);
+            p_logKey(frame, &(it->first));
+        }
+        for (std::set<std::string>::const_iterator d = w.deleted.begin(); d != w.deleted.end(); ++d) {
+            p_logU8(frame, LOG_DELETE);
+            p_logU32(frame, ws->db->id);
+            p_logKey(frame, &(it->first));
+            p_logString(frame, d->data(), d->size());
+        }
+        for (std::set<std::string>::const_iterator i = w.inserted.begin(); i != w.inserted.end(); ++i) {
+            p_logU8(frame, LOG_INSERT);
+            p_logU32(frame, ws->db->id);
+            p_logKey(frame, &(it->first));
+            p_logString(frame, i->data(), i->size());
+        }
+    }
+}
+
+/**
+ * A write read back from the log, waiting to be replayed
+ */
+struct LoggedWrite
+{
+    Key key;
+    uint64_t ts;
+    uint8_t op;
+    std::string payload;
+};
+
+/**
+ * The log of one index during recovery. Writes are split by key hash into
+ * partitions replayed in parallel; every partition then leaves its keys'
+ * final versions in key order for the index to be loaded from.
+ */
+struct RecoveredIndex
+{
+    DBLink *db;
+    std::vector<std::vector<LoggedWrite> > writes;
+    //std::vector<std::pair<key_type, PayloadVersion> > per partition
+    std::vector<void *> folded;
+    //std::vector<key_type> per partition, the keys the log touched. Only
+    //needed when the tree was not empty before replay.
+    std::vector<void *> touched;
+};
+
+/**
+ * One piece of recovery work: a partition of an index, or with part -1 the
+ * whole index
+ */
+struct RecoveryTask
+{
+    RecoveredIndex *idx;
+    int part;
+};
+
+//indexes by id while the log is replayed
+static std::vector<RecoveredIndex *> recovered;
+static int recoveryParts;
+static RecoveryStats recoveryStats;
+
+static uint32_t p_keyHash(const Key *k)
+{
+    uint64_t h = 0;
+    switch (k->type) {
+        case SHORT:
+            h = (uint64_t) k->keyval.shortkey * 0x9e3779b97f4a7c15ULL;
+            break;
+        case INT:
+            h = (uint64_t) k->keyval.intkey * 0x9e3779b97f4a7c15ULL;
+            break;
+        case VARCHAR:
+            for (const char *c = k->keyval.charkey; *c != '\0'; c++)
+                h = h * 31 + (unsigned char) *c;
+            h *= 0x9e3779b97f4a7c15ULL;
+            break;
+        default:
+            break;
+    }
+    return (uint32_t) (h >> 32);
+}
+
+template <typename key_type, typename value_type>
+static bool p_firstLess(const std::pair<key_type, value_type> &a,
+        const std::pair<key_type, value_type> &b)
+{
+    return a.first < b.first;
+}
+
+/**
+ * Replay one partition of an index: group its writes by key, keeping log
+ * order within a key, and work out what is left of each key. Only reads
+ * the tree, so partitions of one index run side by side.
+ */
+template <typename tree_type, typename key_type>
+static void p_foldPartition(RecoveredIndex *idx, int part)
+{
+    tree_type *t = (tree_type *) idx->db->nbt;
+    std::vector<LoggedWrite> &writes = idx->writes[part];
+    std::vector<std::pair<key_type, PayloadVersion> > *out =
+        new std::vector<std::pair<key_type, PayloadVersion> >;
+    std::vector<key_type> *touched = t->empty() ? NULL : new std::vector<key_type>;
+    std::vector<std::pair<key_type, size_t> > order(writes.size());
+    std::vector<PayloadVersion> live;
+
+    for (size_t i = 0; i < writes.size(); i++) {
+        p_nativeKey(&(writes[i].key), &(order[i].first));
+        order[i].second = i;
+    }
+    std::stable_sort(order.begin(), order.end(), p_firstLess<key_type, size_t>);
+
+    for (size_t i = 0; i < order.size(); ) {
+        const key_type k = order[i].first;
+        live.clear();
+        //start from whatever the tree already held for the key
+        if (touched != NULL) {
+            typename tree_type::iterator vit;
+            for (vit = t->lower_bound(k); (vit != t->end()) && (vit.key() == k); ++vit)
+                live.push_back(vit.data());
+            touched->push_back(k);
+        }
+        for (; (i < order.size()) && (order[i].first == k); i++) {
+            const LoggedWrite &w = writes[order[i].second];
+            if (w.op == LOG_INSERT) {
+                live.push_back(PayloadVersion(w.payload, w.ts, TS_INFINITY));
+                continue;
+            }
+            size_t kept = 0;
+            for (size_t j = 0; j < live.size(); j++) {
+                if (w.op != LOG_DELETE_ALL && live[j].payload != w.payload)
+                    live[kept++] = live[j];
+            }
+            live.resize(kept);
+        }
+        for (size_t j = 0; j < live.size(); j++)
+            out->push_back(std::make_pair(k, live[j]));
+    }
+
+    std::vector<LoggedWrite>().swap(writes);
+    idx->folded[part] = out;
+    idx->touched[part] = touched;
+}
+
+/**
+ * Put the final versions of every partition of an index into its tree. An
+ * empty tree is bulk loaded from them in key order; otherwise the keys the
+ * log touched are replaced one by one, still in key order.
+ */
+template <typename tree_type, typename key_type>
+static void p_installIndex(RecoveredIndex *idx)
+{
+    tree_type *t = (tree_type *) idx->db->nbt;
+    std::vector<std::pair<key_type, PayloadVersion> > all;
+    std::vector<key_type> keys;
+
+    for (size_t p = 0; p < idx->folded.size(); p++) {
+        std::vector<std::pair<key_type, PayloadVersion> > *f =
+            (std::vector<std::pair<key_type, PayloadVersion> > *) idx->folded[p];
+        std::vector<key_type> *k = (std::vector<key_type> *) idx->touched[p];
+        all.insert(all.end(), f->begin(), f->end());
+        if (k != NULL)
+            keys.insert(keys.end(), k->begin(), k->end());
+        delete f;
+        delete k;
+    }
+    //partitions hold disjoint keys, versions of a key stay in log order
+    std::stable_sort(all.begin(), all.end(), p_firstLess<key_type, PayloadVersion>);
+    __sync_fetch_and_add(&(recoveryStats.versions), all.size());
+
+    if (t->empty()) {
+        t->bulk_load(all.begin(), all.end());
+        return;
+    }
+    std::sort(keys.begin(), keys.end());
+    for (size_t i = 0; i < keys.size(); i++) {
+        while (t->erase(keys[i]) >= 0)
+            ;
+    }
+    for (size_t i = 0; i < all.size(); i++)
+        t->insert(all[i].first, all[i].second);
+}
+
+static void p_runTask(const RecoveryTask &task)
+{
+    RecoveredIndex *idx = task.idx;
+    switch (idx->db->type) {
+        case SHORT:
+            if (task.part >= 0)
+                p_foldPartition<nbtree_st, int32_t>(idx, task.part);
+            else
+                p_installIndex<nbtree_st, int32_t>(idx);
+            break;
+        case INT:
+            if (task.part >= 0)
+                p_foldPartition<nbtree_int, int64_t>(idx, task.part);
+            else
+                p_installIndex<nbtree_int, int64_t>(idx);
+            break;
+        case VARCHAR:
+            if (task.part >= 0)
+                p_foldPartition<nbtree_ch, string>(idx, task.part);
+            else
+                p_installIndex<nbtree_ch, string>(idx);
+            break;
+        default:
+            break;
+    }
+}
+
+struct RecoveryWork
+{
+    const std::vector<RecoveryTask> *tasks;
+    size_t next;
+};
+
+static void *p_recoveryWorker(void *arg)
+{
+    RecoveryWork *work = (RecoveryWork *) arg;
+    size_t i;
+    while ((i = __sync_fetch_and_add(&(work->next), 1)) < work->tasks->size())
+        p_runTask((*work->tasks)[i]);
+    return NULL;
+}
+
+/**
+ * Run tasks on recoveryParts threads, this one included
+ */
+static void p_runParallel(const std::vector<RecoveryTask> &tasks)
+{
+    RecoveryWork work = { &tasks, 0 };
+    std::vector<pthread_t> threads;
+
+    for (int i = 1; i < recoveryParts && (size_t) i < tasks.size(); i++) {
+        pthread_t th;
+        if (pthread_create(&th, NULL, p_recoveryWorker, &work) == 0)
+            threads.push_back(th);
+    }
+    p_recoveryWorker(&work);
+    for (size_t i = 0; i < threads.size(); i++)
+        pthread_join(threads[i], NULL);
+}
+
+static DBLink *p_addIndex(KeyType type, const char *name, uint32_t id);
+
+/**
+ * Get an index rebuilt from the checkpoint or the log ready for replay
+ */
+static RecoveredIndex *p_recoverIndex(DBLink *db)
+{
+    if (db == NULL)
+        return NULL;
+    RecoveredIndex *idx = new RecoveredIndex;
+    idx->db = db;
+    idx->writes.resize(recoveryParts);
+    idx->folded.resize(recoveryParts, NULL);
+    idx->touched.resize(recoveryParts, NULL);
+    if (db->id >= recovered.size())
+        recovered.resize(db->id + 1, NULL);
+    recovered[db->id] = idx;
+    if (db->id >= nextIndexId)
+        nextIndexId = db->id + 1;
+    return idx;
+}
+
+/**
+ * Read one log frame. An index being created is made right away, the
+ * writes of a commit are queued on the partition of their key.
+ */
+static void p_replayFrame(const char *frame, size_t len, void *arg)
+{
+    LogReader r = { frame, frame + len };
+    uint8_t op;
+    uint32_t id;
+    uint64_t ts;
+
+    recoveryStats.frames++;
+    if (!p_readBytes(&r, &op, 1))
+        return;
+    if (op == LOG_CREATE) {
+        uint8_t type;
+        char name[256];
+        if (p_readBytes(&r, &id, sizeof(id)) && p_readBytes(&r, &type, 1)
+                && p_readString(&r, name)) {
+            //the checkpoint may already have brought it back
+            if (id >= recovered.size() || recovered[id] == NULL)
+                p_recoverIndex(p_addIndex((KeyType) type, name, id));
+        }
+        return;
+    }
+    if (op != LOG_COMMIT || !p_readBytes(&r, &ts, sizeof(ts)))
+        return;
+    //in the checkpoint image already
+    if (ts <= checkpointTs)
+        return;
+
+    LoggedWrite w;
+    w.ts = ts;
+    while (p_readBytes(&r, &op, 1) && p_readBytes(&r, &id, sizeof(id))) {
+        RecoveredIndex *idx = (id < recovered.size()) ? recovered[id] : NULL;
+        char payload[MAX_PAYLOAD_LEN + 1] = "";
+        if (idx == NULL || idx->db == NULL || !p_readKey(&r, idx->db->type, &(w.key)))
+            break;
+        if (op != LOG_DELETE_ALL && !p_readString(&r, payload))
+            break;
+        w.op = op;
+        w.payload = payload;
+        idx->writes[p_keyHash(&(w.key)) % recoveryParts].push_back(w);
+        recoveryStats.writes++;
+    }
+    if (ts > lastCommitTs)
+        lastCommitTs = stableTs = ts;
+}
+
+/**
+ * Fold a memtable into nbt in key order. With rebuild, one large next to
+ * the tree is merged with the tree's pairs and the tree rebuilt bottom up;
+ * otherwise up to most of its first pairs move over one by one, each near
+ * the one before. Returns whether from is empty now. Caller holds the index
+ * latch for writing.
+ */
+template <typename tree_type, typename key_type>
+static bool p_mergeLayer(DBLink *db, tree_type *from, size_t most, bool rebuild)
+{
+    typedef std::pair<key_type, PayloadVersion> pair_type;
+    tree_type *t = (tree_type *) db->nbt;
+    typename tree_type::iterator it;
+
+    if (!rebuild || (size_t) from->size() * 4 < (size_t) t->size()) {
+        for (size_t n = 0; (n < most) && !from->empty(); n++) {
+            it = from->begin();
+            t->insert(it.key(), it.data());
+            from->eraseslot(it.getleafNode(), it.getslot());
+        }
+        return from->empty();
+    }
+    std::vector<pair_type> mine, theirs, all;
+    mine.reserve(t->size());
+    for (it = t->begin(); it != t->end(); ++it)
+        mine.push_back(pair_type(it.key(), it.data()));
+    theirs.reserve(from->size());
+    for (it = from->begin(); it != from->end(); ++it)
+        theirs.push_back(pair_type(it.key(), it.data()));
+    all.reserve(mine.size() + theirs.size());
+    std::merge(mine.begin(), mine.end(), theirs.begin(), theirs.end(), std::back_inserter(all),
+            p_firstLess<key_type, PayloadVersion>);
+    t->bulk_load(all.begin(), all.end());
+    return true;
+}
+
+/**
+ * Merge an index's frozen memtable into nbt, MERGE_BATCH pairs per hold of
+ * the latch so commits and readers get in between. With all, the mem of
+ * the moment is frozen once the frozen one is gone and merged as well, and
+ * only pair by pair: a rebuild would give every leaf of nbt a new version,
+ * which the checkpoint asking for it would then write out.
+ */
+template <typename tree_type, typename key_type>
+static void p_mergeIndex(DBLink *db, bool all)
+{
+    bool freeze = all;
+    bool more = true;
+    while (more) {
+        pthread_rwlock_wrlock(&(db->latch));
+        if (db->frozen == NULL && freeze) {
+            freeze = false;
+            if (!((tree_type *) db->mem)->empty()) {
+                db->frozen = db->mem;
+                db->mem = new tree_type;
+            }
+        }
+        more = freeze;
+        if (db->frozen != NULL) {
+            if (p_mergeLayer<tree_type, key_type>(db, (tree_type *) db->frozen,
+                    (size_t) MERGE_BATCH, !all)) {
+                delete (tree_type *) db->frozen;
+                db->frozen = NULL;
+            } else
+                more = true;
+        }
+        pthread_rwlock_unlock(&(db->latch));
+    }
+}
+
+static void p_mergeAny(DBLink *db, bool all)
+{
+    switch (db->type) {
+        case SHORT:
+            p_mergeIndex<nbtree_st, int32_t>(db, all);
+            break;
+        case INT:
+            p_mergeIndex<nbtree_int, int64_t>(db, all);
+            break;
+        case VARCHAR:
+            p_mergeIndex<nbtree_ch, string>(db, all);
+            break;
+        default:
+            break;
+    }
+}
+
+/**
+ * Merge the memtables commits freeze, off the committing threads
+ */
+static void *p_merger(void *arg)
+{
+    for (;;) {
+        pthread_mutex_lock(&MERGE_LOCK);
+        while (!mergePending)
+            pthread_cond_wait(&MERGE_WAKE, &MERGE_LOCK);
+        mergePending = false;
+        pthread_mutex_unlock(&MERGE_LOCK);
+
+        std::vector<DBLink *> indexes;
+        pthread_mutex_lock(&ILINK_LOCK);
+        for (DBLink *link = dbLookup; link != NULL; link = link->link)
+            indexes.push_back(link);
+        pthread_mutex_unlock(&ILINK_LOCK);
+        for (size_t i = 0; i < indexes.size(); i++)
+            p_mergeAny(indexes[i], false);
+    }
+    return NULL;
+}
+
+static inline uint64_t p_nanos()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static uint32_t p_checksum(uint32_t h, const char *p, size_t len)
+{
+    for (size_t i = 0; i < len; i++) {
+        h ^= (unsigned char) p[i];
+        h *= 16777619u;
+    }
+    return h;
+}
+
+/**
+ * Page file of one index. Every leaf is written to a slot of its own, a
+ * leaf that has not changed since the last checkpoint keeps the slot it was
+ * written to then. The slots the last checkpoint's page map refers to are
+ * never written over, so that checkpoint stays whole until the page map of
+ * the next one is in place.
+ */
+struct PageImage
+{
+    int fd;
+    std::string path;
+    size_t slotSize;
+    //slots in the file
+    uint32_t slots;
+    //slots the last checkpoint's page map refers to
+    std::vector<uint32_t> durable;
+    //the rest, free for the leaves the next checkpoint writes
+    std::vector<uint32_t> freeSlots;
+    //version of every leaf the last checkpoint wrote whole, and its slot
+    std::map<unsigned long long, uint32_t> pages;
+};
+
+//page files by index id, and page files of an older layout that the next
+//checkpoint makes unnecessary; guarded by CKPT_LOCK
+static std::map<uint32_t, PageImage *> pageImages;
+static std::vector<std::string> stalePages;
+static CheckpointStats checkpointStats;
+
+/**
+ * Leaf pages of one checkpoint being written, no faster than CHECKPOINT_RATE
+ */
+struct CheckpointIO
+{
+    uint64_t written;
+    uint64_t start;
+    uint64_t dirty;
+    uint64_t clean;
+    bool ok;
+};
+
+static void p_checkpointThrottle(CheckpointIO *io, size_t bytes)
+{
+    //token bucket: sleep off whatever went out ahead of the rate
+    io->written += bytes;
+    uint64_t due = io->start + io->written * 1000000000ULL / CHECKPOINT_RATE;
+    uint64_t now = p_nanos();
+    if (due > now)
+        usleep((due - now) / 1000);
+}
+
+/**
+ * Largest leaf page of an index, rounded up to a slot
+ */
+template <typename tree_type>
+static size_t p_slotSize(KeyType type)
+{
+    size_t key = (type == SHORT) ? sizeof(int32_t) : ((type == INT) ? sizeof(int64_t) : 1 + MAX_VARCHAR_LEN);
+    size_t entry = key + 1 + MAX_PAYLOAD_LEN + 2 * sizeof(uint64_t);
+    size_t page = sizeof(uint32_t) + sizeof(uint16_t) + tree_type::keyslotsize() * entry;
+    return (page + 63) & ~(size_t) 63;
+}
+
+static size_t p_indexSlotSize(KeyType type)
+{
+    switch (type) {
+        case SHORT:
+            return p_slotSize<nbtree_st>(type);
+        case INT:
+            return p_slotSize<nbtree_int>(type);
+        case VARCHAR:
+            return p_slotSize<nbtree_ch>(type);
+        default:
+            return 0;
+    }
+}
+
+/**
+ * Open the page file of index id for slots of slotSize. The file is named
+ * after the slot size as well, so one written by a build with larger leaves
+ * is never mixed up with this one.
+ */
+static PageImage *p_openPages(uint32_t id, size_t slotSize, bool create)
+{
+    char path[64];
+    snprintf(path, sizeof(path), ENV_DIRECTORY "/" CHECKPOINT_PAGES "%u.%u", id, (unsigned) slotSize);
+    int fd = open(path, create ? (O_RDWR | O_CREAT | O_TRUNC) : O_RDWR, 0644);
+    if (fd < 0)
+        return NULL;
+    PageImage *img = new PageImage;
+    img->fd = fd;
+    img->path = path;
+    img->slotSize = slotSize;
+    img->slots = 0;
+    struct stat st;
+    if (!create && fstat(fd, &st) == 0)
+        img->slots = st.st_size / slotSize;
+    return img;
+}
+
+/**
+ * Every slot not in the durable page map is free
+ */
+static void p_resetFreeSlots(PageImage *img)
+{
+    std::vector<bool> used(img->slots, false);
+    for (size_t i = 0; i < img->durable.size(); i++)
+        used[img->durable[i]] = true;
+    img->freeSlots.clear();
+    for (uint32_t s = img->slots; s > 0; s--)
+        if (!used[s - 1])
+            img->freeSlots.push_back(s - 1);
+}
+
+static uint32_t p_allocSlot(PageImage *img)
+{
+    if (img->freeSlots.empty())
+        return img->slots++;
+    uint32_t s = img->freeSlots.back();
+    img->freeSlots.pop_back();
+    return s;
+}
+
+/**
+ * A leaf page waiting to be written once the latch is released
+ */
+struct PendingPage
+{
+    uint32_t slot;
+    std::string bytes;
+};
+
+/**
+ * Write the leaves of an index that changed since the last checkpoint to
+ * free slots of its page file, and list the slot of every leaf in slots in
+ * leaf chain order. A page is a checksum, the number of entries and every
+ * version in the leaf with its timestamps, whether visible at the checkpoint
+ * or not; loading filters them.
+ *
+ * The latch is held for CHECKPOINT_BATCH leaves at a time and never while
+ * writing, so commits to the index go on. A batch ends only between leaves
+ * that do not share a key, and the next one resumes after its last key. A
+ * leaf that was split there in the meantime is entered part way: the rest
+ * of it is written, and not kept for the next checkpoint.
+ */
+template <typename tree_type, typename key_type>
+static void p_checkpointIndex(DBLink *db, PageImage *img, std::vector<uint32_t> &slots,
+        std::map<unsigned long long, uint32_t> &pages, CheckpointIO *io)
+{
+    tree_type *t = (tree_type *) db->nbt;
+    std::vector<PendingPage> pending;
+    key_type last;
+    bool started = false;
+    bool done = false;
+    Key k;
+
+    while (!done && io->ok) {
+        pthread_rwlock_rdlock(&(db->latch));
+        typename tree_type::iterator it = started ? t->upper_bound(last) : t->begin();
+        bool boundary = true;
+        for (int n = 0; (it != t->end()) && ((n < CHECKPOINT_BATCH) || !boundary); n++) {
+            void *leaf = it.getleafNode();
+            unsigned long long version = (it.getslot() == 0) ? it.leafversion() : 0;
+            std::map<unsigned long long, uint32_t>::iterator old = img->pages.find(version);
+            started = true;
+            if (version != 0 && old != img->pages.end()) {
+                //unchanged since the last checkpoint wrote it
+                for (; (it != t->end()) && ((void *) it.getleafNode() == leaf); ++it)
+                    last = it.key();
+                slots.push_back(old->second);
+                pages[version] = old->second;
+                io->clean++;
+            } else {
+                PendingPage page;
+                uint16_t count = 0;
+                page.slot = p_allocSlot(img);
+                page.bytes.resize(sizeof(uint32_t) + sizeof(count));
+                for (; (it != t->end()) && ((void *) it.getleafNode() == leaf); ++it, count++) {
+                    last = it.key();
+                    p_setKey(&k, last);
+                    p_logKey(page.bytes, &k);
+                    p_logString(page.bytes, it.data().payload.data(), it.data().payload.size());
+                    p_logU64(page.bytes, it.data().beginTs);
+                    p_logU64(page.bytes, it.data().endTs);
+                }
+                memcpy(&page.bytes[sizeof(uint32_t)], &count, sizeof(count));
+                page.bytes.resize(img->slotSize, '\0');
+                uint32_t sum = p_checksum(2166136261u, page.bytes.data() + sizeof(sum),
+                        page.bytes.size() - sizeof(sum));
+                memcpy(&page.bytes[0], &sum, sizeof(sum));
+                pending.push_back(page);
+                slots.push_back(page.slot);
+                if (version != 0)
+                    pages[version] = page.slot;
+                io->dirty++;
+            }
+            boundary = (it == t->end()) || !(it.key() == last);
+        }
+        done = (it == t->end());
+        pthread_rwlock_unlock(&(db->latch));
+
+        for (size_t i = 0; i < pending.size() && io->ok; i++) {
+            if (pwrite(img->fd, pending[i].bytes.data(), img->slotSize,
+                        (off_t) pending[i].slot * img->slotSize) != (ssize_t) img->slotSize)
+                io->ok = false;
+            p_checkpointThrottle(io, img->slotSize);
+        }
+        pending.clear();
+    }
+}
+
+/**
+ * Write a checkpoint as of the last commit, and the log position after
+ * that commit. Only the leaves that changed since the last checkpoint are
+ * written; the page map, written last, lists the page of every leaf of
+ * every index in key order. Only indexes are latched, for short batches, so
+ * the checkpoint runs while transactions do. Once the page map is in place,
+ * recovery starts from it and the log before the position is deleted.
+ */
+static ErrCode p_checkpoint()
+{
+    pthread_mutex_lock(&CKPT_LOCK);
+    uint64_t start = p_nanos();
+
+    //the log is in commit order, so everything before lsn committed at or
+    //before ts and everything after it later. Pinning the stable timestamp
+    //keeps the versions visible at ts from being collected.
+    pthread_mutex_lock(&TS_LOCK);
+    uint64_t pin = stableTs;
+    activeSnapshots.insert(pin);
+    uint64_t ts = lastCommitTs;
+    Lsn lsn = walEnd();
+    while (stableTs < ts)
+        pthread_cond_wait(&TS_PUBLISHED, &TS_LOCK);
+    pthread_mutex_unlock(&TS_LOCK);
+
+    std::vector<DBLink *> indexes;
+    pthread_mutex_lock(&ILINK_LOCK);
+    for (DBLink *link = dbLookup; link != NULL; link = link->link)
+        indexes.push_back(link);
+    pthread_mutex_unlock(&ILINK_LOCK);
+
+    CheckpointIO io = { 0, start, 0, 0, true };
+    std::vector<PageImage *> images(indexes.size(), (PageImage *) NULL);
+    std::vector<std::vector<uint32_t> > slots(indexes.size());
+    std::vector<std::map<unsigned long long, uint32_t> > pages(indexes.size());
+    std::string map(CHECKPOINT_MAGIC);
+    p_logU64(map, lsn);
+    p_logU64(map, ts);
+    for (size_t i = 0; i < indexes.size() && io.ok; i++) {
+        DBLink *db = indexes[i];
+        size_t slotSize = p_indexSlotSize(db->type);
+        std::map<uint32_t, PageImage *>::iterator found = pageImages.find(db->id);
+        if (found != pageImages.end() && found->second->slotSize == slotSize) {
+            images[i] = found->second;
+        } else {
+            //new since the last checkpoint, or its pages have an older layout
+            images[i] = p_openPages(db->id, slotSize, true);
+            if (images[i] == NULL) {
+                io.ok = false;
+                break;
+            }
+        }
+        //the page map lists the leaves of nbt alone
+        p_mergeAny(db, true);
+        switch (db->type) {
+            case SHORT:
+                p_checkpointIndex<nbtree_st, int32_t>(db, images[i], slots[i], pages[i], &io);
+                break;
+            case INT:
+                p_checkpointIndex<nbtree_int, int64_t>(db, images[i], slots[i], pages[i], &io);
+                break;
+            case VARCHAR:
+                p_checkpointIndex<nbtree_ch, string>(db, images[i], slots[i], pages[i], &io);
+                break;
+            default:
+                break;
+        }
+        p_logU8(map, LOG_CREATE);
+        p_logU32(map, db->id);
+        p_logU8(map, (uint8_t) db->type);
+        p_logString(map, db->name, strlen(db->name));
+        p_logU32(map, (uint32_t) slotSize);
+        p_logU32(map, (uint32_t) slots[i].size());
+        if (!slots[i].empty())
+            map.append((const char *) &(slots[i][0]), slots[i].size() * sizeof(uint32_t));
+    }
+    p_logU8(map, CKPT_END);
+    uint32_t sum = p_checksum(2166136261u, map.data(), map.size());
+    map.append((const char *) &sum, sizeof(sum));
+
+    pthread_mutex_lock(&TS_LOCK);
+    activeSnapshots.erase(activeSnapshots.find(pin));
+    pthread_mutex_unlock(&TS_LOCK);
+
+    //the pages go to disk before the page map that refers to them
+    for (size_t i = 0; i < images.size() && io.ok; i++)
+        if (images[i] != NULL && fdatasync(images[i]->fd) != 0)
+            io.ok = false;
+    int fd = io.ok ? open(ENV_DIRECTORY "/" CHECKPOINT_TMP, O_WRONLY | O_CREAT | O_TRUNC, 0644) : -1;
+    if (fd >= 0) {
+        if (write(fd, map.data(), map.size()) != (ssize_t) map.size() || fsync(fd) != 0)
+            io.ok = false;
+        close(fd);
+    }
+    if (fd < 0 || !io.ok || rename(ENV_DIRECTORY "/" CHECKPOINT_TMP, ENV_DIRECTORY "/" CHECKPOINT_FILE) != 0) {
+        unlink(ENV_DIRECTORY "/" CHECKPOINT_TMP);
+        //whatever was written went to free slots, they stay free
+        for (size_t i = 0; i < images.size(); i++) {
+            if (images[i] == NULL)
+                continue;
+            if (pageImages.find(indexes[i]->id) == pageImages.end() || pageImages[indexes[i]->id] != images[i]) {
+                close(images[i]->fd);
+                delete images[i];
+            } else {
+                p_resetFreeSlots(images[i]);
+            }
+        }
+        pthread_mutex_unlock(&CKPT_LOCK);
+        return FAILURE;
+    }
+    int dirfd = open(ENV_DIRECTORY, O_RDONLY);
+    if (dirfd >= 0) {
+        fsync(dirfd);
+        close(dirfd);
+    }
+
+    //the slots only the previous page map referred to are free from now on
+    for (size_t i = 0; i < images.size(); i++) {
+        PageImage *&img = pageImages[indexes[i]->id];
+        if (img != NULL && img != images[i]) {
+            close(img->fd);
+            unlink(img->path.c_str());
+            delete img;
+        }
+        img = images[i];
+        img->durable.swap(slots[i]);
+        img->pages.swap(pages[i]);
+        p_resetFreeSlots(img);
+    }
+    for (size_t i = 0; i < stalePages.size(); i++)
+        unlink(stalePages[i].c_str());
+    stalePages.clear();
+
+    checkpointTs = ts;
+    checkpointLsn = lsn;
+    walTrim(lsn);
+
+    checkpointStats.checkpoints++;
+    checkpointStats.pagesWritten += io.dirty;
+    checkpointStats.pagesKept += io.clean;
+    checkpointStats.bytes += io.written;
+    checkpointStats.nanos += p_nanos() - start;
+    pthread_mutex_unlock(&CKPT_LOCK);
+    return SUCCESS;
+}
+
+/**
+ * Load one index from the pages of its leaves, in page map order. Only the
+ * versions visible at the checkpoint are kept; what ended after it is ended
+ * again by replaying the log.
+ */
+template <typename tree_type, typename key_type>
+static bool p_loadIndex(DBLink *db, PageImage *img, const std::vector<uint32_t> &slots, uint64_t ts)
+{
+    std::vector<std::pair<key_type, PayloadVersion> > versions;
+    std::string page(img->slotSize, '\0');
+    char payload[MAX_PAYLOAD_LEN + 1];
+    Key k;
+
+    for (size_t i = 0; i < slots.size(); i++) {
+        uint32_t sum;
+        uint16_t count;
+        if (pread(img->fd, &page[0], img->slotSize, (off_t) slots[i] * img->slotSize) != (ssize_t) img->slotSize)
+            return false;
+        memcpy(&sum, page.data(), sizeof(sum));
+        if (p_checksum(2166136261u, page.data() + sizeof(sum), page.size() - sizeof(sum)) != sum)
+            return false;
+        memcpy(&count, page.data() + sizeof(sum), sizeof(count));
+        LogReader r = { page.data() + sizeof(sum) + sizeof(count), page.data() + page.size() };
+        for (uint16_t j = 0; j < count; j++) {
+            uint64_t beginTs, endTs;
+            if (!p_readKey(&r, db->type, &k) || !p_readString(&r, payload)
+                    || !p_readBytes(&r, &beginTs, sizeof(beginTs))
+                    || !p_readBytes(&r, &endTs, sizeof(endTs)))
+                return false;
+            if (!(beginTs <= ts && ts < endTs))
+                continue;
+            key_type nk;
+            p_nativeKey(&k, &nk);
+            versions.push_back(std::make_pair(nk, PayloadVersion(payload, beginTs, TS_INFINITY)));
+        }
+    }
+    ((tree_type *) db->nbt)->bulk_load(versions.begin(), versions.end());
+    return true;
+}
+
+/**
+ * Bring the indexes back from the last checkpoint, if there is one, and
+ * set *from to the log position replay starts at. Fails if the page map or
+ * a page it refers to is damaged: the log it covers is gone.
+ */
+static ErrCode p_loadCheckpoint(Lsn *from)
+{
+    std::string map;
+    *from = 0;
+    FILE *f = fopen(ENV_DIRECTORY "/" CHECKPOINT_FILE, "rb");
+    if (f == NULL)
+        return SUCCESS;
+    char chunk[1 << 16];
+    size_t n;
+    while ((n = fread(chunk, 1, sizeof(chunk), f)) > 0)
+        map.append(chunk, n);
+    fclose(f);
+
+    size_t magic = strlen(CHECKPOINT_MAGIC);
+    uint32_t sum;
+    if (map.size() < magic + 2 * sizeof(uint64_t) + sizeof(sum)
+            || map.compare(0, magic, CHECKPOINT_MAGIC) != 0)
+        return FAILURE;
+    memcpy(&sum, map.data() + map.size() - sizeof(sum), sizeof(sum));
+    if (p_checksum(2166136261u, map.data(), map.size() - sizeof(sum)) != sum)
+        return FAILURE;
+
+    LogReader r = { map.data() + magic, map.data() + map.size() - sizeof(sum) };
+    Lsn lsn;
+    uint64_t ts;
+    uint8_t op;
+    p_readBytes(&r, &lsn, sizeof(lsn));
+    p_readBytes(&r, &ts, sizeof(ts));
+    while (p_readBytes(&r, &op, 1) && (op == LOG_CREATE)) {
+        uint32_t id, slotSize, count;
+        uint8_t type;
+        char name[256];
+        if (!p_readBytes(&r, &id, sizeof(id)) || !p_readBytes(&r, &type, 1)
+                || !p_readString(&r, name) || !p_readBytes(&r, &slotSize, sizeof(slotSize))
+                || !p_readBytes(&r, &count, sizeof(count)))
+            return FAILURE;
+        std::vector<uint32_t> slots(count);
+        if ((count > 0 && !p_readBytes(&r, &slots[0], count * sizeof(uint32_t))) || slotSize == 0)
+            return FAILURE;
+        RecoveredIndex *idx = p_recoverIndex(p_addIndex((KeyType) type, name, id));
+        PageImage *img = p_openPages(id, slotSize, false);
+        if (idx == NULL || img == NULL)
+            return FAILURE;
+        bool ok = false;
+        switch (idx->db->type) {
+            case SHORT:
+                ok = p_loadIndex<nbtree_st, int32_t>(idx->db, img, slots, ts);
+                break;
+            case INT:
+                ok = p_loadIndex<nbtree_int, int64_t>(idx->db, img, slots, ts);
+                break;
+            case VARCHAR:
+                ok = p_loadIndex<nbtree_ch, string>(idx->db, img, slots, ts);
+                break;
+            default:
+                break;
+        }
+        if (!ok) {
+            fprintf(stderr, "checkpoint: damaged page in %s\n", img->path.c_str());
+            return FAILURE;
+        }
+        if (slotSize == p_indexSlotSize(idx->db->type)) {
+            //leaves are rebuilt, so no version is known to be clean yet and
+            //the next checkpoint writes every page again, to free slots
+            img->durable.swap(slots);
+            p_resetFreeSlots(img);
+            pageImages[id] = img;
+        } else {
+            stalePages.push_back(img->path);
+            close(img->fd);
+            delete img;
+        }
+    }
+    if (op != CKPT_END)
+        return FAILURE;
+    checkpointTs = ts;
+    checkpointLsn = lsn;
+    lastCommitTs = stableTs = ts;
+    *from = lsn;
+    return SUCCESS;
+}
+
+/**
+ * Take a checkpoint whenever the log has grown by CHECKPOINT_LOG_BYTES
+ */
+static void *p_checkpointer(void *arg)
+{
+    for (;;) {
+        sleep(1);
+        if (walEnd() - checkpointLsn >= CHECKPOINT_LOG_BYTES)
+            p_checkpoint();
+    }
+    return NULL;
+}
+
+/**
+ * Rebuild the indexes from the last checkpoint and the log after it, and
+ * open the log for the commits to come. Reading the log is sequential;
+ * replaying it is done by partitions of every index on all cores, then
+ * each index is loaded from its partitions' results.
+ */
+static void p_openStorage()
+{
+    uint64_t start = p_nanos();
+
+    if (mkdir(ENV_DIRECTORY, 0755) != 0 && errno != EEXIST) {
+        storageStatus = FAILURE;
+        return;
+    }
+    long cores = sysconf(_SC_NPROCESSORS_ONLN);
+    recoveryParts = (cores < 1) ? 1 : ((cores > RECOVERY_THREADS_MAX) ? RECOVERY_THREADS_MAX : cores);
+    recoveryStats.threads = recoveryParts;
+
+    Lsn from;
+    if (p_loadCheckpoint(&from) != SUCCESS) {
+        storageStatus = FAILURE;
+        return;
+    }
+    storageStatus = walOpen(ENV_DIRECTORY, from, WAL_GROUP, p_replayFrame, NULL);
+
+    std::vector<RecoveryTask> folds, installs;
+    for (size_t i = 0; i < recovered.size(); i++) {
+        if (recovered[i] == NULL || recovered[i]->db == NULL)
+            continue;
+        RecoveryTask task = { recovered[i], -1 };
+        installs.push_back(task);
+        for (int p = 0; p < recoveryParts; p++) {
+            task.part = p;
+            folds.push_back(task);
+        }
+    }
+    p_runParallel(folds);
+    p_runParallel(installs);
+    for (size_t i = 0; i < recovered.size(); i++)
+        delete recovered[i];
+    std::vector<RecoveredIndex *>().swap(recovered);
+
+    recoveryStats.nanos = p_nanos() - start;
+    if (recoveryStats.frames > 0)
+        printRecoveryStats(stderr);
+
+    pthread_t th;
+    if (storageStatus == SUCCESS && pthread_create(&th, NULL, p_checkpointer, NULL) == 0)
+        pthread_detach(th);
+    if (storageStatus == SUCCESS && pthread_create(&th, NULL, p_merger, NULL) == 0)
+        pthread_detach(th);
+}
+
+static inline ErrCode p_startStorage()
+{
+    pthread_once(&storageOnce, p_openStorage);
+    return storageStatus;
+}
+
+static bool p_writeSetLess(const IndexWriteSet *a, const IndexWriteSet *b)
+{
+    return a->db < b->db;
+}
+
+/**
+ * An index a commit latches, exclusively if it writes there
+ */
+struct IndexLatch
+{
+    DBLink *db;
+    bool write;
+};
+
+static bool p_latchLess(const IndexLatch &a, const IndexLatch &b)
+{
+    return a.db < b.db;
+}
+
+static void p_latchAll(const std::vector<IndexLatch> &latches)
+{
+    for (size_t i = 0; i < latches.size(); i++) {
+        if (latches[i].write)
+            pthread_rwlock_wrlock(&(latches[i].db->latch));
+        else
+            pthread_rwlock_rdlock(&(latches[i].db->latch));
+    }
+}
+
+static void p_unlatchAll(const std::vector<IndexLatch> &latches)
+{
+    for (size_t i = latches.size(); i > 0; i--)
+        pthread_rwlock_unlock(&(latches[i - 1].db->latch));
+}
+
+/**
+ * Latches for the written indexes plus, for an optimistic transaction, the
+ * ones it only read so they hold still while the reads are validated
+ */
+static void p_commitLatches(TXNState *txne, const std::vector<IndexWriteSet *> &sets,
+        std::vector<IndexLatch> &out)
+{
+    IndexLatch l;
+    out.clear();
+    l.write = true;
+    for (size_t i = 0; i < sets.size(); i++) {
+        l.db = sets[i]->db;
+        out.push_back(l);
+    }
+    l.write = false;
+    for (ReadProbe *p = txne->readSet; p != NULL; p = p->link) {
+        size_t j = 0;
+        while (j < out.size() && out[j].db != p->range.db)
+            j++;
+        if (j == out.size()) {
+            l.db = p->range.db;
+            out.push_back(l);
+        }
+    }
+    std::sort(out.begin(), out.end(), p_latchLess);
+}
+
+/**
+ * An optimistic transaction locks the keys it writes only now, so a
+ * serializable transaction reading them is not overrun
+ */
+static ErrCode p_lockWrites(TXNState *txne, const std::vector<IndexWriteSet *> &sets)
+{
+    ErrCode ret;
+    for (size_t i = 0; i < sets.size(); i++) {
+        for (KeyWriteMap::iterator it = sets[i]->keys.begin(); it != sets[i]->keys.end(); ++it) {
+            if ((ret = lockAcquire(&(txne->locks), sets[i]->db, &(it->first), LOCK_X)) != SUCCESS)
+                return ret;
         }
-        case VARCHAR:
-            //the key is a <128-byte string
-	    key = new char[strlen(k->keyval.charkey)+1];
-	    strcpy((char*)key, k->keyval.charkey);
-            //key->data = k->keyval.charkey;
-            //key->size = strlen(k->keyval.charkey);
-            //key->ulen = key->size;
-	    return 3;
-            break;
-        default:
-            return -1;
     }
-    return 0;
+    return SUCCESS;
 }
 
-
-ErrCode create( KeyType type, char* name)
+/**
+ * Install every pending write of a transaction. All indexes it touched are
+ * latched (in address order, so two committers cannot deadlock) before the
+ * first change, and the versions only become visible to snapshots once the
+ * commit timestamp is published, so readers see either none or all of the
+ * transaction across every index it wrote. All write sets are checked for
+ * conflicts before any is applied, so there is nothing to roll back. A
+ * conflict, or an optimistic transaction whose reads were overtaken, gets
+ * DEADLOCK and nothing is installed. The commit is logged before it is
+ * applied and returns once the log is durable; FAILURE then means the log
+ * could not be written.
+ */
+static ErrCode p_commit(TXNState *txne)
 {
-    int ret = 0;
-   
-    //lock the dblink
-    if((ret = pthread_mutex_lock(&ILINK_LOCK)) != 0) {
-	cout << "Cannot" << endl;
+    std::vector<IndexWriteSet *> sets;
+    std::vector<IndexLatch> latches;
+    ErrCode ret = SUCCESS;
+
+    for (IndexWriteSet *ws = txne->writeSet; ws != NULL; ws = ws->link) {
+        if (!ws->keys.empty())
+            sets.push_back(ws);
     }
+    //a read only transaction has nothing to install
+    if (sets.empty() && txne->readSet == NULL)
+        return SUCCESS;
+    std::sort(sets.begin(), sets.end(), p_writeSetLess);
+    p_commitLatches(txne, sets, latches);
+    //the log frame is built up front, only the timestamp is filled in later
+    std::string frame;
+    p_logU8(frame, LOG_COMMIT);
+    p_logU64(frame, 0);
+    for (size_t i = 0; i < sets.size(); i++)
+        p_logWrites(frame, sets[i]);
+    std::vector<std::vector<GarbageVersion> > ended(sets.size());
+    std::vector<RangeLock> gaps, need;
 
-    DBLink *link  = dbLookup;
+    if (p_optimistic(txne) && (ret = p_lockWrites(txne, sets)) != SUCCESS)
+        return ret;
 
-    while (link != NULL) {
-	if(strcmp(name, link->name) == 0) {
-	    break;
-	} else {
-	    link = link->link;
-	}	
+    //new keys must not land in a gap a serializable scan holds. The gaps are
+    //only known under the latches but cannot be waited for there, so latch,
+    //check, and if one is missing unlatch, lock it and try again.
+    for (;;) {
+        int added = 0;
+        p_latchAll(latches);
+        need.clear();
+        for (size_t i = 0; i < sets.size(); i++) {
+            switch (sets[i]->db->type) {
+                case SHORT:
+                    p_insertGaps<nbtree_st, int32_t>(sets[i], need);
+                    break;
+                case INT:
+                    p_insertGaps<nbtree_int, int64_t>(sets[i], need);
+                    break;
+                case VARCHAR:
+                    p_insertGaps<nbtree_ch, string>(sets[i], need);
+                    break;
+                default:
+                    break;
+            }
+        }
+        if (p_rangesHeld(need, gaps))
+            break;
+        p_unlatchAll(latches);
+        if ((ret = p_lockRanges(txne, need, gaps, LOCK_INSERT, &added)) != SUCCESS)
+            return ret;
     }
 
+    if (p_optimistic(txne) && !p_validateReads(txne)) {
+        p_unlatchAll(latches);
+        return DEADLOCK;
+    }
+    if (sets.empty()) {
+        p_unlatchAll(latches);
+        return SUCCESS;
+    }
 
-    if(link != NULL) {
-	pthread_mutex_unlock(&ILINK_LOCK);
-	return DB_EXISTS;
+    uint64_t readTs = p_readTs(txne);
+    for (size_t i = 0; (i < sets.size()) && (ret == SUCCESS); i++) {
+        switch (sets[i]->db->type) {
+            case SHORT:
+                ret = p_checkWrites<nbtree_st, int32_t>(sets[i], readTs);
+                break;
+            case INT:
+                ret = p_checkWrites<nbtree_int, int64_t>(sets[i], readTs);
+                break;
+            case VARCHAR:
+                ret = p_checkWrites<nbtree_ch, string>(sets[i], readTs);
+                break;
+            default:
+                ret = FAILURE;
+        }
+    }
+    if (ret != SUCCESS) {
+        p_unlatchAll(latches);
+        return ret;
     }
-	
 
-    //create a file to store error message for database
-    //(if doesn't already exist)
-    if (stderrfile == NULL) {
-        char errFileName[] = "error.log";
-        stderrfile = fopen(errFileName, "w");
-        if (stderrfile == NULL) {
-            pthread_mutex_unlock(&ILINK_LOCK);
-            return FAILURE;
+    //one timestamp for every index the transaction wrote, taken with the
+    //latches held so commits to one index stamp and log in order
+    Lsn lsn;
+    uint64_t commitTs = p_nextCommitTs(frame, &lsn);
+    for (size_t i = 0; i < sets.size(); i++) {
+        switch (sets[i]->db->type) {
+            case SHORT:
+                p_applyWrites<nbtree_st, int32_t>(sets[i], readTs, commitTs, ended[i]);
+                break;
+            case INT:
+                p_applyWrites<nbtree_int, int64_t>(sets[i], readTs, commitTs, ended[i]);
+                break;
+            case VARCHAR:
+                p_applyWrites<nbtree_ch, string>(sets[i], readTs, commitTs, ended[i]);
+                break;
+            default:
+                break;
         }
     }
-    
-    //if there is no environment, make one
-   /* if (env == NULL) {
-        ret = p_createEnv();
-        if (ret != SUCCESS) {
-            return ret;
+    //all indexes become visible to new snapshots at once
+    p_publish(commitTs);
+
+    uint64_t horizon = p_gcHorizon();
+    for (size_t i = 0; i < sets.size(); i++) {
+        switch (sets[i]->db->type) {
+            case SHORT:
+                p_collectGarbage<nbtree_st, int32_t>(sets[i]->db, ended[i], horizon);
+                break;
+            case INT:
+                p_collectGarbage<nbtree_int, int64_t>(sets[i]->db, ended[i], horizon);
+                break;
+            case VARCHAR:
+                p_collectGarbage<nbtree_ch, string>(sets[i]->db, ended[i], horizon);
+                break;
+            default:
+                break;
         }
-    }*/
+    }
+
+    p_unlatchAll(latches);
+    //group commit: the latches are free while waiting for the log writer
+    return walWaitDurable(lsn);
+}
+
+static void p_freeTxn(TXNState *txne)
+{
+    IndexWriteSet *ws = txne->writeSet;
+    while (ws != NULL) {
+        IndexWriteSet *next = ws->link;
+        delete ws;
+        ws = next;
+    }
+    txne->writeSet = NULL;
+    CursorLink *c = txne->cursorLink;
+    while (c != NULL) {
+        CursorLink *next = c->cursorLink;
+        delete c;
+        c = next;
+    }
+    txne->cursorLink = NULL;
+    if (txne->threadCursors)
+        readOnlyCursorCount = 0;
+    txne->threadCursors = 0;
+    ReadProbe *p = txne->readSet;
+    while (p != NULL) {
+        ReadProbe *next = p->link;
+        delete p;
+        p = next;
+    }
+    txne->readSet = NULL;
+    lockReleaseAll(&(txne->locks));
+    p_releaseSnapshot(txne);
+    if (threadTxn == txne)
+        threadTxn = NULL;
+    txne->status = -1;
+    if (freeTxnCount < TXN_FREELIST_MAX) {
+        if (!freeTxnKeySet) {
+            pthread_once(&freeTxnOnce, p_initFreeTxnKey);
+            pthread_setspecific(freeTxnKey, &freeTxns);
+            freeTxnKeySet = 1;
+        }
+        txne->nextFree = freeTxns;
+        freeTxns = txne;
+        freeTxnCount++;
+        return;
+    }
+    delete txne;
+}
+
+static uint32_t p_nextTid()
+{
+    uint32_t tid;
+    do {
+        tid = __sync_add_and_fetch(&lastTid, 1);
+    } while (tid == 0);
+    return tid;
+}
+
+/**
+ * A transaction started with beginTransaction pins its snapshot. The one
+ * a call outside a transaction runs in lives only for that call and does
+ * not: anything collected under it was ended, which its commit reports as a
+ * conflict anyway.
+ */
+static TXNState *p_newTxn(int pinSnapshot)
+{
+    TXNState *txne = freeTxns;
+    if (txne != NULL) {
+        freeTxns = txne->nextFree;
+        freeTxnCount--;
+    } else {
+        txne = new TXNState;
+    }
+    txne->nbt = NULL;
+    txne->cursorLink = NULL;
+    txne->writeSet = NULL;
+    txne->tid = p_nextTid();
+    txne->status = 1;
+    txne->isolation = SNAPSHOT_ISOLATION;
+    txne->locks.id = txne->tid;
+    txne->locks.held = NULL;
+    txne->readSet = NULL;
+    txne->threadCursors = 0;
+    txne->nextFree = NULL;
+    if (pinSnapshot) {
+        p_takeSnapshot(txne);
+    } else {
+        txne->snapshotTs = p_stableTs();
+        txne->snapshotPin = PIN_NONE;
+    }
+    return txne;
+}
+
+
+/**
+ * Make an empty index and add it to the lookup list. Caller holds ILINK_LOCK
+ * or is replaying the log.
+ */
+static DBLink *p_addIndex(KeyType type, const char *name, uint32_t id)
+{
     //stxbtree_type* dbp = new stxbtree_type;
     void* nbt = NULL;
+    void *mem = NULL;
     switch(type)
     {
 	case SHORT:
 	 nbt  =(nbtree_st*) new nbtree_st;
+	 mem = new nbtree_st;
 	break;
 	case INT:
 	nbt  = (nbtree_int*) new nbtree_int;
+	mem = new nbtree_int;
 	break;
 	case VARCHAR:
 	 nbt  = (nbtree_ch*) new nbtree_ch;
+	 mem = new nbtree_ch;
 	break;
 	default:
-	return FAILURE;
+	return NULL;
     }
     //nbtree* nbt = new nbtree;
     if(nbt == NULL)
-    {
-	return FAILURE;
+	return NULL;
 
-    }
-    
     //set the error file for the DB
     //dbp->set_errfile(dbp, stderrfile);
-    
+
     //store the DB info in our db lookup list
-    
+
     //make a new link object
     DBLink  *newLink = new DBLink;
     memset(newLink, 0, sizeof(DBLink));
-    
+
     //populate it
-    newLink->name = name;
+    newLink->name = strdup(name);
+    newLink->id = id;
     newLink->nbt = nbt;
+    newLink->mem = mem;
+    newLink->frozen = NULL;
     newLink->type =  type;
     newLink->numOpenThreads = 0;
     newLink->link = NULL;
     newLink->inUse = 0;
-    
+    newLink->garbage = new std::deque<GarbageVersion>;
+    pthread_rwlock_init(&(newLink->latch), NULL);
+
     //Consider adding errors to log file
-    
+
     if (dbLookup == NULL) {
         dbLookup = newLink;
     } else {
@@ -175,23 +2575,89 @@ ErrCode create( KeyType type, char* name)
         }
         thisLink->link = newLink;
     }
-    
+    return newLink;
+}
+
+ErrCode create( KeyType type, char* name)
+{
+    int ret = 0;
+
+    //indexes created before a restart come back from the log
+    if (p_startStorage() != SUCCESS)
+        return FAILURE;
+    if (strlen(name) > 255)
+        return FAILURE;
+
+    //lock the dblink
+    if((ret = pthread_mutex_lock(&ILINK_LOCK)) != 0) {
+	cout << "Cannot" << endl;
+    }
+
+    DBLink *link  = dbLookup;
+
+    while (link != NULL) {
+	if(strcmp(name, link->name) == 0) {
+	    break;
+	} else {
+	    link = link->link;
+	}
+    }
+
+
+    if(link != NULL) {
+	pthread_mutex_unlock(&ILINK_LOCK);
+	return DB_EXISTS;
+    }
+
+
+    //create a file to store error message for database
+    //(if doesn't already exist)
+    if (stderrfile == NULL) {
+        char errFileName[] = "error.log";
+        stderrfile = fopen(errFileName, "w");
+        if (stderrfile == NULL) {
+            pthread_mutex_unlock(&ILINK_LOCK);
+            return FAILURE;
+        }
+    }
+
+    //if there is no environment, make one
+   /* if (env == NULL) {
+        ret = p_createEnv();
+        if (ret != SUCCESS) {
+            return ret;
+        }
+    }*/
+    DBLink *newLink = p_addIndex(type, name, nextIndexId);
+    if (newLink == NULL) {
+	pthread_mutex_unlock(&ILINK_LOCK);
+	return FAILURE;
+    }
+    nextIndexId++;
+
+    //logged under ILINK_LOCK, ahead of any commit to the new index
+    std::string frame;
+    p_logU8(frame, LOG_CREATE);
+    p_logU32(frame, newLink->id);
+    p_logU8(frame, (uint8_t) type);
+    p_logString(frame, name, strlen(name));
+    Lsn lsn = walAppend(frame.data(), frame.size());
 
     pthread_mutex_unlock(&ILINK_LOCK);
-    return SUCCESS;
+    return walWaitDurable(lsn);
 }
 
 
 ErrCode openIndex(const char *name, IdxState **idxState)
 {
     int ret;
-    //stxbtree_type *dbp;
-    void* nbt;
+    if (p_startStorage() != SUCCESS)
+        return FAILURE;
     //lock the dblink system
     if ((ret = pthread_mutex_lock(&ILINK_LOCK)) != 0) {
         printf("can't acquire mutex lock: %d\n", ret);
     }
-    
+
     //look up the DBLink for the index of that name
     DBLink *link = dbLookup;
     while (link != NULL) {
@@ -201,40 +2667,29 @@ ErrCode openIndex(const char *name, IdxState **idxState)
             link = link->link;
         }
     }
-    
+
     //if no link was found, index was never create()d
     if (link == NULL) {
         pthread_mutex_unlock(&ILINK_LOCK);
         return DB_DNE;
     }
-    
+
     //add this thread to the link's thread counter
     link->numOpenThreads++;
-    
-    //if numOpenThreads == 1, we need to open the index
-    if (link->numOpenThreads == 1) {
-        nbt = link->nbt;
-        
-        //set the db to handle duplicates (flag must be set before db is opened)
-        //ret = dbp->set_flags(dbp, DB_DUPSORT); 
-	//multimap
-        
-       
-    //create a BDBState variable for this thread
-	STXDBState *state =(STXDBState*)  new STXDBState;
-	memset(state, 0, sizeof(STXDBState));
-	*idxState = (IdxState *) state;
-	state->nbt = link->nbt;
-	state->type = link->type;
-	state->db_name = name;
-    
+
+    //create a state variable for this thread, every thread that opens the
+    //index gets its own cursor
+    STXDBState *state =(STXDBState*)  new STXDBState;
+    memset(state, 0, sizeof(STXDBState));
+    *idxState = (IdxState *) state;
+    state->nbt = link->nbt;
+    state->link = link;
+    state->type = link->type;
+    state->db_name = link->name;
+
     //unlock the dblink system
-	pthread_mutex_unlock(&ILINK_LOCK);
-    
-	return SUCCESS;
-    }
     pthread_mutex_unlock(&ILINK_LOCK);
-    return FAILURE;
+    return SUCCESS;
 }
 
 
@@ -244,43 +2699,41 @@ ErrCode closeIndex(IdxState *ident)
     int ret;
     STXDBState *state = (STXDBState*)ident;
     //stxbtree_type *dbp = state->dbp;
-    
+
     //lock the dblink system
     if ((ret = pthread_mutex_lock(&ILINK_LOCK)) != 0) {
         printf("can't acquire mutex lock: %d\n", ret);
     }
-    
+
     //check to see if the DB currently exists
-    DBLink *prevLink = NULL;
     DBLink *link = dbLookup;
     while (link != NULL) {
         if (strcmp(state->db_name, link->name) == 0) {
             break;
         } else {
-            prevLink = link;
             link = link->link;
         }
     }
-    
+
     //if the DB isn't in our linked list, it never existed
     if (link == NULL) {
         fprintf(stderrfile, "closeIndex called on an index that does not exist\n");
         pthread_mutex_unlock(&ILINK_LOCK);
         return DB_DNE;
     }
-    
+
     //decrement the number of threads for whom this index is open
     link->numOpenThreads--;
     //remove this DBP from this thread's state
     state->nbt = NULL;
-    
+
     // if there are still threads using this index, don't close it
     if (link->numOpenThreads > 0) {
         pthread_mutex_unlock(&ILINK_LOCK);
         return SUCCESS;
     }
     /*
-    printf("closing index %s====================\n",state->db_name); 
+    printf("closing index %s====================\n",state->db_name);
     if ((ret = dbp->close(dbp, 0)) != 0) {
         fprintf(stderrfile, "could not close index. errno %d\n", ret);
         pthread_mutex_unlock(&DBLINK_LOCK);
@@ -291,116 +2744,153 @@ ErrCode closeIndex(IdxState *ident)
         printf("link->numOpenThreads somehow got to < 0. Resetting to 0.\n");
         link->numOpenThreads = 0;
     }
-    
+
     pthread_mutex_unlock(&ILINK_LOCK);
-    return SUCCESS;    
+    return SUCCESS;
 }
 
 
 ErrCode beginTransaction(TxnState **txn)
 {
-    //int ret;
+    if (threadTxn != NULL)
+        return TXN_EXISTS;
+
     //create the state variable for this transaction
-    TXNState *txne = new TXNState;
-    
-   
-    txne->cursorLink = NULL;
-    
-    txne->tid = rand();
-    txne->status = 1;
+    TXNState *txne = p_newTxn(1);
+    threadTxn = txne;
     *txn = (TxnState*) txne;
-    printf("Transaction started\n");
-    //    DB_TXN *tid = NULL;a
-      return SUCCESS;
+    return SUCCESS;
+}
+
+
+ErrCode setIsolationLevel(TxnState *txn, IsolationLevel level)
+{
+    TXNState* txne = (TXNState*) txn;
+
+    if (txne == NULL || txne->status == -1)
+        return TXN_DNE;
+    if (level != SNAPSHOT_ISOLATION && level != SERIALIZABLE && level != OPTIMISTIC
+            && level != READ_ONLY)
+        return FAILURE;
+    //what it read or wrote so far was not tracked for the new level
+    if (txne->writeSet != NULL || txne->cursorLink != NULL || txne->threadCursors)
+        return FAILURE;
+    txne->isolation = level;
+    return SUCCESS;
+}
+
+ErrCode setDurability(WalDurability level)
+{
+    if (level != WAL_SYNC && level != WAL_GROUP && level != WAL_ASYNC)
+        return FAILURE;
+    if (p_startStorage() != SUCCESS)
+        return FAILURE;
+    walSetDurability(level);
+    return SUCCESS;
+}
+
+ErrCode checkpoint()
+{
+    if (p_startStorage() != SUCCESS)
+        return FAILURE;
+    return p_checkpoint();
+}
+
+void getCheckpointStats(CheckpointStats *out)
+{
+    pthread_mutex_lock(&CKPT_LOCK);
+    *out = checkpointStats;
+    pthread_mutex_unlock(&CKPT_LOCK);
+}
+
+void printCheckpointStats(FILE *out)
+{
+    CheckpointStats s;
+    getCheckpointStats(&s);
+    uint64_t pages = s.pagesWritten + s.pagesKept;
+    fprintf(out, "checkpoint: %llu checkpoints, %llu pages written, %llu kept (%.1f%% written)\n",
+            (unsigned long long) s.checkpoints, (unsigned long long) s.pagesWritten,
+            (unsigned long long) s.pagesKept, pages ? 100.0 * s.pagesWritten / pages : 0.0);
+    fprintf(out, "checkpoint: %llu bytes in %.3f s\n", (unsigned long long) s.bytes,
+            (double) s.nanos / 1e9);
+}
+
+void getRecoveryStats(RecoveryStats *out)
+{
+    *out = recoveryStats;
+}
+
+void printRecoveryStats(FILE *out)
+{
+    RecoveryStats s;
+    getRecoveryStats(&s);
+    double secs = (double) s.nanos / 1e9;
+    fprintf(out, "recovery: %llu log frames, %llu writes, %llu versions restored on %d threads\n",
+            (unsigned long long) s.frames, (unsigned long long) s.writes,
+            (unsigned long long) s.versions, s.threads);
+    fprintf(out, "recovery: %.3f s, %.0f writes/s\n", secs,
+            (secs > 0) ? (double) s.writes / secs : 0.0);
 }
 
-    
 /***
- * Not dealing with transactions yet
+ * Drop the transaction's write set, nothing it did ever reached the trees,
+ * and release its locks
  */
 ErrCode abortTransaction(TxnState *txn)
 {
   TXNState* txne = (TXNState*) txn;
 
+  if (txne == NULL || txne->status == -1)
+      return TXN_DNE;
   txne->status = -1;
-  
-  printf("Transaction Aborted\n");
+  p_freeTxn(txne);
   return SUCCESS;
 }
 
 /***
- * Not dealing with transactions yet
+ * Apply the transaction's write set. On DEADLOCK nothing was applied and
+ * the transaction stays open so the caller can abort and retry it.
  */
 ErrCode commitTransaction(TxnState *txn)
 {
-    
     TXNState* txne = (TXNState*) txn;
+    ErrCode ret;
 
+    if (txne == NULL || txne->status == -1)
+        return TXN_DNE;
+    if ((ret = p_commit(txne)) != SUCCESS)
+        return ret;
     txne->status = -1;
-  
-    printf("Transaction Commited\n");
+    p_freeTxn(txne);
     return SUCCESS;
 }
 /**
- * Get the first record, I am going to ignore the transaction values
- * since we only have one index
+ Retrieve the first record associated with the given key value; if
+ more than one record exists with this key, return the first record
+ with this key. Contents of the retrieved record are copied into
+ the user supplied Record structure.
+
+ Outside of a transaction the latest committed records are seen; inside one
+ the records committed as of its begin plus its own uncommitted changes.
  **/
 ErrCode get(IdxState *idxState, TxnState *txn, Record *record)
-{   
+{
     STXDBState *state = (STXDBState*) idxState;
-     std::pair<string, bool> ret;
-    //stxbtree_type* dbp = state->dbp;
-    //nbtree_int* nbt = (nbtree_int*)state->nbt;
+    TXNState* txne = (TXNState*) txn;
+
+    if (state == NULL || state->nbt == NULL || record->key.type != state->type)
+        return FAILURE;
     switch(state->type)
     {
-	case SHORT: 
-	    { 
-	    nbtree_st* shtree = (nbtree_st*)state->nbt;
-	    short k;
-	    p_setKeyDataFromKey(&(record->key), &k);
-            ret = shtree->get(k);
-	    cout << "string returned " << ret.first << endl;
-	    strcpy(record->payload, (ret.first).c_str());
-	    break;
-	    return SUCCESS;	    
-	    }
-	case INT: 
-	    {
-	    nbtree_int* intree = (nbtree_int*)state->nbt;
-	    int k;
-	    p_setKeyDataFromKey(&(record->key), &k);
-	    ret = intree->get(k);
-	    cout << "string returned " << ret.first << endl;
-	      strcpy(record->payload, ret.first.c_str());
-	      return SUCCESS;
-	      break;
-	    }
-	case VARCHAR: 
-	    {
-	    nbtree_ch* chtree = (nbtree_ch*)state->nbt;
-	    char* k;
-	    p_setKeyDataFromKey(&(record->key), k);
-	    string sk(k);
-	    ret = chtree->get(sk);
-	    cout << "string returend " << ret.first << endl;
-	    return SUCCESS;
-	    break;
-		      }
+	case SHORT:
+	    return p_get<nbtree_st, int32_t>(state, txne, record);
+	case INT:
+	    return p_get<nbtree_int, int64_t>(state, txne, record);
+	case VARCHAR:
+	    return p_get<nbtree_ch, string>(state, txne, record);
 	default:
 	    return FAILURE;
-    
-    }
-    
-    TXNState* txne = (TXNState*) txn;
-    if(txne->tid != state->tid) {
-	state->tid = txne->tid;
-	 memset(&(state->lastKey), 0, sizeof(Key));
-	state->keyNotFound = 1;
     }
-
-    memcpy(&(state->lastKey) , &(record->key), sizeof(Key));
-    state->keyNotFound  = 0;
-
 }
 
 
@@ -410,17 +2900,17 @@ ErrCode get(IdxState *idxState, TxnState *txn, Record *record)
  began, or if this is called from outside of a transaction, this
  returns the first record in the index. Records are ordered in ascending
  order by key.  Records with the same key but different payloads
- may be returned in any order. 
+ may be returned in any order.
 
  If get returned KEY_NOT_FOUND for a key k, invoking getNext will
  return the first key after k.
- 
- If the index is closed and reopened, or a new transaction has begun 
- since any previous call of get or getNext, getNext returns the first 
+
+ If the index is closed and reopened, or a new transaction has begun
+ since any previous call of get or getNext, getNext returns the first
  record in the index.
- 
 
- @param idxState The state variable for the index whose next Record 
+
+ @param idxState The state variable for the index whose next Record
  is to be returned
  @param txn The transaction state to be used (or NULL if not in a transaction)
  @param record Record through which the next key/payload pair is returned
@@ -433,52 +2923,20 @@ ErrCode get(IdxState *idxState, TxnState *txn, Record *record)
 ErrCode getNext(IdxState *idxState, TxnState *txn, Record *record)
 {
     STXDBState* state  = (STXDBState*) idxState;
-    //stxbtree_type* dbp = state->dbp;
-    void* nbt =(nbtree_int*) state->nbt;
-
-    btinter bit;
-    //if key wasn't found
     TXNState* txne = (TXNState*) txn;
-    if(txne->tid != state->tid){
-	state->tid = txne->tid;
-    memset(&(state->lastKey), 0, sizeof(Key));
-    state->keyNotFound = 1;
-    
-    if(state->keyNotFound == 1)
-    {
-	if(nbt->size() == 0)
-	{
-	    //state->keyNotFound = 0;
-	    return DB_END;
-	}
-	//bit = dbp->begin();
-	//copy data to payload
-	 nbt->exits(state->lastKey)
-	//move next
-	///bit++;
-	//strcpy(record->payload, bit->second.c_str());
-	//memcpy(&(state->lastKey) , &(record->key), sizeof(Key));
-	state->keyNotFound  = 0;
-	return SUCCESS;
-    }
-    else
-    {
-	nbt->exists(state->lastKey);
-	//move next
-	bit++;
-	if(bit == nbt->end())
-	{   
-	    return DB_END;
-	}
-	else
-	{   
-	    memcpy(&(record->key), &(bit->first), sizeof(Key));
-	    memcpy(&(state->lastKey), &(bit->first), sizeof(Key));
-	    strcpy(record->payload, bit->second.c_str());
-	    state->keyNotFound  = 0;	 
-	    return SUCCESS;
-	}
 
+    if (state == NULL || state->nbt == NULL)
+        return FAILURE;
+    switch(state->type)
+    {
+	case SHORT:
+	    return p_getNext<nbtree_st, int32_t>(state, txne, record);
+	case INT:
+	    return p_getNext<nbtree_int, int64_t>(state, txne, record);
+	case VARCHAR:
+	    return p_getNext<nbtree_ch, string>(state, txne, record);
+	default:
+	    return FAILURE;
     }
 }
 
@@ -488,7 +2946,7 @@ ErrCode getNext(IdxState *idxState, TxnState *txn, Record *record)
  called from outside of a transaction, it should commit immediately.
  Records in an index are ordered in ascending order by key.  Records
  with the same key may be stored in any order.
- 
+
  The implementation is responsible for making a copy of payload
  (e.g., it may not assume that the payload pointer continues
  to be valid after this routine returns.)
@@ -505,73 +2963,40 @@ ErrCode getNext(IdxState *idxState, TxnState *txn, Record *record)
  */
 ErrCode insertRecord(IdxState *idxState, TxnState *txn, Key *k, const char* payload)
 {
-
-	void* vbt;
-	void* mykey = NULL;
 	STXDBState* state = (STXDBState*) idxState;
-	
-	p_setKeyDataFromKey(k, mykey);
-	
-	if(mykey == NULL)
-	{
+	TXNState* txne = (TXNState*) txn;
+	ErrCode ret;
+
+	if(state == NULL || state->nbt == NULL || k->type != state->type)
+	    return FAILURE;
+	if(payload == NULL || strlen(payload) > MAX_PAYLOAD_LEN)
+	    return FAILURE;
+	if(txne != NULL && txne->isolation == READ_ONLY)
 	    return FAILURE;
-	}
 
-	//stxbtree_type* dbp = state->dbp;
-	//nbtree* nbt = state->nbt;
-	
-	std::string value(payload);
-	//std::pair<btinter, btinter> range; 
-	//range = dbp->equal_range(*k);
+	//outside of a transaction the insert runs as its own transaction
+	TXNState* own = (txne == NULL) ? p_newTxn(0) : NULL;
 	switch(k->type)
 	{
 	    case SHORT:
-		{
-		if(state->type != SHORT)
-		    return FAILURE;
-		nbtree_st* nbt = (nbtree_st*) state->nbt;
-
-	if(nbt->insert(*((short*)mykey), value) < 0)
-	{
-	    return ENTRY_EXISTS;
-	}
-		}
-	else 
-	    return SUCCESS;
+		ret = p_insert<nbtree_st, int32_t>(state, own ? own : txne, k, payload);
 		break;
 	    case INT:
-		{
-		if(state->type != INT)
-		    return FAILURE
-		
-		if(nbt->insert(*((int*)mykey), value) < 0)
-		{
-		    return ENTRY_EXISTS;
-		}
-		else 
-		    return SUCCESS;
+		ret = p_insert<nbtree_int, int64_t>(state, own ? own : txne, k, payload);
 		break;
-		}
 	    case VARCHAR:
-		{
-		string stkey((char*)mykey);
-		if(nbt->insert(stkey, value) < 0)
-		{
-
-		    return ENTRY_EXISTS;
-		}
-		else
-		    return SUCCESS;
+		ret = p_insert<nbtree_ch, string>(state, own ? own : txne, k, payload);
 		break;
-
-		}
 	    default:
-		return FAILURE;
+		ret = FAILURE;
 	}
-    	
-	memcpy(&(state->lastKey) , k, sizeof(Key));
-
-	return SUCCESS;
+	if(own != NULL)
+	{
+	    if(ret == SUCCESS)
+		ret = p_commit(own);
+	    p_freeTxn(own);
+	}
+	return ret;
 }
 
 
@@ -579,12 +3004,12 @@ ErrCode insertRecord(IdxState *idxState, TxnState *txn, Key *k, const char* payl
  Remove the record associated with the given key from the index
  structure.  If a payload is specified in the Record, then the
  key/payload pair specified is removed. Otherwise, the payload pointer
- is a length 0 string and all records with the given key are removed from thelll
+ is a length 0 string and all records with the given key are removed from the
  database.  If this is called from outside of a transaction, it should
  commit immediately.
 
  @param txn The transaction state to be used (or NULL if not in a transaction)
- @param record Record struct containing a Key and a char* payload 
+ @param record Record struct containing a Key and a char* payload
  (or NULL pointer) describing what is to be deleted
  @return ErrCode
  SUCCESS if successfully deleted record from DB.
@@ -595,19 +3020,36 @@ ErrCode insertRecord(IdxState *idxState, TxnState *txn, Key *k, const char* payl
  */
 ErrCode deleteRecord(IdxState *idxState, TxnState *txn, Record *record)
 {
-
-	
 	STXDBState* state = (STXDBState*) idxState;
-	void* nbt = state->nbt;
-    
-	//determnine if there is a payload
-	if(strlen(record->payload) != 0)
-	{
-	    if(nbt->erase_pair(record->key, record->payload) < 0)
-		return KEY_NOTFOUND;
-	}
+	TXNState* txne = (TXNState*) txn;
+	ErrCode ret;
 
-    return SUCCESS;
+	if(state == NULL || state->nbt == NULL || record->key.type != state->type)
+	    return FAILURE;
+	if(txne != NULL && txne->isolation == READ_ONLY)
+	    return FAILURE;
 
+	//outside of a transaction the delete runs as its own transaction
+	TXNState* own = (txne == NULL) ? p_newTxn(0) : NULL;
+	switch(state->type)
+	{
+	    case SHORT:
+		ret = p_delete<nbtree_st, int32_t>(state, own ? own : txne, record);
+		break;
+	    case INT:
+		ret = p_delete<nbtree_int, int64_t>(state, own ? own : txne, record);
+		break;
+	    case VARCHAR:
+		ret = p_delete<nbtree_ch, string>(state, own ? own : txne, record);
+		break;
+	    default:
+		ret = FAILURE;
+	}
+	if(own != NULL)
+	{
+	    if(ret == SUCCESS)
+		ret = p_commit(own);
+	    p_freeTxn(own);
+	}
+	return ret;
 }
-
@@ -1,9 +1,18 @@
 #include <stdio.h>
 #include <pthread.h>
+#include <algorithm>
+#include <deque>
+#include <map>
+#include <set>
+#include <string>
 #include <stx/btree_multimap.h>
 //sigmod server file
 #include "server.h"
 #include "src/btree.h"
+#include "src/hashbtree.h"
+#include "src/learnedbtree.h"
+#include "lockmgr.h"
+#include "wal.h"
 #define ENV_DIRECTORY "ENV"
 #define DEFAULT_HOMEDIR "./"
 
@@ -36,48 +45,256 @@ struct keyless
 
 
 
+//end timestamp of a version nobody has deleted yet
+#define TS_INFINITY (~(uint64_t) 0)
+
+/**
+ * One version of a payload stored in an index. It is visible to snapshots
+ * taken at or after beginTs and before endTs.
+ */
+struct PayloadVersion
+{
+    std::string payload;
+    uint64_t beginTs;
+    uint64_t endTs;
+
+    PayloadVersion() : beginTs(0), endTs(TS_INFINITY) {}
+    PayloadVersion(const std::string &p, uint64_t begin, uint64_t end)
+        : payload(p), beginTs(begin), endTs(end) {}
+
+    inline bool visible(uint64_t ts) const {
+        return (beginTs <= ts) && (ts < endTs);
+    }
+
+    //a version is identified by its payload and the commit that made it
+    inline bool operator==(const PayloadVersion &v) const {
+        return (beginTs == v.beginTs) && (payload == v.payload);
+    }
+
+    //trade contents with v, the payloads hand their buffers over
+    inline void swap(PayloadVersion &v) {
+        payload.swap(v.payload);
+        std::swap(beginTs, v.beginTs);
+        std::swap(endTs, v.endTs);
+    }
+};
+
+namespace nwt {
+    //index leaves shift versions by swapping them instead of copying payloads
+    template <>
+    struct slot_mover<PayloadVersion, false> : public slot_swapper<PayloadVersion> {
+    };
+}
+
+//bytes an index node is sized for, see nwt::btree_node_size. Larger nodes
+//make the trees shallower, smaller ones keep the leaf versions optimistic
+//transactions check and the checkpoint pages of changed leaves small.
+#define INDEX_NODE_BYTES 1024
+
+typedef nwt::btree_node_size<int32_t, PayloadVersion, INDEX_NODE_BYTES> nbtree_st_size;
+typedef nwt::btree_node_size<int64_t, PayloadVersion, INDEX_NODE_BYTES> nbtree_int_size;
+typedef nwt::btree_node_size<string, PayloadVersion, INDEX_NODE_BYTES> nbtree_ch_size;
+
 typedef nwt::btree<int, string, 4,4,std::less<int> > nbtree;
 typedef stx::btree_multimap<Key, std::string, keyless, btree_traits_debug<16> > stxbtree_type;
-typedef nwt::btree<short, string, 4,4,std::less<short> > nbtree_st;
-typedef nwt::btree<string, string, 4,4,std::less<string> > nbtree_ch;
-typedef nwt::btree<int, string, 4,4,std::less<int> > nbtree_int;
+typedef nwt::btree<int32_t, PayloadVersion, nbtree_st_size::nodeslots, nbtree_st_size::leafslots,
+        std::less<int32_t> > nbtree_st;
+//INT and VARCHAR indexes are read mostly by get, which finds a stored key
+//through a hash table instead of descending the tree. INT keys are mostly
+//sequence numbers, whose leaves a learned model finds for keys not stored.
+typedef nwt::hash_btree<string, PayloadVersion, nbtree_ch_size::nodeslots, nbtree_ch_size::leafslots,
+        std::less<string> > nbtree_ch;
+typedef nwt::learned_btree<int64_t, PayloadVersion, nbtree_int_size::nodeslots, nbtree_int_size::leafslots,
+        std::less<int64_t> > nbtree_int;
 typedef stxbtree_type::iterator btinter;
 
+struct DBLink;
+
+/**
+ * Position of get/getNext in an index
+ */
+struct IndexCursor
+{
+    Key lastKey;
+    char lastPayload[MAX_PAYLOAD_LEN + 1];
+    int scanStarted;
+    int keyNotFound;
+};
+
 struct STXDBState
 {
     stxbtree_type *dbp; //this will be the struct type stx btree
     void *nbt;
+    DBLink *link;
     KeyType type;
     const char* db_name;
+    //last transaction that used this handle, 0 for none
     uint32_t tid;
-    Key lastKey;
-    int keyNotFound;
+    //cursor for calls made outside a transaction, reset once one was used
+    IndexCursor cursor;
     int inUse;
 };
 
+/**
+ * Changes a transaction made under one key. They stay private to the
+ * transaction until commit.
+ */
+struct KeyWrite
+{
+    //payloads the transaction added
+    std::set<std::string> inserted;
+    //committed payloads the transaction removed
+    std::set<std::string> deleted;
+    //every committed payload under the key was removed
+    bool deleteAll;
+
+    KeyWrite() : deleteAll(false) {}
+};
+
+typedef std::map<Key, KeyWrite, keyless> KeyWriteMap;
+
+/**
+ * Write set of a transaction on one index, kept in key order so commit
+ * applies it to the tree as a sorted batch.
+ */
+struct IndexWriteSet
+{
+    DBLink *db;
+    KeyWriteMap keys;
+    struct IndexWriteSet *link;
+};
+
+/**
+ * Cursor a transaction has on one index handle. It goes away with the
+ * transaction, so the next one starts at the beginning of the index.
+ */
 struct CursorLink
 {   
  //   DBC *cursor;
+    STXDBState *idx;
+    IndexCursor cursor;
     struct CursorLink *cursorLink;
 };
-typedef struct
+/**
+ * SNAPSHOT_ISOLATION reads the snapshot taken at begin and locks only the
+ * keys it writes. SERIALIZABLE reads the latest committed data under shared
+ * key locks held to the end of the transaction. OPTIMISTIC is serializable
+ * as well but takes no locks until commit: it remembers the versions of the
+ * leaves its reads depended on and fails the commit with DEADLOCK if any of
+ * them changed. READ_ONLY reads the snapshot taken at begin with no locks
+ * and no read or write set, keeping its cursors in slots of its thread;
+ * inserts and deletes in it fail.
+ */
+typedef enum IsolationLevel { SNAPSHOT_ISOLATION, SERIALIZABLE, OPTIMISTIC, READ_ONLY } IsolationLevel;
+
+struct ReadProbe;
+
+typedef struct TXNState
 {
 	//stxbtree_type  *dbp;
 	void* nbt;
         CursorLink  *cursorLink;
+	IndexWriteSet *writeSet;
 	int status;
 	uint32_t tid;
+	//reads see the versions committed at or before this timestamp
+	uint64_t snapshotTs;
+	//snapshot slot snapshotTs is pinned in against garbage collection
+	int snapshotPin;
+	IsolationLevel isolation;
+	LockOwner locks;
+	//what an OPTIMISTIC transaction read, checked at commit
+	struct ReadProbe *readSet;
+	//some of its cursors are in its thread's READ_ONLY cursor slots
+	int threadCursors;
+	//next finished transaction on the thread's free list
+	struct TXNState *nextFree;
 } TXNState;
 
+/**
+ * A version a commit ended, physically removed once no snapshot can see it
+ */
+struct GarbageVersion
+{
+    Key key;
+    PayloadVersion version;
+};
+
 //typedef int bool;
 
 struct DBLink
 {
     char    *name;
+    //names the index in the write-ahead log
+    uint32_t id;
     void* nbt;
     stxbtree_type   *dbp;
     KeyType type;
+    //readers share it, commit holds it exclusively while applying writes
+    pthread_rwlock_t latch;
+    //ended versions in commit order, guarded by latch
+    std::deque<GarbageVersion> *garbage;
+    //small trees of the same type in front of nbt, guarded by latch.
+    //Commits insert into mem; a full mem becomes frozen, which the merge
+    //thread folds into nbt. Reads look at all three.
+    void *mem;
+    void *frozen;
     struct DBLink *link;
     int numOpenThreads;
     int inUse;
 };
+
+/**
+ Choose how a transaction started with beginTransaction is isolated. Must be
+ called before its first get, getNext, insertRecord or deleteRecord; after
+ one FAILURE is returned and the level stays. Transactions are
+ SNAPSHOT_ISOLATION by default.
+ */
+extern "C" ErrCode setIsolationLevel(TxnState *txn, IsolationLevel level);
+
+/**
+ Choose how durable commits are from now on, see WalDurability. The default
+ is WAL_GROUP.
+ */
+extern "C" ErrCode setDurability(WalDurability level);
+
+/**
+ Write a checkpoint of every index now, while transactions go on, and drop
+ the part of the log it makes unnecessary. One is also taken in the
+ background whenever the log has grown enough.
+ */
+extern "C" ErrCode checkpoint();
+
+/**
+ * What the checkpoints taken since the process started wrote. A leaf page
+ * is kept when the leaf did not change since the checkpoint before.
+ */
+struct CheckpointStats
+{
+    uint64_t checkpoints;
+    uint64_t pagesWritten;
+    uint64_t pagesKept;
+    uint64_t bytes;
+    uint64_t nanos;
+};
+
+extern "C" void getCheckpointStats(CheckpointStats *stats);
+extern "C" void printCheckpointStats(FILE *out);
+
+/**
+ * What rebuilding the indexes from the log took when the process started
+ */
+struct RecoveryStats
+{
+    //log frames read, one per commit or created index
+    uint64_t frames;
+    //insert and delete records replayed
+    uint64_t writes;
+    //versions left in the indexes once replay was done
+    uint64_t versions;
+    int threads;
+    uint64_t nanos;
+};
+
+extern "C" void getRecoveryStats(RecoveryStats *stats);
+extern "C" void printRecoveryStats(FILE *out);
@@ -0,0 +1,139 @@
+/*
+ * Cache misses per lookup of the nwt B+ tree
+ *
+ * Fills trees of several node sizes with random keys, then looks up random
+ * keys and reports the time and, from the CPU's counters, the L1 data and
+ * last level cache misses per lookup. Counters the kernel does not give
+ * out, as in most virtual machines, are reported as -.
+ *
+ *   g++ -O2 cachetest.cc -o cachetest && ./cachetest [keys] [lookups]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/time.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+
+#include "src/btree.h"
+
+// *** Settings
+
+/// default number of keys in each tree
+const unsigned int defaultkeys = 1024000 * 4;
+
+/// default number of lookups measured
+const unsigned int defaultlookups = 1024000;
+
+const int randseed = 34234235;
+
+/// Time is measured using gettimeofday()
+inline double timestamp()
+{
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    return tv.tv_sec + tv.tv_usec * 0.000001;
+}
+
+/// One hardware counter of this thread, fd is -1 when it is not available
+struct Counter
+{
+    int fd;
+
+    Counter(uint32_t type, uint64_t config)
+    {
+	struct perf_event_attr attr;
+	memset(&attr, 0, sizeof(attr));
+	attr.size = sizeof(attr);
+	attr.type = type;
+	attr.config = config;
+	attr.disabled = 1;
+	attr.exclude_kernel = 1;
+	attr.exclude_hv = 1;
+	fd = syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+    }
+
+    ~Counter()
+    {
+	if (fd >= 0)
+	    close(fd);
+    }
+
+    void start()
+    {
+	if (fd < 0)
+	    return;
+	ioctl(fd, PERF_EVENT_IOC_RESET, 0);
+	ioctl(fd, PERF_EVENT_IOC_ENABLE, 0);
+    }
+
+    void stop()
+    {
+	if (fd >= 0)
+	    ioctl(fd, PERF_EVENT_IOC_DISABLE, 0);
+    }
+
+    /// events per lookup, printed as - without the counter
+    void print(unsigned int lookups)
+    {
+	uint64_t count;
+	if ((fd < 0) || (read(fd, &count, sizeof(count)) != sizeof(count)))
+	    printf(" %8s", "-");
+	else
+	    printf(" %8.2f", (double) count / lookups);
+    }
+};
+
+/// Look up random keys in a tree of Slots slots per node
+template <int Slots>
+void lookup_test(unsigned int keys, unsigned int lookups)
+{
+    typedef nwt::btree<unsigned int, unsigned int, Slots, Slots> btree_type;
+
+    btree_type bt;
+
+    srand(randseed);
+    for(unsigned int i = 0; i < keys; i++)
+	bt.insert(rand(), i);
+
+    Counter l1(PERF_TYPE_HW_CACHE, PERF_COUNT_HW_CACHE_L1D |
+	       (PERF_COUNT_HW_CACHE_OP_READ << 8) | (PERF_COUNT_HW_CACHE_RESULT_MISS << 16));
+    Counter llc(PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES);
+
+    // keys stored and keys not stored alike
+    srand(randseed + 1);
+    unsigned int found = 0;
+    l1.start();
+    llc.start();
+    double ts1 = timestamp();
+    for(unsigned int i = 0; i < lookups; i++)
+	found += bt.exists(rand());
+    double ts2 = timestamp();
+    l1.stop();
+    llc.stop();
+
+    printf("%5d %10.1f", Slots, (ts2 - ts1) * 1e9 / lookups);
+    l1.print(lookups);
+    llc.print(lookups);
+    printf("   (%u found)\n", found);
+}
+
+int main(int argc, char* argv[])
+{
+    unsigned int keys = (argc > 1) ? atoi(argv[1]) : defaultkeys;
+    unsigned int lookups = (argc > 2) ? atoi(argv[2]) : defaultlookups;
+
+    printf("%u keys, %u lookups\n", keys, lookups);
+    printf("slots  ns/lookup  L1D/lkp  LLC/lkp\n");
+
+    lookup_test<8>(keys, lookups);
+    lookup_test<16>(keys, lookups);
+    lookup_test<32>(keys, lookups);
+    lookup_test<64>(keys, lookups);
+    lookup_test<128>(keys, lookups);
+
+    return 0;
+}
@@ -0,0 +1,343 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+#include <map>
+#include <vector>
+#include "server.h"
+#include "lockmgr.h"
+
+using namespace std;
+
+//the lock table is split so requests on different keys rarely share a mutex
+#define LOCK_STRIPES 64
+
+struct LockHead;
+
+struct LockRequest
+{
+    LockOwner *owner;
+    LockMode mode;
+    struct LockHead *head;
+    //next request granted on the same lock
+    struct LockRequest *next;
+    //next lock held by the same owner
+    struct LockRequest *ownerLink;
+};
+
+//what a lock name covers
+#define LOCK_ON_KEY 0
+#define LOCK_ON_GAP 1
+#define LOCK_ON_END 2
+
+struct LockName
+{
+    const void *space;
+    int on;
+    //zeroed for LOCK_ON_END
+    Key key;
+};
+
+struct LockNameLess
+{
+    bool operator()(const LockName &a, const LockName &b) const
+    {
+        if (a.space != b.space)
+            return a.space < b.space;
+        if (a.on != b.on)
+            return a.on < b.on;
+        if (a.key.type != b.key.type)
+            return a.key.type < b.key.type;
+        switch (a.key.type) {
+            case SHORT:
+                return a.key.keyval.shortkey < b.key.keyval.shortkey;
+            case INT:
+                return a.key.keyval.intkey < b.key.keyval.intkey;
+            case VARCHAR:
+                return strcmp(a.key.keyval.charkey, b.key.keyval.charkey) < 0;
+            default:
+                return false;
+        }
+    }
+};
+
+struct LockHead
+{
+    LockName name;
+    int stripe;
+    LockRequest *granted;
+    //owners blocked on this lock, the head is kept until they are gone
+    int waiters;
+};
+
+typedef std::map<LockName, LockHead *, LockNameLess> LockHeadMap;
+
+struct LockStripe
+{
+    pthread_mutex_t mutex;
+    //broadcast whenever a lock in the stripe is released
+    pthread_cond_t released;
+    LockHeadMap heads;
+};
+
+static LockStripe stripes[LOCK_STRIPES];
+static pthread_once_t stripesOnce = PTHREAD_ONCE_INIT;
+
+//wait-for graph: owner id -> ids of the owners it is waiting on. Only
+//owners that are waiting have an entry. An edge to an owner that finished
+//since names no live owner, as ids are not reused the way its address is.
+typedef std::map<uint32_t, std::vector<uint32_t> > WaitForGraph;
+static WaitForGraph waitsFor;
+static pthread_mutex_t WFG_LOCK = PTHREAD_MUTEX_INITIALIZER;
+
+static LockStats stats;
+
+static void p_initStripes()
+{
+    for (int i = 0; i < LOCK_STRIPES; i++) {
+        pthread_mutex_init(&(stripes[i].mutex), NULL);
+        pthread_cond_init(&(stripes[i].released), NULL);
+    }
+}
+
+static int p_stripeOf(const LockName &name)
+{
+    uint64_t h = (uint64_t) (size_t) name.space + name.on;
+    switch (name.key.type) {
+        case SHORT:
+            h ^= (uint64_t) name.key.keyval.shortkey * 0x9e3779b97f4a7c15ULL;
+            break;
+        case INT:
+            h ^= (uint64_t) name.key.keyval.intkey * 0x9e3779b97f4a7c15ULL;
+            break;
+        case VARCHAR:
+            for (const char *c = name.key.keyval.charkey; *c != '\0'; c++)
+                h = h * 31 + (unsigned char) *c;
+            break;
+        default:
+            break;
+    }
+    h ^= h >> 29;
+    return (int) (h % LOCK_STRIPES);
+}
+
+static inline uint64_t p_nowNanos()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static inline bool p_compatible(LockMode a, LockMode b)
+{
+    return (a == b) && (a != LOCK_X);
+}
+
+/**
+ * Owners other than owner holding a lock on head that conflicts with mode
+ */
+static void p_conflicting(LockHead *head, LockOwner *owner, LockMode mode,
+        std::vector<uint32_t> &out)
+{
+    out.clear();
+    for (LockRequest *r = head->granted; r != NULL; r = r->next) {
+        if (r->owner != owner && !p_compatible(r->mode, mode))
+            out.push_back(r->owner->id);
+    }
+}
+
+/**
+ * Record that owner waits on holders and check whether that closes a cycle.
+ * On a cycle the edges are dropped again and owner is the victim.
+ */
+static bool p_waitCloses(LockOwner *owner, const std::vector<uint32_t> &holders)
+{
+    bool cycle = false;
+    pthread_mutex_lock(&WFG_LOCK);
+    waitsFor[owner->id] = holders;
+
+    std::vector<uint32_t> stack(holders);
+    std::map<uint32_t, int> seen;
+    while (!stack.empty() && !cycle) {
+        uint32_t o = stack.back();
+        stack.pop_back();
+        if (o == owner->id) {
+            cycle = true;
+            break;
+        }
+        if (seen[o]++)
+            continue;
+        WaitForGraph::iterator it = waitsFor.find(o);
+        if (it != waitsFor.end())
+            stack.insert(stack.end(), it->second.begin(), it->second.end());
+    }
+    if (cycle)
+        waitsFor.erase(owner->id);
+    pthread_mutex_unlock(&WFG_LOCK);
+    return cycle;
+}
+
+static void p_stopWaiting(LockOwner *owner)
+{
+    pthread_mutex_lock(&WFG_LOCK);
+    waitsFor.erase(owner->id);
+    pthread_mutex_unlock(&WFG_LOCK);
+}
+
+static void p_recordWait(uint64_t nanos)
+{
+    __sync_fetch_and_add(&(stats.waitNanos), nanos);
+    uint64_t max = stats.maxWaitNanos;
+    while (nanos > max) {
+        uint64_t seen = __sync_val_compare_and_swap(&(stats.maxWaitNanos), max, nanos);
+        if (seen == max)
+            break;
+        max = seen;
+    }
+}
+
+static ErrCode p_acquire(LockOwner *owner, const LockName &name, LockMode mode)
+{
+    std::vector<uint32_t> holders;
+
+    pthread_once(&stripesOnce, p_initStripes);
+    int s = p_stripeOf(name);
+    LockStripe *stripe = &(stripes[s]);
+
+    pthread_mutex_lock(&(stripe->mutex));
+    LockHead *head;
+    LockHeadMap::iterator hit = stripe->heads.find(name);
+    if (hit != stripe->heads.end()) {
+        head = hit->second;
+    } else {
+        head = new LockHead;
+        head->name = name;
+        head->stripe = s;
+        head->granted = NULL;
+        head->waiters = 0;
+        stripe->heads[name] = head;
+    }
+
+    LockRequest *mine = head->granted;
+    while (mine != NULL && mine->owner != owner)
+        mine = mine->next;
+    if (mine != NULL && (mine->mode == LOCK_X || mine->mode == mode)) {
+        pthread_mutex_unlock(&(stripe->mutex));
+        return SUCCESS;
+    }
+    //holding one mode and asking for another means holding both, only X does
+    if (mine != NULL)
+        mode = LOCK_X;
+    __sync_fetch_and_add(&(stats.requests), 1);
+
+    p_conflicting(head, owner, mode, holders);
+    if (!holders.empty()) {
+        uint64_t start = p_nowNanos();
+        __sync_fetch_and_add(&(stats.waits), 1);
+        head->waiters++;
+        do {
+            if (p_waitCloses(owner, holders)) {
+                __sync_fetch_and_add(&(stats.deadlocks), 1);
+                p_recordWait(p_nowNanos() - start);
+                head->waiters--;
+                if (head->granted == NULL && head->waiters == 0) {
+                    stripe->heads.erase(head->name);
+                    delete head;
+                }
+                pthread_mutex_unlock(&(stripe->mutex));
+                return DEADLOCK;
+            }
+            pthread_cond_wait(&(stripe->released), &(stripe->mutex));
+            p_conflicting(head, owner, mode, holders);
+        } while (!holders.empty());
+        head->waiters--;
+        p_stopWaiting(owner);
+        p_recordWait(p_nowNanos() - start);
+    }
+
+    if (mine != NULL) {
+        mine->mode = mode;
+    } else {
+        mine = new LockRequest;
+        mine->owner = owner;
+        mine->mode = mode;
+        mine->head = head;
+        mine->next = head->granted;
+        head->granted = mine;
+        mine->ownerLink = owner->held;
+        owner->held = mine;
+    }
+    pthread_mutex_unlock(&(stripe->mutex));
+    return SUCCESS;
+}
+
+ErrCode lockAcquire(LockOwner *owner, const void *space, const Key *k, LockMode mode)
+{
+    LockName name;
+
+    memset(&name, 0, sizeof(LockName));
+    name.space = space;
+    name.on = LOCK_ON_KEY;
+    memcpy(&(name.key), k, sizeof(Key));
+    return p_acquire(owner, name, mode);
+}
+
+ErrCode lockAcquireGap(LockOwner *owner, const void *space, const Key *next, LockMode mode)
+{
+    LockName name;
+
+    memset(&name, 0, sizeof(LockName));
+    name.space = space;
+    name.on = (next != NULL) ? LOCK_ON_GAP : LOCK_ON_END;
+    if (next != NULL)
+        memcpy(&(name.key), next, sizeof(Key));
+    return p_acquire(owner, name, mode);
+}
+
+void lockReleaseAll(LockOwner *owner)
+{
+    LockRequest *r = owner->held;
+    while (r != NULL) {
+        LockRequest *nextHeld = r->ownerLink;
+        LockHead *head = r->head;
+        LockStripe *stripe = &(stripes[head->stripe]);
+
+        pthread_mutex_lock(&(stripe->mutex));
+        LockRequest **pp = &(head->granted);
+        while (*pp != r)
+            pp = &((*pp)->next);
+        *pp = r->next;
+        if (head->granted == NULL && head->waiters == 0) {
+            stripe->heads.erase(head->name);
+            delete head;
+        }
+        pthread_cond_broadcast(&(stripe->released));
+        pthread_mutex_unlock(&(stripe->mutex));
+
+        delete r;
+        r = nextHeld;
+    }
+    owner->held = NULL;
+}
+
+void getLockStats(LockStats *out)
+{
+    out->requests = __sync_add_and_fetch(&(stats.requests), 0);
+    out->waits = __sync_add_and_fetch(&(stats.waits), 0);
+    out->deadlocks = __sync_add_and_fetch(&(stats.deadlocks), 0);
+    out->waitNanos = __sync_add_and_fetch(&(stats.waitNanos), 0);
+    out->maxWaitNanos = __sync_add_and_fetch(&(stats.maxWaitNanos), 0);
+}
+
+void printLockStats(FILE *out)
+{
+    LockStats s;
+    getLockStats(&s);
+    fprintf(out, "locks: %llu requests, %llu waits, %llu deadlocks\n",
+            (unsigned long long) s.requests, (unsigned long long) s.waits,
+            (unsigned long long) s.deadlocks);
+    fprintf(out, "lock wait: avg %.1f us, max %.1f us\n",
+            s.waits ? (double) s.waitNanos / s.waits / 1000.0 : 0.0,
+            (double) s.maxWaitNanos / 1000.0);
+}
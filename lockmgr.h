@@ -0,0 +1,72 @@
+#ifndef _LOCKMGR_H_
+#define _LOCKMGR_H_
+
+#include <stdio.h>
+#include <stdint.h>
+//server.h has no include guard, includers bring it in before this file
+
+/**
+ * Key-level lock manager. Locks are named by an index (any pointer that
+ * identifies it) and a key, and are held by a LockOwner until it releases
+ * all of them at the end of its transaction.
+ *
+ * Besides the key itself a lock can name the gap between a key and the key
+ * before it (or the gap after the last key). A scan holds LOCK_S on the gaps
+ * it passed; a writer adding a new key holds LOCK_INSERT on the gap the key
+ * goes into. Inserters into one gap do not block each other.
+ */
+
+typedef enum LockMode { LOCK_S, LOCK_X, LOCK_INSERT } LockMode;
+
+struct LockRequest;
+
+struct LockOwner
+{
+    //names the owner in the wait-for graph, unique among live owners. The
+    //owner's memory is reused by later ones, so its address cannot.
+    uint32_t id;
+    //granted requests of this owner
+    struct LockRequest *held;
+};
+
+/**
+ * Lock wait statistics since the process started
+ */
+struct LockStats
+{
+    //requests not already covered by a lock the owner held
+    uint64_t requests;
+    //requests that had to wait for another owner
+    uint64_t waits;
+    //requests refused because waiting would have closed a cycle
+    uint64_t deadlocks;
+    uint64_t waitNanos;
+    uint64_t maxWaitNanos;
+};
+
+/**
+ Take a lock on key k of index space, waiting while another owner holds a
+ conflicting one. An owner holding S asking for X is upgraded.
+
+ @return ErrCode
+ SUCCESS once the lock is held.
+ DEADLOCK if waiting would close a cycle in the wait-for graph; the request
+ is dropped and the locks already held are kept.
+ */
+ErrCode lockAcquire(LockOwner *owner, const void *space, const Key *k, LockMode mode);
+
+/**
+ Same as lockAcquire, for the gap just before key next, or the gap after the
+ last key of the index when next is NULL
+ */
+ErrCode lockAcquireGap(LockOwner *owner, const void *space, const Key *next, LockMode mode);
+
+/**
+ Release every lock owner holds and wake the owners waiting for them
+ */
+void lockReleaseAll(LockOwner *owner);
+
+void getLockStats(LockStats *stats);
+void printLockStats(FILE *out);
+
+#endif
@@ -21,6 +21,7 @@
 
 #include <string>
 #include <stdlib.h>
+#include <unistd.h>
 #include <sys/time.h>
 
 #include <fstream>
@@ -30,6 +31,9 @@
 #include <set>
 #include <ext/hash_set>
 #include <stx/btree_multiset.h>
+#include "src/btree.h"
+#include "src/csbbtree.h"
+#include "src/pagedbtree.h"
 
 #include <assert.h>
 
@@ -300,6 +304,99 @@ struct Test_Btree_Find
     }
 };
 
+/// Test a tree of unsigned int pairs held in memory (find only)
+template <typename Tree>
+struct Test_Tree_Find
+{
+    typedef Tree btree_type;
+
+    btree_type bt;
+
+    Test_Tree_Find(unsigned int insertnum)
+    {
+	srand(randseed);
+	for(unsigned int i = 0; i < insertnum; i++)
+	    bt.insert(rand(), i);
+
+	assert( (unsigned int) bt.size() == insertnum );
+    }
+
+    void run(unsigned int insertnum)
+    {
+	srand(randseed);
+	for(unsigned int i = 0; i < insertnum; i++)
+	    bt.exists(rand());
+    }
+};
+
+/// Test the nwt B+ tree held in memory (find only), searching its leaves
+/// linearly or by interpolation and naming nodes by pointer or by arena
+/// handle as Traits says
+template <typename Traits>
+struct Test_Nwt_Find
+    : public Test_Tree_Find< nwt::btree<unsigned int, unsigned int, 64, 64, std::less<unsigned int>, Traits> >
+{
+    Test_Nwt_Find(unsigned int insertnum)
+	: Test_Tree_Find< nwt::btree<unsigned int, unsigned int, 64, 64, std::less<unsigned int>, Traits> >(insertnum)
+    {
+    }
+};
+
+/// Test the nwt B+ tree with a specific leaf/inner slots (find only)
+template <int Slots>
+struct Test_Nwt_Slots_Find : public Test_Tree_Find< nwt::btree<unsigned int, unsigned int, Slots, Slots> >
+{
+    Test_Nwt_Slots_Find(unsigned int insertnum)
+	: Test_Tree_Find< nwt::btree<unsigned int, unsigned int, Slots, Slots> >(insertnum)
+    {
+    }
+};
+
+/// Test the CSB+ tree with a specific leaf/inner slots (find only)
+template <int Slots>
+struct Test_Csb_Find : public Test_Tree_Find< nwt::csb_btree<unsigned int, unsigned int, Slots, Slots> >
+{
+    Test_Csb_Find(unsigned int insertnum)
+	: Test_Tree_Find< nwt::csb_btree<unsigned int, unsigned int, Slots, Slots> >(insertnum)
+    {
+    }
+};
+
+/// Test the paged B+ tree with every page in the buffer pool (find only),
+/// descending through swizzled child references or through the page hash
+template <bool Swizzle>
+struct Test_Paged_Find
+{
+    typedef nwt::paged_btree<unsigned int, unsigned int> btree_type;
+
+    btree_type bt;
+
+    Test_Paged_Find(unsigned int insertnum)
+    {
+	unlink("speedtest-paged.dat");
+	bt.open("speedtest-paged.dat", insertnum / 64 + btree_type::MIN_FRAMES, Swizzle);
+
+	srand(randseed);
+	for(unsigned int i = 0; i < insertnum; i++)
+	    bt.insert(rand(), i);
+
+	assert( bt.size() == insertnum );
+    }
+
+    ~Test_Paged_Find()
+    {
+	bt.close();
+	unlink("speedtest-paged.dat");
+    }
+
+    void run(unsigned int insertnum)
+    {
+	srand(randseed);
+	for(unsigned int i = 0; i < insertnum; i++)
+	    bt.exists(rand());
+    }
+};
+
 unsigned int repeatuntil;
 
 /// Repeat (short) tests until enough time elapsed and divide by the runs.
@@ -422,6 +519,20 @@ int main()
 
 	    btree_range<Test_Btree_Find, min_nodeslots, max_nodeslots>()(os, insertnum);
 
+	    testrunner_loop< Test_Nwt_Find<nwt::btree_traits_default> >(os, insertnum);
+
+	    testrunner_loop< Test_Nwt_Find<nwt::btree_traits_interpolate> >(os, insertnum);
+
+	    testrunner_loop< Test_Nwt_Find<nwt::btree_traits_compact> >(os, insertnum);
+
+	    btree_range<Test_Nwt_Slots_Find, min_nodeslots, max_nodeslots>()(os, insertnum);
+
+	    btree_range<Test_Csb_Find, min_nodeslots, max_nodeslots>()(os, insertnum);
+
+	    testrunner_loop< Test_Paged_Find<true> >(os, insertnum);
+
+	    testrunner_loop< Test_Paged_Find<false> >(os, insertnum);
+
 	    os << "\n" << std::flush;
 	}
     }
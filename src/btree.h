@@ -4,7 +4,10 @@
 
 #include <iostream>
 #include <ostream>
+#include <vector>
 #include <assert.h>
+#include "nodearena.h"
+#include "slotmove.h"
 
 
 #ifdef BTREE_DEBUG
@@ -20,9 +23,105 @@
 using namespace std;
 
 namespace nwt {
+    /**
+     *How a btree searches a leaf for a key: slot by slot from the front
+     **/
+    struct btree_traits_default {
+        static const bool interpolate = false;
+        static const bool compact = false;
+    };
+
+    /**
+     *Guess where the key is in a leaf from where it falls between the first
+     *and last key, for arithmetic keys ordered by std::less. Evenly spread
+     *keys, like sequence numbers, are found a probe or two from the guess;
+     *when the guess is off the leaf is binary searched instead.
+     **/
+    struct btree_traits_interpolate {
+        static const bool interpolate = true;
+        static const bool compact = false;
+    };
+
+    /**
+     *Keep the nodes in arenas of the tree and have inner nodes name their
+     *children, and every node its parent, by a 32 bit handle instead of a
+     *pointer, which makes an inner node of 32 bit keys a third smaller
+     **/
+    struct btree_traits_compact {
+        static const bool interpolate = false;
+        static const bool compact = true;
+    };
+
+    //what a node names another node by, see btree_traits_compact
+    template <typename _Node, bool _Compact>
+    struct btree_noderef {
+        typedef _Node* type;
+    };
+
+    template <typename _Node>
+    struct btree_noderef<_Node, true> {
+        typedef nodehandle_t type;
+    };
+
+    //a node in an arena knows its own handle, others need no room for it
+    template <bool _Compact>
+    struct btree_nodeself {
+    };
+
+    template <>
+    struct btree_nodeself<true> {
+        nodehandle_t handle;
+    };
+
+    //fewest slots btree_node_size gives a node, any fewer and it could
+    //not split and merge
+    static const size_t BTREE_MIN_SLOTS = 4;
+
+    //slots of _Slot bytes that fit in _Bytes after _Overhead
+    template <size_t _Bytes, size_t _Overhead, size_t _Slot>
+    struct btree_slots_fitting {
+        static const size_t fit = (_Bytes > _Overhead) ? (_Bytes - _Overhead) / _Slot : 0;
+        static const int slots = (fit < BTREE_MIN_SLOTS) ? BTREE_MIN_SLOTS : fit;
+    };
+
+    /**
+     *Slot counts that make the nodes of a btree of _Key and _Datatype take
+     *about _Bytes, like a cache line (64), a few of them (256) or a page
+     *(4096):
+     *
+     *  typedef btree_node_size<K, D, 256> sizing;
+     *  btree<K, D, sizing::nodeslots, sizing::leafslots> t;
+     *
+     *An inner node pays a child pointer per key. A leaf pays for the data
+     *array it points to as well, since a lookup that finds its key reads
+     *the data next.
+     **/
+    template <typename _Key, typename _Datatype, size_t _Bytes>
+    struct btree_node_size {
+        //node header, the slot count and leaf flag padded to 4 bytes, and
+        //nodetail, the parent link
+        static const size_t header = 4;
+        static const size_t tail = sizeof(void*);
+        //the last child and the child count of an inner node, or the data
+        //array pointer, leaf links and version of a leaf
+        static const size_t inneroverhead = header + sizeof(void*) + sizeof(int) + tail;
+        static const size_t leafoverhead = header + 3 * sizeof(void*) + sizeof(unsigned long long) + tail;
+
+        static const int nodeslots =
+                btree_slots_fitting<_Bytes, inneroverhead, sizeof(_Key) + sizeof(void*)>::slots;
+        static const int leafslots =
+                btree_slots_fitting<_Bytes, leafoverhead, sizeof(_Key) + sizeof(_Datatype)>::slots;
+    };
+
+    template <typename _Key, typename _Datatype, int _nodeslots, int _leafslots, typename _Compare, typename _Traits, typename _Hash>
+            class hash_btree;
+    template <typename _Key, typename _Datatype, int _nodeslots, int _leafslots, typename _Compare, typename _Traits, typename _Hash>
+            class learned_btree;
+
     //class for the btree
 
-    template <typename _Key, typename _Datatype, int _nodeslots, int _leafslots, typename _Compare = std::less<_Key> >
+    template <typename _Key, typename _Datatype, int _nodeslots, int _leafslots, typename _Compare = std::less<_Key>,
+            typename _Traits = btree_traits_default>
             class btree {
     public:
         //key type for this current instance of the btree.
@@ -35,6 +134,8 @@ namespace nwt {
         typedef std::pair<_Key, bool> lookuppair_type;
         //Key comparison function
         typedef _Compare key_compare;
+        //leaf search, see btree_traits_default
+        typedef _Traits traits;
 
         class iterator;
         class const_iterator;
@@ -42,6 +143,11 @@ namespace nwt {
         class const_reverse_iterator;
 
     private:
+        template <typename, typename, int, int, typename, typename, typename>
+                friend class hash_btree;
+        template <typename, typename, int, int, typename, typename, typename>
+                friend class learned_btree;
+
         static const unsigned short bt_nodenum;
         //Number of nodes in the tree
         short bt_numNodes;
@@ -60,22 +166,27 @@ namespace nwt {
     private:
         //Private data structures
 
+        struct node;
+        //a child or parent as a node holds it, a pointer or a handle
+        typedef typename btree_noderef<node, _Traits::compact>::type noderef;
+        //how slots are shifted and moved between nodes, see slot_mover
+        typedef slot_mover<keytype> keymover;
+        typedef slot_mover<data_type> datamover;
+        typedef slot_mover<noderef> childmover;
+
+        /**
+         *What every node starts with: only what a lookup reads before the
+         *keys, so the first cache line of a node is mostly keys. What only
+         *changes to the tree read sits behind the slots, in nodetail.
+         **/
         struct node {
-            //total number of slots
-            unsigned short slots;
             //total number of slots in use
             unsigned short slotsinuse;
             //if its a leafnode
             bool isleafnode;
-	    //if its a root
-            bool isrootnode;
-            node* parent;
 
             inline void initialize() {
-                slots = 0;
                 slotsinuse = 0;
-                parent = NULL;
-                isrootnode = false;
             }
 
             inline bool isleaf() const {
@@ -85,14 +196,11 @@ namespace nwt {
             inline unsigned short keyCount() const {
                 return slotsinuse;
             }
+        };
 
-            inline bool isRoot() const {
-                return isrootnode;
-            }
-
-            inline void setIsRoot(bool root) {
-                isrootnode = root;
-            }
+        //the end of every node, the parent and in an arena the node's handle
+        struct nodetail : public btree_nodeself<_Traits::compact> {
+            noderef parent;
         };
 
         //inherit node for inner node
@@ -100,17 +208,18 @@ namespace nwt {
             //slots for keys....inner nodes only have slots of keys and pointers
             keytype keySlots[bt_innernodemax];
             //pointer to the first child, this is the pointer to the main segment
-            node * firstChild[bt_innernodemax + 1];
+            noderef firstChild[bt_innernodemax + 1];
             //number of child nodes present, max can be node:slots + 1
             int numChildren;
+            nodetail tail;
             //innernode slots
             inline void initialize() {
                 node::initialize();
-                node::slots = bt_innernodemax;
                 node::isleafnode = false;
                 for (int i = 0; i < bt_innernodemax + 1; i++)
-                    firstChild[i] = NULL;
+                    firstChild[i] = noderef();
                 numChildren = 0;
+                tail.parent = noderef();
             }
 	    //quick quess that two nodes are identical...not always correct
             inline bool equal(const innerNode & n) {
@@ -133,32 +242,6 @@ namespace nwt {
             };
         };
 
-	/**
-	 *Struct mean't to represent inner nodes
-	 *
-	 * */
-        struct innerngroup {
-            innerNode * group[bt_innernodemax];
-
-            inline void initialize() {
-                group = new innerNode[bt_innernodemax];
-                for (int i = 0; i < bt_innernodemax; i++) {
-                    group[i] = NULL;
-                }
-            }
-
-            innerngroup * getNodeGroup() {
-                return group;
-            }
-
-            inline void free_group() {
-                for (int i = 0; i < bt_leafnodemax; i++)
-                    delete group[i];
-
-            }
-        };
-
-
         //inherit node for leaf node
 
         struct leafNode : public node {
@@ -170,12 +253,16 @@ namespace nwt {
             //They will be helpful for range queries
             leafNode* nextLeaf;
             leafNode* prevLeaf;
+            //changes whenever the leaf does, see touchleaf
+            unsigned long long version;
+            nodetail tail;
 
             inline void initialize() {
                 node::initialize();
-                node::slots = bt_leafnodemax;
                 node::isleafnode = true;
                 prevLeaf = nextLeaf = NULL;
+                version = 0;
+                tail.parent = noderef();
                 dataSlots = new data_type[bt_leafnodemax];
                 //keySlots = new keytype[node::slot];
             }
@@ -218,20 +305,167 @@ namespace nwt {
         leafNode* tailleaf;
         leafNode* headleaf;
         unsigned int totalkeycount;
+        //last leaf version handed out, never reset so a leaf allocated
+        //where a freed one was never repeats its version
+        unsigned long long leafversions;
+        //told about each leaf a split, merge or borrow moved pairs into,
+        //NULL when nobody asked, see hash_btree
+        void (*leafmoved)(void* arg, leafNode* l);
+        void* leafmovedarg;
+        //leaves freed so far, a pointer to a leaf taken when it was
+        //different may be dangling
+        unsigned long long leaffrees;
+        //where the nodes are with btree_traits_compact, unused otherwise
+        node_arena<innerNode> innerarena;
+        node_arena<leafNode> leafarena;
+        //leaf handles have the top bit set, inner node handles do not
+        static const nodehandle_t LEAF_HANDLE = 0x80000000u;
+
+        template <bool _Compact>
+        struct arenatag {
+        };
+
+        inline node* nodeof(node* r, arenatag<false>) const {
+            return r;
+        }
+
+        inline node* nodeof(nodehandle_t h, arenatag<true>) const {
+            if (h == 0)
+                return NULL;
+            if (h & LEAF_HANDLE)
+                return leafarena.at(h);
+            return innerarena.at(h);
+        }
+
+        inline node* refof(node* n, arenatag<false>) const {
+            return n;
+        }
+
+        inline nodehandle_t refof(node* n, arenatag<true>) const {
+            return (n != NULL) ? tailof(n).handle : 0;
+        }
+
+        inline node* nodeof(noderef r) const {
+            return nodeof(r, arenatag<_Traits::compact>());
+        }
+
+        inline noderef refof(node* n) const {
+            return refof(n, arenatag<_Traits::compact>());
+        }
+
+        inline nodetail& tailof(node* n) const {
+            if (n->isleaf())
+                return static_cast<leafNode*> (n)->tail;
+            return static_cast<innerNode*> (n)->tail;
+        }
+
+        inline innerNode* parentof(node* n) const {
+            return static_cast<innerNode*> (nodeof(tailof(n).parent));
+        }
+
+        inline void setparent(node* n, innerNode* p) {
+            tailof(n).parent = refof(p);
+        }
+
+        inline node* childat(innerNode* n, int i) const {
+            return nodeof(n->firstChild[i]);
+        }
+
+        inline leafNode* newleaf(arenatag<false>) {
+            return new leafNode;
+        }
+
+        inline leafNode* newleaf(arenatag<true>) {
+            nodehandle_t h = leafarena.allocate();
+            leafNode* l = leafarena.at(h);
+            l->tail.handle = h;
+            return l;
+        }
+
+        inline innerNode* newinner(arenatag<false>) {
+            return new innerNode;
+        }
+
+        inline innerNode* newinner(arenatag<true>) {
+            nodehandle_t h = innerarena.allocate();
+            innerNode* n = innerarena.at(h);
+            n->tail.handle = h;
+            return n;
+        }
+
+        inline void deleteleaf(leafNode* l, arenatag<false>) {
+            delete l;
+        }
+
+        inline void deleteleaf(leafNode* l, arenatag<true>) {
+            leafarena.release(l->tail.handle);
+        }
+
+        inline void deleteinner(innerNode* n, arenatag<false>) {
+            delete n;
+        }
+
+        inline void deleteinner(innerNode* n, arenatag<true>) {
+            innerarena.release(n->tail.handle);
+        }
+
+        //a new node, to be initialized
+        inline leafNode* newleaf() {
+            return newleaf(arenatag<_Traits::compact>());
+        }
+
+        inline innerNode* newinner() {
+            return newinner(arenatag<_Traits::compact>());
+        }
         //public tree methods
     public:
         //constructor
 
-        inline btree() {
+        inline btree()
+        : leafarena(LEAF_HANDLE) {
             root = NULL;
             tailleaf = NULL;
             headleaf = NULL;
             totalkeycount = 0;
+            leafversions = 0;
+            leafmoved = NULL;
+            leafmovedarg = NULL;
+            leaffrees = 0;
+        }
+
+        inline ~btree() {
+            clear();
+        }
+
+        //free every node, the tree is empty afterwards
+        inline void clear() {
+            freeSubtree(root);
+            root = NULL;
+            tailleaf = NULL;
+            headleaf = NULL;
+            totalkeycount = 0;
+            innerarena.clear();
+            leafarena.clear();
         }
 
         inline node* getRoot() {
             return btree::root;
         }
+
+        /**
+         *Give leaf l a new version. The tree does it for every change it
+         *makes, callers that change data in place through an iterator
+         *call it themselves.
+         * */
+        inline void touchleaf(leafNode* l) {
+            l->version = ++leafversions;
+        }
+
+        //pairs were moved into leaf l from one of its neighbours
+        inline void movedinto(leafNode* l) {
+            if (leafmoved != NULL)
+                leafmoved(leafmovedarg, l);
+        }
         //size, this will return the number of data values in the treee
 
         inline int size() {
@@ -246,9 +480,13 @@ namespace nwt {
             return false;
         }
         //get leaf slot size
-        int keyslotsize();
+        static inline int keyslotsize() {
+            return bt_leafnodemax;
+        }
         //get node slot size
-        int nodeslotsize();
+        static inline int nodeslotsize() {
+            return bt_innernodemax;
+        }
         //erase
         void erase();
 
@@ -256,70 +494,25 @@ namespace nwt {
 	 *Find the location of node c, in innerNode n
 	 **/
         int findInnerNodeLoc(innerNode* n, node* c) {
-            //cout << "findInnerNodeLoc" << endl;
             if ((c == NULL) || (n == NULL)) {
                 //cout << "findInnerNodeLoc, child is null" << endl;
                 return -1;
             }
-            //cout << "parent has " << n->numChildren << " children" << endl;
-             //cout << "parent has " << n->keyCount() << " keys" << endl;
-
-            if (c->isleaf()) {
-                leafNode* child = static_cast<leafNode*> (c);
-                //cout << "findinnernodeloc:: inner node is leaf" << endl;
-                //get the first key of the child
-                keytype k = child->keySlots[0];
-                int i;
-                //cout << "findinnernodeloc:: search key is " << k << endl;
-                for (i = 0; i < n->keyCount(); i++) {
-                     //cout << "findinnernodeloc:: checking loc " << i << endl;
-                    if (keygreater(n->keySlots[i], k) > 0) {
-                        return i;
-                    }
-                }
-                //check node at the end
-                if(i < n->numChildren) {
-                    //cout << "checking last child " << endl;
-                leafNode* last = static_cast<leafNode*>(n->firstChild[i]);
-                //cout << "last child's first key key is " << last->keySlots[0] << endl;
-                if(keyequal(last->keySlots[0], k))
+            //match children by address, separator keys are not unique once
+            //duplicate keys span more than one leaf
+            noderef r = refof(c);
+            for (int i = 0; i < n->numChildren; i++) {
+                if (n->firstChild[i] == r)
                     return i;
-                }
-                return -1;
-                
-
-            } else {
-                innerNode* child = static_cast<innerNode*> (c);
-
-                //get the first key of the child
-                int i;
-                keytype k = child->keySlots[0];
-                for (i = 0; i < n->keyCount(); i++) {
-                    if (keygreater(n->keySlots[i], k) > 0) {
-                        return i;
-                    }
-                }
-                if(i < n->numChildren)
-                {
-                    //cout << "checking last child " << endl;
-                //the node is at the end
-                  innerNode* last = static_cast<innerNode*>(n->firstChild[n->numChildren-1]);
-
-                    if(keyequal(last->keySlots[0], k))
-                        return i;
-                }
-                return i;
             }
             return -1;
-
-
         }
         void printleaves()
         {
 
             leafNode* l;
             //cout << "printing leaves" << endl;
-            l = find(0);
+            l = headleaf;
 
             while(l != NULL) {
                 for(int i = 0; i < l->keyCount(); i++)
@@ -330,63 +523,28 @@ namespace nwt {
                 //cout << "next leaf" << endl;
             }
         }
-	/**
-	 *Find the location of key in innderNode
-	 *
-	 * */
-        int findInnerNodeKey(innerNode* n, keytype k) {
-            if (n == NULL)
-                return -1;
-            //cout << "findInnerNodeKey:: locking for key " << k << endl;
-            for (int i = 0; i < n->slotsinuse; i++)
-                if (keyequal(n->keySlots[i], k) > 0) {
-                    return i;
-                }
-            return -1;
-        }
 
         inline node* getChild(innerNode* n, int i) {
-            if (i < 0 || i > n->slotsinuse)
-                return NULL;
-            if (n->firstChild == NULL)
+            if (i < 0 || i >= n->numChildren)
                 return NULL;
-            else {
-                //cout << "returning child " << i << endl;
-                return n->firstChild[i];
-            }
-
+            //cout << "returning child " << i << endl;
+            return childat(n, i);
         }
 	/**
 	 *insert a key in a inner Node
 	 *
 	 * */
         inline int insertInnerNodeKeyAt(innerNode* n, keytype k, int index) {
-            //int old = node:slotsinuse;
-            int max = n->keyCount();
-            max = max - 1;
-            if (index >= n->slots || index < 0) {
+            if (index > n->keyCount() || index < 0 || n->isfull()) {
                 return -1;
-            }//if there are no keys or position is at end, a simple entry.
-            if ((n->keyCount() == 0) || ((n->keyCount() <= index) && (index < n->slots))) {
-                n->keySlots[index] = k;
-                //cout << "added key " << k << " at location " << index << endl;
-                n->slotsinuse++;
-                return 1;
-            } else if ((index) <= n->keyCount()) {
-                //loop through array to move keys to create space
-                //for new key in position index
-                for (int i = max + 1; i > index; i--) {
-                    n->keySlots[i] = n->keySlots[i - 1];
-                }
-
-                //insert the new key
-                n->keySlots[index] = k;
-                n->slotsinuse++;
-                //cout << "added key " << k << endl;
-
-                return 1;
             }
-            return -1;
+            //move keys to create space for new key in position index
+            keymover::move(n->keySlots + index + 1, n->keySlots + index, n->keyCount() - index);
+
+            //insert the new key
+            n->keySlots[index] = k;
+            n->slotsinuse++;
+            return 1;
         }
 
         /**
@@ -394,125 +552,133 @@ namespace nwt {
          * */
         inline int insertInnerNodeChildAt(innerNode* dest, node* n, int index) {
             //check if its out of bounds
-            if (index > dest->slots || index < 0) {
-                printf("Array of of bounds, %d in array of size %d\n", index, dest->slots);
+            if (index > dest->numChildren || index < 0 || dest->numChildren > bt_innernodemax) {
+                printf("Array of of bounds, %d in array of size %d\n", index, bt_innernodemax);
                 return -1;
             }
             //cout << "insert child in index " << index << endl;
-            if(index < dest->numChildren)
-            {
-                //cout << "insertInnerNodeChildAt:: shifting nodes" << endl;
-                for(int i=dest->numChildren-1; i >= index; i--)
-                {
-                    dest->firstChild[i+1] = dest->firstChild[i];
-                    //leafNode* d = static_cast<leafNode*> (dest->firstChild[index+1]);
-                       ////cout << "first key in next is " << d->keySlots[i+1] << endl;
-                }
-            }
-            dest->firstChild[index] = static_cast<node*> (n);
-            n->parent = dest;
-            //cout << "a child has been added" << endl;
-
+            childmover::move(dest->firstChild + index + 1, dest->firstChild + index, dest->numChildren - index);
+            dest->firstChild[index] = refof(n);
+            setparent(n, dest);
 
             //increment the number of Children
             dest->numChildren++;
-            ///set the next and previous leaf pointers if the node being
-            //added is a leaf
-            if (n->isleaf()) {
-                //set the next and previous nodes
-                 leafNode* l = static_cast<leafNode*> (n);
-                if (index - 1 >= 0) {
-                    //cout << "setting prev leaf" << endl;
-
-                    leafNode* d = static_cast<leafNode*> (dest->firstChild[index - 1]);
-                     l->prevLeaf = d;
-                    d->nextLeaf = l;
-                     //cout << "last key in prev is " << d->keySlots[d->keyCount()-1] << endl;
-                     //cout << "first key in cur is " << l->keySlots[0] << endl;
-                }
-          
-                if (index + 1 < dest->numChildren) {
-                    //cout << "setting next leaf" << endl;
-                    
-                    leafNode* d = static_cast<leafNode*> (dest->firstChild[index + 1]);
-                    l->nextLeaf = d;
-                    d->prevLeaf = l;
-                     //cout << "last key in cur is " << l->keySlots[l->keyCount()-1] << endl;
-                     //cout << "first key in next is " << d->keySlots[0] << endl;
-                }
-             
-            }
-            //cout << dest->numChildren << endl;
             return 0;
-            //return -1;
         }
 
         /**
-         * insert pair into node
+         *Remove key keyloc and child childloc from an inner node
          * */
-        inline int insertinnernodepair(innerNode* n, keytype k, node* child) {
-
-            int loc = -1;
-            if ((child == NULL)) {
-                printf("Cannot insert null keys or nodes\n");
+        inline int deleteinnerpair(innerNode* p, int keyloc, int childloc) {
+            if (keyloc < 0 || keyloc >= p->keyCount() || childloc < 0 || childloc >= p->numChildren)
                 return -1;
-            }
-            assert(n->slotsinuse < n->slots);
-            
-               for (int i = 0; i < n->slotsinuse; i++) {
-                if (keygreater(n->keySlots[i], k) > 0) {
-                    loc = i;
-                }
+            keymover::move(p->keySlots + keyloc, p->keySlots + keyloc + 1, p->keyCount() - keyloc - 1);
+            childmover::move(p->firstChild + childloc, p->firstChild + childloc + 1, p->numChildren - childloc - 1);
+            p->slotsinuse--;
+            p->numChildren--;
+            p->firstChild[p->numChildren] = noderef();
+            return keyloc;
+        }
 
-               }
-            if(loc == -1)
-                loc = n->slotsinuse;
-            if (loc < 0) {
-                //cout << "cannot find location " << endl;
-                return loc;
+        /**
+         *Free a node and everything below it
+         * */
+        void freeSubtree(node* n) {
+            if (n == NULL)
+                return;
+            if (!n->isleaf()) {
+                innerNode* inner = static_cast<innerNode*> (n);
+                for (int i = 0; i < inner->numChildren; i++) {
+                    freeSubtree(childat(inner, i));
+                }
             }
+            freeNode(n);
+        }
+        //slots a guessed position is walked from before a binary search
+        static const int INTERPOLATION_STEPS = 4;
+        //leaves with fewer pairs are always searched slot by slot
+        static const int INTERPOLATION_MIN = 16;
 
-            if (loc >= 0) {
-                //cout << "insertinnernodepair:: loc is " << loc << endl;
-                insertInnerNodeKeyAt(n, k, loc);
-                insertInnerNodeChildAt(n, child, loc);
-                //cout << "there are now " << n->numChildren << " children" << endl;
-                return loc;
-            } else {
-                printf("cannot insert pair\n");
-                return loc;
-            }
-            return -1;
+        template <bool _Interpolate>
+        struct searchtag {
+        };
+
+        //key in slot i of l comes before the slot searched for
+        inline bool slotbefore(leafNode* l, int i, const keytype& k, bool upper) const {
+            return upper ? !keyless(k, l->keySlots[i]) : keyless(l->keySlots[i], k);
         }
 
         /**
-         *Free all keys and children in node
+         *First slot of l with a key not less than k, or greater than k with
+         *upper, looking at one slot after the other
          * */
-        void freeInnerNode(innerNode* n) {
-            for (int i = 0; i < n->keyCount(); i++) {
-                delete n->firstChild[i];
+        inline int searchleaf(leafNode* l, const keytype& k, bool upper, searchtag<false>) const {
+            int i = 0;
+            while ((i < l->slotsinuse) && slotbefore(l, i, k, upper))
+                i++;
+            return i;
+        }
+
+        /**
+         *The same from a guess interpolated between the first and last key.
+         *A few slots are walked from the guess; when the slot is not among
+         *them the keys are skewed and the rest is binary searched.
+         * */
+        int searchleaf(leafNode* l, const keytype& k, bool upper, searchtag<true>) const {
+            int lo = 0;
+            int hi = l->slotsinuse;
+            if (hi < INTERPOLATION_MIN)
+                return searchleaf(l, k, upper, searchtag<false>());
+            if (!slotbefore(l, 0, k, upper))
+                return 0;
+            if (slotbefore(l, hi - 1, k, upper))
+                return hi;
+
+            //keys at the ends differ here, k lies between them
+            double first = (double) l->keySlots[0];
+            double last = (double) l->keySlots[hi - 1];
+            int guess = (int) (((double) k - first) / (last - first) * (hi - 1));
+            if (guess < 1)
+                guess = 1;
+            else if (guess > hi - 1)
+                guess = hi - 1;
+            if (slotbefore(l, guess - 1, k, upper)) {
+                lo = guess;
+                for (int i = 0; (i < INTERPOLATION_STEPS) && (lo < hi); i++, lo++) {
+                    if (!slotbefore(l, lo, k, upper))
+                        return lo;
+                }
+            } else {
+                hi = guess - 1;
+                for (int i = 0; (i < INTERPOLATION_STEPS) && (hi > lo); i++, hi--) {
+                    if (slotbefore(l, hi - 1, k, upper))
+                        return hi;
+                }
             }
+            while (lo < hi) {
+                int mid = (lo + hi) / 2;
+                if (slotbefore(l, mid, k, upper))
+                    lo = mid + 1;
+                else
+                    hi = mid;
+            }
+            return lo;
         }
+
 	/***
 	 *Find a key great in a leafNode
 	 *
 	 * **/
         inline int findKeyLoc(leafNode* l, keytype k) {
-            int i = 0;
-
-            if (l->slotsinuse == 0)
-                return 0;
-            //cout << "In leafnode find key Loc" << endl;
-            for (i = 0; i < l->slotsinuse; i++) {
-                //cout << "slot key is " << l->keySlots[i] << " and key is " << k << endl;
-                if (keygreaterequal(l->keySlots[i], k) > 0)
-                {
-                    return i;
-                }
-            }
-            //cout << "findkeyloc:: k is greater than everything" << endl;
-            return l->slotsinuse;
+            return searchleaf(l, k, false, searchtag<_Traits::interpolate>());
+        }
 
+	/***
+	 *Find the first slot in a leafNode with a key greater than k
+	 *
+	 * **/
+        inline int findKeyUpper(leafNode* l, keytype k) {
+            return searchleaf(l, k, true, searchtag<_Traits::interpolate>());
         }
 
 	/***
@@ -520,19 +686,12 @@ namespace nwt {
 	 *
 	 * */
         inline int findKeyEqual(leafNode* l, keytype k) {
-            int i = 0;
 	    if(l == NULL)
 		return -1;
-            if (l->slotsinuse == 0)
-                return 0;
-            //cout << "In leafnode find key Loc" << endl;
-            for (i = 0; i < l->slotsinuse; i++) {
-                //cout << "slot key is " << l->keySlots[i] << " and key is " << k << endl;
-                if (keyequal(l->keySlots[i], k) > 0)
-                    return i;
-            }
-            //cout << "findkeyloc:: k is greater than everything" << endl;
-            return l->slotsinuse;
+            int i = findKeyLoc(l, k);
+            if ((i < l->slotsinuse) && keyequal(l->keySlots[i], k))
+                return i;
+            return -1;
         }
 	/**
 	 *Insert data in the index of the leafNode
@@ -549,48 +708,31 @@ namespace nwt {
 
                 l->dataSlots[index] = data;
             }
-
-            //dosomething
+            touchleaf(l);
 
             return index;
         }
 	/**
-	 *Insert key in the index of the leafNode 
+	 *Insert key in the index of the leafNode, the data slots are moved
+	 *along with the keys so insertleafDataAt can fill in the gap.
 	 * */
         inline int insertleafKeyAt(leafNode* l, keytype k, int index) {
-            //int old = node:slotsinuse;
 	    if(l == NULL)
 		return -1;
-            int max = l->keyCount();
             assert(l->isleaf());
             //cout << "in insertleafkey " << k << " at index " << index << endl;
-            if ((index >= l->slots) || (index < 0)) {
+            if ((index > l->keyCount()) || (index < 0) || l->isfull()) {
                 return -1;
-            }//if there are no keys or position is at end, a simple entry.
-            if ((l->keyCount() == 0) || ((l->keyCount() <= index) && (index < l->slots))) {
-                l->keySlots[index] = k;
-                l->slotsinuse++;
-                //cout << "keys in node" << endl;
-                for (int i = 0; i < l->keyCount(); i++)
-                    //cout << "key is " << l->keySlots[i] << endl;
-                return 1;
-            } else if ((index) <= l->keyCount()) {
-                //loop through array to move keys to create space
-                //for new key in position index
-                //cout << "moving keys to create space" << endl;
-                for (int i = max; i > index; i--) {
-                    l->keySlots[i] = l->keySlots[i - 1];
-                }
-
-                //insert the new key
-                l->keySlots[index] = k;
-                l->slotsinuse++;
-                //cout << "keys in node" << endl;
-                for (int i = 0; i < l->keyCount(); i++)
-                    //cout << "key is " << l->keySlots[i] << endl;
-                return 1;
-
             }
+            //move keys and data to create space for new key in position index
+            int behind = l->keyCount() - index;
+            keymover::move(l->keySlots + index + 1, l->keySlots + index, behind);
+            datamover::move(l->dataSlots + index + 1, l->dataSlots + index, behind);
+
+            //insert the new key
+            l->keySlots[index] = k;
+            l->slotsinuse++;
+            touchleaf(l);
             return 1;
         }
 
@@ -600,243 +742,130 @@ namespace nwt {
                 return -1;
             assert(l->isleaf());
 
-            if ((bt_leafnodemax == l->slotsinuse))
-                return -1;
-            //cout << "insertleafpair:: about to find key location" << endl;
-            int loc = findKeyLoc(l, k);
-            //cout << "loc is " << loc << endl;
-            if (loc < 0)
-                return loc;
-
-            //check for duplicates
-            leafNode* cur = l;
-            int j = loc;
-            while(cur != NULL)
-            {
-                if((keyequal(cur->keySlots[j], k) > 0)) {
-                    while((j < cur->keyCount()) && (keyequal(cur->keySlots[j], k) > 0))
-                    {
-                            if(data == cur->dataSlots[j])
-                            {
-                                //there is a duplicate pair return a special error.
-                                cout << "duplicate pair found" << endl;
-                                return -2;
-                            }
-                            j++;
-                    }
-
-                    j = 0;
-                    cur = cur->nextLeaf;
-                }
-                else
-                {
-                    cur = NULL;
-                    break;
-                }
-            }
+            //new duplicates go behind the ones already stored
+            int loc = findKeyUpper(l, k);
             insertleafKeyAt(l, k, loc);
             insertleafDataAt(l, data, loc);
-            //l->slotsinuse++;
             //cout << "insertleafpair:: key count is " << l->slotsinuse << " after insert" << endl;
-            return 1;
+            return loc;
         }
 
-        inline int deleteleafpair(leafNode* l, keytype k, data_type data) {
+        /**
+         *Remove the pair in slot loc of a leaf, no rebalancing is done
+         * */
+        inline int deleteleafpair(leafNode* l, int loc) {
             //cout << "deletepair:: entering" << endl;
-            if (l->keyCount() < 1)
+            if (loc < 0 || loc >= l->keyCount())
                 return -1;
-            int loc = find_lowerkey(l, k);
-
-            //cout << "key found in leaf at slot " << loc << std::endl;
-            if (keyequal(k, l->keySlots[loc])) {
-                for (int i = loc; i < l->keyCount() - 1; i++) {
-                    l->keySlots[i] = l->keySlots[i + 1];
-                    l->dataSlots[i] = l->dataSlots[i + 1];
-
-                }
-                l->slotsinuse--;
-                downkeycount();
-                //cout << k << " has been deleted" << endl;
-                //cout << "key count is now " << l->keyCount() << endl;
-            } else {
-              return -1;
-            }
+            int behind = l->keyCount() - loc - 1;
+            keymover::move(l->keySlots + loc, l->keySlots + loc + 1, behind);
+            datamover::move(l->dataSlots + loc, l->dataSlots + loc + 1, behind);
+            l->slotsinuse--;
+            //release whatever the old last slot was holding
+            l->dataSlots[l->slotsinuse] = data_type();
+            touchleaf(l);
             return loc;
         }
 
-        inline int deleteinnerpair(innerNode* p, keytype k, node* n) {
-
-            //cout << "deleteinnerpair:: " << endl;
-            // innerNode* inner = static_cast<innerNode*>(n);
-            if (p->keyCount() < 1)
-                return -1;
-            int j = 0;
-            for (int i = 0; i < p->keyCount(); i++) {
-                if (keyequal(k, p->keySlots[i]) > 0) {
-                    //cout << "deleteinnerpair:: found keyes that are equal" << endl;
-                    for (j = i; i < p->keyCount() - 1; j++) {
-                        p->firstChild[j] = p->firstChild[j + 1];
-                        p->keySlots[j] = p->keySlots[j + 1];
-                    }
-                    if (j + 2 == p->numChildren) {
-                        p->firstChild[j + 1] = p->firstChild[j + 2];
-                    }
-                    p->slotsinuse--;
-                    p->numChildren--;
-                    return i;
-                }
-
-            }
-            return -1;
-        }
-
         /**
-         *Find Key in tree.
+         *Find Key in tree. Returns the leaf holding the first key that is
+         *not less than k.
          **/
         inline leafNode* find(keytype k) {
-            int i = 0;
             node* rootNode = root;
-            node* tempNode = NULL;
-            keytype ki;
-            int slot = -1;
-            std::pair<iterator, bool> ret;
             //cout << "FIND: in btree find" << endl;
             if (empty())
                 return NULL;
-            //return std::pair<iterator, bool> (end(), false);
-            //cout << "FIND: not empty" << endl;
-
-            if (rootNode->isRoot()) {
-                //cout << "this is root" << endl;
 
-            }
-            if (rootNode == NULL) {
-                //cout << "root is null" << endl;
-            }
             while (!(rootNode->isleaf())) {
                 innerNode* curNode = static_cast<innerNode*> (rootNode);
-                //cout << "FIND:: checking inner nodes, this node has  " << curNode->numChildren << " children." << endl;
-                //cout << "FIND:: Key is " << k << " key count is " << curNode->keyCount() << endl;
-                for (i = 0; i < curNode->keyCount(); i++) {
-                    //cout << "checking slot, key is " << curNode->keySlots[i] << endl;
-                    // TREE_PRINT("looking for key " << k << "and at index" << i);
-                    if (keygreater(curNode->keySlots[i], k) > 0) {
-                        //found a key that is greater than the look being searched'
-                        //cout << curNode->keySlots[i] << " is greater than " << k << endl;
-                        ki = (curNode->keySlots[i]);
-                        slot = i;
-                        break;
-                    }
-                    //cout << "i is " << i << endl;
-                }
-         
-                if (slot >= 0) {
-                    //cout << "FIND:: slot is " << slot << endl;
-                    if (curNode->numChildren > curNode->keyCount()) {
-                        tempNode = getChild(curNode, slot);
-                        if (tempNode == NULL) {
-                            tempNode = getChild(curNode, curNode->numChildren - 1);
-                            //cout << "tempNode is NULL" << endl;
-                        }
-
-                        rootNode = static_cast<node*> (tempNode);
-                        assert(rootNode != NULL);
-                    }
-
-                    //TREE_PRINT("returning node child " << curNode->numChildren - 1);
-                } else {
-                    tempNode = getChild(curNode, curNode->keyCount());
-                    rootNode = static_cast<node*> (tempNode);
-                }
-                slot = -1;
-
+                int slot = 0;
+                //keys equal to a separator can sit on both sides of it, so
+                //descend left of the first separator that is not less than k
+                while ((slot < curNode->keyCount()) && keyless(curNode->keySlots[slot], k))
+                    slot++;
+                rootNode = childat(curNode, slot);
+                assert(rootNode != NULL);
             }
-            //cout << "FIND:: found the leaf I hope" << endl;
             leafNode* lnode = static_cast<leafNode*> (rootNode);
 
-            while (lnode != NULL) {
-                //if we are out of the following loop it means we have reached a leaf node, return false
-                //cout << "lnode key count is " << lnode->keyCount() << endl;
-                for (i = 0; i < lnode->keyCount(); i++) {
-                    //cout << lnode->keySlots[i] << " is current slot key and  key " << k << " is query key" << endl;
-                    if (keygreaterequal(lnode->keySlots[i], k)) {
-                        //cout << lnode->keySlots[i] << " is greater or equal to " << k << endl;
-                        return lnode;
-                        //return std::pair<iterator, bool>(iterator(lNode, i), true);
-                    }
-
-
-                }
-                if (lnode->isfull()) {
-                    //cout << "moving to nextleaf, check next leaf" << endl;
-                    if (lnode->nextLeaf != NULL)
-                        lnode = static_cast<leafNode*> (lnode->nextLeaf);
-                    else
-                        return lnode;
-                } else
-                    return lnode;
-            }
-            //cout << "returning null" << endl;
+            //the first match may be the head of the next leaf
+            while ((lnode->nextLeaf != NULL) && (findKeyLoc(lnode, k) == lnode->keyCount()))
+                lnode = lnode->nextLeaf;
             return lnode;
-            // return std::pair<iterator, bool>(iterator(lNode, i-1), false);
+        }
 
-            // return std::pair<iterator, bool>(end(), false);
+        /**
+         *Find the leaf a new pair with key k belongs to, behind any keys
+         *equal to k.
+         **/
+        inline leafNode* findInsertLeaf(keytype k) {
+            node* rootNode = root;
+            if (empty())
+                return NULL;
+
+            while (!(rootNode->isleaf())) {
+                innerNode* curNode = static_cast<innerNode*> (rootNode);
+                int slot = 0;
+                while ((slot < curNode->keyCount()) && !keygreater(curNode->keySlots[slot], k))
+                    slot++;
+                rootNode = childat(curNode, slot);
+                assert(rootNode != NULL);
+            }
+            return static_cast<leafNode*> (rootNode);
         }
 
         /**
          *  just calls find and returns a bool if the key exists
          **/
         inline bool exists(keytype k) {
-            leafNode* ret;
-            ret = find(k);
+            iterator it = lower_bound(k);
 
-            if (ret == NULL)
-                return false;
-            for (int i = 0; i < ret->keyCount(); i++) {
-                if (keyequal(ret->keySlots[i], k) > 0)
+            return (it != end()) && keyequal(it.key(), k);
+        }
+
+        /**
+         *  true if the exact key/data pair is stored in the tree
+         **/
+        inline bool existspair(keytype k, const data_type& data) {
+            for (iterator it = lower_bound(k); (it != end()) && keyequal(it.key(), k); ++it) {
+                if (it.data() == data)
                     return true;
             }
             return false;
+        }
 
+        inline std::pair<data_type, bool> get(keytype k) {
+            iterator it = lower_bound(k);
 
-            // return false;
-
+            if ((it == end()) || !keyequal(it.key(), k))
+                return std::pair<data_type, bool>(data_type(), false);
+            return std::pair<data_type, bool>(it.data(), true);
         }
-        inline std::pair<data_type, bool> get(keytype k) {
-            leafNode* ret;
-            ret = find(k);
-            string empty = "";
 
-            if (ret == NULL)
-                return std::pair<data_type, bool>(empty, false);
-            for (int i = 0; i < ret->keyCount(); i++) {
-                if (keyequal(ret->keySlots[i], k) > 0)
-                    return std::pair<data_type, bool>(ret->dataSlots[i], true);
-            }
-            
-            return std::pair<data_type, bool>(empty, false);
+        /**
+         * Iterator to the first pair whose key is not less than k
+         **/
+        inline iterator lower_bound(keytype k) {
+            leafNode* l = find(k);
+
+            if (l == NULL)
+                return end();
+            return iterator(l, findKeyLoc(l, k));
         }
-        inline iterator getNext(keytype k)
-        {
-	    leafNode* l;
-	    l = find(k);
-	    std::pair<iterator, bool> ret;
-	    
-            string empty = "";
-
-            if (ret == NULL)
-                return std::pair<data_type, bool>(empty, false);
-            for (int i = 0; i < ret->keyCount(); i++) {
-                if (keyequal(ret->keySlots[i], k) > 0)
-                    //return std::pair<data_type, bool>(ret->dataSlots[i], true);
-		{
-		    iterator(l, i);
-		}
-	    
-	    }
-            
-	    return end();
 
+        /**
+         * Iterator to the first pair whose key is greater than k
+         **/
+        inline iterator upper_bound(keytype k) {
+            leafNode* l = findInsertLeaf(k);
+
+            if (l == NULL)
+                return end();
+            int slot = findKeyUpper(l, k);
+            if ((slot == l->keyCount()) && (l->nextLeaf != NULL))
+                return iterator(l->nextLeaf, 0);
+            return iterator(l, slot);
         }
         /**
          * Insert is a pair into the tree
@@ -844,751 +873,393 @@ namespace nwt {
          *
          **/
         int insert(keytype k, data_type data) {
-          
+            return (insertpair(k, data) != NULL) ? 1 : -2;
+        }
+
+        /**
+         * Insert a pair and return the leaf it went into, NULL when the
+         * identical pair is stored already
+         **/
+        leafNode* insertpair(keytype k, data_type data) {
             leafNode* n = NULL;
 
             //cout << "in global insert function" << endl;
             if (root == NULL) {
                 //cout << "making new root" << endl;
                 makeroot(k, data);
-                //ret = std::pair<iterator, bool>(iterator(static_cast<leafNode*> (root), 0), true);
                 upkeycount();
-                //return ret;
-                return 1;
+                return static_cast<leafNode*> (root);
             }
 
-            n = find(k);
+            //an identical key/data pair may only be stored once
+            if (existspair(k, data))
+                return NULL;
 
-            /*this means it wasn't found and there is current leaf to place the
-             * key*/
-            if (n == NULL) {
-                n = new leafNode();
-                n->initialize();
+            n = findInsertLeaf(k);
+            if (insertleafpair(n, k, data) < 0) {
+                //leafnode is full, split it and push the first key of the
+                //new right half up to the parent
+                leafNode* lp = splitleaf(n);
+                leafNode* into = keyless(k, lp->keySlots[0]) ? n : lp;
+                insertleafpair(into, k, data);
+                insert_in_parent(parentof(n), n, lp->keySlots[0], lp);
+                n = into;
             }
-            //if(ret.second)
-            //  n = (ret.first).getleafNode();
-
-            //n =(leafNode*)  (iter.getleafNode());
-            int out = insertleafpair(n, k, data);
-            if(out == -2)
-            {
-                //duplicate was found
-                //return std::pair<iterator, bool>(iterator(static_cast<leafNode*> (root), false), 0);
-                return out;
-            }
-            if (out == -1) {
-                //cout << "cannot insert in initial first node, it must be full" << endl;
-                //leafnode is full
-                if (n->keyCount() == bt_innernodemax) {
-                    //cout << "splitting node" << endl;
-                    //this will lead to a split of the leaf node.
-                    leafNode* ln = new leafNode;
-                    leafNode* lp = new leafNode;
-                    ln->initialize();
-                    lp->initialize();
-                    //copy half of the keys/tuple pairs to the new leaf node
-                    int j = 0;
-                    int slot = 0;
-                    int added = -1;
-                    for (int i = 0, slot = 0; i < n->keyCount(); i++, slot++) {
-                        //insert first half in l, then second half in lp
-                        if ((keygreater(n->keySlots[i], k) > 0) && slot == i) {
-                            if (i < (n->keyCount() / 2)) {
-                                insertleafKeyAt(ln, k, slot);
-                                insertleafDataAt(ln, data, slot);
-                            } else {
-                                insertleafKeyAt(lp, k, j);
-                                insertleafDataAt(lp, data, j);
-                                j++;
-                            }
-                            added = 1;
-                            //keep i in the same pos
-                            if (i > 0)
-                                i--;
-                            //cout << " adding middle key in slot " << j << endl;
-                        } else if (i < (n->keyCount() / 2)) {
-
-                            insertleafKeyAt(ln, n->keySlots[i], slot);
-                            insertleafDataAt(ln, n->dataSlots[i], slot);
-                        } else {
-
-                            insertleafKeyAt(lp, n->keySlots[i], j);
-                            insertleafDataAt(lp, n->dataSlots[i], j);
-                            j++;
-                        }
+            upkeycount();
+            return n;
+        }
 
+        /**
+         * Build the tree bottom up from pairs sorted by key, replacing what
+         * it held. Leaves are filled evenly and linked in order, then each
+         * inner level is laid over the one below, so no pair is ever
+         * searched for or split. Duplicate keys keep their order.
+         **/
+        template <typename InputIterator>
+        void bulk_load(InputIterator first, InputIterator last) {
+            clear();
+            std::vector<pair_type> pairs(first, last);
+            size_t n = pairs.size();
+            if (n == 0)
+                return;
+
+            //fill every leaf to within one pair of the others, which never
+            //leaves one below half full
+            size_t numleaves = (n + bt_leafnodemax - 1) / bt_leafnodemax;
+            std::vector<node*> level;
+            std::vector<keytype> firstkeys;
+            leafNode* prev = NULL;
+            size_t p = 0;
+            for (size_t i = 0; i < numleaves; i++) {
+                size_t count = n / numleaves + ((i < n % numleaves) ? 1 : 0);
+                leafNode* l = newleaf();
+                l->initialize();
+                for (size_t j = 0; j < count; j++, p++) {
+                    l->keySlots[j] = pairs[p].first;
+                    l->dataSlots[j] = pairs[p].second;
+                }
+                l->slotsinuse = count;
+                touchleaf(l);
+                l->prevLeaf = prev;
+                if (prev != NULL)
+                    prev->nextLeaf = l;
+                else
+                    headleaf = l;
+                prev = l;
+                level.push_back(l);
+                firstkeys.push_back(l->keySlots[0]);
+            }
+            tailleaf = prev;
+            totalkeycount = n;
+
+            //separators are the first key under each child but the first,
+            //as insert_in_parent leaves them
+            while (level.size() > 1) {
+                size_t m = level.size();
+                size_t numparents = (m + bt_innernodemax) / (bt_innernodemax + 1);
+                std::vector<node*> up;
+                std::vector<keytype> upkeys;
+                size_t c = 0;
+                for (size_t i = 0; i < numparents; i++) {
+                    size_t count = m / numparents + ((i < m % numparents) ? 1 : 0);
+                    innerNode* in = newinner();
+                    in->initialize();
+                    for (size_t j = 0; j < count; j++, c++) {
+                        if (j > 0)
+                            insertInnerNodeKeyAt(in, firstkeys[c], j - 1);
+                        insertInnerNodeChildAt(in, level[c], j);
                     }
-                    if (added != 1) {
-                        //cout << " adding middle key at the end " << endl;
-                        insertleafKeyAt(lp, k, j);
-                        insertleafDataAt(lp, data, j);
-                    }
-                    slot = 1;
-                    keytype kp = lp->keySlots[0];
-
-                    //cout << "split key kp is " << kp << endl;
-                    upkeycount();
-                     if(ln->isleaf())
-                     {
-                                //cout << "connecting leaves of spliting leafs" << endl;
-                                   ln->nextLeaf = lp;
-                                   lp->prevLeaf = ln;
-                     }
-                    ///innerNode* parent = static_cast<innerNode*>(n->parent);
-                    //int oldloc = findInnerNodeLoc(parent, n);
-                    //assert(oldloc >= 0);
-                    //key is pushed up to parent.
-                    insert_in_parent(n->parent, ln, kp, lp);
-                    //cout << "out of insert parent" << endl;
-                    freeNode(n);
-                    n = NULL;
-                    //return std::pair<iterator, bool> (iterator(static_cast<leafNode*> (root), 0), true);
-                    return 1;
+                    up.push_back(in);
+                    upkeys.push_back(firstkeys[c - count]);
                 }
-
+                level.swap(up);
+                firstkeys.swap(upkeys);
             }
-            upkeycount();
-            //return std::pair<iterator, bool> (iterator(static_cast<leafNode*> (btree::root), 0), true);
-            return 1;
+            root = level[0];
+            setparent(root, NULL);
         }
 
         void makeroot(keytype k, data_type data) {
             leafNode* l;
             //cout << "MAKEROOT:: making root" << endl;
-            l = new leafNode;
+            l = newleaf();
             l->initialize();
-            l->setIsRoot(true);
-            l->parent = NULL;
             insertleafpair(l, k, data);
 	    headleaf = l;
+	    tailleaf = l;
             root = static_cast<node*> (l);
         }
 
         /**
-         *This function is used when adding a tuple that requires splitting of the node.
+         *Move the upper half of a full leaf into a new right sibling
          *
          * */
+        leafNode* splitleaf(leafNode* n) {
+            leafNode* lp = newleaf();
+            lp->initialize();
+            int half = n->keyCount() / 2;
+            keymover::move(lp->keySlots, n->keySlots + half, n->keyCount() - half);
+            datamover::move(lp->dataSlots, n->dataSlots + half, n->keyCount() - half);
+            for (int i = half; i < n->keyCount(); i++)
+                n->dataSlots[i] = data_type();
+            lp->slotsinuse = n->keyCount() - half;
+            n->slotsinuse = half;
+            touchleaf(n);
+            touchleaf(lp);
+
+            //keep the leaf chain intact for range scans
+            lp->prevLeaf = n;
+            lp->nextLeaf = n->nextLeaf;
+            if (n->nextLeaf != NULL)
+                n->nextLeaf->prevLeaf = lp;
+            else
+                tailleaf = lp;
+            n->nextLeaf = lp;
+            movedinto(lp);
+            return lp;
+        }
+
+        /**
+         *This function is used when adding a tuple that requires splitting of the node.
+         *Nprime is the new right sibling of N and k the first key under it.
+         * */
         void insert_in_parent(node* parent, node* N, keytype k, node* Nprime) {
-            innerNode* tnode;
             innerNode* p = static_cast<innerNode*> (parent);
-            //initialize node
-            //tnode->initialize();
-            keytype kp;
             //cout << "inserting in parent" << endl;
-            if ((p != NULL)) {
-
-                //cout << "there is a  parent " << endl;
-                if ((p->numChildren < bt_innernodemax+1)) {
-                    //cout << "parent is not full, inserting pair " << endl;
-                    //decrement number of Children because 1 is going to be overwritten
-                    p->numChildren--;
-
-                    int loc = insertinnernodepair(p, k, N);
-                    if (loc >= 1) {
-                        insertInnerNodeChildAt(p, Nprime, loc + 1);
-                        //p->numChildren--;
-                        ////cout << "replace old N with new N" << endl;
-
-                    }
-
-                    //cout << "loc is " << loc << endl;
-
-                    return;
-                } else {
-                    //cout << "parent is full" << endl;
-                    innerNode* pNode = new innerNode;
-                    pNode->initialize();
-                    innerNode* ppNode = new innerNode;
-                    ppNode->initialize();
-
-                    //perform splitting of the parent
-                    //then push it up.
-                    int j = 0;
-                    int slot = 0;
-                    int added = -1;
-                    int i = 0;
-                    //cout << "keycount of parent is " << p->keyCount() << endl;
-                    for (i = 0, slot = 0; i < p->keyCount(); i++, slot++) {
-                        //insert Np in the nodes
-                        //try to insert the pushed up child
-                        if ((keygreater(p->keySlots[i], k) > 0) && slot == i) {
-                            if (i < (p->keyCount() / 2) + 1) {
-
-                                insertInnerNodeKeyAt(pNode, k, slot);
-                                insertInnerNodeChildAt(pNode, (N), slot);
-                                insertInnerNodeChildAt(pNode, (Nprime), slot + 1);
-                                added = slot;
-                                //cout << " adding middle key in first node slot " << slot << endl;
-
-                            } else {
-
-                                insertInnerNodeKeyAt(pNode, k, j);
-                                insertInnerNodeChildAt(pNode, (N), j);
-                                insertInnerNodeChildAt(pNode, (Nprime), j + 1);
-                                //cout << " adding middle key in second node slot " << j << endl;
-                                j++;
-                                added = j;
-                            }
-
-                            //keep i in the same pos
-                            if (i > 0)
-                                i--;
-
-                        }
-                        if (i < (p->keyCount() / 2 + 1) && slot == i) {
-                            //cout << "inserting in first node" << endl;
-                            insertInnerNodeKeyAt(pNode, p->keySlots[i], slot);
-                            insertInnerNodeChildAt(pNode, static_cast<node*> (p->firstChild[i]), slot);
-
-                        }
-
-
-                        if (i > (p->keyCount() / 2)) {
-                            //cout << "inserting in second node" << endl;
-                            insertInnerNodeKeyAt(ppNode, p->keySlots[i], j);
-                            insertInnerNodeChildAt(ppNode, static_cast<node*> (p->firstChild[i]), j);
-                            //keep chain
-                           
-                            j++;
-                        }
-
-                        if (i == (p->keyCount() / 2 + 1)) {
-                            //cout << "delete last key in first node" << endl;
-                            kp = pNode->keySlots[i-1];
-                            pNode->slotsinuse--;
-                            if(p->firstChild[i]->isleaf())
-                            {
-                                leafNode* lp = static_cast<leafNode*>(p->firstChild[i-1]);
-                                leafNode* ln = static_cast<leafNode*>(p->firstChild[i]);
-                                lp->nextLeaf = ln;
-                                ln->prevLeaf = lp;
-                            }
-                          
-                        }
-
-                    }
-
-
-                    if (p->firstChild[i] != NULL) {
-                        //insert last pointer in ppNode
-                        insertInnerNodeChildAt(ppNode, static_cast<node*> (p->firstChild[i]), j);
-                        //cout << "insert last parent inner node into child, slot is " << j << endl;
-                        //innerNode* temp = static_cast<innerNode*> (p->firstChild[i]);
-                        //cout << "Child's first key is " << temp->keySlots[0] << endl;
-                        //cout << "ppNode has last key as " << ppNode->keySlots[ppNode->keyCount() - 1] << endl;
-                        //j++;
-
-                    } else {
-                        //cout << "last child is null " << endl;
-                    }
-                    if (added < 0) {
-                        //cout << "adding new key and children at the end" << endl;
-
-                        //decrease the number of children because it is going to be overwritten
-                        ppNode->numChildren--;
-                        insertInnerNodeChildAt(ppNode, N, j);
-                        insertInnerNodeKeyAt(ppNode, k, j);
-                        //cout << "insert child and key at slot " << j << endl;
-                        insertInnerNodeChildAt(ppNode, (Nprime), j + 1);
-                        //cout << "adding key " << k << " at then end " << j + 1 << endl;
-                        assert(Nprime != NULL);
-
-                    }
-                  
-                    //insert in parent
-                    k = pNode->keySlots[pNode->keyCount()];
-                    //cout << "key to push up to parent is " << kp << endl;
-
-                    insert_in_parent(p->parent, pNode, kp, ppNode);
-                }
-
-            } else {
+            if (p == NULL) {
                 //cout << "making new root to insert" << endl;
-                //there is no parent
-                // assert(N->isRoot());
-                tnode = new innerNode;
+                innerNode* tnode = newinner();
                 tnode->initialize();
-                tnode->setIsRoot(true);
-                tnode->parent = NULL;
-
 
                 //insert key and children in top node
                 insertInnerNodeKeyAt(tnode, k, 0);
                 insertInnerNodeChildAt(tnode, N, 0);
                 insertInnerNodeChildAt(tnode, Nprime, 1);
                 root = static_cast<node*> (tnode);
-
-            }
-
-
-        }
-
-        //Node Search Operations
-
-        /**
-         *Find lower key in a node
-         **/
-        template <typename node_type>
-        inline int find_lowerkey(node_type* l, keytype& k) {
-            int i = 0;
-            if ((l == NULL))
-                return -1;
-
-            if (l->slotsinuse == 0)
-                return 0;
-            //cout << "In leafnode find key Loc" << endl;
-            for (i = 0; i < l->slotsinuse; i++) {
-                if (keylessequal(k, l->keySlots[i])) {
-                    //cout << "found the key" << endl;
-                    return i;
-                }
-
-            }
-            return -1;
-
-
+                return;
+            }
+
+            int loc = findInnerNodeLoc(p, N);
+            assert(loc >= 0);
+            if (!p->isfull()) {
+                //cout << "parent is not full, inserting pair " << endl;
+                insertInnerNodeKeyAt(p, k, loc);
+                insertInnerNodeChildAt(p, Nprime, loc + 1);
+                return;
+            }
+
+            //parent is full, lay out its keys and children with the new pair
+            //in place, then split them around the middle key
+            int nkeys = p->keyCount();
+            keytype keys[bt_innernodemax + 1];
+            node* children[bt_innernodemax + 2];
+            keymover::move(keys, p->keySlots, loc);
+            keys[loc] = k;
+            keymover::move(keys + loc + 1, p->keySlots + loc, nkeys - loc);
+            for (int i = 0; i <= loc; i++)
+                children[i] = childat(p, i);
+            children[loc + 1] = Nprime;
+            for (int i = loc + 1; i <= nkeys; i++)
+                children[i + 1] = childat(p, i);
+
+            int mid = (nkeys + 1) / 2;
+            innerNode* pp = newinner();
+            pp->initialize();
+            keymover::move(p->keySlots, keys, mid);
+            p->slotsinuse = mid;
+            p->numChildren = 0;
+            for (int i = 0; i <= mid; i++)
+                insertInnerNodeChildAt(p, children[i], i);
+            keymover::move(pp->keySlots, keys + mid + 1, nkeys - mid);
+            pp->slotsinuse = nkeys - mid;
+            for (int i = mid + 1; i <= nkeys + 1; i++)
+                insertInnerNodeChildAt(pp, children[i], i - mid - 1);
+            for (int i = p->numChildren; i < bt_innernodemax + 1; i++)
+                p->firstChild[i] = noderef();
+
+            //the middle key moves up to the parent
+            insert_in_parent(parentof(p), p, keys[mid], pp);
         }
 
         /**
          * Delete key, data pair from index
          */
         int delete_pair(keytype k, data_type data) {
-            leafNode* leaf = NULL;
-            leaf = find(k);
-            int loc = -1;
-
-            if (leaf == NULL) {
-                //cout << "key not in tree" << endl;
-                return -1;
-            } else {
-                if ((loc = deleteleafpair(leaf, k, data)) < 0) {
-                    return -1;
-                }
-                balancetree(static_cast<leafNode*> (leaf), loc);
-                return loc;
-            }
+            return erasepair(k, data);
         }
 
         /*
          *Delete the first key that matches k
          */
         int erase(keytype k) {
-            leafNode* l = NULL;
-            l = find(k);
+            iterator it = lower_bound(k);
 
             //cout << "in erase funtion" << endl;
-            if (l == NULL) {
+            if ((it == end()) || !keyequal(it.key(), k)) {
                 //cout << " key not in tree" << endl;
                 return -1;
-            } else {
-                int loc = findKeyEqual(l, k);
-		if(loc < 0)
-		    return loc;
-                //cout << "key is in location " << loc << endl;
-                if (keyequal(k, l->keySlots[loc]) > 0) {
-                    //cout << "found a key equal, now deleting it" << endl;
-                    for (int i = loc; i < l->keyCount() - 1; i++) {
-                        l->keySlots[i] = l->keySlots[i + 1];
-                    }
-                    l->slotsinuse--;
-                    downkeycount();
-                    if (!(l->isRoot())) {
-                        //cout << "not a root, balance it" << endl;
-                        balancetree(l, loc);
-                    } else {
-                        //cout << "leaf is root" << endl;
-                    }
-                    return loc;
-                }
-            }
-                    return -1;
             }
+            return eraseslot(it.getleafNode(), it.getslot());
+        }
             /**
              *erasepair - erase a key and a data pair from the tree.
              */
-            int erasepair(keytype k, data_type d)  {
-            leafNode* l = NULL;
-            l = find(k);
-
-            //cout << "in erase funtion" << endl;
-            if (l == NULL) {
-                //cout << " key not in tree" << endl;
-                return -1;
-            } else {
-                int loc = findKeyEqual(l, k);
-		if(loc < 0)
-		    return loc;
-                //cout << "key is in location " << loc << endl;
-                if (keyequal(k, l->keySlots[loc]) > 0 && (d==l->dataSlots[l])) {
-                    //cout << "found a key equal, now deleting it" << endl;
-                    for (int i = loc; i < l->keyCount() - 1; i++) {
-                        l->keySlots[i] = l->keySlots[i + 1];
-                    }
-                    l->slotsinuse--;
-                    downkeycount();
-                    if (!(l->isRoot())) {
-                        //cout << "not a root, balance it" << endl;
-                        balancetree(l, loc);
-                    } else {
-                        //cout << "leaf is root" << endl;
-                    }
-                    return loc;
-                }
+        int erasepair(keytype k, data_type d) {
+            for (iterator it = lower_bound(k); (it != end()) && keyequal(it.key(), k); ++it) {
+                if (it.data() == d)
+                    return eraseslot(it.getleafNode(), it.getslot());
             }
+            return -1;
+        }
 
-                    return -1;
+        /**
+         *Remove slot loc of leaf l and rebalance the tree
+         */
+        int eraseslot(leafNode* l, int loc) {
+            if (deleteleafpair(l, loc) < 0)
+                return -1;
+            downkeycount();
+            balancetree(l, loc);
+            return loc;
         }
 
         void balancetree(leafNode* leaf, int loc) {
-            int parentloc = findInnerNodeLoc(static_cast<innerNode*>(leaf->parent), static_cast<node*>(leaf));
-            //cout << "attemping to  balance tree, loc is " << parentloc << endl;
-            //check for underflow...we need to rebalance tree
-            if (leaf->isunderflow() ) {
-                //cout << "the leaf underflows" << endl;
-                //get parent
-                // innerNode* pparent = static_cast<innerNode*>(leaf->parent);
-
-                //check neighbors
-                if ((leaf->prevLeaf != NULL) && (parentloc > 0) ) {
-                     //cout << "prev leaf" << endl;
-                    leafNode* prev = static_cast<leafNode*> (leaf->prevLeaf);
-
-                    //if they can merge add them
-                    if ((prev->keyCount() + leaf->keyCount()) < bt_leafnodemax) {
-                        //cout << "prev leaf merging leafs" << endl;
-                        int loc = findInnerNodeLoc(static_cast<innerNode*>(leaf->parent), static_cast<node*> (leaf));
-                        for (int i = 0; i < leaf->keyCount(); i++) {
-                            insertleafpair(prev, leaf->keySlots[i], leaf->dataSlots[i]);
-                        }
-                        
-                        assert(loc >= 0);
-                        //cout << "loc returned is " << parentloc << endl;
-                        loc = parentloc;
-                        innerNode* p = static_cast<innerNode*> (leaf->parent);
-                        keytype k;
-                        if(loc == p->numChildren)
-                        {
-                            loc--;
-
-                        }
-                        else
-                            k = p->keySlots[loc-1];
-                        //cout << "key is " << k << endl;
-                        deleteInnerNode(static_cast<innerNode*> (leaf->parent), k, static_cast<node*> (leaf));
-                        
-
-                    } else //borrow key data pair
-                    {
-                        //cout << "borrowing from previous neighbor" << endl;
-                        assert(leaf->keyCount() < prev->keyCount());
-                        //move last key in prev to leaf
-                        insertleafpair(leaf, prev->keySlots[prev->keyCount() - 1], prev->dataSlots[prev->keyCount() - 1]);
-
-                        innerNode* p = static_cast<innerNode*> (leaf->parent);
-                        keytype replacee = p->keySlots[parentloc-1];
-
-
-                        replacekey(leaf->parent, replacee , leaf->keySlots[0]);
-
-                        deleteleafpair(prev, prev->keySlots[prev->keyCount() - 1], prev->dataSlots[prev->keyCount() - 1]);
-                        upkeycount();
-                        //change K in parent to be new key
-                    }
-
-                } else if (leaf->nextLeaf != NULL) {
-                     //cout << "nextleaf" << endl;
-                    leafNode* next = static_cast<leafNode*> (leaf->nextLeaf);
-                    if ((next->keyCount() + leaf->keyCount()) < bt_leafnodemax) //if not full move key
-                    {
-                        //cout << "nextleaf, merging leafs" << endl;
-                        for (int i = 0; i < leaf->keyCount(); i++) {
-                            //cout << "inserting key " << leaf->keySlots[i] << " to next leaf" << endl;
-                            insertleafpair(next, leaf->keySlots[i], leaf->dataSlots[i]);
-                        }
-                        int loc = findInnerNodeLoc(static_cast<innerNode*>(leaf->parent), static_cast<node*> (leaf));
-                        
-                        assert(loc >= 0);
-                        //cout << "inner node loc is " << loc << endl;
-                        innerNode* p = static_cast<innerNode*> (leaf->parent);
-                        keytype k;
-                        if (loc < p->numChildren) {
-                            k = p->keySlots[loc];
-                        } else {
-                            k = p->keySlots[loc+1];
-                        }
-                        
-                        deleteInnerNode(static_cast<innerNode*> (leaf->parent), k, static_cast<node*> (leaf));
-                        //replacekey(next->parent, next->keySlots[1], next->keySlots[0]);
-                    } else //borrow key data pair
-                    {
-                        //cout << "borrowing for next neighbor" << endl;
-                        assert(leaf->keyCount() < next->keyCount());
-                        //move last key in prev to leaf
-                        insertleafpair(leaf, next->keySlots[0], next->dataSlots[0]);
-
-                        replacekey(next->parent, next->keySlots[0], next->keySlots[1]);
-                        deleteleafpair(next, next->keySlots[0], next->dataSlots[0]);
-                        upkeycount();
-
-                        //change K in parent to be new key
-                    }
-
-                    //delete leaf from parent
-
+            if (leaf == root) {
+                if (leaf->keyCount() == 0) {
+                    //last pair is gone, the tree is empty again
+                    freeNode(leaf);
+                    root = NULL;
+                    headleaf = tailleaf = NULL;
                 }
-
+                return;
+            }
+            //check for underflow...we need to rebalance tree
+            if (!leaf->isunderflow())
+                return;
+
+            innerNode* p = parentof(leaf);
+            int parentloc = findInnerNodeLoc(p, leaf);
+            assert(parentloc >= 0);
+            //only siblings under the same parent are merged or borrowed from
+            leafNode* prev = NULL;
+            leafNode* next = NULL;
+            if (parentloc > 0)
+                prev = static_cast<leafNode*> (childat(p, parentloc - 1));
+            if (parentloc + 1 < p->numChildren)
+                next = static_cast<leafNode*> (childat(p, parentloc + 1));
+
+            if ((prev != NULL) && (prev->keyCount() + leaf->keyCount() <= bt_leafnodemax)) {
+                //cout << "prev leaf merging leafs" << endl;
+                mergeleaves(prev, leaf, parentloc - 1);
+            } else if ((next != NULL) && (leaf->keyCount() + next->keyCount() <= bt_leafnodemax)) {
+                //cout << "nextleaf, merging leafs" << endl;
+                mergeleaves(leaf, next, parentloc);
+            } else if ((prev != NULL) && (prev->keyCount() > bt_leafnodemin)) {
+                //cout << "borrowing from previous neighbor" << endl;
+                int last = prev->keyCount() - 1;
+                insertleafKeyAt(leaf, prev->keySlots[last], 0);
+                insertleafDataAt(leaf, prev->dataSlots[last], 0);
+                deleteleafpair(prev, last);
+                //change K in parent to be new key
+                p->keySlots[parentloc - 1] = leaf->keySlots[0];
+                movedinto(leaf);
+            } else if (next != NULL) {
+                //cout << "borrowing for next neighbor" << endl;
+                int slot = leaf->keyCount();
+                insertleafKeyAt(leaf, next->keySlots[0], slot);
+                insertleafDataAt(leaf, next->dataSlots[0], slot);
+                deleteleafpair(next, 0);
+                //change K in parent to be new key
+                p->keySlots[parentloc] = next->keySlots[0];
+                movedinto(leaf);
             }
         }
 
     private:
 
-        int replacekey(node* n, keytype replacee, keytype replacer) {
-            innerNode* inner = static_cast<innerNode*> (n);
-
-            if (inner == NULL) {
-                //cout << "replacekey:: inner is null" << endl;
-                return -1;
-            }
-
-            for (int i = 0; i < inner->keyCount(); i++) {
-                if (keyequal(inner->keySlots[i], replacee) > 0) {
-                    //cout << "replacing key " << replacee << " with " << replacer << endl;
-                    inner->keySlots[i] = replacer;
-                    return 1;
-                }
-            }
-            //cout << "did not find key to replace" << endl;
-            return -1;
+        /**
+         *Append right to left, drop right and the separator at seploc
+         *from their parent
+         * */
+        void mergeleaves(leafNode* left, leafNode* right, int seploc) {
+            innerNode* p = parentof(left);
+            keymover::move(left->keySlots + left->keyCount(), right->keySlots, right->keyCount());
+            datamover::move(left->dataSlots + left->keyCount(), right->dataSlots, right->keyCount());
+            left->slotsinuse += right->keyCount();
+            touchleaf(left);
+            left->nextLeaf = right->nextLeaf;
+            if (right->nextLeaf != NULL)
+                right->nextLeaf->prevLeaf = left;
+            else
+                tailleaf = left;
+            movedinto(left);
+            deleteinnerpair(p, seploc, seploc + 1);
+            freeNode(right);
+            balanceinner(p);
         }
 
-        int deleteInnerNode(innerNode* N, keytype kP, node* P) {
-            int loc = 0;
-            keytype k;
-            loc = findInnerNodeLoc(N, P);
-            int keyloc = findInnerNodeKey(N, kP);
-            //cout << "deleteInnerNode:: key to delete is in location " << keyloc << endl;
-            if (loc < 0) {
-                //cout << "deleteInnerNode:: cannot find inner node" << endl;
-                return loc;
-            }
-
-            k = N->keySlots[keyloc];
-            //cout << "key to delete is " << k << endl;
-            
-            //cout << "deleteInnnerNode: N has " << N->numChildren << " children" << endl;
-            //this is where actuall deletion takes place
-           if (loc < N->numChildren) {
-               if((loc < N->numChildren)  && (loc > 0))
-               {
-                     if ((N->firstChild[loc])->isleaf()) {
-                          leafNode* cur = static_cast<leafNode*> (N->firstChild[loc]);
-                          leafNode* prev = static_cast<leafNode*> (N->firstChild[loc-1]);
-                          prev->nextLeaf = cur->nextLeaf;
-                          //if(cur->nextLeaf == NULL)
-                          //cout << "deleteInnnerNode: next leaf is NULL " << endl;
-                     }
-                   
-               }
-                freeNode(N->firstChild[loc]);
-                
-                //cout << "deleteInnerNode:: deleting node at loc " << loc << endl;
-                //cout << "shift remaining nodes" << endl;
-                //cout << "keycount is " << N->keyCount() << endl;
-                int i;
-                int kloc;
-                //shift remaining nodes.
-                for(kloc = keyloc; kloc < N->keyCount()-1; kloc++)
-                {
-                    //cout << "deleteInnerNode:: shifting key to location " << kloc << endl;
-
-                    N->keySlots[kloc] = N->keySlots[kloc + 1];
-
-                    
-                }
-                for (i = loc; i < N->keyCount() - 1; i++) {
-                    assert(i + 1 < N->keyCount());
-                    //cout << "deleteInnerNode:: shifting to location " << i << endl;
-
-                    N->firstChild[i] = N->firstChild[i + 1];
-
-                    //cout << "cur loc is  " << i << endl;
-                   if ((N->firstChild[i])->isleaf()) {
-                        leafNode* cur = static_cast<leafNode*> (N->firstChild[i]);
-                        if (i - 1 >= 0) {
-                            leafNode* prev = static_cast<leafNode*> (N->firstChild[i - 1]);
-                            //cout << "setting previous node" << endl;
-                            cur->prevLeaf = prev;
-                            prev->nextLeaf = cur;
-                             //cout << "last key in prev is " << prev->keySlots[prev->keyCount()-1] << endl;
-                            //cout << "first key in cur is " << cur->keySlots[0] << endl;
-                            assert(prev != NULL);
-                            
-                        } else {
-                            cur->prevLeaf = NULL;
-                            //cout << "setting prev as NULL" << endl;
-                        }
-
-                    } else {
-                        //cout << "N isn't leaf" << endl;
-                    }
-
-                }
-
-                if (N->numChildren > N->keyCount()) {
-                   if(loc+1 < N->numChildren)
-                    {
-                         //cout << "setting the last child at loc " << i << endl;
-                    
-                        N->firstChild[i] = N->firstChild[i + 1];
-                        N->firstChild[i + 1] = NULL;
-
-                        if ((N->firstChild[i])->isleaf()) {
-                        leafNode* cur = static_cast<leafNode*> (N->firstChild[i]);
-                        if (i - 1 >= 0) {
-                            leafNode* prev = static_cast<leafNode*> (N->firstChild[i - 1]);
-                            //cout << "setting previous node" << endl;
-                            cur->prevLeaf = prev;
-                            prev->nextLeaf = cur;
-                             //cout << "last key in prev is " << prev->keySlots[prev->keyCount()-1] << endl;
-                            //cout << "first key in cur is " << cur->keySlots[0] << endl;
-                            assert(prev != NULL);
-
-                        }
-
-                    } else {
-                        //cout << "N isn't leaf" << endl;
-                    }
-
-                   }
-               
-                }
-               
-                N->slotsinuse--;
-                N->numChildren--;
-                //cout << "num of children after delete is " << N->numChildren << endl;
-            }
-
-            innerNode* child = static_cast<innerNode*> (N);
-            innerNode* parent = static_cast<innerNode*> (child->parent);
-            innerNode* next = NULL;
-            innerNode* prev = NULL;
+        /**
+         *Append right to left pulling the separator down, drop right from
+         *the parent
+         * */
+        void mergeinner(innerNode* left, innerNode* right, int seploc) {
+            innerNode* p = parentof(left);
+            insertInnerNodeKeyAt(left, p->keySlots[seploc], left->keyCount());
+            keymover::move(left->keySlots + left->keyCount(), right->keySlots, right->keyCount());
+            left->slotsinuse += right->keyCount();
+            for (int i = 0; i < right->numChildren; i++) {
+                insertInnerNodeChildAt(left, childat(right, i), left->numChildren);
+            }
+            right->numChildren = 0;
+            deleteinnerpair(p, seploc, seploc + 1);
+            freeNode(right);
+            balanceinner(p);
+        }
 
-            if (N->isRoot()) {
-                //cout << "parent is root" << endl;
-                if (N->numChildren == 1) {
+        /**
+         *Fix an inner node that lost a child
+         * */
+        void balanceinner(innerNode* n) {
+            if (n == root) {
+                if (n->numChildren == 1) {
                     //cout << "making child root" << endl;
-                    innerNode* child = static_cast<innerNode*> (N->firstChild[0]);
-                    child->parent = NULL;
-                    child->setIsRoot(true);
-                    root = static_cast<node*> (child);
-                    delete N;
-                    return 1;
+                    node* child = childat(n, 0);
+                    setparent(child, NULL);
+                    root = child;
+                    freeNode(n);
                 }
+                return;
             }
-            //balance nodes
-            else if(child->isunderflow()) {
-                //cout << "N parent is underflow" << endl;
-                loc = findInnerNodeLoc(parent, child);
-                
-                //cout << "child loc is " << loc << endl;
-                
-                if (loc - 1 >= 0) {
-                    prev = static_cast<innerNode*> (parent->firstChild[loc - 1]);
-                }
-                if (loc + 1 < parent->numChildren) {
-                    next = static_cast<innerNode*> (parent->firstChild[loc + 1]);
-
-                }
-                if(loc == parent->numChildren-1)
-                    loc = loc-1;
-                //cout << "key is " << parent->keySlots[loc] << endl;
-                if (next != NULL) {
-                    if ((next->numChildren + child->numChildren) <= (bt_innernodemax+1)) {
-                        //cout << "merging parent with next neighbor" << endl;
-                        //cout << "neighbor has children count of " << next->numChildren << endl;
-                        //cout << "neighbor has key count of " << next->keyCount() << endl;
-                           //cout << "keey in loc is " << parent->keySlots[loc] << endl;
-                                //cout << "keey in loc+1 is " << parent->keySlots[loc+1] << endl;
-                      
-                        //leafNode* nextChild = static_cast<leafNode*>(next->firstChild[0]);
-                        insertInnerNodeKeyAt(next, parent->keySlots[loc], 0);
-                        insertInnerNodeChildAt(next, getChild(child, child->numChildren-1), 0);
-                        for (int i = child->keyCount()-1; i >= 0; i--) {
-                            //cout << "inserting node and key from loc " << i << " in next node" << endl;
-                            insertInnerNodeKeyAt(next, child->keySlots[i], 0);
-                            insertInnerNodeChildAt(next, child->firstChild[i], 0);
-
-                        }
-                        keytype kp =  parent->keySlots[loc];
-                         //cout << "no more children delete child" << endl;
-                         deleteInnerNode(static_cast<innerNode*>(child->parent), kp, child);
-                        
-                    } else {
-                        //cout << "redistribute from next" << endl;
-                        //cout << "keey in loc is " << parent->keySlots[loc] << endl;
-                                //cout << "keey in loc+1 is " << parent->keySlots[loc+1] << endl;
-                        insertInnerNodeKeyAt(child, parent->keySlots[loc], child->keyCount());
-                        insertInnerNodeChildAt(child, next->firstChild[0], child->numChildren);
-
-                        
-                        //cout << "removing redistributed child from next node" << endl;
-                        replacekey(next->parent, parent->keySlots[loc], next->keySlots[0]);
-                        int i = 0;
-                        for (i = 0; i < next->keyCount() - 1; i++) {
-                            //cout << "shifting key and child to " << i << endl;
-                            next->keySlots[i] = next->keySlots[i + 1];
-                            next->firstChild[i] = next->firstChild[i + 1];
-
-                        }
-                        if (next->numChildren > next->keyCount()) {
-                            //cout << "shifting last child" << endl;
-                            next->firstChild[i] = next->firstChild[i + 1];
-                        }
-                        next->slotsinuse--;
-                        next->numChildren--;
+            if (!n->isunderflow())
+                return;
 
-
-                    }
-                } else if (prev != NULL) {
-                    //cout << "merging parent with previous neighbor" << endl;
-                    if ((prev->numChildren + child->numChildren) <= (bt_innernodemax+1)) {
-                        //merge together
-                        insertInnerNodeKeyAt(prev, parent->keySlots[loc], prev->keyCount());
-                         insertInnerNodeChildAt(prev, child->firstChild[0], prev->numChildren);
-                        for (int i = 0; i < child->keyCount(); i++) {
-                            insertInnerNodeKeyAt(prev, child->keySlots[i], prev->keyCount());
-                            insertInnerNodeChildAt(prev, child->firstChild[i+1], prev->numChildren);
-
-                        }
-                         keytype kp =  parent->keySlots[loc];
-                         //cout << "no more children delete child" << endl;
-                         deleteInnerNode(static_cast<innerNode*>(child->parent), kp , child);
-
-                    } else {
-                        //cout << "redistribute from prev" << endl;
-                       
-                        insertInnerNodeKeyAt(child, parent->keySlots[loc], child->keyCount());
-                        insertInnerNodeChildAt(child, prev->firstChild[prev->numChildren-1], 0);
-
-
-                        //cout << "removing redistributed child from next node" << endl;
-                        replacekey(next->parent, parent->keySlots[loc], prev->keySlots[prev->keyCount()-1]);
-
-                       
-                        //cout << "removing redistributed child from prev node" << endl;
-                        prev->firstChild[prev->numChildren - 1] = NULL;
-                        prev->numChildren--;
-                        prev->slotsinuse--;
-                    }
-
-
-                }
+            innerNode* parent = parentof(n);
+            int loc = findInnerNodeLoc(parent, n);
+            assert(loc >= 0);
+            innerNode* prev = NULL;
+            innerNode* next = NULL;
+            if (loc > 0)
+                prev = static_cast<innerNode*> (childat(parent, loc - 1));
+            if (loc + 1 < parent->numChildren)
+                next = static_cast<innerNode*> (childat(parent, loc + 1));
+
+            if ((prev != NULL) && (prev->keyCount() + n->keyCount() < bt_innernodemax)) {
+                mergeinner(prev, n, loc - 1);
+            } else if ((next != NULL) && (n->keyCount() + next->keyCount() < bt_innernodemax)) {
+                mergeinner(n, next, loc);
+            } else if ((prev != NULL) && (prev->keyCount() > bt_innernodemin)) {
+                //cout << "redistribute from prev" << endl;
+                insertInnerNodeKeyAt(n, parent->keySlots[loc - 1], 0);
+                insertInnerNodeChildAt(n, childat(prev, prev->numChildren - 1), 0);
+                parent->keySlots[loc - 1] = prev->keySlots[prev->keyCount() - 1];
+                deleteinnerpair(prev, prev->keyCount() - 1, prev->numChildren - 1);
+            } else if (next != NULL) {
+                //cout << "redistribute from next" << endl;
+                insertInnerNodeKeyAt(n, parent->keySlots[loc], n->keyCount());
+                insertInnerNodeChildAt(n, childat(next, 0), n->numChildren);
+                parent->keySlots[loc] = next->keySlots[0];
+                deleteinnerpair(next, 0, 0);
             }
-
-
-
-            return loc;
-
         }
 
         void upkeycount() {
@@ -1604,11 +1275,14 @@ namespace nwt {
         {
             if(free->isleaf())
             {
-                delete static_cast<leafNode*>(free);
+                leafNode* l = static_cast<leafNode*>(free);
+                delete [] l->dataSlots;
+                deleteleaf(l, arenatag<_Traits::compact>());
+                leaffrees++;
             }
             else
             {//if node is inner node
-                delete static_cast<innerNode*>(free);
+                deleteinner(static_cast<innerNode*>(free), arenatag<_Traits::compact>());
             }
 
         }
@@ -1773,6 +1447,16 @@ namespace nwt {
             inline leafNode* getleafNode() {
                 return currnode;
             }
+
+            inline unsigned short getslot() const {
+                return currslot;
+            }
+
+            /// Version of the leaf the iterator is in, 0 in an empty tree
+
+            inline unsigned long long leafversion() const {
+                return currnode ? currnode->version : 0;
+            }
             /// Prefix++ advance the iterator to the next slot
 
             inline self & operator++() {
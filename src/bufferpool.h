@@ -0,0 +1,466 @@
+#ifndef _BUFFERPOOL_H_
+#define _BUFFERPOOL_H_
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <vector>
+#include "pageio.h"
+
+namespace nwt {
+
+    //number of a page in a paged file. Page 0 is the file's own header, so
+    //0 never names a node and stands for none.
+    typedef uint32_t pageid_t;
+
+    /**
+     *Keeps pages of one file in a fixed number of frames, so memory stays at
+     *frames * PAGE_SIZE however large the file grows. A page is fixed while
+     *in use and is never evicted then. Unfixed pages are evicted by CLOCK:
+     *the hand sweeps the frames, a page used since the hand last passed it
+     *gets a second chance, and the first one that was not is written back if
+     *dirty and its frame reused.
+     *
+     *A page can also be reached from its parent page without the hash:
+     *fixswip swizzles the parent's reference to it into the frame number it
+     *is in, and the page stays swizzled until it is evicted, when the owner
+     *of the pages unswizzles the reference again through the unswizzle_fn
+     *it set. A page with swizzled children is not evicted before them, and
+     *is unswizzled in a copy when written back, so the file only ever holds
+     *page ids.
+     *
+     *Pages known to be needed soon can be prefetched: prefetch gives the
+     *page a frame and starts reading it through page_io without waiting,
+     *and fix waits only if the read has not finished by then.
+     *
+     *Not thread safe, like btree; callers latch.
+     **/
+    class buffer_pool;
+
+    /**
+     *Turn swizzled references in page back into page ids with
+     *buffer_pool::unswip, only the one to frame only unless only is -1
+     **/
+    typedef void (*unswizzle_fn)(char *page, int only, bool detach, buffer_pool *pool, void *arg);
+
+    class buffer_pool {
+    public:
+        static const size_t PAGE_SIZE = 4096;
+
+        //a reference to a child page held in its parent: the page id, or
+        //with SWIZZLED set the frame the child is in
+        static const uint32_t SWIZZLED = 0x80000000u;
+
+        struct stats {
+            uint64_t hits;
+            uint64_t misses;
+            uint64_t evictions;
+            //dirty pages written, by eviction or flush
+            uint64_t writebacks;
+            //reads started by prefetch
+            uint64_t prefetches;
+        };
+
+    private:
+        struct frame {
+            pageid_t id;
+            int pins;
+            //used since the clock hand last passed
+            bool ref;
+            bool dirty;
+            bool used;
+            //next frame in the same hash bucket, -1 at the end
+            int nexthash;
+            //frame of the page holding a swizzled reference to this one,
+            //-1 if none does
+            int parent;
+            //children of this page reached through swizzled references
+            int swizzled;
+            //being read in by prefetch, and fixed until the read finishes
+            bool loading;
+        };
+
+        int fd;
+        char *pages;
+        std::vector<frame> frames;
+        //frame holding each page, chained by page id
+        std::vector<int> buckets;
+        size_t hand;
+        pageid_t npages;
+        stats st;
+        unswizzle_fn unswizzler;
+        void *unswizzlearg;
+        //copy of a page being written back without its swizzled references
+        char *scratch;
+        page_io io;
+        std::vector<page_io::completion> done;
+
+        inline size_t bucketof(pageid_t id) const {
+            return (id * 2654435761u) % buckets.size();
+        }
+
+        inline char *frameof(int f) const {
+            return pages + (size_t) f * PAGE_SIZE;
+        }
+
+        int lookup(pageid_t id) const {
+            for (int f = buckets[bucketof(id)]; f >= 0; f = frames[f].nexthash)
+                if (frames[f].id == id)
+                    return f;
+            return -1;
+        }
+
+        void hash(int f, pageid_t id) {
+            size_t b = bucketof(id);
+            frames[f].id = id;
+            frames[f].nexthash = buckets[b];
+            buckets[b] = f;
+        }
+
+        void unhash(int f) {
+            int *p = &buckets[bucketof(frames[f].id)];
+            while (*p != f)
+                p = &frames[*p].nexthash;
+            *p = frames[f].nexthash;
+            frames[f].used = false;
+        }
+
+        bool writeback(int f) {
+            const char *page = frameof(f);
+            if (frames[f].swizzled > 0) {
+                memcpy(scratch, page, PAGE_SIZE);
+                unswizzler(scratch, -1, false, this, unswizzlearg);
+                page = scratch;
+            }
+            if (pwrite(fd, page, PAGE_SIZE, (off_t) frames[f].id * PAGE_SIZE) != (ssize_t) PAGE_SIZE)
+                return false;
+            frames[f].dirty = false;
+            st.writebacks++;
+            return true;
+        }
+
+        /**
+         *Find a frame for another page: a free one, else the CLOCK victim.
+         *Two sweeps clear every second chance, so -1 means every frame is
+         *fixed or the victim could not be written back.
+         **/
+        int victim() {
+            for (size_t n = 0; n <= 2 * frames.size(); n++) {
+                int f = hand;
+                hand = (hand + 1) % frames.size();
+                if (!frames[f].used)
+                    return f;
+                //children are evicted before their parent
+                if ((frames[f].pins > 0) || (frames[f].swizzled > 0))
+                    continue;
+                if (frames[f].ref) {
+                    frames[f].ref = false;
+                    continue;
+                }
+                if (frames[f].dirty && !writeback(f))
+                    return -1;
+                if (frames[f].parent >= 0)
+                    unswizzler(frameof(frames[f].parent), f, true, this, unswizzlearg);
+                unhash(f);
+                st.evictions++;
+                return f;
+            }
+            return -1;
+        }
+
+        //a fixed frame for page id
+        int claim(pageid_t id) {
+            int f = victim();
+            //frames being prefetched into are fixed until their reads finish
+            while (f < 0 && io.pending() > 0) {
+                io.reap(done, true);
+                complete();
+                f = victim();
+            }
+            if (f < 0)
+                return -1;
+            hash(f, id);
+            frames[f].used = true;
+            frames[f].pins = 1;
+            frames[f].ref = true;
+            frames[f].dirty = false;
+            frames[f].parent = -1;
+            frames[f].swizzled = 0;
+            frames[f].loading = false;
+            return f;
+        }
+
+        /**
+         *Finish the prefetches page_io has completed, dropping the pages
+         *that could not be read
+         **/
+        void complete() {
+            for (size_t i = 0; i < done.size(); i++) {
+                int f = done[i].first;
+                frames[f].loading = false;
+                frames[f].pins--;
+                if (!done[i].second)
+                    unhash(f);
+            }
+            done.clear();
+        }
+
+    public:
+        //prefetch reads in flight at most
+        static const unsigned PREFETCH_DEPTH = 32;
+
+        inline buffer_pool()
+        : fd(-1), pages(NULL), hand(0), npages(0), unswizzler(NULL), unswizzlearg(NULL),
+        scratch(NULL) {
+            memset(&st, 0, sizeof(st));
+        }
+
+        inline ~buffer_pool() {
+            close();
+        }
+
+        /**
+         *Cache the file at path, made if missing, in nframes frames
+         **/
+        bool open(const char *path, size_t nframes, bool uring = true) {
+            close();
+            if (nframes == 0)
+                return false;
+            fd = ::open(path, O_RDWR | O_CREAT, 0644);
+            if (fd < 0)
+                return false;
+            struct stat s;
+            void *p;
+            if (fstat(fd, &s) != 0 || posix_memalign(&p, PAGE_SIZE, (nframes + 1) * PAGE_SIZE) != 0) {
+                ::close(fd);
+                fd = -1;
+                return false;
+            }
+            pages = static_cast<char *> (p);
+            scratch = pages + nframes * PAGE_SIZE;
+            npages = s.st_size / PAGE_SIZE;
+            frame empty = { 0, 0, false, false, false, -1, -1, 0, false };
+            frames.assign(nframes, empty);
+            buckets.assign(2 * nframes, -1);
+            hand = 0;
+            //without page_io prefetch does nothing and fix reads as before
+            io.open(fd, PREFETCH_DEPTH < nframes / 2 ? PREFETCH_DEPTH : nframes / 2, nframes, uring);
+            return true;
+        }
+
+        /**
+         *Write back every dirty page and let the file go
+         **/
+        bool close() {
+            if (fd < 0)
+                return true;
+            wait();
+            bool ok = flush();
+            io.close();
+            ::close(fd);
+            free(pages);
+            fd = -1;
+            pages = scratch = NULL;
+            frames.clear();
+            buckets.clear();
+            return ok;
+        }
+
+        /**
+         *Set how swizzled references are found in a page, before the first
+         *fixswip
+         **/
+        inline void setunswizzle(unswizzle_fn fn, void *arg) {
+            unswizzler = fn;
+            unswizzlearg = arg;
+        }
+
+        //pages in the file, counting those not written back yet
+        inline pageid_t size() const {
+            return npages;
+        }
+
+        /**
+         *Fix page id in a frame, reading it in if it is not cached. Returns
+         *NULL if it could not be read or no frame could be freed.
+         **/
+        char *fix(pageid_t id) {
+            if (io.pending() > 0)
+                poll();
+            int f = lookup(id);
+            while (f >= 0 && frames[f].loading) {
+                io.reap(done, true);
+                complete();
+                f = lookup(id);
+            }
+            if (f >= 0) {
+                frames[f].pins++;
+                frames[f].ref = true;
+                st.hits++;
+                return frameof(f);
+            }
+            if (id >= npages || (f = claim(id)) < 0)
+                return NULL;
+            st.misses++;
+            if (pread(fd, frameof(f), PAGE_SIZE, (off_t) id * PAGE_SIZE) != (ssize_t) PAGE_SIZE) {
+                frames[f].pins = 0;
+                unhash(f);
+                return NULL;
+            }
+            return frameof(f);
+        }
+
+        /**
+         *Fix the child page *swip refers to in parent, a page fixed by the
+         *caller. A swizzled reference leads straight to the frame; a page id
+         *is looked up like fix does and then swizzled in place, which does
+         *not make parent dirty.
+         **/
+        char *fixswip(uint32_t *swip, const char *parent) {
+            if (*swip & SWIZZLED) {
+                int f = *swip & ~SWIZZLED;
+                frames[f].pins++;
+                frames[f].ref = true;
+                st.hits++;
+                return frameof(f);
+            }
+            char *page = fix(*swip);
+            if (page == NULL || unswizzler == NULL)
+                return page;
+            int f = (page - pages) / PAGE_SIZE;
+            int p = (parent - pages) / PAGE_SIZE;
+            if (frames[f].parent < 0) {
+                frames[f].parent = p;
+                frames[p].swizzled++;
+                *swip = f | SWIZZLED;
+            }
+            return page;
+        }
+
+        /**
+         *Fix a page the caller has fixed already once more
+         **/
+        inline void refix(const char *page) {
+            frames[(page - pages) / PAGE_SIZE].pins++;
+        }
+
+        inline pageid_t pageid(const char *page) const {
+            return frames[(page - pages) / PAGE_SIZE].id;
+        }
+
+        /**
+         *Page id of a reference. With detach the reference is being
+         *unswizzled where it is kept, and the child forgets its parent.
+         **/
+        pageid_t unswip(uint32_t swip, bool detach) {
+            if (!(swip & SWIZZLED))
+                return swip;
+            int f = swip & ~SWIZZLED;
+            if (detach && frames[f].parent >= 0) {
+                frames[frames[f].parent].swizzled--;
+                frames[f].parent = -1;
+            }
+            return frames[f].id;
+        }
+
+        /**
+         *Unswizzle every reference in a fixed page in place, before its
+         *references are moved or copied elsewhere
+         **/
+        inline void unswizzle(char *page) {
+            int f = (page - pages) / PAGE_SIZE;
+            if (frames[f].swizzled > 0)
+                unswizzler(page, -1, true, this, unswizzlearg);
+        }
+
+        /**
+         *Add a zeroed page at the end of the file and fix it; it is dirty
+         *until written back
+         **/
+        char *fixnew(pageid_t *id) {
+            int f = claim(npages);
+            if (f < 0)
+                return NULL;
+            *id = npages++;
+            memset(frameof(f), 0, PAGE_SIZE);
+            frames[f].dirty = true;
+            return frameof(f);
+        }
+
+        /**
+         *Release a page fix returned, marking it dirty if it was changed
+         **/
+        void unfix(const char *page, bool dirty) {
+            int f = (page - pages) / PAGE_SIZE;
+            frames[f].pins--;
+            if (dirty)
+                frames[f].dirty = true;
+        }
+
+        /**
+         *Start reading page id into a frame unless it is cached, is being
+         *read already, or PREFETCH_DEPTH reads are in flight. Returns
+         *whether a read was started; the page is not fixed either way.
+         **/
+        bool prefetch(pageid_t id) {
+            if (id >= npages || io.full() || lookup(id) >= 0)
+                return false;
+            int f = claim(id);
+            if (f < 0)
+                return false;
+            frames[f].loading = true;
+            if (!io.submit(frameof(f), PAGE_SIZE, (off_t) id * PAGE_SIZE, f)) {
+                frames[f].loading = false;
+                frames[f].pins = 0;
+                unhash(f);
+                return false;
+            }
+            st.prefetches++;
+            return true;
+        }
+
+        /**
+         *Send the prefetches started since the last call on their way and
+         *finish those that completed, without waiting
+         **/
+        inline void poll() {
+            io.reap(done, false);
+            complete();
+        }
+
+        /**
+         *Wait for every prefetch in flight
+         **/
+        void wait() {
+            while (io.pending() > 0) {
+                io.reap(done, true);
+                complete();
+            }
+        }
+
+        //whether prefetches are read through io_uring, not pread threads
+        inline bool usinguring() const {
+            return io.usinguring();
+        }
+
+        /**
+         *Write back every dirty page and sync the file
+         **/
+        bool flush() {
+            bool ok = true;
+            for (size_t f = 0; f < frames.size(); f++)
+                if (frames[f].used && frames[f].dirty && !writeback(f))
+                    ok = false;
+            return ok && (fdatasync(fd) == 0);
+        }
+
+        inline void getstats(stats *out) const {
+            *out = st;
+        }
+    };
+}
+
+#endif
@@ -0,0 +1,438 @@
+#ifndef _CSBBTREE_H_
+#define _CSBBTREE_H_
+
+#include <stddef.h>
+#include <functional>
+#include <utility>
+#include "slotmove.h"
+
+namespace nwt {
+
+    /**
+     *A cache sensitive B+ tree (CSB+). The children of an inner node are
+     *one node group, laid out one after the other, and the inner node
+     *holds a single pointer to the group instead of one per child; child i
+     *is found by its position in the group. The room the child pointers
+     *took goes to keys, so an inner node of the same size holds about twice
+     *as many and a lookup touches fewer cache lines on its way down.
+     *
+     *Groups are allocated full, with room for as many children as an inner
+     *node can have, so splitting a node only shifts the siblings behind it
+     *within its group. An inner node that splits moves the upper half of
+     *its children to a new group. Nodes are split on the way down as soon
+     *as they are full, so a split never has to go back up the tree, and
+     *since nothing points at a node but its parent's group pointer, nodes
+     *are free to move. Leaf groups are linked in key order for scans.
+     *
+     *Like btree it is a multimap in which an identical key/data pair is
+     *only stored once. Erasing a pair takes it out of its leaf but never
+     *merges nodes, the tree only shrinks with clear. Insert invalidates
+     *iterators. Not thread safe; callers latch.
+     **/
+    template <typename _Key, typename _Datatype, int _nodeslots, int _leafslots,
+            typename _Compare = std::less<_Key> >
+            class csb_btree {
+    public:
+        typedef _Key keytype;
+        typedef _Datatype data_type;
+        typedef _Compare key_compare;
+
+        static const unsigned short bt_leafnodemax = _leafslots;
+        static const unsigned short bt_innernodemax = _nodeslots;
+
+    private:
+        typedef slot_mover<keytype> keymover;
+        typedef slot_mover<data_type> datamover;
+
+        struct leafNode {
+            unsigned short slotsinuse;
+            keytype keySlots[bt_leafnodemax];
+            data_type dataSlots[bt_leafnodemax];
+        };
+
+        struct innerNode {
+            unsigned short slotsinuse;
+            keytype keySlots[bt_innernodemax];
+            //the slotsinuse + 1 children, a leafgroup right above the
+            //leaves and an innergroup further up
+            void* children;
+        };
+
+        struct innergroup {
+            innerNode nodes[bt_innernodemax + 1];
+        };
+
+        struct leafgroup {
+            leafNode nodes[bt_innernodemax + 1];
+            //leaves in use, one more than the parent's keys
+            unsigned short used;
+            //group of the leaves that follow in key order
+            leafgroup* next;
+        };
+
+        //group holding the root as its only node, NULL when empty
+        void* rootgroup;
+        //inner levels above the leaves
+        int height;
+        leafgroup* headgroup;
+        size_t count;
+        key_compare keyless;
+
+        inline bool keyequal(const keytype& a, const keytype& b) const {
+            return !keyless(a, b) && !keyless(b, a);
+        }
+
+        //key in slot i of a node comes before the slot searched for
+        inline bool before(const keytype& key, const keytype& k, bool upper) const {
+            return upper ? !keyless(k, key) : keyless(key, k);
+        }
+
+        /**
+         *Child of n a lookup of k goes to: left of the first separator not
+         *less than k, or greater than k with upper, where new duplicates go
+         **/
+        inline int innerslot(const innerNode* n, const keytype& k, bool upper) const {
+            int slot = 0;
+            while ((slot < n->slotsinuse) && before(n->keySlots[slot], k, upper))
+                slot++;
+            return slot;
+        }
+
+        inline int leafslot(const leafNode* l, const keytype& k, bool upper) const {
+            int slot = 0;
+            while ((slot < l->slotsinuse) && before(l->keySlots[slot], k, upper))
+                slot++;
+            return slot;
+        }
+
+        //move the keys in use, and the data or the child group along
+        static void copynode(leafNode* dst, leafNode* src) {
+            keymover::move(dst->keySlots, src->keySlots, src->slotsinuse);
+            datamover::move(dst->dataSlots, src->dataSlots, src->slotsinuse);
+            dst->slotsinuse = src->slotsinuse;
+        }
+
+        static void copynode(innerNode* dst, innerNode* src) {
+            keymover::move(dst->keySlots, src->keySlots, src->slotsinuse);
+            dst->slotsinuse = src->slotsinuse;
+            dst->children = src->children;
+        }
+
+        static leafgroup* newleafgroup() {
+            leafgroup* g = new leafgroup;
+            g->used = 0;
+            g->next = NULL;
+            return g;
+        }
+
+        static innergroup* newinnergroup() {
+            return new innergroup;
+        }
+
+        /**
+         *Make room for a node at position at of a group of n nodes by
+         *shifting the ones from there on
+         **/
+        template <typename _Node>
+        static void opengap(_Node* nodes, int n, int at) {
+            for (int i = n; i > at; i--)
+                copynode(&nodes[i], &nodes[i - 1]);
+        }
+
+        /**
+         *Split child c of p, which is full and level levels above the
+         *leaves, into it and a new sibling right behind it. p must not be
+         *full itself.
+         **/
+        void splitchild(innerNode* p, int c, int level) {
+            int n = p->slotsinuse + 1;
+            keytype sep;
+            if (level == 0) {
+                leafgroup* g = static_cast<leafgroup*> (p->children);
+                opengap(g->nodes, n, c + 1);
+                leafNode* l = &g->nodes[c];
+                leafNode* r = &g->nodes[c + 1];
+                int half = l->slotsinuse / 2;
+                keymover::move(r->keySlots, l->keySlots + half, l->slotsinuse - half);
+                datamover::move(r->dataSlots, l->dataSlots + half, l->slotsinuse - half);
+                for (int i = half; i < l->slotsinuse; i++)
+                    l->dataSlots[i] = data_type();
+                r->slotsinuse = l->slotsinuse - half;
+                l->slotsinuse = half;
+                g->used++;
+                sep = r->keySlots[0];
+            } else {
+                innergroup* g = static_cast<innergroup*> (p->children);
+                opengap(g->nodes, n, c + 1);
+                innerNode* l = &g->nodes[c];
+                innerNode* r = &g->nodes[c + 1];
+                //the middle key moves up, the children right of it move
+                //to a group of their own
+                int mid = l->slotsinuse / 2;
+                int children = l->slotsinuse + 1;
+                sep = l->keySlots[mid];
+                keymover::move(r->keySlots, l->keySlots + mid + 1, l->slotsinuse - mid - 1);
+                r->slotsinuse = l->slotsinuse - mid - 1;
+                l->slotsinuse = mid;
+                if (level == 1) {
+                    leafgroup* lg = static_cast<leafgroup*> (l->children);
+                    leafgroup* rg = newleafgroup();
+                    for (int i = mid + 1; i < children; i++) {
+                        copynode(&rg->nodes[i - mid - 1], &lg->nodes[i]);
+                        for (int j = 0; j < lg->nodes[i].slotsinuse; j++)
+                            lg->nodes[i].dataSlots[j] = data_type();
+                    }
+                    rg->used = children - mid - 1;
+                    lg->used = mid + 1;
+                    rg->next = lg->next;
+                    lg->next = rg;
+                    r->children = rg;
+                } else {
+                    innergroup* lg = static_cast<innergroup*> (l->children);
+                    innergroup* rg = newinnergroup();
+                    for (int i = mid + 1; i < children; i++)
+                        copynode(&rg->nodes[i - mid - 1], &lg->nodes[i]);
+                    r->children = rg;
+                }
+            }
+            for (int i = p->slotsinuse; i > c; i--)
+                p->keySlots[i] = p->keySlots[i - 1];
+            p->keySlots[c] = sep;
+            p->slotsinuse++;
+        }
+
+        inline bool isfull(void* group, int i, int level) const {
+            if (level == 0)
+                return static_cast<leafgroup*> (group)->nodes[i].slotsinuse == bt_leafnodemax;
+            return static_cast<innergroup*> (group)->nodes[i].slotsinuse == bt_innernodemax;
+        }
+
+        //put a new root above the full one and split it
+        void growroot() {
+            innergroup* g = newinnergroup();
+            g->nodes[0].slotsinuse = 0;
+            g->nodes[0].children = rootgroup;
+            rootgroup = g;
+            height++;
+            splitchild(&g->nodes[0], 0, height - 1);
+        }
+
+        void freegroup(void* group, int nodes, int level) {
+            if (level == 0) {
+                delete static_cast<leafgroup*> (group);
+                return;
+            }
+            innergroup* g = static_cast<innergroup*> (group);
+            for (int i = 0; i < nodes; i++)
+                freegroup(g->nodes[i].children, g->nodes[i].slotsinuse + 1, level - 1);
+            delete g;
+        }
+
+    public:
+
+        /**
+         *Position of a pair, always one in use or end
+         **/
+        class iterator {
+            friend class csb_btree;
+            leafgroup* group;
+            int leaf;
+            int slot;
+
+            //move on to the next pair in use when slot is past its leaf
+            inline void settle() {
+                while ((group != NULL) && (slot >= group->nodes[leaf].slotsinuse)) {
+                    slot = 0;
+                    if (++leaf >= group->used) {
+                        group = group->next;
+                        leaf = 0;
+                    }
+                }
+            }
+
+            inline iterator(leafgroup* g, int l, int s)
+            : group(g), leaf(l), slot(s) {
+                settle();
+            }
+
+        public:
+
+            inline iterator()
+            : group(NULL), leaf(0), slot(0) {
+            }
+
+            inline const keytype& key() const {
+                return group->nodes[leaf].keySlots[slot];
+            }
+
+            inline data_type& data() const {
+                return group->nodes[leaf].dataSlots[slot];
+            }
+
+            inline iterator& operator++() {
+                slot++;
+                settle();
+                return *this;
+            }
+
+            inline bool operator==(const iterator& x) const {
+                return (group == x.group) && (leaf == x.leaf) && (slot == x.slot);
+            }
+
+            inline bool operator!=(const iterator& x) const {
+                return !(*this == x);
+            }
+        };
+
+        inline csb_btree()
+        : rootgroup(NULL), height(0), headgroup(NULL), count(0) {
+        }
+
+        inline ~csb_btree() {
+            clear();
+        }
+
+        void clear() {
+            if (rootgroup != NULL)
+                freegroup(rootgroup, 1, height);
+            rootgroup = NULL;
+            height = 0;
+            headgroup = NULL;
+            count = 0;
+        }
+
+        inline size_t size() const {
+            return count;
+        }
+
+        inline bool empty() const {
+            return count == 0;
+        }
+
+        inline iterator begin() const {
+            return iterator(headgroup, 0, 0);
+        }
+
+        inline iterator end() const {
+            return iterator();
+        }
+
+        /**
+         *Iterator to the first pair whose key is not less than k, or
+         *greater than k with upper
+         **/
+        iterator lower_bound(const keytype& k, bool upper = false) const {
+            if (rootgroup == NULL)
+                return end();
+            void* group = rootgroup;
+            int slot = 0;
+            for (int level = height; level > 0; level--) {
+                innerNode* n = &static_cast<innergroup*> (group)->nodes[slot];
+                slot = innerslot(n, k, upper);
+                group = n->children;
+            }
+            leafgroup* g = static_cast<leafgroup*> (group);
+            return iterator(g, slot, leafslot(&g->nodes[slot], k, upper));
+        }
+
+        inline iterator upper_bound(const keytype& k) const {
+            return lower_bound(k, true);
+        }
+
+        inline bool exists(const keytype& k) const {
+            iterator it = lower_bound(k);
+            return (it != end()) && keyequal(it.key(), k);
+        }
+
+        bool existspair(const keytype& k, const data_type& data) const {
+            for (iterator it = lower_bound(k); (it != end()) && keyequal(it.key(), k); ++it) {
+                if (it.data() == data)
+                    return true;
+            }
+            return false;
+        }
+
+        std::pair<data_type, bool> get(const keytype& k) const {
+            iterator it = lower_bound(k);
+            if ((it == end()) || !keyequal(it.key(), k))
+                return std::pair<data_type, bool>(data_type(), false);
+            return std::pair<data_type, bool>(it.data(), true);
+        }
+
+        /**
+         *Insert a pair behind any with the same key, 1 when it was added
+         *and -2 when the identical pair is stored already
+         **/
+        int insert(const keytype& k, const data_type& data) {
+            if (existspair(k, data))
+                return -2;
+            if (rootgroup == NULL) {
+                leafgroup* g = newleafgroup();
+                g->nodes[0].slotsinuse = 0;
+                g->used = 1;
+                rootgroup = headgroup = g;
+            }
+            if (isfull(rootgroup, 0, height))
+                growroot();
+
+            void* group = rootgroup;
+            int slot = 0;
+            for (int level = height; level > 0; level--) {
+                innerNode* n = &static_cast<innergroup*> (group)->nodes[slot];
+                int c = innerslot(n, k, true);
+                if (isfull(n->children, c, level - 1)) {
+                    splitchild(n, c, level - 1);
+                    if (!keyless(k, n->keySlots[c]))
+                        c++;
+                }
+                group = n->children;
+                slot = c;
+            }
+
+            leafNode* l = &static_cast<leafgroup*> (group)->nodes[slot];
+            int loc = leafslot(l, k, true);
+            keymover::move(l->keySlots + loc + 1, l->keySlots + loc, l->slotsinuse - loc);
+            datamover::move(l->dataSlots + loc + 1, l->dataSlots + loc, l->slotsinuse - loc);
+            l->keySlots[loc] = k;
+            l->dataSlots[loc] = data;
+            l->slotsinuse++;
+            count++;
+            return 1;
+        }
+
+        /**
+         *Remove the pair it is at. Its leaf stays however few pairs are
+         *left in it.
+         **/
+        void erase(iterator it) {
+            leafNode* l = &it.group->nodes[it.leaf];
+            keymover::move(l->keySlots + it.slot, l->keySlots + it.slot + 1, l->slotsinuse - it.slot - 1);
+            datamover::move(l->dataSlots + it.slot, l->dataSlots + it.slot + 1, l->slotsinuse - it.slot - 1);
+            l->slotsinuse--;
+            l->dataSlots[l->slotsinuse] = data_type();
+            count--;
+        }
+
+        //remove the first pair with key k, -1 when there is none
+        int erase(const keytype& k) {
+            iterator it = lower_bound(k);
+            if ((it == end()) || !keyequal(it.key(), k))
+                return -1;
+            erase(it);
+            return 1;
+        }
+
+        //remove the pair k, data, -1 when it is not stored
+        int erasepair(const keytype& k, const data_type& data) {
+            for (iterator it = lower_bound(k); (it != end()) && keyequal(it.key(), k); ++it) {
+                if (it.data() == data) {
+                    erase(it);
+                    return 1;
+                }
+            }
+            return -1;
+        }
+    };
+}
+
+#endif
@@ -0,0 +1,110 @@
+/*
+ * Checks nwt::csb_btree against a std::multimap through random inserts,
+ * erases and erasepairs with many duplicate keys, enough of them to split
+ * leaf and inner groups several levels up and to empty leaves that then
+ * have to be walked over. Pairs of a key must come back in the order they
+ * were inserted, and the tree must fill again after a clear.
+ *
+ *   make csbtest && ./csbtest
+ */
+
+#include <iostream>
+#include <map>
+#include <string>
+#include <stdlib.h>
+#include <stdint.h>
+#include "csbbtree.h"
+#include "testutil.h"
+
+using namespace nwt;
+using namespace std;
+
+/*
+ * Every pair in the same order, duplicates included, and lookups of every
+ * key in range
+ */
+template <typename tree_type, typename K>
+static void compare(tree_type &t, multimap<K, int> &ref, K (*key)(int), int range, int round)
+{
+    typedef typename multimap<K, int>::iterator refiter;
+
+    typename tree_type::iterator ti = t.begin();
+    refiter ri = ref.begin();
+    for (; (ti != t.end()) && (ri != ref.end()); ++ti, ++ri)
+        check((ti.key() == ri->first) && (ti.data() == ri->second), "iteration", round);
+    check((ti == t.end()) && (ri == ref.end()), "iteration length", round);
+    check(t.size() == ref.size(), "size", round);
+    check(t.empty() == ref.empty(), "empty", round);
+
+    for (int i = -1; i <= range; i++) {
+        K k = key(i);
+        refiter rl = ref.lower_bound(k), ru = ref.upper_bound(k);
+        typename tree_type::iterator lb = t.lower_bound(k), ub = t.upper_bound(k);
+        check((lb == t.end()) ? (rl == ref.end()) : ((rl != ref.end()) && (lb.key() == rl->first) && (lb.data() == rl->second)), "lower_bound", round);
+        check((ub == t.end()) ? (ru == ref.end()) : ((ru != ref.end()) && (ub.key() == ru->first) && (ub.data() == ru->second)), "upper_bound", round);
+        check(t.exists(k) == (rl != ru), "exists", round);
+        pair<int, bool> g = t.get(k);
+        check((g.second == (rl != ru)) && (!g.second || g.first == rl->second), "get", round);
+    }
+}
+
+/*
+ * rounds of ops random changes, insert taking share out of ten of them and
+ * erase and erasepair splitting the rest, with keys drawn from range and
+ * data from 0 to 3. Halfway through the tree is cleared.
+ */
+template <typename K, int nodeslots, int leafslots>
+static void randomized(K (*key)(int), int range, int rounds, int ops, int share)
+{
+    typedef csb_btree<K, int, nodeslots, leafslots> tree_type;
+    typedef typename multimap<K, int>::iterator refiter;
+    tree_type t;
+    multimap<K, int> ref;
+
+    for (int round = 0; round < rounds; round++) {
+        for (int i = 0; i < ops; i++) {
+            K k = key(rand() % range);
+            int d = rand() % 4;
+            int op = rand() % 10;
+            refiter r = ref.lower_bound(k), ru = ref.upper_bound(k);
+            if (op < share) {
+                while ((r != ru) && (r->second != d))
+                    ++r;
+                check(t.insert(k, d) == ((r != ru) ? -2 : 1), "insert", round);
+                if (r == ru)
+                    ref.insert(make_pair(k, d));
+            } else if (op % 2 == 0) {
+                check(t.erase(k) == ((r != ru) ? 1 : -1), "erase", round);
+                if (r != ru)
+                    ref.erase(r);
+            } else {
+                while ((r != ru) && (r->second != d))
+                    ++r;
+                check(t.erasepair(k, d) == ((r != ru) ? 1 : -1), "erasepair", round);
+                if (r != ru)
+                    ref.erase(r);
+            }
+        }
+        compare(t, ref, key, range, round);
+        if (round == rounds / 2) {
+            t.clear();
+            ref.clear();
+            compare(t, ref, key, range, round);
+        }
+    }
+}
+
+int main()
+{
+    srand(34234235);
+
+    randomized<int64_t, 4, 4>(intkey, 500, 20, 3000, 6);
+    //smallest nodes, so the tree is deep
+    randomized<int64_t, 2, 2>(intkey, 800, 20, 3000, 7);
+    //few keys, runs of one key over many leaves and groups
+    randomized<int64_t, 3, 5>(intkey, 100, 20, 5000, 6);
+    randomized<int64_t, 8, 16>(intkey, 50000, 10, 20000, 6);
+    randomized<string, 4, 4>(stringkey, 300, 20, 3000, 6);
+
+    return passed("csb_btree");
+}
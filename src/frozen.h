@@ -0,0 +1,420 @@
+#ifndef _FROZEN_H_
+#define _FROZEN_H_
+
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <algorithm>
+#include <functional>
+#include <utility>
+#include <vector>
+
+namespace nwt {
+
+    /**
+     *A B+ tree frozen into a file and read straight from an mmap of it.
+     *Nothing is loaded or rebuilt when the file is opened, a lookup only
+     *touches the pages on its path, and processes that open the same file
+     *share its pages in the page cache.
+     *
+     *The file is a header page followed by the leaves in key order, one
+     *per FROZEN_PAGE, then each inner level above them up to the root.
+     *Children are referred to by their offset in the file, and leaves being
+     *consecutive is what links them. Keys and data are copied as bytes, so
+     *they must be plain fixed size types, and the file is only readable by
+     *a build with the same types, page size and byte order, which the
+     *header records and open checks.
+     **/
+    template <typename _Key, typename _Datatype, typename _Compare = std::less<_Key> >
+            class frozen_btree {
+    public:
+        typedef _Key keytype;
+        typedef _Datatype data_type;
+        typedef _Compare key_compare;
+
+        static const size_t FROZEN_PAGE = 4096;
+
+        //pairs per leaf and keys per inner node that fill a page
+        static const unsigned short bt_leafnodemax =
+                (FROZEN_PAGE - 16) / (sizeof(_Key) + sizeof(_Datatype));
+        static const unsigned short bt_innernodemax =
+                (FROZEN_PAGE - 24) / (sizeof(_Key) + sizeof(uint64_t));
+
+    private:
+        struct header {
+            char magic[8];
+            uint32_t pagesize;
+            uint32_t keysize;
+            uint32_t datasize;
+            //levels, leaves included
+            uint32_t height;
+            uint64_t count;
+            uint64_t leaves;
+            //offset of the root, the only leaf when height is 1
+            uint64_t root;
+        };
+
+        struct leafNode {
+            uint16_t level;
+            uint16_t slotsinuse;
+            _Key keySlots[bt_leafnodemax];
+            _Datatype dataSlots[bt_leafnodemax];
+        };
+
+        struct innerNode {
+            uint16_t level;
+            uint16_t slotsinuse;
+            _Key keySlots[bt_innernodemax];
+            //offset of the subtree holding the keys before keySlots[i]
+            uint64_t firstChild[bt_innernodemax + 1];
+        };
+
+        //a node must fit a page
+        typedef char leaf_fits_page[(sizeof(leafNode) <= FROZEN_PAGE) ? 1 : -1];
+        typedef char inner_fits_page[(sizeof(innerNode) <= FROZEN_PAGE) ? 1 : -1];
+
+        //leaves are a page apart, not sizeof(leafNode)
+        static inline const leafNode *leafstep(const leafNode *l, long n) {
+            return reinterpret_cast<const leafNode *> (reinterpret_cast<const char *> (l) + n * (long) FROZEN_PAGE);
+        }
+
+        static inline const char *frozen_magic() {
+            return "NWTFRZN1";
+        }
+
+        const char *base;
+        size_t length;
+        const header *head;
+        //first and last leaf, NULL in an empty tree
+        const leafNode *headleaf;
+        const leafNode *tailleaf;
+        key_compare keyless;
+
+        inline bool keyequal(const keytype &a, const keytype &b) const {
+            return !keyless(a, b) && !keyless(b, a);
+        }
+
+        //nodes fill a page, so slots are binary searched rather than
+        //scanned like btree's
+        inline int firstnotless(const keytype *keys, int n, const keytype &k) const {
+            return std::lower_bound(keys, keys + n, k, keyless) - keys;
+        }
+
+        inline int firstgreater(const keytype *keys, int n, const keytype &k) const {
+            return std::upper_bound(keys, keys + n, k, keyless) - keys;
+        }
+
+        inline const leafNode *leafat(uint64_t off) const {
+            return reinterpret_cast<const leafNode *> (base + off);
+        }
+
+        inline const innerNode *innerat(uint64_t off) const {
+            return reinterpret_cast<const innerNode *> (base + off);
+        }
+
+        /**
+         *Write one page, zero filled past the node
+         **/
+        static bool writepage(int fd, const void *node, size_t len) {
+            char page[FROZEN_PAGE];
+            memset(page, 0, sizeof(page));
+            memcpy(page, node, len);
+            const char *p = page;
+            size_t left = sizeof(page);
+            while (left > 0) {
+                ssize_t n = ::write(fd, p, left);
+                if (n <= 0)
+                    return false;
+                p += n;
+                left -= n;
+            }
+            return true;
+        }
+
+    public:
+        class iterator {
+        public:
+            typedef iterator self;
+
+        private:
+            const leafNode *currnode;
+            unsigned short currslot;
+            //ends of the leaves, which follow each other in the file
+            const leafNode *headleaf;
+            const leafNode *tailleaf;
+
+        public:
+
+            inline iterator()
+            : currnode(NULL), currslot(0), headleaf(NULL), tailleaf(NULL) {
+            }
+
+            inline iterator(const leafNode *l, unsigned short s, const leafNode *head,
+                    const leafNode *tail)
+            : currnode(l), currslot(s), headleaf(head), tailleaf(tail) {
+            }
+
+            /// Key of the current slot
+
+            inline const keytype& key() const {
+                return currnode->keySlots[currslot];
+            }
+
+            /// Data of the current slot, read only like the rest of the file
+
+            inline const data_type& data() const {
+                return currnode->dataSlots[currslot];
+            }
+
+            /// Prefix++ advance the iterator to the next slot
+
+            inline self & operator++() {
+                if (currslot + 1 < currnode->slotsinuse) {
+                    ++currslot;
+                } else if (currnode != tailleaf) {
+                    currnode = leafstep(currnode, 1);
+                    currslot = 0;
+                } else {
+                    currslot = currnode->slotsinuse;
+                }
+                return *this;
+            }
+
+            /// Prefix-- move the iterator to the previous slot
+
+            inline self & operator--() {
+                if (currslot > 0) {
+                    --currslot;
+                } else if (currnode != headleaf) {
+                    currnode = leafstep(currnode, -1);
+                    currslot = currnode->slotsinuse - 1;
+                }
+                return *this;
+            }
+
+            inline bool operator==(const self& x) const {
+                return (x.currnode == currnode) && (x.currslot == currslot);
+            }
+
+            inline bool operator!=(const self& x) const {
+                return (x.currnode != currnode) || (x.currslot != currslot);
+            }
+        };
+
+        inline frozen_btree()
+        : base(NULL), length(0), head(NULL), headleaf(NULL), tailleaf(NULL) {
+        }
+
+        inline ~frozen_btree() {
+            close();
+        }
+
+        /**
+         *Freeze tree into the file at path, walking its leaf chain once.
+         *Leaves are written as they fill and each inner level is written
+         *from the first key and offset of the nodes below it, so only those
+         *are held in memory. The header goes in last, so a file cut short
+         *is never opened.
+         **/
+        template <typename tree_type>
+        static bool write(const char *path, tree_type &tree) {
+            int fd = ::open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+            if (fd < 0)
+                return false;
+
+            header h;
+            memset(&h, 0, sizeof(h));
+            h.pagesize = FROZEN_PAGE;
+            h.keysize = sizeof(_Key);
+            h.datasize = sizeof(_Datatype);
+            bool ok = writepage(fd, &h, sizeof(h));
+
+            //first key and offset of every node of the level being built on
+            std::vector<std::pair<_Key, uint64_t> > level;
+            uint64_t off = FROZEN_PAGE;
+            leafNode *l = new leafNode;
+            memset(l, 0, sizeof(*l));
+            for (typename tree_type::iterator it = tree.begin(); ok && it != tree.end(); ++it) {
+                l->keySlots[l->slotsinuse] = it.key();
+                l->dataSlots[l->slotsinuse] = it.data();
+                if (++l->slotsinuse == bt_leafnodemax) {
+                    level.push_back(std::make_pair(l->keySlots[0], off));
+                    ok = writepage(fd, l, sizeof(*l));
+                    off += FROZEN_PAGE;
+                    h.count += l->slotsinuse;
+                    memset(l, 0, sizeof(*l));
+                }
+            }
+            if (ok && l->slotsinuse > 0) {
+                level.push_back(std::make_pair(l->keySlots[0], off));
+                ok = writepage(fd, l, sizeof(*l));
+                off += FROZEN_PAGE;
+                h.count += l->slotsinuse;
+            }
+            delete l;
+            h.leaves = level.size();
+            h.height = level.empty() ? 0 : 1;
+
+            //lay inner levels over the one below until one node is left,
+            //spreading the children evenly like btree::bulk_load
+            innerNode *n = new innerNode;
+            while (ok && level.size() > 1) {
+                size_t m = level.size();
+                size_t parents = (m + bt_innernodemax) / (bt_innernodemax + 1);
+                std::vector<std::pair<_Key, uint64_t> > up;
+                size_t c = 0;
+                for (size_t i = 0; ok && i < parents; i++) {
+                    size_t children = m / parents + ((i < m % parents) ? 1 : 0);
+                    memset(n, 0, sizeof(*n));
+                    n->level = h.height;
+                    n->slotsinuse = children - 1;
+                    up.push_back(std::make_pair(level[c].first, off));
+                    for (size_t j = 0; j < children; j++, c++) {
+                        n->firstChild[j] = level[c].second;
+                        if (j > 0)
+                            n->keySlots[j - 1] = level[c].first;
+                    }
+                    ok = writepage(fd, n, sizeof(*n));
+                    off += FROZEN_PAGE;
+                }
+                level.swap(up);
+                h.height++;
+            }
+            delete n;
+            h.root = level.empty() ? 0 : level[0].second;
+
+            memcpy(h.magic, frozen_magic(), sizeof(h.magic));
+            if (ok)
+                ok = (fsync(fd) == 0) && (pwrite(fd, &h, sizeof(h), 0) == (ssize_t) sizeof(h))
+                    && (fsync(fd) == 0);
+            ::close(fd);
+            return ok;
+        }
+
+        /**
+         *Map the file at path. Returns false if it is not a whole frozen
+         *tree of these types.
+         **/
+        bool open(const char *path) {
+            close();
+            int fd = ::open(path, O_RDONLY);
+            if (fd < 0)
+                return false;
+            struct stat st;
+            if (fstat(fd, &st) != 0 || (size_t) st.st_size < FROZEN_PAGE) {
+                ::close(fd);
+                return false;
+            }
+            void *p = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+            ::close(fd);
+            if (p == MAP_FAILED)
+                return false;
+            base = static_cast<const char *> (p);
+            length = st.st_size;
+            head = reinterpret_cast<const header *> (base);
+            if (memcmp(head->magic, frozen_magic(), sizeof(head->magic)) != 0
+                    || head->pagesize != FROZEN_PAGE || head->keysize != sizeof(_Key)
+                    || head->datasize != sizeof(_Datatype)
+                    || (1 + head->leaves) * FROZEN_PAGE > length || head->root + FROZEN_PAGE > length) {
+                close();
+                return false;
+            }
+            if (head->leaves > 0) {
+                headleaf = leafat(FROZEN_PAGE);
+                tailleaf = leafstep(headleaf, head->leaves - 1);
+            }
+            return true;
+        }
+
+        void close() {
+            if (base != NULL)
+                munmap(const_cast<char *> (base), length);
+            base = NULL;
+            length = 0;
+            head = NULL;
+            headleaf = tailleaf = NULL;
+        }
+
+        inline bool isopen() const {
+            return base != NULL;
+        }
+
+        inline size_t size() const {
+            return head ? head->count : 0;
+        }
+
+        inline bool empty() const {
+            return headleaf == NULL;
+        }
+
+        inline iterator begin() const {
+            return iterator(headleaf, 0, headleaf, tailleaf);
+        }
+
+        inline iterator end() const {
+            return iterator(tailleaf, tailleaf ? tailleaf->slotsinuse : 0, headleaf, tailleaf);
+        }
+
+        /**
+         * Iterator to the first pair whose key is not less than k
+         **/
+        iterator lower_bound(const keytype &k) const {
+            if (empty())
+                return end();
+            uint64_t off = head->root;
+            for (uint32_t h = head->height; h > 1; h--) {
+                const innerNode *n = innerat(off);
+                //keys equal to a separator can sit on both sides of it
+                off = n->firstChild[firstnotless(n->keySlots, n->slotsinuse, k)];
+            }
+            const leafNode *l = leafat(off);
+            for (;;) {
+                int slot = firstnotless(l->keySlots, l->slotsinuse, k);
+                if (slot < l->slotsinuse)
+                    return iterator(l, slot, headleaf, tailleaf);
+                if (l == tailleaf)
+                    return end();
+                //the first match may be the head of the next leaf
+                l = leafstep(l, 1);
+            }
+        }
+
+        /**
+         * Iterator to the first pair whose key is greater than k
+         **/
+        iterator upper_bound(const keytype &k) const {
+            if (empty())
+                return end();
+            uint64_t off = head->root;
+            for (uint32_t h = head->height; h > 1; h--) {
+                const innerNode *n = innerat(off);
+                off = n->firstChild[firstgreater(n->keySlots, n->slotsinuse, k)];
+            }
+            const leafNode *l = leafat(off);
+            int slot = firstgreater(l->keySlots, l->slotsinuse, k);
+            if ((slot == l->slotsinuse) && (l != tailleaf))
+                return iterator(leafstep(l, 1), 0, headleaf, tailleaf);
+            return iterator(l, slot, headleaf, tailleaf);
+        }
+
+        inline bool exists(const keytype &k) const {
+            iterator it = lower_bound(k);
+
+            return (it != end()) && keyequal(it.key(), k);
+        }
+
+        inline std::pair<data_type, bool> get(const keytype &k) const {
+            iterator it = lower_bound(k);
+
+            if ((it == end()) || !keyequal(it.key(), k))
+                return std::pair<data_type, bool>(data_type(), false);
+            return std::pair<data_type, bool>(it.data(), true);
+        }
+    };
+}
+
+#endif
@@ -0,0 +1,103 @@
+/*
+ * Checks nwt::frozen_btree against the btree it was frozen from: every
+ * lookup and a walk over all pairs must agree, for trees with duplicate
+ * keys of one leaf up to three levels, and for an empty one. A file cut
+ * short or frozen from other types must not open.
+ *
+ *   make frozentest && ./frozentest
+ */
+
+#include <iostream>
+#include <stdlib.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include "btree.h"
+#include "frozen.h"
+#include "testutil.h"
+
+using namespace nwt;
+using namespace std;
+
+typedef btree<int64_t, int64_t, 16, 16> source_tree;
+typedef frozen_btree<int64_t, int64_t> frozen_tree;
+
+static const char *path = "frozentest.dat";
+
+/*
+ * Freeze a tree of n pairs with keys drawn from range, so most keys have
+ * duplicates when n is larger, and compare the two
+ */
+static void roundtrip(int n, int range)
+{
+    source_tree t;
+    for (int i = 0; i < n; i++)
+        t.insert(rand() % range, i);
+
+    frozen_tree f;
+    if (!frozen_tree::write(path, t) || !f.open(path)) {
+        cout << "could not freeze a tree of " << n << " pairs" << endl;
+        fails++;
+        return;
+    }
+    check(f.size() == (size_t) t.size(), "size", n);
+    check(f.empty() == (n == 0), "empty", n);
+
+    source_tree::iterator ti = t.begin();
+    frozen_tree::iterator fi = f.begin();
+    for (; (ti != t.end()) && (fi != f.end()); ++ti, ++fi)
+        check((fi.key() == ti.key()) && (fi.data() == ti.data()), "iteration", ti.key());
+    check((ti == t.end()) && (fi == f.end()), "iteration length", n);
+
+    //keys below, between, on and above the stored ones
+    for (int64_t k = -2; k < range + 2; k++) {
+        check(samepair(f.lower_bound(k), f.end(), t.lower_bound(k), t.end()), "lower_bound", k);
+        check(samepair(f.upper_bound(k), f.end(), t.upper_bound(k), t.end()), "upper_bound", k);
+        check(f.exists(k) == t.exists(k), "exists", k);
+        pair<int64_t, bool> fg = f.get(k), tg = t.get(k);
+        check((fg.second == tg.second) && (!fg.second || fg.first == tg.first), "get", k);
+    }
+}
+
+int main()
+{
+    srand(34234235);
+
+    roundtrip(0, 10);
+    roundtrip(1, 10);
+    //one leaf full, then several
+    roundtrip(frozen_tree::bt_leafnodemax, 50);
+    roundtrip(5000, 1000);
+    //three levels
+    roundtrip(frozen_tree::bt_leafnodemax * (frozen_tree::bt_innernodemax + 2), 20000);
+
+    //the root is written last, so any cut loses it
+    source_tree t;
+    for (int i = 0; i < 5000; i++)
+        t.insert(i, i);
+    frozen_tree f;
+    if (!frozen_tree::write(path, t) || !f.open(path)) {
+        cout << "could not freeze a tree to cut short" << endl;
+        fails++;
+    }
+    f.close();
+    struct stat st;
+    stat(path, &st);
+    off_t page = frozen_tree::FROZEN_PAGE;
+    off_t cuts[] = { st.st_size - 1, st.st_size - page, page, 16, 0 };
+    for (size_t i = 0; i < sizeof(cuts) / sizeof(cuts[0]); i++) {
+        if ((truncate(path, cuts[i]) != 0) || f.open(path)) {
+            cout << "opened a frozen tree cut to " << cuts[i] << " bytes" << endl;
+            fails++;
+        }
+    }
+
+    //nor does a tree frozen from other types
+    if (!frozen_tree::write(path, t) || frozen_btree<int32_t, int64_t>().open(path)) {
+        cout << "opened a frozen tree as other types" << endl;
+        fails++;
+    }
+
+    unlink(path);
+    return passed("frozen_btree");
+}
@@ -0,0 +1,291 @@
+#ifndef _HASHBTREE_H_
+#define _HASHBTREE_H_
+
+#include <stdint.h>
+#include <string>
+#include <vector>
+#include "btree.h"
+
+namespace nwt {
+
+    /**
+     *Hash of a key for hash_btree. Integer keys are multiplied by a large
+     *odd constant and folded, so sequence numbers spread over the buckets.
+     **/
+    template <typename _Key>
+    struct key_hash {
+        inline size_t operator()(const _Key& k) const {
+            uint64_t h = (uint64_t) k * 0x9E3779B97F4A7C15ULL;
+            return (size_t) (h ^ (h >> 32));
+        }
+    };
+
+    //FNV-1a over the bytes of the string
+    template <>
+    struct key_hash<std::string> {
+        inline size_t operator()(const std::string& k) const {
+            uint64_t h = 14695981039346656037ULL;
+            for (size_t i = 0; i < k.size(); i++) {
+                h ^= (unsigned char) k[i];
+                h *= 1099511628211ULL;
+            }
+            return (size_t) (h ^ (h >> 32));
+        }
+    };
+
+    /**
+     *A btree with a hash table from each key to the leaf holding its first
+     *pair, for indexes read mostly one key at a time. lower_bound, exists,
+     *existspair and get of a stored key go straight to its leaf instead of
+     *descending from the root, erase and erasepair find the pair the same
+     *way. Keys that are not stored, upper_bound and iteration use the tree
+     *as usual, so scans are unchanged.
+     *
+     *The table is kept right by the tree itself: every split, merge and
+     *borrow reports the leaf it moved pairs into, and the keys whose first
+     *pair is now there are pointed at it. Lookups only read the table, so
+     *any number of them may run together as long as nothing changes the
+     *tree, the same rule as for btree.
+     **/
+    template <typename _Key, typename _Datatype, int _nodeslots, int _leafslots,
+            typename _Compare = std::less<_Key>, typename _Traits = btree_traits_default,
+            typename _Hash = key_hash<_Key> >
+            class hash_btree : public btree<_Key, _Datatype, _nodeslots, _leafslots, _Compare, _Traits> {
+    public:
+        typedef btree<_Key, _Datatype, _nodeslots, _leafslots, _Compare, _Traits> tree_type;
+        typedef typename tree_type::keytype keytype;
+        typedef typename tree_type::data_type data_type;
+        typedef typename tree_type::iterator iterator;
+
+    protected:
+        typedef typename tree_type::leafNode leafNode;
+
+    private:
+        //buckets the table starts with, always a power of two
+        static const size_t HASH_MIN_BUCKETS = 16;
+
+        struct entry {
+            keytype key;
+            leafNode* leaf;
+            //next entry in the same bucket or on the free list, -1 at the end
+            int next;
+        };
+
+        std::vector<int> buckets;
+        std::vector<entry> entries;
+        //first unused entry, -1 for none
+        int freeentries;
+        //keys in the table
+        size_t numkeys;
+        _Hash hasher;
+
+        inline size_t bucketof(const keytype& k) const {
+            return hasher(k) & (buckets.size() - 1);
+        }
+
+        int findentry(const keytype& k) const {
+            for (int e = buckets[bucketof(k)]; e >= 0; e = entries[e].next) {
+                if (this->keyequal(entries[e].key, k))
+                    return e;
+            }
+            return -1;
+        }
+
+
+        //point k at leaf l, adding it if it is not there yet
+        void sethash(const keytype& k, leafNode* l) {
+            int e = findentry(k);
+            if (e >= 0) {
+                entries[e].leaf = l;
+                return;
+            }
+            if (numkeys >= buckets.size())
+                rehash(buckets.size() * 2);
+            if (freeentries >= 0) {
+                e = freeentries;
+                freeentries = entries[e].next;
+            } else {
+                e = entries.size();
+                entries.push_back(entry());
+            }
+            size_t b = bucketof(k);
+            entries[e].key = k;
+            entries[e].leaf = l;
+            entries[e].next = buckets[b];
+            buckets[b] = e;
+            numkeys++;
+        }
+
+        void unhash(const keytype& k) {
+            for (int* p = &buckets[bucketof(k)]; *p >= 0; p = &entries[*p].next) {
+                int e = *p;
+                if (!this->keyequal(entries[e].key, k))
+                    continue;
+                *p = entries[e].next;
+                entries[e].key = keytype();
+                entries[e].leaf = NULL;
+                entries[e].next = freeentries;
+                freeentries = e;
+                numkeys--;
+                return;
+            }
+        }
+
+        void rehash(size_t nbuckets) {
+            buckets.assign(nbuckets, -1);
+            for (size_t e = 0; e < entries.size(); e++) {
+                if (entries[e].leaf == NULL)
+                    continue;
+                size_t b = bucketof(entries[e].key);
+                entries[e].next = buckets[b];
+                buckets[b] = e;
+            }
+        }
+
+        void resethash() {
+            buckets.assign(HASH_MIN_BUCKETS, -1);
+            entries.clear();
+            freeentries = -1;
+            numkeys = 0;
+        }
+
+        static void moved(void* arg, leafNode* l) {
+            static_cast<hash_btree*> (arg)->rescan(l);
+        }
+
+    protected:
+        //leaf holding the first pair of k, NULL when k is not stored
+        inline leafNode* leafof(const keytype& k) const {
+            int e = findentry(k);
+            return (e >= 0) ? entries[e].leaf : NULL;
+        }
+
+        /**
+         *Point every key whose first pair is in leaf l at it. Keys that
+         *also end the leaf before keep pointing there.
+         **/
+        void rescan(leafNode* l) {
+            for (int i = 0; i < l->keyCount(); i++) {
+                const keytype& k = l->keySlots[i];
+                if (i > 0) {
+                    if (this->keyequal(l->keySlots[i - 1], k))
+                        continue;
+                } else if (l->prevLeaf != NULL) {
+                    leafNode* p = l->prevLeaf;
+                    if ((p->keyCount() > 0) && this->keyequal(p->keySlots[p->keyCount() - 1], k))
+                        continue;
+                }
+                sethash(k, l);
+            }
+        }
+
+    public:
+
+        inline hash_btree()
+        : freeentries(-1), numkeys(0) {
+            buckets.assign(HASH_MIN_BUCKETS, -1);
+            this->leafmoved = &hash_btree::moved;
+            this->leafmovedarg = this;
+        }
+
+        inline void clear() {
+            tree_type::clear();
+            resethash();
+        }
+
+        //distinct keys stored
+        inline size_t keycount() const {
+            return numkeys;
+        }
+
+        inline bool exists(keytype k) {
+            return findentry(k) >= 0;
+        }
+
+        inline bool existspair(keytype k, const data_type& data) {
+            leafNode* l = leafof(k);
+            if (l == NULL)
+                return false;
+            for (iterator it(l, this->findKeyEqual(l, k)); (it != this->end()) && this->keyequal(it.key(), k); ++it) {
+                if (it.data() == data)
+                    return true;
+            }
+            return false;
+        }
+
+        inline std::pair<data_type, bool> get(keytype k) {
+            leafNode* l = leafof(k);
+            if (l == NULL)
+                return std::pair<data_type, bool>(data_type(), false);
+            return std::pair<data_type, bool>(l->dataSlots[this->findKeyEqual(l, k)], true);
+        }
+
+        /**
+         * Iterator to the first pair whose key is not less than k, without
+         * a descent when k is stored
+         **/
+        inline iterator lower_bound(keytype k) {
+            leafNode* l = leafof(k);
+            if (l == NULL)
+                return tree_type::lower_bound(k);
+            return iterator(l, this->findKeyEqual(l, k));
+        }
+
+        int insert(keytype k, data_type data) {
+            leafNode* l = this->insertpair(k, data);
+            if (l == NULL)
+                return -2;
+            //a duplicate goes behind the first pair, which stays put
+            if (findentry(k) < 0)
+                sethash(k, l);
+            return 1;
+        }
+
+        template <typename InputIterator>
+        void bulk_load(InputIterator first, InputIterator last) {
+            tree_type::bulk_load(first, last);
+            resethash();
+            for (leafNode* l = this->headleaf; l != NULL; l = l->nextLeaf)
+                rescan(l);
+        }
+
+        /**
+         *Remove slot loc of leaf l. When it held the first pair of its key
+         *the key moves on to the next pair, or leaves the table with it.
+         **/
+        int eraseslot(leafNode* l, int loc) {
+            if ((loc < 0) || (loc >= l->keyCount()))
+                return -1;
+            keytype k = l->keySlots[loc];
+            if ((leafof(k) == l) && (this->findKeyEqual(l, k) == loc)) {
+                iterator next(l, loc);
+                ++next;
+                if ((next != this->end()) && this->keyequal(next.key(), k))
+                    sethash(k, next.getleafNode());
+                else
+                    unhash(k);
+            }
+            return tree_type::eraseslot(l, loc);
+        }
+
+        int erase(keytype k) {
+            leafNode* l = leafof(k);
+            if (l == NULL)
+                return -1;
+            return eraseslot(l, this->findKeyEqual(l, k));
+        }
+
+        int erasepair(keytype k, data_type d) {
+            leafNode* l = leafof(k);
+            if (l == NULL)
+                return -1;
+            for (iterator it(l, this->findKeyEqual(l, k)); (it != this->end()) && this->keyequal(it.key(), k); ++it) {
+                if (it.data() == d)
+                    return eraseslot(it.getleafNode(), it.getslot());
+            }
+            return -1;
+        }
+    };
+}
+
+#endif
@@ -0,0 +1,123 @@
+/*
+ * Checks nwt::hash_btree against a plain btree given the same changes:
+ * inserts with many duplicate keys, then erases and erasepairs until
+ * merges and borrows have freed most leaves, then both mixed, and again
+ * after a bulk_load. The table must send every lookup of a stored key to
+ * the pair the tree finds by descending.
+ *
+ *   make hashtest && ./hashtest
+ */
+
+#include <iostream>
+#include <string>
+#include <vector>
+#include <stdlib.h>
+#include <stdint.h>
+#include "hashbtree.h"
+#include "testutil.h"
+
+using namespace nwt;
+using namespace std;
+
+template <typename hash_type>
+static int leafcount(hash_type &h)
+{
+    int n = 0;
+    void *last = NULL;
+    for (typename hash_type::iterator it = h.begin(); it != h.end(); ++it) {
+        if ((void *) it.getleafNode() != last)
+            n++;
+        last = it.getleafNode();
+    }
+    return n;
+}
+
+/*
+ * Lookups of every key in range, stored or not, and all pairs in order
+ */
+template <typename hash_type, typename tree_type, typename K>
+static void compare(hash_type &h, tree_type &t, K (*key)(int), int range, int phase)
+{
+    size_t distinct = 0;
+    for (int i = -1; i <= range; i++) {
+        K k = key(i);
+        check(samepair(h.lower_bound(k), h.end(), t.lower_bound(k), t.end()), "lower_bound", phase);
+        check(samepair(h.upper_bound(k), h.end(), t.upper_bound(k), t.end()), "upper_bound", phase);
+        check(h.exists(k) == t.exists(k), "exists", phase);
+        pair<int, bool> hg = h.get(k), tg = t.get(k);
+        check((hg.second == tg.second) && (!hg.second || hg.first == tg.first), "get", phase);
+        distinct += t.exists(k);
+    }
+    check(h.keycount() == distinct, "keycount", phase);
+    check(h.size() == t.size(), "size", phase);
+
+    typename hash_type::iterator hi = h.begin();
+    typename tree_type::iterator ti = t.begin();
+    for (; (hi != h.end()) && (ti != t.end()); ++hi, ++ti)
+        check((hi.key() == ti.key()) && (hi.data() == ti.data()), "iteration", phase);
+    check((hi == h.end()) && (ti == t.end()), "iteration length", phase);
+}
+
+/*
+ * n random changes made to both trees, insert taking share out of ten of
+ * them and erase and erasepair splitting the rest. Both must find the same
+ * pairs to erase, although after a bulk_load not in the same slots.
+ */
+template <typename hash_type, typename tree_type, typename K>
+static void change(hash_type &h, tree_type &t, K (*key)(int), int range, int n, int share, int phase)
+{
+    for (int i = 0; i < n; i++) {
+        K k = key(rand() % range);
+        int d = rand() % 4;
+        int op = rand() % 10;
+        if (op < share)
+            check(h.insert(k, d) == t.insert(k, d), "insert", phase);
+        else if (op % 2 == 0)
+            check((h.erase(k) < 0) == (t.erase(k) < 0), "erase", phase);
+        else
+            check((h.erasepair(k, d) < 0) == (t.erasepair(k, d) < 0), "erasepair", phase);
+    }
+}
+
+template <typename K, int slots>
+static void run(K (*key)(int), int range)
+{
+    typedef hash_btree<K, int, slots, slots> hash_type;
+    typedef btree<K, int, slots, slots> tree_type;
+    hash_type h;
+    tree_type t;
+
+    change(h, t, key, range, range * 3, 10, 1);
+    compare(h, t, key, range, 1);
+
+    //most pairs go, so leaves merge, borrow and are freed
+    int leaves = leafcount(h);
+    change(h, t, key, range, range * 6, 0, 2);
+    compare(h, t, key, range, 2);
+    check(leafcount(h) < leaves / 2, "freed leaves", 2);
+
+    change(h, t, key, range, range * 4, 5, 3);
+    compare(h, t, key, range, 3);
+
+    vector<pair<K, int> > pairs;
+    for (typename tree_type::iterator it = t.begin(); it != t.end(); ++it)
+        pairs.push_back(make_pair(it.key(), it.data()));
+    h.bulk_load(pairs.begin(), pairs.end());
+    compare(h, t, key, range, 4);
+
+    change(h, t, key, range, range * 4, 5, 5);
+    compare(h, t, key, range, 5);
+}
+
+int main()
+{
+    srand(34234235);
+
+    run<int64_t, 4>(intkey, 2000);
+    run<int64_t, 16>(intkey, 20000);
+    //few keys, long runs of duplicates
+    run<int64_t, 4>(intkey, 40);
+    run<string, 4>(stringkey, 2000);
+
+    return passed("hash_btree");
+}
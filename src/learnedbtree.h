@@ -0,0 +1,286 @@
+#ifndef _LEARNEDBTREE_H_
+#define _LEARNEDBTREE_H_
+
+#include <algorithm>
+#include <vector>
+#include "hashbtree.h"
+
+namespace nwt {
+
+    /**
+     *A hash_btree of integer keys that finds the leaf of a key it does not
+     *hold without descending either. A piecewise linear model of the first
+     *keys of the leaves, in leaf order, predicts the position of the leaf
+     *within LEARNED_ERROR; a binary search of the first keys around the
+     *prediction picks it, and a few steps along the leaf chain correct for
+     *changes since the model was made. When those are not enough, or a
+     *leaf was freed since, the tree is descended as usual.
+     *
+     *A split of the last leaf, which is all that appending increasing keys
+     *causes, extends the model in place. Other splits, merges and borrows
+     *make it drift and it is trained again once there were more of them
+     *than half the leaves; a freed leaf turns it off until then. Only
+     *changes to the tree train it, lookups just read it.
+     **/
+    template <typename _Key, typename _Datatype, int _nodeslots, int _leafslots,
+            typename _Compare = std::less<_Key>, typename _Traits = btree_traits_default,
+            typename _Hash = key_hash<_Key> >
+            class learned_btree : public hash_btree<_Key, _Datatype, _nodeslots, _leafslots, _Compare, _Traits, _Hash> {
+    public:
+        typedef hash_btree<_Key, _Datatype, _nodeslots, _leafslots, _Compare, _Traits, _Hash> hash_type;
+        typedef typename hash_type::tree_type tree_type;
+        typedef typename hash_type::keytype keytype;
+        typedef typename hash_type::data_type data_type;
+        typedef typename hash_type::iterator iterator;
+
+        //most positions a prediction is off by
+        static const int LEARNED_ERROR = 8;
+        //leaf chain steps taken before giving up on a prediction
+        static const int ROUTE_STEPS = 8;
+        //fewest changes that train the model again
+        static const size_t RETRAIN_MIN = 64;
+
+    private:
+        typedef typename hash_type::leafNode leafNode;
+
+        /**
+         *Leaves from position first on are predicted at
+         *first + slope * (k - start)
+         **/
+        struct segment {
+            keytype start;
+            size_t first;
+            double slope;
+        };
+
+        //first key and leaf at each position when the model was made
+        std::vector<keytype> firstkeys;
+        std::vector<leafNode*> leaves;
+        std::vector<segment> segments;
+        //slopes the last segment can still take and cover every point in it
+        double lastlo;
+        double lasthi;
+        //tree_type::leaffrees when the model was made
+        unsigned long long trainedfrees;
+        //leaves split, merged or borrowed into since, other than appends
+        size_t drift;
+
+        struct segmentless {
+            _Compare keyless;
+            inline bool operator()(const keytype& k, const segment& s) const {
+                return keyless(k, s.start);
+            }
+        };
+
+        //start a segment at position i
+        void opensegment(size_t i) {
+            segment s;
+            s.start = firstkeys[i];
+            s.first = i;
+            s.slope = 0;
+            segments.push_back(s);
+            lastlo = 0;
+            lasthi = -1;
+        }
+
+        /**
+         *Cover position i with the last segment if a slope is left that
+         *keeps all its points within LEARNED_ERROR, else open a new one
+         **/
+        void addpoint(size_t i) {
+            segment& s = segments.back();
+            double dx = (double) firstkeys[i] - (double) s.start;
+            double dy = (double) (i - s.first);
+            if (dx <= 0) {
+                if (dy > LEARNED_ERROR)
+                    opensegment(i);
+                return;
+            }
+            double lo = (dy - LEARNED_ERROR) / dx;
+            double hi = (dy + LEARNED_ERROR) / dx;
+            if (lasthi >= 0) {
+                lo = std::max(lo, lastlo);
+                hi = std::min(hi, lasthi);
+            }
+            if (lo > hi) {
+                opensegment(i);
+                return;
+            }
+            lastlo = std::max(lo, 0.0);
+            lasthi = hi;
+            s.slope = (lastlo + lasthi) / 2;
+        }
+
+        void train() {
+            firstkeys.clear();
+            leaves.clear();
+            segments.clear();
+            for (leafNode* l = this->headleaf; l != NULL; l = l->nextLeaf) {
+                firstkeys.push_back(l->keySlots[0]);
+                leaves.push_back(l);
+            }
+            for (size_t i = 0; i < leaves.size(); i++) {
+                if (i == 0)
+                    opensegment(0);
+                else
+                    addpoint(i);
+            }
+            trainedfrees = this->leaffrees;
+            drift = 0;
+        }
+
+        inline bool trained() const {
+            return !leaves.empty() && (trainedfrees == this->leaffrees);
+        }
+
+        void retrainifdrifted() {
+            if ((drift > leaves.size() / 2) && (drift > RETRAIN_MIN))
+                train();
+        }
+
+        /**
+         *Pairs were moved into leaf l. A new last leaf right after the last
+         *one modelled is added to the model, anything else is drift.
+         **/
+        void moved(leafNode* l) {
+            this->rescan(l);
+            if (trained() && (l == this->tailleaf) && (l->prevLeaf == leaves.back())
+                    && (l->keyCount() > 0)) {
+                firstkeys.push_back(l->keySlots[0]);
+                leaves.push_back(l);
+                addpoint(leaves.size() - 1);
+            } else
+                drift++;
+        }
+
+        static void movedinto(void* arg, leafNode* l) {
+            static_cast<learned_btree*> (arg)->moved(l);
+        }
+
+        /**
+         *Leaf holding the first pair with key not less than k, or greater
+         *than k with upper, found through the model; NULL when it cannot
+         *tell and the tree has to be descended
+         **/
+        leafNode* route(const keytype& k, bool upper) {
+            if (!trained())
+                return NULL;
+            typename std::vector<segment>::iterator s =
+                    std::upper_bound(segments.begin(), segments.end(), k, segmentless());
+            if (s != segments.begin())
+                --s;
+            long n = leaves.size();
+            double p = s->first + s->slope * ((double) k - (double) s->start);
+            p = std::max(0.0, std::min(p, (double) n));
+            long lo = std::max(0L, (long) p - LEARNED_ERROR - 1);
+            long hi = std::min(n, (long) p + LEARNED_ERROR + 2);
+            typename std::vector<keytype>::iterator b = firstkeys.begin();
+            typename std::vector<keytype>::iterator f = upper
+                    ? std::upper_bound(b + lo, b + hi, k, this->keyless)
+                    : std::lower_bound(b + lo, b + hi, k, this->keyless);
+            //the leaf sits beyond the window, the drift moved it
+            if (((f == b + lo) && (lo > 0)) || ((f == b + hi) && (hi < n)))
+                f = upper ? std::upper_bound(b, b + n, k, this->keyless)
+                    : std::lower_bound(b, b + n, k, this->keyless);
+            leafNode* l = leaves[(f == b) ? 0 : (f - b - 1)];
+
+            for (int step = 0; step < ROUTE_STEPS; step++) {
+                leafNode* prev = l->prevLeaf;
+                if (prev != NULL) {
+                    const keytype& last = prev->keySlots[prev->keyCount() - 1];
+                    if (upper ? this->keyless(k, last) : !this->keyless(last, k)) {
+                        l = prev;
+                        continue;
+                    }
+                }
+                int slot = upper ? this->findKeyUpper(l, k) : this->findKeyLoc(l, k);
+                if ((slot == l->keyCount()) && (l->nextLeaf != NULL)) {
+                    l = l->nextLeaf;
+                    continue;
+                }
+                return l;
+            }
+            return NULL;
+        }
+
+    public:
+
+        inline learned_btree()
+        : lastlo(0), lasthi(-1), trainedfrees(0), drift(0) {
+            this->leafmoved = &learned_btree::movedinto;
+            this->leafmovedarg = this;
+        }
+
+        inline void clear() {
+            hash_type::clear();
+            train();
+        }
+
+        //leaves and segments in the model, 0 when it is not in use
+        inline size_t modelleaves() const {
+            return trained() ? leaves.size() : 0;
+        }
+
+        inline size_t modelsegments() const {
+            return trained() ? segments.size() : 0;
+        }
+
+        inline iterator lower_bound(keytype k) {
+            leafNode* l = this->leafof(k);
+            if (l != NULL)
+                return iterator(l, this->findKeyEqual(l, k));
+            l = route(k, false);
+            if (l != NULL)
+                return iterator(l, this->findKeyLoc(l, k));
+            return tree_type::lower_bound(k);
+        }
+
+        inline iterator upper_bound(keytype k) {
+            leafNode* l = route(k, true);
+            if (l != NULL)
+                return iterator(l, this->findKeyUpper(l, k));
+            return tree_type::upper_bound(k);
+        }
+
+        int insert(keytype k, data_type data) {
+            int r = hash_type::insert(k, data);
+            //the first leaf of a tree was not split off from anything
+            if ((r > 0) && leaves.empty())
+                train();
+            retrainifdrifted();
+            return r;
+        }
+
+        template <typename InputIterator>
+        void bulk_load(InputIterator first, InputIterator last) {
+            hash_type::bulk_load(first, last);
+            train();
+        }
+
+        int eraseslot(leafNode* l, int loc) {
+            int r = hash_type::eraseslot(l, loc);
+            retrainifdrifted();
+            return r;
+        }
+
+        int erase(keytype k) {
+            leafNode* l = this->leafof(k);
+            if (l == NULL)
+                return -1;
+            return eraseslot(l, this->findKeyEqual(l, k));
+        }
+
+        int erasepair(keytype k, data_type d) {
+            leafNode* l = this->leafof(k);
+            if (l == NULL)
+                return -1;
+            for (iterator it(l, this->findKeyEqual(l, k)); (it != this->end()) && this->keyequal(it.key(), k); ++it) {
+                if (it.data() == d)
+                    return eraseslot(it.getleafNode(), it.getslot());
+            }
+            return -1;
+        }
+    };
+}
+
+#endif
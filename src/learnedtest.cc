@@ -0,0 +1,102 @@
+/*
+ * Checks the lookups nwt::learned_btree routes through its model against
+ * a plain btree holding the same pairs. Stored keys are even, so every odd
+ * key, and those past either end, is one the table does not hold. This is
+ * done with a freshly trained model, after appends extend it, and through
+ * random inserts and erases that make it drift and free leaves, which turn
+ * it off until it is trained again.
+ *
+ *   make learnedtest && ./learnedtest
+ */
+
+#include <iostream>
+#include <stdlib.h>
+#include <stdint.h>
+#include <vector>
+#include "btree.h"
+#include "learnedbtree.h"
+#include "testutil.h"
+
+using namespace nwt;
+using namespace std;
+
+typedef learned_btree<int64_t, int64_t, 8, 8> learned_tree;
+typedef btree<int64_t, int64_t, 8, 8> plain_tree;
+
+/*
+ * lower_bound and upper_bound of the keys not stored, in and around the
+ * range of stored ones, and upper_bound of those stored
+ */
+static void compare(learned_tree &l, plain_tree &t, int64_t range)
+{
+    for (int64_t k = -3; k <= range + 3; k++) {
+        if (k % 2 != 0)
+            check(samepair(l.lower_bound(k), l.end(), t.lower_bound(k), t.end()), "lower_bound", k);
+        check(samepair(l.upper_bound(k), l.end(), t.upper_bound(k), t.end()), "upper_bound", k);
+    }
+    check(l.size() == t.size(), "size", range);
+}
+
+static void insert(learned_tree &l, plain_tree &t, int64_t k, int64_t d)
+{
+    check(l.insert(k, d) == t.insert(k, d), "insert", k);
+}
+
+static void erase(learned_tree &l, plain_tree &t, int64_t k)
+{
+    check((l.erase(k) < 0) == (t.erase(k) < 0), "erase", k);
+}
+
+int main()
+{
+    learned_tree l;
+    plain_tree t;
+    int64_t range = 20000;
+
+    srand(34234235);
+
+    //trained by bulk_load, two pairs of most keys
+    vector<pair<int64_t, int64_t> > pairs;
+    for (int64_t k = 0; k < range; k += 2) {
+        pairs.push_back(make_pair(k, (int64_t) 0));
+        if (k % 6 != 0)
+            pairs.push_back(make_pair(k, (int64_t) 1));
+    }
+    l.bulk_load(pairs.begin(), pairs.end());
+    for (size_t i = 0; i < pairs.size(); i++)
+        t.insert(pairs[i].first, pairs[i].second);
+    size_t leaves = l.modelleaves();
+    check(leaves > 0, "model after bulk_load", range);
+    compare(l, t, range);
+
+    //appends split only the last leaf, which extends the model
+    for (int64_t k = range; k < 2 * range; k += 2) {
+        insert(l, t, k, 0);
+        insert(l, t, k, 1);
+    }
+    range *= 2;
+    check(l.modelleaves() > leaves, "model after appends", range);
+    compare(l, t, range);
+
+    //splits and frees in the middle, looked up as the model drifts, is
+    //turned off and is trained again
+    bool off = false, retrained = false;
+    for (int round = 0; round < 40; round++) {
+        for (int i = 0; i < 1000; i++) {
+            int64_t k = 2 * (rand() % (range / 2));
+            if (round % 4 < 2)
+                insert(l, t, k, rand() % 8);
+            else
+                erase(l, t, k);
+        }
+        if (l.modelleaves() == 0)
+            off = true;
+        else if (off)
+            retrained = true;
+        compare(l, t, range);
+    }
+    check(off, "model turned off by freed leaves", range);
+    check(retrained, "model trained again", range);
+
+    return passed("learned_btree");
+}
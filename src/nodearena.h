@@ -0,0 +1,88 @@
+#ifndef _NODEARENA_H_
+#define _NODEARENA_H_
+
+#include <assert.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <vector>
+
+namespace nwt {
+
+    //32 bit name of a node in a node_arena, 0 stands for none
+    typedef uint32_t nodehandle_t;
+
+    /**
+     *Nodes of one type for one tree, handed out from chunks of ARENA_CHUNK
+     *nodes and named by a 32 bit handle instead of their address. Chunks
+     *are never moved or freed before clear, so a node's address stays
+     *good as long as the handle is allocated, and freed handles are reused
+     *before the arena grows.
+     *
+     *Handles count from 1 and leave the bits in tagmask alone, so an owner
+     *can tell the handles of two arenas apart by a bit of its own.
+     **/
+    template <typename _Node>
+    class node_arena {
+    public:
+        static const nodehandle_t ARENA_CHUNK_BITS = 8;
+        static const nodehandle_t ARENA_CHUNK = 1 << ARENA_CHUNK_BITS;
+
+    private:
+        std::vector<_Node*> chunks;
+        std::vector<nodehandle_t> freehandles;
+        //handles handed out so far, freed ones included
+        nodehandle_t used;
+        nodehandle_t tag;
+
+    public:
+
+        inline node_arena(nodehandle_t tagbits = 0)
+        : used(0), tag(tagbits) {
+        }
+
+        inline ~node_arena() {
+            clear();
+        }
+
+        //the node named by h, which must be allocated
+        inline _Node* at(nodehandle_t h) const {
+            nodehandle_t i = (h & ~tag) - 1;
+            return chunks[i >> ARENA_CHUNK_BITS] + (i & (ARENA_CHUNK - 1));
+        }
+
+        nodehandle_t allocate() {
+            if (!freehandles.empty()) {
+                nodehandle_t h = freehandles.back();
+                freehandles.pop_back();
+                return h;
+            }
+            if ((used & (ARENA_CHUNK - 1)) == 0)
+                chunks.push_back(new _Node[ARENA_CHUNK]);
+            used++;
+            //the tag bits are not free for handles
+            assert((used & tag) == 0);
+            return used | tag;
+        }
+
+        //the node keeps its contents until the handle is handed out again
+        inline void release(nodehandle_t h) {
+            freehandles.push_back(h);
+        }
+
+        //nodes allocated and not released
+        inline size_t size() const {
+            return used - freehandles.size();
+        }
+
+        //drop every node, handles given out before are no longer good
+        void clear() {
+            for (size_t i = 0; i < chunks.size(); i++)
+                delete [] chunks[i];
+            chunks.clear();
+            freehandles.clear();
+            used = 0;
+        }
+    };
+}
+
+#endif
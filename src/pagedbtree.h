@@ -0,0 +1,1085 @@
+#ifndef _PAGEDBTREE_H_
+#define _PAGEDBTREE_H_
+
+#include <stdint.h>
+#include <string.h>
+#include <algorithm>
+#include <functional>
+#include <utility>
+#include <vector>
+#include "bufferpool.h"
+
+namespace nwt {
+
+    /**
+     *A B+ tree kept in a file of fixed size pages and reached through a
+     *buffer_pool, for indexes larger than memory. Nodes refer to each other
+     *by page id instead of by pointer and are fixed in the pool only while
+     *an operation uses them, so the tree needs as much memory as the pool
+     *was given and no more. Inserts and lookups follow btree: the same
+     *descent rules for duplicate keys, the same leaf split and separator.
+     *
+     *Keys and data are copied into pages as bytes, so they must be plain
+     *fixed size types. Erasing does not merge nodes; a leaf left empty
+     *stays in the chain and is skipped, and is filled again by inserts
+     *that land in it. Like btree the tree is not thread safe, and changes
+     *invalidate iterators.
+     *
+     *Leaves not in the pool are read ahead where the tree knows it will
+     *need them: a range scan prefetches the next readahead leaves as it
+     *goes, and multiget prefetches the leaves of a batch of keys before
+     *looking any of them up, so their reads overlap.
+     *
+     *With _Buffered the tree is a B-epsilon tree for write heavy loads:
+     *each inner page gives half of itself to a buffer of pending inserts
+     *and erases. Changes are queued in the root's buffer, and a full
+     *buffer moves the messages bound for its busiest child down one level
+     *in a batch, so a leaf is read and written once for many changes
+     *rather than once each. get, exists and existspair merge the messages
+     *on the way to the leaf; range searches apply all pending messages
+     *first. Buffered files have their own magic, so neither mode opens a
+     *file written by the other.
+     **/
+    template <typename _Key, typename _Datatype, typename _Compare = std::less<_Key>, bool _Buffered = false>
+            class paged_btree {
+    public:
+        typedef _Key keytype;
+        typedef _Datatype data_type;
+        typedef _Compare key_compare;
+
+        static const size_t PAGE_SIZE = buffer_pool::PAGE_SIZE;
+
+        //frames an insert can have fixed at once, iterators not counted
+        static const size_t MIN_FRAMES = 8;
+
+        //leaves a range scan reads ahead of itself unless set otherwise
+        static const unsigned DEFAULT_READAHEAD = 8;
+
+        //pairs per leaf and keys per inner node that fill a page, or the
+        //half of it the buffer leaves
+        static const unsigned short bt_leafnodemax =
+                (PAGE_SIZE - 16) / (sizeof(_Key) + sizeof(_Datatype));
+        static const unsigned short bt_innernodemax =
+                ((_Buffered ? PAGE_SIZE / 2 : PAGE_SIZE) - 16) / (sizeof(_Key) + sizeof(pageid_t));
+
+    private:
+        //page 0
+        struct header {
+            char magic[8];
+            uint32_t keysize;
+            uint32_t datasize;
+            pageid_t root;
+            pageid_t headleaf;
+            pageid_t tailleaf;
+            //levels, leaves included
+            uint32_t height;
+            uint64_t count;
+        };
+
+        struct leafNode {
+            uint16_t level;
+            uint16_t slotsinuse;
+            pageid_t prevLeaf;
+            pageid_t nextLeaf;
+            _Key keySlots[bt_leafnodemax];
+            _Datatype dataSlots[bt_leafnodemax];
+        };
+
+        struct innerNode {
+            uint16_t level;
+            uint16_t slotsinuse;
+            _Key keySlots[bt_innernodemax];
+            //page of the subtree holding the keys before keySlots[i]
+            pageid_t firstChild[bt_innernodemax + 1];
+        };
+
+        static const uint32_t MSG_INSERT = 1;
+        //erase the first pair with the key
+        static const uint32_t MSG_ERASE = 2;
+        static const uint32_t MSG_ERASEPAIR = 3;
+
+        //a change waiting in a buffer in the buffered mode
+        struct message {
+            _Key key;
+            _Datatype data;
+            uint32_t op;
+        };
+
+        static const unsigned short bt_msgmax = (PAGE_SIZE / 2 - 8) / sizeof(message);
+
+        //the second half of an inner page in the buffered mode. Messages
+        //are kept in the order they arrived, and are older than those in
+        //the buffers above them.
+        struct msgbuffer {
+            uint16_t nmsgs;
+            message msgs[bt_msgmax];
+        };
+
+        //a node must fit a page
+        typedef char leaf_fits_page[(sizeof(leafNode) <= PAGE_SIZE) ? 1 : -1];
+        typedef char inner_fits_page[(sizeof(innerNode) <= (_Buffered ? PAGE_SIZE / 2 : PAGE_SIZE)) ? 1 : -1];
+        typedef char buffer_fits_page[(sizeof(msgbuffer) <= PAGE_SIZE / 2) ? 1 : -1];
+
+        static inline const char *paged_magic() {
+            return _Buffered ? "NWTBUFF1" : "NWTPAGE1";
+        }
+
+        static inline msgbuffer *bufferof(const innerNode *n) {
+            return reinterpret_cast<msgbuffer *> (reinterpret_cast<char *> (const_cast<innerNode *> (n)) + PAGE_SIZE / 2);
+        }
+
+        /**
+         *A page fixed in the pool for as long as this is in scope
+         **/
+        template <typename node_type>
+        class pinned {
+            buffer_pool *pool;
+            node_type *n;
+            bool dirty;
+
+            pinned(const pinned &);
+            pinned & operator=(const pinned &);
+
+        public:
+
+            inline pinned(buffer_pool *p, pageid_t id)
+            : pool(p), n(reinterpret_cast<node_type *> (p->fix(id))), dirty(false) {
+            }
+
+            //a new page, its id stored in *id
+            inline pinned(buffer_pool *p, pageid_t *id, bool)
+            : pool(p), n(reinterpret_cast<node_type *> (p->fixnew(id))), dirty(true) {
+            }
+
+            //a page the caller fixed
+            inline pinned(buffer_pool *p, node_type *fixed)
+            : pool(p), n(fixed), dirty(false) {
+            }
+
+            //no page yet, see fixnew
+            inline explicit pinned(buffer_pool *p)
+            : pool(p), n(NULL), dirty(false) {
+            }
+
+            inline ~pinned() {
+                if (n != NULL)
+                    pool->unfix(reinterpret_cast<char *> (n), dirty);
+            }
+
+            inline bool ok() const {
+                return n != NULL;
+            }
+
+            inline node_type *operator->() const {
+                return n;
+            }
+
+            //for the changes being made through it
+            inline node_type *write() {
+                dirty = true;
+                return n;
+            }
+
+            //fix a new page, its id stored in *id, in one holding none
+            inline bool fixnew(pageid_t *id) {
+                n = reinterpret_cast<node_type *> (pool->fixnew(id));
+                dirty = true;
+                return n != NULL;
+            }
+        };
+
+        buffer_pool pool;
+        //page 0 as of the last flush plus what changed since
+        header meta;
+        bool opened;
+        //root page, fixed for as long as it is the root
+        char *rootframe;
+        unsigned readahead;
+        key_compare keyless;
+
+        inline bool keyequal(const keytype &a, const keytype &b) const {
+            return !keyless(a, b) && !keyless(b, a);
+        }
+
+        inline bool keygreater(const keytype &a, const keytype &b) const {
+            return keyless(b, a);
+        }
+
+        //nodes fill a page, so slots are binary searched rather than
+        //scanned like btree's
+        inline int firstnotless(const keytype *keys, int n, const keytype &k) const {
+            return std::lower_bound(keys, keys + n, k, keyless) - keys;
+        }
+
+        inline int firstgreater(const keytype *keys, int n, const keytype &k) const {
+            return std::upper_bound(keys, keys + n, k, keyless) - keys;
+        }
+
+        /**
+         *Fix the page at level a search for k passes, leaves being level 1.
+         *With upper it descends right
+         *of the separators equal to k, to where a new pair with key k goes,
+         *and records the inner pages and child slots on the way in path;
+         *otherwise left of them, to the first key not less than k, as
+         *btree::find does. Children are fixed through their swizzled
+         *references and the root stays fixed, so a descent through resident
+         *pages never looks up the page hash.
+         **/
+        char *descendto(const keytype &k, bool upper, std::vector<std::pair<pageid_t, int> > *path,
+                uint32_t level) {
+            if (rootframe == NULL)
+                return NULL;
+            char *page = rootframe;
+            bool fixed = false;
+            for (uint32_t h = meta.height; h > level; h--) {
+                innerNode *n = reinterpret_cast<innerNode *> (page);
+                //keys equal to a separator can sit on both sides of it
+                int slot = upper ? firstgreater(n->keySlots, n->slotsinuse, k)
+                        : firstnotless(n->keySlots, n->slotsinuse, k);
+                if (path != NULL)
+                    path->push_back(std::make_pair(pool.pageid(page), slot));
+                char *child = pool.fixswip(&(n->firstChild[slot]), page);
+                if (fixed)
+                    pool.unfix(page, false);
+                if (child == NULL)
+                    return NULL;
+                page = child;
+                fixed = true;
+            }
+            //the root is the page asked for
+            if (!fixed)
+                pool.refix(page);
+            return page;
+        }
+
+        //fix the leaf a search for k ends in, see descendto
+        inline leafNode *descend(const keytype &k, bool upper, std::vector<std::pair<pageid_t, int> > *path) {
+            return reinterpret_cast<leafNode *> (descendto(k, upper, path, 1));
+        }
+
+        /**
+         *Page id of the leaf descend would fix, without fixing it, so it can
+         *be prefetched. 0 if an inner page could not be read.
+         **/
+        pageid_t leafof(const keytype &k, bool upper, std::vector<std::pair<pageid_t, int> > *path) {
+            if (meta.height <= 1)
+                return meta.root;
+            innerNode *n = reinterpret_cast<innerNode *> (descendto(k, upper, path, 2));
+            if (n == NULL)
+                return 0;
+            int slot = upper ? firstgreater(n->keySlots, n->slotsinuse, k)
+                    : firstnotless(n->keySlots, n->slotsinuse, k);
+            if (path != NULL)
+                path->push_back(std::make_pair(pool.pageid(reinterpret_cast<char *> (n)), slot));
+            pageid_t id = pool.unswip(n->firstChild[slot], false);
+            pool.unfix(reinterpret_cast<char *> (n), false);
+            return id;
+        }
+
+        /**
+         *Add the leaves under the children of inner page id from slot from
+         *on to ids, until it holds n. level is the page's, leaves being 1.
+         **/
+        void gatherleaves(pageid_t id, int from, uint32_t level, std::vector<pageid_t> &ids, size_t n) {
+            pinned<innerNode> in(&pool, id);
+            if (!in.ok())
+                return;
+            for (int i = from; (i <= in->slotsinuse) && (ids.size() < n); i++) {
+                pageid_t child = pool.unswip(in->firstChild[i], false);
+                if (level == 2)
+                    ids.push_back(child);
+                else
+                    gatherleaves(child, 0, level - 1, ids, n);
+            }
+        }
+
+        /**
+         *Prefetch the readahead leaves after the one a search for k ends
+         *in. The leaf chain only names one next leaf at a time, so they are
+         *taken from the inner pages right of the search path instead,
+         *nearest first.
+         **/
+        void prefetchafter(const keytype &k) {
+            std::vector<std::pair<pageid_t, int> > path;
+            std::vector<pageid_t> ids;
+            if ((readahead == 0) || (leafof(k, true, &path) == 0))
+                return;
+            for (size_t i = path.size(); (i-- > 0) && (ids.size() < readahead);)
+                gatherleaves(path[i].first, path[i].second + 1, meta.height - i, ids, readahead);
+            for (size_t i = 0; i < ids.size(); i++)
+                pool.prefetch(ids[i]);
+            pool.poll();
+        }
+
+        /**
+         *Make page id the root and keep it fixed
+         **/
+        bool setroot(pageid_t id) {
+            if (rootframe != NULL)
+                pool.unfix(rootframe, false);
+            rootframe = (id != 0) ? pool.fix(id) : NULL;
+            meta.root = id;
+            return (id == 0) || (rootframe != NULL);
+        }
+
+        /**
+         *Turn the swizzled child references of an inner page back into page
+         *ids, for the buffer_pool
+         **/
+        static void unswizzlechildren(char *page, int only, bool detach, buffer_pool *pool, void *) {
+            innerNode *n = reinterpret_cast<innerNode *> (page);
+            for (int i = 0; i <= n->slotsinuse; i++) {
+                uint32_t swip = n->firstChild[i];
+                if ((swip & buffer_pool::SWIZZLED)
+                        && ((only < 0) || (swip == ((uint32_t) only | buffer_pool::SWIZZLED))))
+                    n->firstChild[i] = pool->unswip(swip, detach);
+            }
+        }
+
+        /**
+         *Put separator k and its right child at slot of inner page id, where
+         *the child split off the one at firstChild[slot]. Splits the page
+         *and carries on up the path when it is full.
+         **/
+        bool insertinparent(std::vector<std::pair<pageid_t, int> > &path, keytype k, pageid_t right) {
+            while (!path.empty()) {
+                pageid_t id = path.back().first;
+                int slot = path.back().second;
+                path.pop_back();
+                pinned<innerNode> n(&pool, id);
+                if (!n.ok())
+                    return false;
+                innerNode *in = n.write();
+                //references moved within the page stay swizzled
+                if (in->slotsinuse < bt_innernodemax) {
+                    for (int i = in->slotsinuse; i > slot; i--) {
+                        in->keySlots[i] = in->keySlots[i - 1];
+                        in->firstChild[i + 1] = in->firstChild[i];
+                    }
+                    in->keySlots[slot] = k;
+                    in->firstChild[slot + 1] = right;
+                    in->slotsinuse++;
+                    return true;
+                }
+
+                //full: lay the keys and children out with the new ones in
+                //place, keep the left half, move the right half to a new
+                //page and push the key between them up. Half the children
+                //change parent, so none stays swizzled.
+                pool.unswizzle(reinterpret_cast<char *> (in));
+                std::vector<keytype> keys(in->keySlots, in->keySlots + in->slotsinuse);
+                std::vector<pageid_t> children(in->firstChild, in->firstChild + in->slotsinuse + 1);
+                keys.insert(keys.begin() + slot, k);
+                children.insert(children.begin() + slot + 1, right);
+                int half = keys.size() / 2;
+                pageid_t rid;
+                pinned<innerNode> r(&pool, &rid, true);
+                if (!r.ok())
+                    return false;
+                innerNode *rn = r.write();
+                rn->level = in->level;
+                in->slotsinuse = half;
+                for (int i = 0; i < half; i++) {
+                    in->keySlots[i] = keys[i];
+                    in->firstChild[i] = children[i];
+                }
+                in->firstChild[half] = children[half];
+                rn->slotsinuse = keys.size() - half - 1;
+                for (int i = 0; i < rn->slotsinuse; i++) {
+                    rn->keySlots[i] = keys[half + 1 + i];
+                    rn->firstChild[i] = children[half + 1 + i];
+                }
+                rn->firstChild[rn->slotsinuse] = children[keys.size()];
+                k = keys[half];
+                right = rid;
+                if (_Buffered) {
+                    //messages routed right of the pushed up key go along
+                    msgbuffer *lb = bufferof(in), *rb = bufferof(rn);
+                    int kept = 0;
+                    for (int i = 0; i < lb->nmsgs; i++) {
+                        if (keyless(lb->msgs[i].key, k))
+                            lb->msgs[kept++] = lb->msgs[i];
+                        else
+                            rb->msgs[rb->nmsgs++] = lb->msgs[i];
+                    }
+                    lb->nmsgs = kept;
+                }
+            }
+
+            //the root split, a new one goes over it
+            pageid_t rootid;
+            pinned<innerNode> root(&pool, &rootid, true);
+            if (!root.ok())
+                return false;
+            innerNode *rn = root.write();
+            rn->level = meta.height;
+            rn->slotsinuse = 1;
+            rn->keySlots[0] = k;
+            rn->firstChild[0] = meta.root;
+            rn->firstChild[1] = right;
+            meta.height++;
+            return setroot(rootid);
+        }
+
+    public:
+        /**
+         *Iterator over the pairs in key order. It keeps its leaf fixed in
+         *the pool, so the key and data it refers to stay put.
+         **/
+        class iterator {
+        public:
+            typedef iterator self;
+
+        private:
+            paged_btree *tree;
+            pageid_t currpage;
+            unsigned short currslot;
+            const leafNode *currnode;
+            //leaves to pass before reading ahead again
+            unsigned ahead;
+
+            void pin(pageid_t id) {
+                currpage = id;
+                currnode = (id != 0) ? reinterpret_cast<const leafNode *> (tree->pool.fix(id)) : NULL;
+                if (currnode == NULL)
+                    currpage = 0;
+            }
+
+            void unpin() {
+                if (currnode != NULL)
+                    tree->pool.unfix(reinterpret_cast<const char *> (currnode), false);
+                currnode = NULL;
+            }
+
+            //move on from a slot past the end of a leaf, over empty leaves.
+            //A scan reads the leaves after this one ahead, and again once
+            //it has passed half of them.
+            void settle(bool scan) {
+                while ((currnode != NULL) && (currslot >= currnode->slotsinuse)) {
+                    pageid_t next = currnode->nextLeaf;
+                    if (scan && (ahead > 0)) {
+                        ahead--;
+                    } else if (scan && (next != 0) && (currnode->slotsinuse > 0)) {
+                        tree->prefetchafter(currnode->keySlots[currnode->slotsinuse - 1]);
+                        ahead = tree->readahead / 2;
+                    }
+                    unpin();
+                    currslot = 0;
+                    pin(next);
+                }
+                if (currnode == NULL)
+                    currslot = 0;
+            }
+
+        public:
+
+            inline iterator()
+            : tree(NULL), currpage(0), currslot(0), currnode(NULL), ahead(0) {
+            }
+
+            inline iterator(paged_btree *t, pageid_t id, unsigned short s)
+            : tree(t), currpage(0), currslot(s), currnode(NULL), ahead(0) {
+                pin(id);
+                settle(false);
+            }
+
+            //an iterator on leaf l, which the caller fixed
+            inline iterator(paged_btree *t, const leafNode *l, unsigned short s)
+            : tree(t), currpage(0), currslot(s), currnode(l), ahead(0) {
+                if (l != NULL)
+                    currpage = t->pool.pageid(reinterpret_cast<const char *> (l));
+                settle(false);
+            }
+
+            inline iterator(const iterator &it)
+            : tree(it.tree), currpage(0), currslot(it.currslot), currnode(NULL), ahead(it.ahead) {
+                if (tree != NULL)
+                    pin(it.currpage);
+            }
+
+            inline iterator & operator=(const iterator &it) {
+                if (this != &it) {
+                    unpin();
+                    tree = it.tree;
+                    currslot = it.currslot;
+                    currpage = 0;
+                    ahead = it.ahead;
+                    if (tree != NULL)
+                        pin(it.currpage);
+                }
+                return *this;
+            }
+
+            inline ~iterator() {
+                unpin();
+            }
+
+            /// Key of the current slot
+
+            inline const keytype& key() const {
+                return currnode->keySlots[currslot];
+            }
+
+            /// Data of the current slot
+
+            inline const data_type& data() const {
+                return currnode->dataSlots[currslot];
+            }
+
+            inline pageid_t getleafpage() const {
+                return currpage;
+            }
+
+            inline unsigned short getslot() const {
+                return currslot;
+            }
+
+            /// Prefix++ advance the iterator to the next slot
+
+            inline self & operator++() {
+                ++currslot;
+                settle(true);
+                return *this;
+            }
+
+            /// Prefix-- move the iterator to the previous slot, from end()
+            /// to the last one
+
+            inline self & operator--() {
+                if (currnode == NULL) {
+                    pin(tree->meta.tailleaf);
+                    currslot = currnode ? currnode->slotsinuse : 0;
+                }
+                while ((currnode != NULL) && (currslot == 0) && (currnode->prevLeaf != 0)) {
+                    pageid_t prev = currnode->prevLeaf;
+                    unpin();
+                    pin(prev);
+                    currslot = currnode ? currnode->slotsinuse : 0;
+                }
+                if (currslot > 0)
+                    --currslot;
+                return *this;
+            }
+
+            inline bool operator==(const self& x) const {
+                return (x.currpage == currpage) && (x.currslot == currslot);
+            }
+
+            inline bool operator!=(const self& x) const {
+                return (x.currpage != currpage) || (x.currslot != currslot);
+            }
+        };
+
+        inline paged_btree()
+        : opened(false), rootframe(NULL), readahead(DEFAULT_READAHEAD) {
+            memset(&meta, 0, sizeof(meta));
+        }
+
+        inline ~paged_btree() {
+            close();
+        }
+
+        /**
+         *Open the tree in the file at path, or start an empty one there,
+         *with frames pages of memory. Returns false if the file holds
+         *something else. swizzle is there to measure what swizzling saves,
+         *and uring to read ahead through pread threads where io_uring is
+         *there.
+         **/
+        bool open(const char *path, size_t frames, bool swizzle = true, bool uring = true) {
+            close();
+            if (frames < MIN_FRAMES || !pool.open(path, frames, uring))
+                return false;
+            pool.setunswizzle(swizzle ? unswizzlechildren : NULL, NULL);
+            memset(&meta, 0, sizeof(meta));
+            if (pool.size() == 0) {
+                pageid_t id;
+                pinned<header> h(&pool, &id, true);
+                memcpy(meta.magic, paged_magic(), sizeof(meta.magic));
+                meta.keysize = sizeof(_Key);
+                meta.datasize = sizeof(_Datatype);
+                if (h.ok())
+                    *h.write() = meta;
+                opened = h.ok();
+            } else {
+                pinned<header> h(&pool, (pageid_t) 0);
+                opened = h.ok() && (memcmp(h->magic, paged_magic(), sizeof(meta.magic)) == 0)
+                        && (h->keysize == sizeof(_Key)) && (h->datasize == sizeof(_Datatype));
+                if (opened)
+                    meta = *(h.operator->());
+            }
+            if (opened && !setroot(meta.root)) {
+                opened = false;
+                rootframe = NULL;
+            }
+            if (!opened)
+                pool.close();
+            return opened;
+        }
+
+        /**
+         *Write back every changed page and the header
+         **/
+        bool flush() {
+            {
+                pinned<header> h(&pool, (pageid_t) 0);
+                if (!h.ok())
+                    return false;
+                *h.write() = meta;
+            }
+            return pool.flush();
+        }
+
+        bool close() {
+            if (!opened)
+                return true;
+            bool ok = flush();
+            if (rootframe != NULL)
+                pool.unfix(rootframe, false);
+            rootframe = NULL;
+            opened = false;
+            return pool.close() && ok;
+        }
+
+        //pairs in the leaves; in the buffered mode pending messages count
+        //once they reach them
+        inline size_t size() const {
+            return meta.count;
+        }
+
+        inline bool empty() const {
+            return meta.count == 0;
+        }
+
+        inline void getstats(buffer_pool::stats *out) const {
+            pool.getstats(out);
+        }
+
+        /**
+         *Leaves a range scan reads ahead, 0 for none
+         **/
+        inline void setreadahead(unsigned n) {
+            readahead = n;
+        }
+
+        inline bool usinguring() const {
+            return pool.usinguring();
+        }
+
+        inline iterator begin() {
+            if (_Buffered)
+                flushbuffers();
+            return iterator(this, meta.headleaf, 0);
+        }
+
+        inline iterator end() {
+            return iterator(this, (pageid_t) 0, 0);
+        }
+
+        /**
+         * Iterator to the first pair whose key is not less than k
+         **/
+        iterator lower_bound(const keytype &k) {
+            if (_Buffered)
+                flushbuffers();
+            return leafbound(k, false);
+        }
+
+        /**
+         * Iterator to the first pair whose key is greater than k
+         **/
+        iterator upper_bound(const keytype &k) {
+            if (_Buffered)
+                flushbuffers();
+            return leafbound(k, true);
+        }
+
+        inline bool exists(const keytype &k) {
+            if (_Buffered) {
+                std::vector<data_type> ds;
+                pairsof(k, ds);
+                return !ds.empty();
+            }
+            iterator it = leafbound(k, false);
+
+            return (it != end()) && keyequal(it.key(), k);
+        }
+
+        inline bool existspair(const keytype &k, const data_type &d) {
+            if (_Buffered) {
+                std::vector<data_type> ds;
+                pairsof(k, ds);
+                return std::find(ds.begin(), ds.end(), d) != ds.end();
+            }
+            return leafexistspair(k, d);
+        }
+
+        inline std::pair<data_type, bool> get(const keytype &k) {
+            if (_Buffered) {
+                std::vector<data_type> ds;
+                pairsof(k, ds);
+                if (ds.empty())
+                    return std::pair<data_type, bool>(data_type(), false);
+                return std::pair<data_type, bool>(ds[0], true);
+            }
+            iterator it = leafbound(k, false);
+
+            if ((it == end()) || !keyequal(it.key(), k))
+                return std::pair<data_type, bool>(data_type(), false);
+            return std::pair<data_type, bool>(it.data(), true);
+        }
+
+        /**
+         *get each of n keys into out. The leaves of up to PREFETCH_DEPTH
+         *keys at a time are prefetched before any of them is looked up, so
+         *a batch waits for about one read instead of one read per key.
+         **/
+        void multiget(const keytype *keys, size_t n, std::pair<data_type, bool> *out) {
+            for (size_t b = 0; b < n; b += buffer_pool::PREFETCH_DEPTH) {
+                size_t e = std::min(n, b + (size_t) buffer_pool::PREFETCH_DEPTH);
+                for (size_t i = b; i < e; i++) {
+                    pageid_t id = leafof(keys[i], false, NULL);
+                    if (id != 0)
+                        pool.prefetch(id);
+                }
+                pool.poll();
+                for (size_t i = b; i < e; i++)
+                    out[i] = get(keys[i]);
+            }
+        }
+
+        /**
+         *Insert a pair, returns 1, -2 if the identical pair is stored
+         *already, or -1 if a page could not be read or written. In the
+         *buffered mode the insert is queued and returns 1; an identical
+         *pair is dropped when the insert reaches the leaf.
+         **/
+        int insert(const keytype &k, const data_type &d) {
+            if (_Buffered && (meta.height > 1))
+                return enqueue(MSG_INSERT, k, d) ? 1 : -1;
+            return leafinsert(k, d);
+        }
+
+        /**
+         *Delete the first key that matches k. Returns 1 once it is erased,
+         *-1 if there was none or a page could not be read or written. In
+         *the buffered mode the erase is queued and returns 1; it does
+         *nothing if the key is gone when it reaches the leaf.
+         */
+        int erase(const keytype &k) {
+            if (_Buffered && (meta.height > 1))
+                return enqueue(MSG_ERASE, k, data_type()) ? 1 : -1;
+            return (leaferase(k) >= 0) ? 1 : -1;
+        }
+
+        /**
+         *erasepair - erase a key and a data pair from the tree. Returns
+         *like erase.
+         */
+        int erasepair(const keytype &k, const data_type &d) {
+            if (_Buffered && (meta.height > 1))
+                return enqueue(MSG_ERASEPAIR, k, d) ? 1 : -1;
+            return (leaferasepair(k, d) >= 0) ? 1 : -1;
+        }
+
+        /**
+         *Apply every pending message to the leaves, in the buffered mode.
+         *Buffers split off while draining are found by another pass.
+         **/
+        bool flushbuffers() {
+            if (!_Buffered)
+                return true;
+            for (bool again = true; again;) {
+                again = false;
+                //inner pages top down, so messages drain in one pass
+                std::vector<pageid_t> inner;
+                if (meta.height > 1)
+                    inner.push_back(meta.root);
+                for (size_t i = 0; i < inner.size(); i++) {
+                    pinned<innerNode> n(&pool, inner[i]);
+                    if (!n.ok())
+                        return false;
+                    if (n->level > 1) {
+                        for (int j = 0; j <= n->slotsinuse; j++)
+                            inner.push_back(pool.unswip(n->firstChild[j], false));
+                    }
+                }
+                for (size_t i = 0; i < inner.size(); i++) {
+                    for (;;) {
+                        pinned<innerNode> n(&pool, inner[i]);
+                        if (!n.ok())
+                            return false;
+                        if (bufferof(n.operator->())->nmsgs == 0)
+                            break;
+                        again = true;
+                        if (!flushfrom(inner[i]))
+                            return false;
+                    }
+                }
+            }
+            return true;
+        }
+
+        /**
+         *Remove slot loc of leaf page id
+         */
+        int eraseslot(pageid_t id, int loc) {
+            pinned<leafNode> l(&pool, id);
+            if (!l.ok() || loc >= l->slotsinuse)
+                return -1;
+            leafNode *ln = l.write();
+            for (int i = loc; i + 1 < ln->slotsinuse; i++) {
+                ln->keySlots[i] = ln->keySlots[i + 1];
+                ln->dataSlots[i] = ln->dataSlots[i + 1];
+            }
+            ln->slotsinuse--;
+            meta.count--;
+            return loc;
+        }
+
+    private:
+
+        iterator leafbound(const keytype &k, bool upper) {
+            leafNode *l = descend(k, upper, NULL);
+            if (l == NULL)
+                return end();
+            int slot = upper ? firstgreater(l->keySlots, l->slotsinuse, k)
+                    : firstnotless(l->keySlots, l->slotsinuse, k);
+            //past the end of the leaf the iterator moves on to the next one
+            //holding anything, which is where the first match is then
+            return iterator(this, l, slot);
+        }
+
+        bool leafexistspair(const keytype &k, const data_type &d) {
+            for (iterator it = leafbound(k, false); (it != end()) && keyequal(it.key(), k); ++it) {
+                if (it.data() == d)
+                    return true;
+            }
+            return false;
+        }
+
+        /**
+         *insert straight into the leaf
+         **/
+        int leafinsert(const keytype &k, const data_type &d) {
+            if (meta.root == 0) {
+                pageid_t id;
+                pinned<leafNode> l(&pool, &id, true);
+                if (!l.ok())
+                    return -1;
+                leafNode *ln = l.write();
+                ln->slotsinuse = 1;
+                ln->keySlots[0] = k;
+                ln->dataSlots[0] = d;
+                meta.headleaf = meta.tailleaf = id;
+                meta.height = 1;
+                meta.count = 1;
+                return setroot(id) ? 1 : -1;
+            }
+
+            //an identical key/data pair may only be stored once
+            if (leafexistspair(k, d))
+                return -2;
+
+            std::vector<std::pair<pageid_t, int> > path;
+            pinned<leafNode> l(&pool, descend(k, true, &path));
+            if (!l.ok())
+                return -1;
+            pageid_t id = pool.pageid(reinterpret_cast<char *> (l.operator->()));
+            leafNode *ln = l.write();
+            //the new right half of a split, fixed until the pair is in
+            pinned<leafNode> r(&pool);
+            if (ln->slotsinuse == bt_leafnodemax) {
+                //leafnode is full, split it and push the first key of the
+                //new right half up to the parent
+                pageid_t rid;
+                if (!r.fixnew(&rid))
+                    return -1;
+                leafNode *rn = r.write();
+                int half = ln->slotsinuse / 2;
+                for (int i = half; i < ln->slotsinuse; i++) {
+                    rn->keySlots[i - half] = ln->keySlots[i];
+                    rn->dataSlots[i - half] = ln->dataSlots[i];
+                }
+                rn->slotsinuse = ln->slotsinuse - half;
+                ln->slotsinuse = half;
+
+                //keep the leaf chain intact for range scans
+                rn->prevLeaf = id;
+                rn->nextLeaf = ln->nextLeaf;
+                if (ln->nextLeaf != 0) {
+                    pinned<leafNode> next(&pool, ln->nextLeaf);
+                    if (!next.ok())
+                        return -1;
+                    next.write()->prevLeaf = rid;
+                } else {
+                    meta.tailleaf = rid;
+                }
+                ln->nextLeaf = rid;
+                if (!keyless(k, rn->keySlots[0]))
+                    ln = rn;
+                if (!insertinparent(path, rn->keySlots[0], rid))
+                    return -1;
+            }
+
+            //behind any keys equal to k
+            int i = ln->slotsinuse;
+            int at = firstgreater(ln->keySlots, ln->slotsinuse, k);
+            for (; i > at; i--) {
+                ln->keySlots[i] = ln->keySlots[i - 1];
+                ln->dataSlots[i] = ln->dataSlots[i - 1];
+            }
+            ln->keySlots[i] = k;
+            ln->dataSlots[i] = d;
+            ln->slotsinuse++;
+            meta.count++;
+            return 1;
+        }
+
+        int leaferase(const keytype &k) {
+            iterator it = leafbound(k, false);
+
+            if ((it == end()) || !keyequal(it.key(), k))
+                return -1;
+            return eraseslot(it.getleafpage(), it.getslot());
+        }
+
+        int leaferasepair(const keytype &k, const data_type &d) {
+            for (iterator it = leafbound(k, false); (it != end()) && keyequal(it.key(), k); ++it) {
+                if (it.data() == d)
+                    return eraseslot(it.getleafpage(), it.getslot());
+            }
+            return -1;
+        }
+
+        /**
+         *The data of the pairs with key k in order, as they will be once
+         *the pending messages are applied. Those are all in the buffers
+         *on the path an insert of k takes, deeper ones older.
+         **/
+        void pairsof(const keytype &k, std::vector<data_type> &ds) {
+            std::vector<std::pair<pageid_t, int> > path;
+            if ((meta.height > 1) && (leafof(k, true, &path) == 0))
+                return;
+            for (iterator it = leafbound(k, false); (it != end()) && keyequal(it.key(), k); ++it)
+                ds.push_back(it.data());
+            for (size_t i = path.size(); i-- > 0;) {
+                pinned<innerNode> n(&pool, path[i].first);
+                if (!n.ok())
+                    return;
+                const msgbuffer *b = bufferof(n.operator->());
+                for (int j = 0; j < b->nmsgs; j++) {
+                    const message &m = b->msgs[j];
+                    if (!keyequal(m.key, k))
+                        continue;
+                    typename std::vector<data_type>::iterator at =
+                            (m.op == MSG_ERASE) ? ds.begin() : std::find(ds.begin(), ds.end(), m.data);
+                    if (m.op == MSG_INSERT) {
+                        if (at == ds.end())
+                            ds.push_back(m.data);
+                    } else if (at != ds.end()) {
+                        ds.erase(at);
+                    }
+                }
+            }
+        }
+
+        /**
+         *Queue a message in the root's buffer, making room first
+         **/
+        bool enqueue(uint32_t op, const keytype &k, const data_type &d) {
+            for (;;) {
+                {
+                    pinned<innerNode> r(&pool, meta.root);
+                    if (!r.ok())
+                        return false;
+                    if (bufferof(r.operator->())->nmsgs < bt_msgmax) {
+                        msgbuffer *b = bufferof(r.write());
+                        message &m = b->msgs[b->nmsgs++];
+                        m.key = k;
+                        m.data = d;
+                        m.op = op;
+                        return true;
+                    }
+                }
+                if (!flushfrom(meta.root))
+                    return false;
+            }
+        }
+
+        /**
+         *Move the messages of inner page id bound for the child most of
+         *them go to down into that child's buffer, or apply them to the
+         *leaf when the child is one. A child without room for them is
+         *flushed instead, so the caller repeats until id has the room it
+         *wants; every call moves some messages down a level.
+         **/
+        bool flushfrom(pageid_t id) {
+            std::vector<message> batch;
+            pageid_t child;
+            bool leaves;
+            {
+                pinned<innerNode> n(&pool, id);
+                if (!n.ok())
+                    return false;
+                const msgbuffer *b = bufferof(n.operator->());
+                if (b->nmsgs == 0)
+                    return true;
+                std::vector<int> counts(n->slotsinuse + 1, 0);
+                for (int i = 0; i < b->nmsgs; i++)
+                    counts[firstgreater(n->keySlots, n->slotsinuse, b->msgs[i].key)]++;
+                int c = std::max_element(counts.begin(), counts.end()) - counts.begin();
+                child = pool.unswip(n->firstChild[c], false);
+                leaves = (n->level == 1);
+                bool room = true;
+                if (!leaves) {
+                    pinned<innerNode> ch(&pool, child);
+                    if (!ch.ok())
+                        return false;
+                    room = bufferof(ch.operator->())->nmsgs + counts[c] <= bt_msgmax;
+                }
+                if (room) {
+                    //take the batch out, keeping the order of the rest
+                    msgbuffer *wb = bufferof(n.write());
+                    int kept = 0;
+                    for (int i = 0; i < wb->nmsgs; i++) {
+                        if (firstgreater(n->keySlots, n->slotsinuse, wb->msgs[i].key) == c)
+                            batch.push_back(wb->msgs[i]);
+                        else
+                            wb->msgs[kept++] = wb->msgs[i];
+                    }
+                    wb->nmsgs = kept;
+                }
+                if (room && !leaves) {
+                    //newer than the messages already there
+                    pinned<innerNode> ch(&pool, child);
+                    if (!ch.ok())
+                        return false;
+                    msgbuffer *cb = bufferof(ch.write());
+                    for (size_t i = 0; i < batch.size(); i++)
+                        cb->msgs[cb->nmsgs++] = batch[i];
+                    return true;
+                }
+            }
+
+            //the child has no room, make some there with nothing fixed here
+            if (!leaves)
+                return flushfrom(child);
+
+            //a batch for one leaf, applied with no inner page fixed, as the
+            //leaf may split up to the root
+            for (size_t i = 0; i < batch.size(); i++) {
+                const message &m = batch[i];
+                if ((m.op == MSG_INSERT) && (leafinsert(m.key, m.data) == -1))
+                    return false;
+                if (m.op == MSG_ERASE)
+                    leaferase(m.key);
+                if (m.op == MSG_ERASEPAIR)
+                    leaferasepair(m.key, m.data);
+            }
+            return true;
+        }
+    };
+}
+
+#endif
@@ -0,0 +1,236 @@
+/*
+ * Checks nwt::paged_btree against a std::multimap through random inserts,
+ * erases and erasepairs with many duplicate keys, in a pool so small that
+ * pages are evicted and read back all the time, and again after the file
+ * is closed and reopened. The buffered mode is checked the same way, with
+ * lookups made while changes are still queued. multiget and a scan reading
+ * ahead through a cold pool are checked in both modes.
+ *
+ *   make pagedtest && ./pagedtest
+ */
+
+#include <iostream>
+#include <map>
+#include <vector>
+#include <stdlib.h>
+#include <stdint.h>
+#include <unistd.h>
+#include "pagedbtree.h"
+#include "testutil.h"
+
+using namespace nwt;
+using namespace std;
+
+typedef multimap<int64_t, int64_t> reference;
+
+static const char *path = "pagedtest.dat";
+
+/*
+ * get and exists of keys stored and not stored, which in the buffered mode
+ * leave pending messages where they are
+ */
+template <typename tree_type>
+static void lookups(tree_type &t, reference &ref, int64_t range)
+{
+    for (int64_t k = -1; k <= range; k++) {
+        reference::iterator r = ref.lower_bound(k);
+        bool found = (r != ref.end()) && (r->first == k);
+        pair<int64_t, bool> g = t.get(k);
+        check(t.exists(k) == found, "exists", k);
+        check((g.second == found) && (!found || g.first == r->second), "get", k);
+    }
+}
+
+/*
+ * Every pair in the same order, duplicates included, and lookups
+ */
+template <typename tree_type>
+static void compare(tree_type &t, reference &ref, int64_t range)
+{
+    lookups(t, ref, range);
+    typename tree_type::iterator ti = t.begin();
+    reference::iterator ri = ref.begin();
+    for (; (ti != t.end()) && (ri != ref.end()); ++ti, ++ri)
+        check((ti.key() == ri->first) && (ti.data() == ri->second), "iteration", ri->first);
+    check((ti == t.end()) && (ri == ref.end()), "iteration length", (int64_t) ref.size());
+    check(t.size() == ref.size(), "size", (int64_t) ref.size());
+
+    for (int64_t k = -1; k <= range; k++) {
+        reference::iterator r = ref.lower_bound(k);
+        typename tree_type::iterator lb = t.lower_bound(k);
+        check((lb == t.end()) ? (r == ref.end()) : ((r != ref.end()) && (lb.key() == r->first)), "lower_bound", k);
+    }
+}
+
+/*
+ * ops random changes to the tree in the file at path, with frames pages of
+ * memory, checked against the reference as they go. Keys are drawn from
+ * range and data from datarange, so a key has up to datarange pairs.
+ *
+ * A buffered tree queues changes, and then returns 1 without knowing yet
+ * whether the insert is a duplicate or there is anything to erase.
+ */
+template <typename tree_type, bool buffered>
+static void randomized(size_t frames, int ops, int64_t range, int64_t datarange)
+{
+    reference ref;
+    tree_type t;
+
+    unlink(path);
+    if (!t.open(path, frames)) {
+        cout << "could not open " << path << endl;
+        fails++;
+        return;
+    }
+    for (int i = 0; i < ops; i++) {
+        int64_t k = rand() % range;
+        int64_t d = rand() % datarange;
+        int op = rand() % 10;
+        if (op < 6) {
+            bool stored = false;
+            for (reference::iterator r = ref.lower_bound(k); (r != ref.end()) && (r->first == k); ++r)
+                stored = stored || (r->second == d);
+            int ret = t.insert(k, d);
+            check((ret == (stored ? -2 : 1)) || (buffered && ret == 1), "insert", k);
+            if (!stored)
+                ref.insert(make_pair(k, d));
+        } else if (op < 8) {
+            reference::iterator r = ref.lower_bound(k);
+            bool found = (r != ref.end()) && (r->first == k);
+            int ret = t.erase(k);
+            check((ret == (found ? 1 : -1)) || (buffered && ret == 1), "erase", k);
+            if (found)
+                ref.erase(r);
+        } else {
+            reference::iterator r = ref.lower_bound(k);
+            while ((r != ref.end()) && (r->first == k) && (r->second != d))
+                ++r;
+            bool found = (r != ref.end()) && (r->first == k);
+            int ret = t.erasepair(k, d);
+            check((ret == (found ? 1 : -1)) || (buffered && ret == 1), "erasepair", k);
+            if (found)
+                ref.erase(r);
+        }
+        if ((i + 1) % (ops / 4) == 0) {
+            //with messages pending, then with all of them in the leaves
+            lookups(t, ref, range);
+            check(t.flushbuffers(), "flushbuffers", i);
+            compare(t, ref, range);
+        }
+    }
+
+    buffer_pool::stats s;
+    t.getstats(&s);
+    check(s.evictions > 0, "evictions", (int64_t) frames);
+
+    if (!t.close() || !t.open(path, frames)) {
+        cout << "could not reopen " << path << endl;
+        fails++;
+        return;
+    }
+    compare(t, ref, range);
+    t.close();
+    unlink(path);
+}
+
+/*
+ * A tree of ops random inserts, reopened with a cold pool of frames pages,
+ * must multiget every key in range, stored or not and in random order, the
+ * same as the reference, and then scan the same with ahead leaves read
+ * ahead. Both must have prefetched.
+ */
+template <typename tree_type>
+static void readahead(size_t frames, unsigned ahead, int ops, int64_t range, int64_t datarange)
+{
+    reference ref;
+    tree_type t;
+
+    unlink(path);
+    if (!t.open(path, frames)) {
+        cout << "could not open " << path << endl;
+        fails++;
+        return;
+    }
+    for (int i = 0; i < ops; i++) {
+        int64_t k = rand() % range;
+        int64_t d = rand() % datarange;
+        bool stored = false;
+        for (reference::iterator r = ref.lower_bound(k); (r != ref.end()) && (r->first == k); ++r)
+            stored = stored || (r->second == d);
+        check(t.insert(k, d) != -1, "insert", k);
+        if (!stored)
+            ref.insert(make_pair(k, d));
+    }
+    if (!t.close() || !t.open(path, frames)) {
+        cout << "could not reopen " << path << endl;
+        fails++;
+        return;
+    }
+    t.setreadahead(ahead);
+
+    vector<int64_t> keys;
+    for (int64_t k = -1; k <= range; k++)
+        keys.push_back(k);
+    for (size_t i = keys.size() - 1; i > 0; i--)
+        swap(keys[i], keys[rand() % (i + 1)]);
+    vector<pair<int64_t, bool> > out(keys.size());
+    t.multiget(&keys[0], keys.size(), &out[0]);
+    for (size_t i = 0; i < keys.size(); i++) {
+        reference::iterator r = ref.lower_bound(keys[i]);
+        bool found = (r != ref.end()) && (r->first == keys[i]);
+        check((out[i].second == found) && (!found || out[i].first == r->second), "multiget", keys[i]);
+    }
+    buffer_pool::stats got, scanned;
+    t.getstats(&got);
+    check(got.prefetches > 0, "multiget prefetches", (int64_t) frames);
+
+    compare(t, ref, range);
+    t.getstats(&scanned);
+    check(scanned.prefetches > got.prefetches, "scan prefetches", (int64_t) ahead);
+    t.close();
+    unlink(path);
+}
+
+/*
+ * A file written in one mode must not open in the other
+ */
+template <typename from_type, typename to_type>
+static void othermode()
+{
+    from_type f;
+    to_type t;
+
+    unlink(path);
+    if (!f.open(path, from_type::MIN_FRAMES) || (f.insert(1, 1) != 1) || !f.close()) {
+        cout << "could not write " << path << endl;
+        fails++;
+        return;
+    }
+    if (t.open(path, to_type::MIN_FRAMES)) {
+        cout << "opened a paged file written in the other mode" << endl;
+        fails++;
+    }
+    unlink(path);
+}
+
+int main()
+{
+    typedef paged_btree<int64_t, int64_t> unbuffered;
+    typedef paged_btree<int64_t, int64_t, std::less<int64_t>, true> buffered;
+
+    srand(34234235);
+
+    randomized<unbuffered, false>(unbuffered::MIN_FRAMES, 40000, 3000, 4);
+    //runs of one key over several leaves
+    randomized<unbuffered, false>(unbuffered::MIN_FRAMES + 4, 40000, 20, 1000);
+    randomized<buffered, true>(buffered::MIN_FRAMES, 40000, 3000, 4);
+    randomized<buffered, true>(buffered::MIN_FRAMES + 4, 40000, 20, 1000);
+
+    readahead<unbuffered>(unbuffered::MIN_FRAMES + 4, 4, 20000, 3000, 4);
+    readahead<buffered>(buffered::MIN_FRAMES + 4, 4, 20000, 3000, 4);
+
+    othermode<unbuffered, buffered>();
+    othermode<buffered, unbuffered>();
+
+    return passed("paged_btree");
+}
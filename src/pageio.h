@@ -0,0 +1,321 @@
+#ifndef _PAGEIO_H_
+#define _PAGEIO_H_
+
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <deque>
+#include <utility>
+#include <vector>
+
+#if defined(__linux__) && defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+#define NWT_HAVE_IO_URING
+#endif
+#endif
+
+#ifdef NWT_HAVE_IO_URING
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+#endif
+
+namespace nwt {
+
+    /**
+     *Reads of pages issued without waiting for them, many at a time. Reads
+     *go through io_uring where the kernel has it, otherwise to a few
+     *threads doing pread, so a caller that knows which pages it will need
+     *keeps up to depth of them in flight instead of one.
+     *
+     *Each read carries a tag that comes back with its completion. Used by
+     *one thread at a time, like the buffer_pool that owns it.
+     **/
+    class page_io {
+    public:
+        //a finished read: its tag and whether the whole length was read
+        typedef std::pair<int, bool> completion;
+
+    private:
+        struct request {
+            char *buf;
+            size_t len;
+            off_t off;
+            int tag;
+        };
+
+        int fd;
+        unsigned depth;
+        //reads submitted and not reaped yet
+        unsigned inflight;
+        //length of the read in flight for each tag, to check completions
+        std::vector<size_t> lengths;
+
+#ifdef NWT_HAVE_IO_URING
+        int ring;
+        char *sqmap;
+        size_t sqmaplen;
+        char *cqmap;
+        size_t cqmaplen;
+        struct io_uring_sqe *sqes;
+        size_t sqeslen;
+        unsigned *sqhead;
+        unsigned *sqtail;
+        unsigned *sqmask;
+        unsigned *sqarray;
+        unsigned *cqhead;
+        unsigned *cqtail;
+        unsigned *cqmask;
+        struct io_uring_cqe *cqes;
+        //sqes filled and not yet handed to the kernel
+        unsigned unsubmitted;
+
+        bool ringopen() {
+            struct io_uring_params p;
+            memset(&p, 0, sizeof(p));
+            ring = syscall(__NR_io_uring_setup, depth, &p);
+            if (ring < 0)
+                return false;
+            sqmaplen = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+            cqmaplen = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+            sqmap = static_cast<char *> (mmap(NULL, sqmaplen, PROT_READ | PROT_WRITE,
+                    MAP_SHARED | MAP_POPULATE, ring, IORING_OFF_SQ_RING));
+            cqmap = static_cast<char *> (mmap(NULL, cqmaplen, PROT_READ | PROT_WRITE,
+                    MAP_SHARED | MAP_POPULATE, ring, IORING_OFF_CQ_RING));
+            sqeslen = p.sq_entries * sizeof(struct io_uring_sqe);
+            sqes = static_cast<struct io_uring_sqe *> (mmap(NULL, sqeslen, PROT_READ | PROT_WRITE,
+                    MAP_SHARED | MAP_POPULATE, ring, IORING_OFF_SQES));
+            if (sqmap == MAP_FAILED || cqmap == MAP_FAILED || sqes == MAP_FAILED) {
+                ringclose();
+                return false;
+            }
+            sqhead = reinterpret_cast<unsigned *> (sqmap + p.sq_off.head);
+            sqtail = reinterpret_cast<unsigned *> (sqmap + p.sq_off.tail);
+            sqmask = reinterpret_cast<unsigned *> (sqmap + p.sq_off.ring_mask);
+            sqarray = reinterpret_cast<unsigned *> (sqmap + p.sq_off.array);
+            cqhead = reinterpret_cast<unsigned *> (cqmap + p.cq_off.head);
+            cqtail = reinterpret_cast<unsigned *> (cqmap + p.cq_off.tail);
+            cqmask = reinterpret_cast<unsigned *> (cqmap + p.cq_off.ring_mask);
+            cqes = reinterpret_cast<struct io_uring_cqe *> (cqmap + p.cq_off.cqes);
+            unsubmitted = 0;
+            return true;
+        }
+
+        void ringclose() {
+            if (sqmap != NULL && sqmap != MAP_FAILED)
+                munmap(sqmap, sqmaplen);
+            if (cqmap != NULL && cqmap != MAP_FAILED)
+                munmap(cqmap, cqmaplen);
+            if (sqes != NULL && sqes != MAP_FAILED)
+                munmap(sqes, sqeslen);
+            if (ring >= 0)
+                ::close(ring);
+            ring = -1;
+            sqmap = cqmap = NULL;
+            sqes = NULL;
+        }
+
+        bool ringsubmit(const request &r) {
+            unsigned tail = *sqtail;
+            unsigned i = tail & *sqmask;
+            struct io_uring_sqe *sqe = &sqes[i];
+            memset(sqe, 0, sizeof(*sqe));
+            sqe->opcode = IORING_OP_READ;
+            sqe->fd = fd;
+            sqe->addr = (uint64_t) (uintptr_t) r.buf;
+            sqe->len = r.len;
+            sqe->off = r.off;
+            sqe->user_data = (uint64_t) r.tag;
+            sqarray[i] = i;
+            //the kernel must see the sqe before the new tail
+            __sync_synchronize();
+            *sqtail = tail + 1;
+            unsubmitted++;
+            return true;
+        }
+
+        void ringreap(std::vector<completion> &done, bool wait) {
+            __sync_synchronize();
+            bool block = wait && inflight > 0 && *cqhead == *cqtail;
+            if (unsubmitted > 0 || block) {
+                int n = syscall(__NR_io_uring_enter, ring, unsubmitted, block ? 1 : 0,
+                        block ? IORING_ENTER_GETEVENTS : 0, NULL, 0);
+                if (n > 0)
+                    unsubmitted -= n;
+            }
+            __sync_synchronize();
+            unsigned head = *cqhead;
+            while (head != *cqtail) {
+                struct io_uring_cqe *cqe = &cqes[head & *cqmask];
+                int tag = (int) cqe->user_data;
+                done.push_back(completion(tag, cqe->res == (int) lengths[tag]));
+                head++;
+                inflight--;
+            }
+            __sync_synchronize();
+            *cqhead = head;
+        }
+#endif
+
+        //pread threads, when there is no io_uring
+        std::vector<pthread_t> threads;
+        pthread_mutex_t lock;
+        pthread_cond_t queued;
+        pthread_cond_t finished;
+        std::deque<request> queue;
+        std::vector<completion> results;
+        bool stopping;
+
+        static void *worker(void *arg) {
+            page_io *io = static_cast<page_io *> (arg);
+            pthread_mutex_lock(&io->lock);
+            for (;;) {
+                while (io->queue.empty() && !io->stopping)
+                    pthread_cond_wait(&io->queued, &io->lock);
+                if (io->queue.empty())
+                    break;
+                request r = io->queue.front();
+                io->queue.pop_front();
+                pthread_mutex_unlock(&io->lock);
+                ssize_t n = pread(io->fd, r.buf, r.len, r.off);
+                pthread_mutex_lock(&io->lock);
+                io->results.push_back(completion(r.tag, n == (ssize_t) r.len));
+                pthread_cond_signal(&io->finished);
+            }
+            pthread_mutex_unlock(&io->lock);
+            return NULL;
+        }
+
+    public:
+        //pread threads used without io_uring
+        static const int IO_THREADS = 4;
+
+        inline page_io()
+        : fd(-1), depth(0), inflight(0), stopping(false) {
+#ifdef NWT_HAVE_IO_URING
+            ring = -1;
+            sqmap = cqmap = NULL;
+            sqes = NULL;
+#endif
+            pthread_mutex_init(&lock, NULL);
+            pthread_cond_init(&queued, NULL);
+            pthread_cond_init(&finished, NULL);
+        }
+
+        inline ~page_io() {
+            close();
+            pthread_mutex_destroy(&lock);
+            pthread_cond_destroy(&queued);
+            pthread_cond_destroy(&finished);
+        }
+
+        /**
+         *Read from file descriptor f with up to d reads in flight. Tags
+         *must be below maxtag. With uring false the pread threads are used
+         *even where io_uring is there.
+         **/
+        bool open(int f, unsigned d, int maxtag, bool uring = true) {
+            close();
+            fd = f;
+            depth = d;
+            inflight = 0;
+            lengths.assign(maxtag, 0);
+#ifdef NWT_HAVE_IO_URING
+            if (uring && ringopen())
+                return true;
+#else
+            (void) uring;
+#endif
+            stopping = false;
+            for (int i = 0; i < IO_THREADS; i++) {
+                pthread_t th;
+                if (pthread_create(&th, NULL, worker, this) == 0)
+                    threads.push_back(th);
+            }
+            return !threads.empty();
+        }
+
+        /**
+         *Wait for the reads in flight and stop
+         **/
+        void close() {
+            std::vector<completion> done;
+            while (inflight > 0)
+                reap(done, true);
+#ifdef NWT_HAVE_IO_URING
+            ringclose();
+#endif
+            pthread_mutex_lock(&lock);
+            stopping = true;
+            pthread_cond_broadcast(&queued);
+            pthread_mutex_unlock(&lock);
+            for (size_t i = 0; i < threads.size(); i++)
+                pthread_join(threads[i], NULL);
+            threads.clear();
+            fd = -1;
+        }
+
+        inline bool usinguring() const {
+#ifdef NWT_HAVE_IO_URING
+            return ring >= 0;
+#else
+            return false;
+#endif
+        }
+
+        //false when depth reads are in flight already
+        inline bool full() const {
+            return inflight >= depth;
+        }
+
+        inline unsigned pending() const {
+            return inflight;
+        }
+
+        /**
+         *Start reading len bytes at off into buf. The read is on its way by
+         *the next reap.
+         **/
+        bool submit(char *buf, size_t len, off_t off, int tag) {
+            if (full() || fd < 0)
+                return false;
+            request r = { buf, len, off, tag };
+            lengths[tag] = len;
+            inflight++;
+#ifdef NWT_HAVE_IO_URING
+            if (ring >= 0)
+                return ringsubmit(r);
+#endif
+            pthread_mutex_lock(&lock);
+            queue.push_back(r);
+            pthread_cond_signal(&queued);
+            pthread_mutex_unlock(&lock);
+            return true;
+        }
+
+        /**
+         *Hand submitted reads to the kernel and collect the finished ones
+         *into done; with wait, block until at least one finished if any
+         *is in flight
+         **/
+        void reap(std::vector<completion> &done, bool wait) {
+#ifdef NWT_HAVE_IO_URING
+            if (ring >= 0) {
+                ringreap(done, wait);
+                return;
+            }
+#endif
+            pthread_mutex_lock(&lock);
+            while (wait && results.empty() && inflight > 0)
+                pthread_cond_wait(&finished, &lock);
+            inflight -= results.size();
+            done.insert(done.end(), results.begin(), results.end());
+            results.clear();
+            pthread_mutex_unlock(&lock);
+        }
+    };
+}
+
+#endif
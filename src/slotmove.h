@@ -0,0 +1,67 @@
+#ifndef _SLOTMOVE_H_
+#define _SLOTMOVE_H_
+
+#include <stddef.h>
+#include <string.h>
+#include <string>
+
+namespace nwt {
+
+    /**
+     *Moves keys or data between the slots of tree nodes, within one node
+     *when a pair is added or removed and between two on a split or merge.
+     *The slots moved from are left holding something unspecified, which
+     *the tree overwrites or resets.
+     *
+     *Anything copied byte for byte, like integers and pointers, is moved
+     *with one memmove. Other types are assigned slot by slot, unless they
+     *are swappable in constant time, see slot_swapper.
+     **/
+    template <typename T, bool _Trivial = __is_trivially_copyable(T)>
+    struct slot_mover {
+
+        //move n slots from src to dst, the two may overlap
+        static inline void move(T* dst, T* src, size_t n) {
+            if (dst < src) {
+                for (size_t i = 0; i < n; i++)
+                    dst[i] = src[i];
+            } else if (dst > src) {
+                for (size_t i = n; i > 0; i--)
+                    dst[i - 1] = src[i - 1];
+            }
+        }
+    };
+
+    template <typename T>
+    struct slot_mover<T, true> {
+
+        static inline void move(T* dst, T* src, size_t n) {
+            memmove(dst, src, n * sizeof(T));
+        }
+    };
+
+    /**
+     *slot_mover for types whose swap member hands their buffers over, so
+     *a string is moved without copying its characters. A type opts in by
+     *specializing slot_mover to derive from this.
+     **/
+    template <typename T>
+    struct slot_swapper {
+
+        static inline void move(T* dst, T* src, size_t n) {
+            if (dst < src) {
+                for (size_t i = 0; i < n; i++)
+                    dst[i].swap(src[i]);
+            } else if (dst > src) {
+                for (size_t i = n; i > 0; i--)
+                    dst[i - 1].swap(src[i - 1]);
+            }
+        }
+    };
+
+    template <>
+    struct slot_mover<std::string, false> : public slot_swapper<std::string> {
+    };
+}
+
+#endif
@@ -0,0 +1,84 @@
+/*
+ * Checks that slot_mover shifts slots of strings and of the index's
+ * PayloadVersions, which move by swapping, both ways over overlapping
+ * ranges of every length and distance, and leaves every value moved in its
+ * new slot and those not moved where they were. Payloads are long enough
+ * to live on the heap, so a swap that lost a buffer shows.
+ *
+ *   make slottest && ./slottest
+ */
+
+#include <iostream>
+#include <string>
+#include <vector>
+#include <stdio.h>
+#include "slotmove.h"
+#include "testutil.h"
+#include "../bptree.h"
+
+using namespace nwt;
+using namespace std;
+
+static const int SLOTS = 16;
+
+static string value(int i)
+{
+    char b[64];
+    snprintf(b, sizeof(b), "payload %d, long enough not to fit in the string", i);
+    return b;
+}
+
+static void fill(string *s)
+{
+    for (int i = 0; i < SLOTS; i++)
+        s[i] = value(i);
+}
+
+static void fill(PayloadVersion *v)
+{
+    for (int i = 0; i < SLOTS; i++)
+        v[i] = PayloadVersion(value(i), i, 100 + i);
+}
+
+static bool holds(const string *s, int at, int i)
+{
+    return s[at] == value(i);
+}
+
+static bool holds(const PayloadVersion *v, int at, int i)
+{
+    return (v[at].payload == value(i)) && (v[at].beginTs == (uint64_t) i)
+            && (v[at].endTs == (uint64_t) (100 + i));
+}
+
+/*
+ * n slots from src to dst for every n, src and dst that fit, checking the
+ * moved slots and those neither moved from nor to
+ */
+template <typename T>
+static void shifts(const char *what)
+{
+    for (int n = 0; n <= SLOTS; n++) {
+        for (int src = 0; src + n <= SLOTS; src++) {
+            for (int dst = 0; dst + n <= SLOTS; dst++) {
+                T slots[SLOTS];
+                fill(slots);
+                slot_mover<T>::move(slots + dst, slots + src, n);
+                for (int i = 0; i < n; i++)
+                    check(holds(slots, dst + i, src + i), what, dst + i);
+                for (int i = 0; i < SLOTS; i++) {
+                    if (((i < src) || (i >= src + n)) && ((i < dst) || (i >= dst + n)))
+                        check(holds(slots, i, i), what, i);
+                }
+            }
+        }
+    }
+}
+
+int main()
+{
+    shifts<string>("string");
+    shifts<PayloadVersion>("PayloadVersion");
+
+    return passed("slot_mover");
+}
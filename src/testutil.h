@@ -0,0 +1,57 @@
+#ifndef _TESTUTIL_H_
+#define _TESTUTIL_H_
+
+#include <iostream>
+#include <string>
+#include <stdio.h>
+#include <stdint.h>
+
+/**
+ *What the tests of the trees in this directory share. Each is one
+ *program: a check that fails is printed and counted, and main ends with
+ *passed.
+ **/
+
+static int fails = 0;
+
+//what is a lookup or an operation, at the key, slot or phase it was made at
+static void check(bool ok, const char *what, int64_t at)
+{
+    if (!ok) {
+        std::cout << what << " differs at " << at << std::endl;
+        fails++;
+    }
+}
+
+//what main returns, after saying so if nothing failed
+static int passed(const char *tree)
+{
+    if (fails == 0)
+        std::cout << tree << " tests passed" << std::endl;
+    return fails == 0 ? 0 : 1;
+}
+
+//i as a key of the trees under test
+static inline int64_t intkey(int i)
+{
+    return i;
+}
+
+//i as a string key sorting the same as intkey(i) for i from 0 to 99999
+static inline std::string stringkey(int i)
+{
+    char b[16];
+    snprintf(b, sizeof(b), "k%05d", i);
+    return b;
+}
+
+//both at the end, or at the same pair
+template <typename A, typename B>
+static bool samepair(A a, A aend, B b, B bend)
+{
+    if ((a == aend) || (b == bend))
+        return (a == aend) && (b == bend);
+    return (a.key() == b.key()) && (a.data() == b.data());
+}
+
+#endif
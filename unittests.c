@@ -31,12 +31,46 @@ This is version 1.0, released December 12, 2008.
 
 #import "server.h"
 
+#include <dirent.h>
 #include <pthread.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <time.h>
 #include <unistd.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+
+/*
+ Extensions of this implementation, declared in bptree.h and wal.h
+ */
+typedef enum IsolationLevel { SNAPSHOT_ISOLATION, SERIALIZABLE, OPTIMISTIC, READ_ONLY } IsolationLevel;
+typedef enum WalDurability { WAL_SYNC, WAL_GROUP, WAL_ASYNC } WalDurability;
+ErrCode setIsolationLevel(TxnState *txn, IsolationLevel level);
+ErrCode setDurability(WalDurability level);
+
+typedef struct RecoveryStats
+{
+    uint64_t frames;
+    uint64_t writes;
+    uint64_t versions;
+    int threads;
+    uint64_t nanos;
+} RecoveryStats;
+
+void getRecoveryStats(RecoveryStats *stats);
+ErrCode checkpoint();
+
+typedef struct CheckpointStats
+{
+    uint64_t checkpoints;
+    uint64_t pagesWritten;
+    uint64_t pagesKept;
+    uint64_t bytes;
+    uint64_t nanos;
+} CheckpointStats;
+
+void getCheckpointStats(CheckpointStats *stats);
 
 IdxState *idx;
 
@@ -252,6 +286,1337 @@ static void *secondary_index_func()
     return NULL;
 }
 
+static void make_key(Key *k, const char *s)
+{
+    k->type = VARCHAR;
+    memcpy(k->keyval.charkey, s, strlen(s)+1);
+}
+
+/*
+ Whether the pair (k, payload) is seen through txn, or outside of a transaction when txn is NULL.
+ */
+static int has_record(IdxState *idx, TxnState *txn, Key *k, const char *payload)
+{
+    Record record;
+    memset(&record, 0, sizeof(Record));
+    record.key = *k;
+    if (get(idx, txn, &record) != SUCCESS)
+        return 0;
+    do {
+        if (strcmp(k->keyval.charkey, record.key.keyval.charkey) != 0)
+            return 0;
+        if (strcmp(payload, record.payload) == 0)
+            return 1;
+    } while (getNext(idx, txn, &record) == SUCCESS);
+    return 0;
+}
+
+/*
+ Aborting a transaction must drop both the entries it inserted and the deletes it made, while
+ the transaction itself saw them.
+ */
+static int abort_test(void)
+{
+    IdxState *idx;
+    TxnState *txn;
+    Record record;
+    Key k_a, k_b;
+    make_key(&k_a, a_key);
+    make_key(&k_b, b_key);
+
+    if (create(VARCHAR, "abort_index") != SUCCESS || openIndex("abort_index", &idx) != SUCCESS) {
+        printf("could not create abort_index\n");
+        return 1;
+    }
+    if (insertRecord(idx, NULL, &k_a, value_one) != SUCCESS) {
+        printf("could not insert (a,1) into abort_index\n");
+        return 1;
+    }
+
+    if (beginTransaction(&txn) != SUCCESS) {
+        printf("could not begin abort test transaction\n");
+        return 1;
+    }
+    memset(&record, 0, sizeof(Record));
+    record.key = k_a;
+    memcpy(record.payload, value_one, strlen(value_one)+1);
+    if (insertRecord(idx, txn, &k_b, value_one) != SUCCESS || deleteRecord(idx, txn, &record) != SUCCESS) {
+        printf("could not write in abort test transaction\n");
+        return 1;
+    }
+    if (!has_record(idx, txn, &k_b, value_one) || has_record(idx, txn, &k_a, value_one)) {
+        printf("abort test transaction does not see its own writes\n");
+        return 1;
+    }
+    if (abortTransaction(txn) != SUCCESS) {
+        printf("could not abort abort test transaction\n");
+        return 1;
+    }
+
+    //the delete of (a,1) and the insert of (b,1) are both gone
+    if (!has_record(idx, NULL, &k_a, value_one)) {
+        printf("aborted delete of (a,1) was applied\n");
+        return 1;
+    }
+    memset(&record, 0, sizeof(Record));
+    record.key = k_b;
+    if (get(idx, NULL, &record) != KEY_NOTFOUND) {
+        printf("aborted insert of (b,1) was applied\n");
+        return 1;
+    }
+    closeIndex(idx);
+    return 0;
+}
+
+static int dirty_read_result;
+
+/*
+ Runs while the main thread holds an uncommitted transaction that inserted (c,1) and deleted (a,1)
+ from isolation_index. Neither change may be seen, inside a transaction or outside of one.
+ */
+static void *dirty_read_func()
+{
+    IdxState *idx;
+    TxnState *txn;
+    Key k_a, k_c;
+    make_key(&k_a, a_key);
+    make_key(&k_c, c_key);
+
+    dirty_read_result = 1;
+    if (openIndex("isolation_index", &idx) != SUCCESS) {
+        printf("cannot open isolation_index from reader thread\n");
+        return NULL;
+    }
+    if (has_record(idx, NULL, &k_c, value_one) || !has_record(idx, NULL, &k_a, value_one)) {
+        printf("read outside of a transaction saw uncommitted changes\n");
+        return NULL;
+    }
+    if (beginTransaction(&txn) != SUCCESS) {
+        printf("could not begin reader transaction\n");
+        return NULL;
+    }
+    if (has_record(idx, txn, &k_c, value_one) || !has_record(idx, txn, &k_a, value_one)) {
+        printf("reader transaction saw uncommitted changes\n");
+        return NULL;
+    }
+    if (commitTransaction(txn) != SUCCESS) {
+        printf("could not commit reader transaction\n");
+        return NULL;
+    }
+    closeIndex(idx);
+    dirty_read_result = 0;
+    return NULL;
+}
+
+/*
+ Another thread never sees the entries of a transaction that has not committed yet, and sees all
+ of them once it did.
+ */
+static int dirty_read_test(void)
+{
+    IdxState *idx;
+    TxnState *txn;
+    Record record;
+    Key k_a, k_c;
+    pthread_t reader;
+    make_key(&k_a, a_key);
+    make_key(&k_c, c_key);
+
+    if (create(VARCHAR, "isolation_index") != SUCCESS || openIndex("isolation_index", &idx) != SUCCESS) {
+        printf("could not create isolation_index\n");
+        return 1;
+    }
+    if (insertRecord(idx, NULL, &k_a, value_one) != SUCCESS) {
+        printf("could not insert (a,1) into isolation_index\n");
+        return 1;
+    }
+    if (beginTransaction(&txn) != SUCCESS) {
+        printf("could not begin writer transaction\n");
+        return 1;
+    }
+    memset(&record, 0, sizeof(Record));
+    record.key = k_a;
+    memcpy(record.payload, value_one, strlen(value_one)+1);
+    if (insertRecord(idx, txn, &k_c, value_one) != SUCCESS || deleteRecord(idx, txn, &record) != SUCCESS) {
+        printf("could not write in writer transaction\n");
+        return 1;
+    }
+    if (pthread_create(&reader, NULL, dirty_read_func, NULL) != 0)
+        return 1;
+    pthread_join(reader, NULL);
+    if (dirty_read_result != 0)
+        return 1;
+    if (commitTransaction(txn) != SUCCESS) {
+        printf("could not commit writer transaction\n");
+        return 1;
+    }
+    if (!has_record(idx, NULL, &k_c, value_one) || has_record(idx, NULL, &k_a, value_one)) {
+        printf("committed changes to isolation_index are not seen\n");
+        return 1;
+    }
+    closeIndex(idx);
+    return 0;
+}
+
+/*
+ A transaction writing two indexes commits in both or in neither. Its delete from right_index is
+ overtaken by another delete of the same entry, so its commit must fail and leave its insert into
+ left_index out as well.
+ */
+static int two_index_test(void)
+{
+    IdxState *left, *right;
+    TxnState *txn;
+    Record record;
+    Key k_a, k_b;
+    make_key(&k_a, a_key);
+    make_key(&k_b, b_key);
+
+    if (create(VARCHAR, "left_index") != SUCCESS || openIndex("left_index", &left) != SUCCESS ||
+        create(VARCHAR, "right_index") != SUCCESS || openIndex("right_index", &right) != SUCCESS) {
+        printf("could not create left_index and right_index\n");
+        return 1;
+    }
+    if (insertRecord(right, NULL, &k_a, value_one) != SUCCESS) {
+        printf("could not insert (a,1) into right_index\n");
+        return 1;
+    }
+
+    if (beginTransaction(&txn) != SUCCESS) {
+        printf("could not begin two index transaction\n");
+        return 1;
+    }
+    //(a,1) is gone once the transaction took its snapshot
+    memset(&record, 0, sizeof(Record));
+    record.key = k_a;
+    memcpy(record.payload, value_one, strlen(value_one)+1);
+    if (deleteRecord(right, NULL, &record) != SUCCESS) {
+        printf("could not delete (a,1) from right_index\n");
+        return 1;
+    }
+    if (insertRecord(left, txn, &k_b, value_one) != SUCCESS || deleteRecord(right, txn, &record) != SUCCESS) {
+        printf("could not write in two index transaction\n");
+        return 1;
+    }
+    if (commitTransaction(txn) != DEADLOCK) {
+        printf("two index transaction committed over a conflicting delete\n");
+        return 1;
+    }
+    if (abortTransaction(txn) != SUCCESS) {
+        printf("could not abort two index transaction\n");
+        return 1;
+    }
+    memset(&record, 0, sizeof(Record));
+    record.key = k_b;
+    if (get(left, NULL, &record) != KEY_NOTFOUND) {
+        printf("failed two index commit left (b,1) in left_index\n");
+        return 1;
+    }
+
+    //without a conflict both writes are seen
+    if (beginTransaction(&txn) != SUCCESS) {
+        printf("could not begin two index transaction\n");
+        return 1;
+    }
+    if (insertRecord(left, txn, &k_b, value_one) != SUCCESS || insertRecord(right, txn, &k_b, value_two) != SUCCESS) {
+        printf("could not write in two index transaction\n");
+        return 1;
+    }
+    if (commitTransaction(txn) != SUCCESS) {
+        printf("could not commit two index transaction\n");
+        return 1;
+    }
+    if (!has_record(left, NULL, &k_b, value_one) || !has_record(right, NULL, &k_b, value_two)) {
+        printf("two index commit is missing from one of the indexes\n");
+        return 1;
+    }
+    closeIndex(left);
+    closeIndex(right);
+    return 0;
+}
+
+
+#define CONFLICT_TEST_INDEXES 3
+
+/*
+ A commit checks every index it writes before it changes any. A transaction inserts (b,1) into
+ and deletes (a,1) from three indexes, one of which had (a,1) deleted under it, and must leave
+ the other two as they were whichever of them conflicts.
+ */
+static int index_conflict_test(void)
+{
+    IdxState *idx[CONFLICT_TEST_INDEXES];
+    TxnState *txn;
+    Record record;
+    Key k_a, k_b;
+    char name[32];
+    int conflict, i;
+    make_key(&k_a, a_key);
+    make_key(&k_b, b_key);
+    memset(&record, 0, sizeof(Record));
+    record.key = k_a;
+    memcpy(record.payload, value_one, strlen(value_one)+1);
+
+    for (conflict = 0; conflict < CONFLICT_TEST_INDEXES; conflict++) {
+        for (i = 0; i < CONFLICT_TEST_INDEXES; i++) {
+            snprintf(name, sizeof(name), "conflict_index_%d_%d", conflict, i);
+            if (create(VARCHAR, name) != SUCCESS || openIndex(name, &idx[i]) != SUCCESS ||
+                insertRecord(idx[i], NULL, &k_a, value_one) != SUCCESS) {
+                printf("could not create %s\n", name);
+                return 1;
+            }
+        }
+        if (beginTransaction(&txn) != SUCCESS) {
+            printf("could not begin conflicting transaction\n");
+            return 1;
+        }
+        if (deleteRecord(idx[conflict], NULL, &record) != SUCCESS) {
+            printf("could not delete (a,1) from conflict_index_%d_%d\n", conflict, conflict);
+            return 1;
+        }
+        for (i = 0; i < CONFLICT_TEST_INDEXES; i++) {
+            if (insertRecord(idx[i], txn, &k_b, value_one) != SUCCESS || deleteRecord(idx[i], txn, &record) != SUCCESS) {
+                printf("could not write in conflicting transaction\n");
+                return 1;
+            }
+        }
+        if (commitTransaction(txn) != DEADLOCK || abortTransaction(txn) != SUCCESS) {
+            printf("transaction committed over a conflict in conflict_index_%d_%d\n", conflict, conflict);
+            return 1;
+        }
+        for (i = 0; i < CONFLICT_TEST_INDEXES; i++) {
+            if (has_record(idx[i], NULL, &k_b, value_one) || has_record(idx[i], NULL, &k_a, value_one) != (i != conflict)) {
+                printf("failed commit changed conflict_index_%d_%d\n", conflict, i);
+                return 1;
+            }
+            closeIndex(idx[i]);
+        }
+    }
+    return 0;
+}
+
+/*
+ A transaction deleting every entry under a key must not also remove an entry committed after it
+ began, which it never saw. Its commit fails and the newer entry survives.
+ */
+static int delete_all_test(void)
+{
+    IdxState *idx;
+    TxnState *txn;
+    Record record;
+    Key k_d;
+    make_key(&k_d, d_key);
+
+    if (create(VARCHAR, "delete_all_index") != SUCCESS || openIndex("delete_all_index", &idx) != SUCCESS) {
+        printf("could not create delete_all_index\n");
+        return 1;
+    }
+    if (insertRecord(idx, NULL, &k_d, value_one) != SUCCESS) {
+        printf("could not insert (d,1) into delete_all_index\n");
+        return 1;
+    }
+    if (beginTransaction(&txn) != SUCCESS) {
+        printf("could not begin delete all transaction\n");
+        return 1;
+    }
+    //(d,2) commits after the transaction took its snapshot
+    if (insertRecord(idx, NULL, &k_d, value_two) != SUCCESS) {
+        printf("could not insert (d,2) into delete_all_index\n");
+        return 1;
+    }
+    memset(&record, 0, sizeof(Record));
+    record.key = k_d;
+    if (deleteRecord(idx, txn, &record) != SUCCESS) {
+        printf("could not delete all of d in delete all transaction\n");
+        return 1;
+    }
+    if (commitTransaction(txn) != DEADLOCK) {
+        printf("delete of all of d committed over the newer (d,2)\n");
+        return 1;
+    }
+    if (abortTransaction(txn) != SUCCESS) {
+        printf("could not abort delete all transaction\n");
+        return 1;
+    }
+    if (!has_record(idx, NULL, &k_d, value_one) || !has_record(idx, NULL, &k_d, value_two)) {
+        printf("failed delete of all of d removed entries\n");
+        return 1;
+    }
+    closeIndex(idx);
+    return 0;
+}
+
+static pthread_barrier_t lock_order_barrier;
+static ErrCode lock_order_result[2];
+
+/*
+ Writes a_key then b_key, or b_key then a_key for the second thread, in one transaction. The
+ barrier makes both hold their first key before either asks for its second.
+ */
+static void *lock_order_func(void *arg)
+{
+    long id = (long) arg;
+    IdxState *idx;
+    TxnState *txn;
+    Key first, second;
+    make_key(&first, id == 0 ? a_key : b_key);
+    make_key(&second, id == 0 ? b_key : a_key);
+
+    lock_order_result[id] = FAILURE;
+    if (openIndex("lock_order_index", &idx) != SUCCESS || beginTransaction(&txn) != SUCCESS) {
+        printf("could not start lock order thread\n");
+        pthread_barrier_wait(&lock_order_barrier);
+        return NULL;
+    }
+    if (insertRecord(idx, txn, &first, value_one) != SUCCESS)
+        printf("could not insert first key in lock order thread\n");
+    pthread_barrier_wait(&lock_order_barrier);
+    lock_order_result[id] = insertRecord(idx, txn, &second, value_two);
+    if (lock_order_result[id] == SUCCESS) {
+        if (commitTransaction(txn) != SUCCESS) {
+            printf("could not commit lock order transaction\n");
+            lock_order_result[id] = FAILURE;
+        }
+    } else {
+        abortTransaction(txn);
+    }
+    closeIndex(idx);
+    return NULL;
+}
+
+/*
+ Two transactions locking two keys in opposite order: exactly one of them is told DEADLOCK, the
+ other goes on and commits.
+ */
+static int lock_order_test(void)
+{
+    IdxState *idx;
+    pthread_t threads[2];
+    long i;
+    Key k_a, k_b;
+    make_key(&k_a, a_key);
+    make_key(&k_b, b_key);
+
+    if (create(VARCHAR, "lock_order_index") != SUCCESS) {
+        printf("could not create lock_order_index\n");
+        return 1;
+    }
+    pthread_barrier_init(&lock_order_barrier, NULL, 2);
+    for (i = 0; i < 2; i++) {
+        if (pthread_create(&threads[i], NULL, lock_order_func, (void *) i) != 0)
+            return 1;
+    }
+    for (i = 0; i < 2; i++)
+        pthread_join(threads[i], NULL);
+    pthread_barrier_destroy(&lock_order_barrier);
+
+    if (!((lock_order_result[0] == DEADLOCK && lock_order_result[1] == SUCCESS) ||
+          (lock_order_result[0] == SUCCESS && lock_order_result[1] == DEADLOCK))) {
+        printf("lock order threads got %i and %i instead of one DEADLOCK\n",
+               lock_order_result[0], lock_order_result[1]);
+        return 1;
+    }
+    //only the surviving transaction's pair is under each key
+    if (openIndex("lock_order_index", &idx) != SUCCESS) {
+        printf("could not open lock_order_index\n");
+        return 1;
+    }
+    i = (lock_order_result[0] == SUCCESS) ? 0 : 1;
+    if (!has_record(idx, NULL, i == 0 ? &k_a : &k_b, value_one) ||
+        !has_record(idx, NULL, i == 0 ? &k_b : &k_a, value_two) ||
+        has_record(idx, NULL, i == 0 ? &k_b : &k_a, value_one)) {
+        printf("lock_order_index does not hold what the surviving transaction wrote\n");
+        return 1;
+    }
+    closeIndex(idx);
+    return 0;
+}
+
+static volatile int range_insert_done;
+static ErrCode range_insert_result;
+
+/*
+ Inserts (b,1) into range_index outside of a transaction, into the range a serializable scan of
+ the main thread holds.
+ */
+static void *range_insert_func()
+{
+    IdxState *idx;
+    Key k_b;
+    make_key(&k_b, b_key);
+
+    range_insert_result = FAILURE;
+    if (openIndex("range_index", &idx) == SUCCESS) {
+        range_insert_result = insertRecord(idx, NULL, &k_b, value_one);
+        closeIndex(idx);
+    }
+    range_insert_done = 1;
+    return NULL;
+}
+
+/*
+ A SERIALIZABLE transaction that scanned from a to c keeps another transaction from inserting b
+ until it commits, so repeating the scan could not find a new entry.
+ */
+static int range_lock_test(void)
+{
+    IdxState *idx;
+    TxnState *txn;
+    Record record;
+    pthread_t inserter;
+    Key k_a, k_b, k_c;
+    make_key(&k_a, a_key);
+    make_key(&k_b, b_key);
+    make_key(&k_c, c_key);
+
+    if (create(VARCHAR, "range_index") != SUCCESS || openIndex("range_index", &idx) != SUCCESS) {
+        printf("could not create range_index\n");
+        return 1;
+    }
+    if (insertRecord(idx, NULL, &k_a, value_one) != SUCCESS || insertRecord(idx, NULL, &k_c, value_one) != SUCCESS) {
+        printf("could not fill range_index\n");
+        return 1;
+    }
+
+    if (beginTransaction(&txn) != SUCCESS || setIsolationLevel(txn, SERIALIZABLE) != SUCCESS) {
+        printf("could not begin serializable scan\n");
+        return 1;
+    }
+    memset(&record, 0, sizeof(Record));
+    record.key = k_a;
+    if (get(idx, txn, &record) != SUCCESS || getNext(idx, txn, &record) != SUCCESS ||
+        strcmp(c_key, record.key.keyval.charkey) != 0) {
+        printf("serializable scan did not find a then c\n");
+        return 1;
+    }
+
+    range_insert_done = 0;
+    if (pthread_create(&inserter, NULL, range_insert_func, NULL) != 0)
+        return 1;
+    wait_thread();
+    if (range_insert_done) {
+        printf("insert into a range a serializable scan read was not blocked\n");
+        return 1;
+    }
+    if (has_record(idx, txn, &k_b, value_one)) {
+        printf("serializable scan sees an entry inserted into its range\n");
+        return 1;
+    }
+    if (commitTransaction(txn) != SUCCESS) {
+        printf("could not commit serializable scan\n");
+        return 1;
+    }
+    pthread_join(inserter, NULL);
+    if (range_insert_result != SUCCESS || !has_record(idx, NULL, &k_b, value_one)) {
+        printf("insert into range_index failed after the scan committed\n");
+        return 1;
+    }
+    closeIndex(idx);
+    return 0;
+}
+
+/*
+ An OPTIMISTIC transaction takes no locks but fails its commit with DEADLOCK when another
+ transaction changed the leaf of a key it read. Left alone it commits.
+ */
+static int optimistic_test(void)
+{
+    IdxState *idx;
+    TxnState *txn;
+    Record record;
+    Key k_a, k_c;
+    make_key(&k_a, a_key);
+    make_key(&k_c, c_key);
+
+    if (create(VARCHAR, "optimistic_index") != SUCCESS || openIndex("optimistic_index", &idx) != SUCCESS) {
+        printf("could not create optimistic_index\n");
+        return 1;
+    }
+    if (insertRecord(idx, NULL, &k_a, value_one) != SUCCESS) {
+        printf("could not insert (a,1) into optimistic_index\n");
+        return 1;
+    }
+
+    if (beginTransaction(&txn) != SUCCESS || setIsolationLevel(txn, OPTIMISTIC) != SUCCESS) {
+        printf("could not begin optimistic transaction\n");
+        return 1;
+    }
+    memset(&record, 0, sizeof(Record));
+    record.key = k_a;
+    if (get(idx, txn, &record) != SUCCESS || insertRecord(idx, txn, &k_c, value_one) != SUCCESS) {
+        printf("could not read and write in optimistic transaction\n");
+        return 1;
+    }
+    //(a,2) lands in the leaf the transaction read a from
+    if (insertRecord(idx, NULL, &k_a, value_two) != SUCCESS) {
+        printf("could not insert (a,2) into optimistic_index\n");
+        return 1;
+    }
+    if (commitTransaction(txn) != DEADLOCK) {
+        printf("optimistic transaction committed over a changed read\n");
+        return 1;
+    }
+    if (abortTransaction(txn) != SUCCESS) {
+        printf("could not abort optimistic transaction\n");
+        return 1;
+    }
+    if (has_record(idx, NULL, &k_c, value_one)) {
+        printf("failed optimistic commit left (c,1) in optimistic_index\n");
+        return 1;
+    }
+
+    if (beginTransaction(&txn) != SUCCESS || setIsolationLevel(txn, OPTIMISTIC) != SUCCESS) {
+        printf("could not begin optimistic transaction\n");
+        return 1;
+    }
+    memset(&record, 0, sizeof(Record));
+    record.key = k_a;
+    if (get(idx, txn, &record) != SUCCESS || insertRecord(idx, txn, &k_c, value_one) != SUCCESS) {
+        printf("could not read and write in optimistic transaction\n");
+        return 1;
+    }
+    if (commitTransaction(txn) != SUCCESS || !has_record(idx, NULL, &k_c, value_one)) {
+        printf("optimistic transaction without a conflict did not commit\n");
+        return 1;
+    }
+    closeIndex(idx);
+    return 0;
+}
+
+/*
+ A READ_ONLY transaction cannot insert or delete, and reads the snapshot taken at its begin even
+ after another transaction committed a change.
+ */
+static int read_only_test(void)
+{
+    IdxState *idx;
+    TxnState *txn;
+    Record record;
+    Key k_a, k_b;
+    make_key(&k_a, a_key);
+    make_key(&k_b, b_key);
+
+    if (create(VARCHAR, "read_only_index") != SUCCESS || openIndex("read_only_index", &idx) != SUCCESS) {
+        printf("could not create read_only_index\n");
+        return 1;
+    }
+    if (insertRecord(idx, NULL, &k_a, value_one) != SUCCESS) {
+        printf("could not insert (a,1) into read_only_index\n");
+        return 1;
+    }
+
+    if (beginTransaction(&txn) != SUCCESS || setIsolationLevel(txn, READ_ONLY) != SUCCESS) {
+        printf("could not begin read only transaction\n");
+        return 1;
+    }
+    memset(&record, 0, sizeof(Record));
+    record.key = k_a;
+    memcpy(record.payload, value_one, strlen(value_one)+1);
+    if (insertRecord(idx, txn, &k_b, value_one) != FAILURE || deleteRecord(idx, txn, &record) != FAILURE) {
+        printf("read only transaction was allowed to write\n");
+        return 1;
+    }
+    //committed after the read only transaction began
+    if (insertRecord(idx, NULL, &k_b, value_one) != SUCCESS || deleteRecord(idx, NULL, &record) != SUCCESS) {
+        printf("could not change read_only_index\n");
+        return 1;
+    }
+    if (!has_record(idx, txn, &k_a, value_one) || has_record(idx, txn, &k_b, value_one)) {
+        printf("read only transaction does not read its snapshot\n");
+        return 1;
+    }
+    memset(&record, 0, sizeof(Record));
+    if (getNext(idx, txn, &record) != DB_END) {
+        printf("read only transaction scanned past its snapshot\n");
+        return 1;
+    }
+    if (setIsolationLevel(txn, SNAPSHOT_ISOLATION) != FAILURE) {
+        printf("read only transaction changed its level after reading\n");
+        return 1;
+    }
+    if (commitTransaction(txn) != SUCCESS) {
+        printf("could not commit read only transaction\n");
+        return 1;
+    }
+    //the next one on this thread scans from the start, not from where that one stopped
+    memset(&record, 0, sizeof(Record));
+    if (beginTransaction(&txn) != SUCCESS || setIsolationLevel(txn, READ_ONLY) != SUCCESS
+            || getNext(idx, txn, &record) != SUCCESS || strcmp(record.key.keyval.charkey, b_key) != 0
+            || commitTransaction(txn) != SUCCESS) {
+        printf("read only transaction did not scan from the first record\n");
+        return 1;
+    }
+    if (has_record(idx, NULL, &k_a, value_one) || !has_record(idx, NULL, &k_b, value_one)) {
+        printf("read_only_index lost the changes made beside the read only transaction\n");
+        return 1;
+    }
+    closeIndex(idx);
+    return 0;
+}
+
+//commits of memtable_test and the changes in each. Together they insert several times
+//MEMTABLE_MAX (4096 in bptree.cc) versions, so mems freeze and merge while the test reads.
+#define MEMTABLE_TEST_KEYS 4000
+#define MEMTABLE_TEST_PAYLOADS 4
+#define MEMTABLE_TEST_ROUNDS 24
+#define MEMTABLE_TEST_OPS 4000
+
+/*
+ An INT record of key and payload v<payload>, or with no payload when payload is -1
+ */
+static void make_memtable_record(Record *record, int64_t key, int payload)
+{
+    memset(record, 0, sizeof(Record));
+    record->key.type = INT;
+    record->key.keyval.intkey = key;
+    if (payload >= 0)
+        snprintf(record->payload, sizeof(record->payload), "v%d", payload);
+}
+
+/*
+ Whether a scan of the whole index and a get of every key find exactly the pairs in held, which
+ has a bit per payload of each key.
+ */
+static int memtable_matches(IdxState *idx, const unsigned char *held)
+{
+    unsigned char seen[MEMTABLE_TEST_KEYS];
+    Record record;
+    ErrCode ret;
+    int64_t k;
+    int p;
+
+    memset(seen, 0, sizeof(seen));
+    make_memtable_record(&record, -1, -1);
+    if (get(idx, NULL, &record) != KEY_NOTFOUND)
+        return 0;
+    while ((ret = getNext(idx, NULL, &record)) == SUCCESS) {
+        k = record.key.keyval.intkey;
+        if (k < 0 || k >= MEMTABLE_TEST_KEYS || sscanf(record.payload, "v%d", &p) != 1 ||
+            p < 0 || p >= MEMTABLE_TEST_PAYLOADS || (seen[k] & (1 << p)))
+            return 0;
+        seen[k] |= 1 << p;
+    }
+    if (ret != DB_END || memcmp(seen, held, sizeof(seen)) != 0)
+        return 0;
+    for (k = 0; k < MEMTABLE_TEST_KEYS; k++) {
+        make_memtable_record(&record, k, -1);
+        if ((get(idx, NULL, &record) == SUCCESS) != (held[k] != 0))
+            return 0;
+    }
+    return 1;
+}
+
+/*
+ Commits enough inserts, duplicate payloads and deletes that mems fill, freeze and are merged into
+ the tree in the background. After each commit the whole index is read back while the pairs of a
+ key can be spread over mem, frozen and the tree, and deleting or inserting again a pair in any of
+ them must return what it did in a reference kept here.
+ */
+static int memtable_test(void)
+{
+    IdxState *idx;
+    TxnState *txn;
+    Record record;
+    unsigned char held[MEMTABLE_TEST_KEYS];
+    ErrCode ret, expect;
+    int64_t k;
+    int round, i, p, op;
+
+    if (create(INT, "memtable_index") != SUCCESS || openIndex("memtable_index", &idx) != SUCCESS) {
+        printf("could not create memtable_index\n");
+        return 1;
+    }
+    memset(held, 0, sizeof(held));
+    srand(7);
+    for (round = 0; round < MEMTABLE_TEST_ROUNDS; round++) {
+        if (beginTransaction(&txn) != SUCCESS) {
+            printf("could not begin memtable_index transaction\n");
+            return 1;
+        }
+        for (i = 0; i < MEMTABLE_TEST_OPS; i++) {
+            k = rand() % MEMTABLE_TEST_KEYS;
+            p = rand() % MEMTABLE_TEST_PAYLOADS;
+            op = rand() % 10;
+            if (op < 6) {
+                make_memtable_record(&record, k, p);
+                expect = (held[k] & (1 << p)) ? ENTRY_EXISTS : SUCCESS;
+                ret = insertRecord(idx, txn, &record.key, record.payload);
+                held[k] |= 1 << p;
+            } else if (op < 9) {
+                make_memtable_record(&record, k, p);
+                expect = (held[k] & (1 << p)) ? SUCCESS : ENTRY_DNE;
+                ret = deleteRecord(idx, txn, &record);
+                held[k] &= ~(1 << p);
+            } else {
+                make_memtable_record(&record, k, -1);
+                expect = held[k] ? SUCCESS : KEY_NOTFOUND;
+                ret = deleteRecord(idx, txn, &record);
+                held[k] = 0;
+            }
+            if (ret != expect) {
+                printf("memtable_index returned %d for a change in round %d, not %d\n", ret, round, expect);
+                return 1;
+            }
+        }
+        if (commitTransaction(txn) != SUCCESS || !memtable_matches(idx, held)) {
+            printf("memtable_index does not hold what round %d committed\n", round);
+            return 1;
+        }
+    }
+    closeIndex(idx);
+    return 0;
+}
+
+/*
+ Runs phase in a child process working in directory dir, so it opens the indexes kept there the way
+ a restarted server would. The child ends with _exit and so stops like a crash, without closing
+ the log. Returns what phase returned.
+ */
+static int run_restarted(const char *dir, int (*phase)(void))
+{
+    pid_t pid;
+    int status;
+
+    fflush(stdout);
+    if ((pid = fork()) < 0)
+        return 1;
+    if (pid == 0) {
+        if (chdir(dir) != 0)
+            _exit(1);
+        status = phase();
+        fflush(stdout);
+        _exit(status);
+    }
+    if (waitpid(pid, &status, 0) != pid || !WIFEXITED(status))
+        return 1;
+    return WEXITSTATUS(status);
+}
+
+static int fresh_dir(const char *dir)
+{
+    char cmd[256];
+    snprintf(cmd, sizeof(cmd), "rm -rf %s && mkdir %s", dir, dir);
+    return system(cmd);
+}
+
+static void make_int_record(Record *record, int64_t key, const char *prefix)
+{
+    memset(record, 0, sizeof(Record));
+    record->key.type = INT;
+    record->key.keyval.intkey = key;
+    snprintf(record->payload, sizeof(record->payload), "%s%lld", prefix, (long long) key);
+}
+
+/*
+ Whether the INT index holds exactly the keys from to to, each once with payload p<key>.
+ */
+static int holds_int_range(IdxState *idx, int64_t from, int64_t to)
+{
+    Record record, expect;
+    int64_t k;
+
+    memset(&record, 0, sizeof(Record));
+    record.key.type = INT;
+    record.key.keyval.intkey = from - 1;
+    if (get(idx, NULL, &record) != KEY_NOTFOUND)
+        return 0;
+    for (k = from; k <= to; k++) {
+        make_int_record(&expect, k, "p");
+        if (getNext(idx, NULL, &record) != SUCCESS || record.key.keyval.intkey != k ||
+            strcmp(expect.payload, record.payload) != 0)
+            return 0;
+    }
+    return getNext(idx, NULL, &record) == DB_END;
+}
+
+#define WAL_TEST_DIR "wal_restart_test"
+#define WAL_TEST_KEYS 100
+
+//size of the last log segment before garbage was appended to it
+static off_t wal_tail_size;
+
+static int wal_write_phase(void)
+{
+    IdxState *idx;
+    TxnState *txn;
+    Record record;
+    int64_t k;
+
+    if (setDurability(WAL_SYNC) != SUCCESS || create(INT, "wal_index") != SUCCESS ||
+        openIndex("wal_index", &idx) != SUCCESS) {
+        printf("could not create wal_index\n");
+        return 1;
+    }
+    for (k = 1; k <= WAL_TEST_KEYS / 2; k++) {
+        make_int_record(&record, k, "p");
+        if (insertRecord(idx, NULL, &record.key, record.payload) != SUCCESS) {
+            printf("could not insert into wal_index\n");
+            return 1;
+        }
+    }
+    if (beginTransaction(&txn) != SUCCESS) {
+        printf("could not begin wal_index transaction\n");
+        return 1;
+    }
+    for (; k <= WAL_TEST_KEYS; k++) {
+        make_int_record(&record, k, "p");
+        if (insertRecord(idx, txn, &record.key, record.payload) != SUCCESS) {
+            printf("could not insert into wal_index\n");
+            return 1;
+        }
+    }
+    if (commitTransaction(txn) != SUCCESS) {
+        printf("could not commit wal_index transaction\n");
+        return 1;
+    }
+    closeIndex(idx);
+    return 0;
+}
+
+static int wal_check_phase(void)
+{
+    IdxState *idx;
+    if (openIndex("wal_index", &idx) != SUCCESS || !holds_int_range(idx, 1, WAL_TEST_KEYS)) {
+        printf("wal_index did not come back from the log\n");
+        return 1;
+    }
+    return 0;
+}
+
+/*
+ Path of the log segment written last, the one named after the highest Lsn.
+ */
+static int last_segment(char *path, size_t len)
+{
+    DIR *dir;
+    struct dirent *e;
+    char last[256] = "";
+
+    if ((dir = opendir(WAL_TEST_DIR "/ENV")) == NULL)
+        return 0;
+    while ((e = readdir(dir)) != NULL) {
+        if (strncmp(e->d_name, "wal.", 4) == 0 && strcmp(e->d_name, last) > 0)
+            snprintf(last, sizeof(last), "%s", e->d_name);
+    }
+    closedir(dir);
+    snprintf(path, len, WAL_TEST_DIR "/ENV/%s", last);
+    return last[0] != '\0';
+}
+
+static int wal_torn_phase(void)
+{
+    IdxState *idx;
+    Record record;
+    char path[512];
+    struct stat st;
+
+    if (openIndex("wal_index", &idx) != SUCCESS || !holds_int_range(idx, 1, WAL_TEST_KEYS)) {
+        printf("wal_index did not come back from a log with a torn tail\n");
+        return 1;
+    }
+    if (chdir("..") != 0 || !last_segment(path, sizeof(path)) || stat(path, &st) != 0 ||
+        st.st_size != wal_tail_size) {
+        printf("torn tail of the log was not cut off\n");
+        return 1;
+    }
+    //appended where the garbage was
+    make_int_record(&record, WAL_TEST_KEYS + 1, "p");
+    if (insertRecord(idx, NULL, &record.key, record.payload) != SUCCESS) {
+        printf("could not insert into wal_index after the torn tail\n");
+        return 1;
+    }
+    return 0;
+}
+
+static int wal_after_torn_phase(void)
+{
+    IdxState *idx;
+    if (openIndex("wal_index", &idx) != SUCCESS || !holds_int_range(idx, 1, WAL_TEST_KEYS + 1)) {
+        printf("commits after a torn tail did not come back from the log\n");
+        return 1;
+    }
+    return 0;
+}
+
+/*
+ Commits made under WAL_SYNC are all there after a restart. Garbage after the last frame of the log,
+ as a crash in the middle of a write leaves, is cut off when the log is opened again: what was
+ committed before it replays, and what is committed after goes where the garbage was.
+ */
+static int wal_restart_test(void)
+{
+    char path[512], garbage[64];
+    struct stat st;
+    FILE *f;
+
+    if (fresh_dir(WAL_TEST_DIR) != 0)
+        return 1;
+    if (run_restarted(WAL_TEST_DIR, wal_write_phase) != 0 || run_restarted(WAL_TEST_DIR, wal_check_phase) != 0)
+        return 1;
+
+    if (!last_segment(path, sizeof(path)) || stat(path, &st) != 0 || (f = fopen(path, "ab")) == NULL) {
+        printf("could not find the log of wal_index\n");
+        return 1;
+    }
+    wal_tail_size = st.st_size;
+    memset(garbage, 0xa5, sizeof(garbage));
+    fwrite(garbage, 1, sizeof(garbage), f);
+    fclose(f);
+
+    if (run_restarted(WAL_TEST_DIR, wal_torn_phase) != 0 || run_restarted(WAL_TEST_DIR, wal_after_torn_phase) != 0)
+        return 1;
+    return 0;
+}
+
+#define RECOVERY_TEST_DIR "recovery_test"
+#define RECOVERY_TEST_KEYS 300
+//keys inserted per transaction
+#define RECOVERY_TEST_BATCH 10
+
+static char *recovery_index[3] = { "recovery_short", "recovery_int", "recovery_varchar" };
+static KeyType recovery_type[3] = { SHORT, INT, VARCHAR };
+
+//the INT keys are spread out so they do not hash to the replay partitions in order
+static void make_typed_key(Key *key, KeyType type, int k)
+{
+    memset(key, 0, sizeof(Key));
+    key->type = type;
+    if (type == SHORT)
+        key->keyval.shortkey = k;
+    else if (type == INT)
+        key->keyval.intkey = (int64_t) k * 7919;
+    else
+        snprintf(key->keyval.charkey, sizeof(key->keyval.charkey), "key%05d", k);
+}
+
+static int typed_key_number(Key *key)
+{
+    if (key->type == SHORT)
+        return key->keyval.shortkey;
+    if (key->type == INT)
+        return (int) (key->keyval.intkey / 7919);
+    return atoi(key->keyval.charkey + 3);
+}
+
+/*
+ Each key gets the payloads a and b. Then a is deleted from every third key and every fifth key is
+ deleted whole, each in a transaction of its own.
+ */
+static int recovery_write_phase(void)
+{
+    IdxState *idx;
+    TxnState *txn;
+    Record record;
+    int i, k;
+
+    for (i = 0; i < 3; i++) {
+        if (create(recovery_type[i], recovery_index[i]) != SUCCESS || openIndex(recovery_index[i], &idx) != SUCCESS) {
+            printf("could not create %s\n", recovery_index[i]);
+            return 1;
+        }
+        for (k = 0; k < RECOVERY_TEST_KEYS; k++) {
+            if ((k % RECOVERY_TEST_BATCH) == 0 && beginTransaction(&txn) != SUCCESS) {
+                printf("could not begin transaction on %s\n", recovery_index[i]);
+                return 1;
+            }
+            make_typed_key(&record.key, recovery_type[i], k);
+            if (insertRecord(idx, txn, &record.key, "a") != SUCCESS || insertRecord(idx, txn, &record.key, "b") != SUCCESS) {
+                printf("could not insert into %s\n", recovery_index[i]);
+                return 1;
+            }
+            if ((k % RECOVERY_TEST_BATCH) == RECOVERY_TEST_BATCH - 1 && commitTransaction(txn) != SUCCESS) {
+                printf("could not commit transaction on %s\n", recovery_index[i]);
+                return 1;
+            }
+        }
+        for (k = 0; k < RECOVERY_TEST_KEYS; k++) {
+            make_typed_key(&record.key, recovery_type[i], k);
+            strcpy(record.payload, "a");
+            if ((k % 3) == 0 && deleteRecord(idx, NULL, &record) != SUCCESS) {
+                printf("could not delete (%i, a) from %s\n", k, recovery_index[i]);
+                return 1;
+            }
+            record.payload[0] = '\0';
+            if ((k % 5) == 0 && deleteRecord(idx, NULL, &record) != SUCCESS) {
+                printf("could not delete %i from %s\n", k, recovery_index[i]);
+                return 1;
+            }
+        }
+        closeIndex(idx);
+    }
+    return 0;
+}
+
+static int recovery_check_phase(void)
+{
+    IdxState *idx;
+    Record record;
+    RecoveryStats stats;
+    int i, k, last, found;
+    int expect = 0, deletes = 0;
+
+    for (k = 0; k < RECOVERY_TEST_KEYS; k++) {
+        if ((k % 5) != 0)
+            expect += ((k % 3) == 0) ? 1 : 2;
+        deletes += ((k % 3) == 0) + ((k % 5) == 0);
+    }
+    for (i = 0; i < 3; i++) {
+        if (openIndex(recovery_index[i], &idx) != SUCCESS) {
+            printf("%s did not come back from the log\n", recovery_index[i]);
+            return 1;
+        }
+        //every pair comes back in key order, none of the deleted ones do
+        memset(&record, 0, sizeof(Record));
+        found = 0;
+        last = -1;
+        while (getNext(idx, NULL, &record) == SUCCESS) {
+            k = typed_key_number(&record.key);
+            if (k < last || (k % 5) == 0 || (strcmp(record.payload, "b") != 0 &&
+                ((k % 3) == 0 || strcmp(record.payload, "a") != 0))) {
+                printf("%s holds (%i, %s) after recovery\n", recovery_index[i], k, record.payload);
+                return 1;
+            }
+            last = k;
+            found++;
+        }
+        if (found != expect) {
+            printf("%s holds %i pairs after recovery instead of %i\n", recovery_index[i], found, expect);
+            return 1;
+        }
+    }
+
+    //a frame per created index and per commit
+    getRecoveryStats(&stats);
+    if (stats.frames != 3 * (1 + RECOVERY_TEST_KEYS / RECOVERY_TEST_BATCH + deletes) ||
+        stats.writes != 3 * (2 * RECOVERY_TEST_KEYS + deletes) || stats.versions != 3 * expect ||
+        stats.threads < 1) {
+        printf("recovery stats are %llu frames, %llu writes, %llu versions\n", (unsigned long long) stats.frames,
+               (unsigned long long) stats.writes, (unsigned long long) stats.versions);
+        return 1;
+    }
+    return 0;
+}
+
+/*
+ Indexes of every key type rebuilt from the log by the parallel replay hold what was committed:
+ duplicate keys keep all their payloads, deleted pairs and keys stay deleted.
+ */
+static int recovery_test(void)
+{
+    if (fresh_dir(RECOVERY_TEST_DIR) != 0)
+        return 1;
+    if (run_restarted(RECOVERY_TEST_DIR, recovery_write_phase) != 0 ||
+        run_restarted(RECOVERY_TEST_DIR, recovery_check_phase) != 0)
+        return 1;
+    return 0;
+}
+
+#define CHECKPOINT_TEST_DIR "checkpoint_test"
+
+/*
+ Commits keys 1 to 50, leaves a transaction that inserted 100 to 109 and deleted 1 open while
+ taking a checkpoint, then commits 51 to 55 after it.
+ */
+static int checkpoint_write_phase(void)
+{
+    IdxState *idx;
+    TxnState *txn;
+    Record record;
+    int64_t k;
+
+    if (create(INT, "checkpoint_index") != SUCCESS || openIndex("checkpoint_index", &idx) != SUCCESS) {
+        printf("could not create checkpoint_index\n");
+        return 1;
+    }
+    for (k = 1; k <= 50; k++) {
+        make_int_record(&record, k, "p");
+        if (insertRecord(idx, NULL, &record.key, record.payload) != SUCCESS) {
+            printf("could not insert into checkpoint_index\n");
+            return 1;
+        }
+    }
+    if (beginTransaction(&txn) != SUCCESS) {
+        printf("could not begin checkpoint_index transaction\n");
+        return 1;
+    }
+    for (k = 100; k < 110; k++) {
+        make_int_record(&record, k, "p");
+        if (insertRecord(idx, txn, &record.key, record.payload) != SUCCESS) {
+            printf("could not insert in checkpoint_index transaction\n");
+            return 1;
+        }
+    }
+    make_int_record(&record, 1, "p");
+    if (deleteRecord(idx, txn, &record) != SUCCESS) {
+        printf("could not delete in checkpoint_index transaction\n");
+        return 1;
+    }
+    if (checkpoint() != SUCCESS) {
+        printf("could not take a checkpoint with a transaction open\n");
+        return 1;
+    }
+    for (k = 51; k <= 55; k++) {
+        make_int_record(&record, k, "p");
+        if (insertRecord(idx, NULL, &record.key, record.payload) != SUCCESS) {
+            printf("could not insert into checkpoint_index after the checkpoint\n");
+            return 1;
+        }
+    }
+    return 0;
+}
+
+static int checkpoint_check_phase(void)
+{
+    IdxState *idx;
+    RecoveryStats stats;
+
+    if (openIndex("checkpoint_index", &idx) != SUCCESS || !holds_int_range(idx, 1, 55)) {
+        printf("checkpoint_index did not come back from its checkpoint\n");
+        return 1;
+    }
+    //the log up to the checkpoint is not read again
+    getRecoveryStats(&stats);
+    if (stats.frames != 5) {
+        printf("recovery from the checkpoint read %llu log frames\n", (unsigned long long) stats.frames);
+        return 1;
+    }
+    return 0;
+}
+
+/*
+ A checkpoint taken while a transaction is open holds what was committed and nothing the open
+ transaction wrote. After a restart the index is loaded from it, and only the log written after it
+ is replayed.
+ */
+static int checkpoint_test(void)
+{
+    if (fresh_dir(CHECKPOINT_TEST_DIR) != 0)
+        return 1;
+    if (run_restarted(CHECKPOINT_TEST_DIR, checkpoint_write_phase) != 0 ||
+        run_restarted(CHECKPOINT_TEST_DIR, checkpoint_check_phase) != 0)
+        return 1;
+    return 0;
+}
+
+#define INCREMENTAL_TEST_DIR "incremental_test"
+//enough keys for many leaves
+#define INCREMENTAL_TEST_KEYS 2000
+//keys appended before the third checkpoint, over a quarter of the tree
+#define INCREMENTAL_TEST_APPENDS 600
+
+/*
+ Reports whether the checkpoint taken since before kept more pages than it wrote
+ */
+static int kept_most_pages(const CheckpointStats *before, const char *which)
+{
+    CheckpointStats after;
+
+    getCheckpointStats(&after);
+    if (after.pagesKept - before->pagesKept == 0 ||
+        after.pagesWritten - before->pagesWritten >= after.pagesKept - before->pagesKept) {
+        printf("%s checkpoint wrote %llu pages and kept %llu\n", which,
+               (unsigned long long) (after.pagesWritten - before->pagesWritten),
+               (unsigned long long) (after.pagesKept - before->pagesKept));
+        return 0;
+    }
+    return 1;
+}
+
+/*
+ Checkpoints keys 1 to INCREMENTAL_TEST_KEYS, adds key 0 to the first leaf and checkpoints again.
+ The second checkpoint must write the changed leaf and keep the pages of most others. The third
+ comes after a commit large next to the tree appended keys behind it, which must not rebuild the
+ leaves it did not reach either.
+ */
+static int incremental_write_phase(void)
+{
+    IdxState *idx;
+    TxnState *txn;
+    Record record;
+    CheckpointStats first, second;
+    int64_t k;
+
+    if (create(INT, "incremental_index") != SUCCESS || openIndex("incremental_index", &idx) != SUCCESS) {
+        printf("could not create incremental_index\n");
+        return 1;
+    }
+    if (beginTransaction(&txn) != SUCCESS) {
+        printf("could not begin incremental_index transaction\n");
+        return 1;
+    }
+    for (k = 1; k <= INCREMENTAL_TEST_KEYS; k++) {
+        make_int_record(&record, k, "p");
+        if (insertRecord(idx, txn, &record.key, record.payload) != SUCCESS) {
+            printf("could not insert into incremental_index\n");
+            return 1;
+        }
+    }
+    if (commitTransaction(txn) != SUCCESS || checkpoint() != SUCCESS) {
+        printf("could not checkpoint incremental_index\n");
+        return 1;
+    }
+    getCheckpointStats(&first);
+
+    make_int_record(&record, 0, "p");
+    if (insertRecord(idx, NULL, &record.key, record.payload) != SUCCESS || checkpoint() != SUCCESS) {
+        printf("could not checkpoint incremental_index again\n");
+        return 1;
+    }
+    if (!kept_most_pages(&first, "second"))
+        return 1;
+    getCheckpointStats(&second);
+
+    if (beginTransaction(&txn) != SUCCESS) {
+        printf("could not begin incremental_index transaction\n");
+        return 1;
+    }
+    for (k = INCREMENTAL_TEST_KEYS + 1; k <= INCREMENTAL_TEST_KEYS + INCREMENTAL_TEST_APPENDS; k++) {
+        make_int_record(&record, k, "p");
+        if (insertRecord(idx, txn, &record.key, record.payload) != SUCCESS) {
+            printf("could not append to incremental_index\n");
+            return 1;
+        }
+    }
+    if (commitTransaction(txn) != SUCCESS || checkpoint() != SUCCESS) {
+        printf("could not checkpoint incremental_index a third time\n");
+        return 1;
+    }
+    if (!kept_most_pages(&second, "third"))
+        return 1;
+    return 0;
+}
+
+static int incremental_check_phase(void)
+{
+    IdxState *idx;
+    RecoveryStats stats;
+
+    if (openIndex("incremental_index", &idx) != SUCCESS
+            || !holds_int_range(idx, 0, INCREMENTAL_TEST_KEYS + INCREMENTAL_TEST_APPENDS)) {
+        printf("incremental_index did not come back from its third checkpoint\n");
+        return 1;
+    }
+    getRecoveryStats(&stats);
+    if (stats.frames != 0) {
+        printf("recovery from the third checkpoint read %llu log frames\n", (unsigned long long) stats.frames);
+        return 1;
+    }
+    return 0;
+}
+
+/*
+ A checkpoint after a small change rewrites only the leaves that changed, and the pages it kept
+ from the one before load back with the rewritten ones.
+ */
+static int incremental_checkpoint_test(void)
+{
+    if (fresh_dir(INCREMENTAL_TEST_DIR) != 0)
+        return 1;
+    if (run_restarted(INCREMENTAL_TEST_DIR, incremental_write_phase) != 0 ||
+        run_restarted(INCREMENTAL_TEST_DIR, incremental_check_phase) != 0)
+        return 1;
+    return 0;
+}
 
 /*
  This tests the basic behavior of the primary index with two transactions. It pushes some of the edges
@@ -285,6 +1650,11 @@ int main(void)
     k_d.type = VARCHAR;
     memcpy(k_d.keyval.charkey, d_key, strlen(d_key)+1);
     
+    //these restart the server in child processes, so they run before this one opens anything
+    if (wal_restart_test() != 0 || recovery_test() != 0 || checkpoint_test() != 0 ||
+        incremental_checkpoint_test() != 0)
+        return EXIT_FAILURE;
+
     //create the primary index
     if ((errCode = create(VARCHAR, primary_index)) != SUCCESS) {
         printf("could not create primary index\n");
@@ -896,6 +2266,11 @@ multi_tbl_txn:
         return EXIT_FAILURE;
     }
     
+    if (abort_test() != 0 || dirty_read_test() != 0 || two_index_test() != 0 || index_conflict_test() != 0 ||
+        delete_all_test() != 0 || lock_order_test() != 0 || range_lock_test() != 0 ||
+        optimistic_test() != 0 || read_only_test() != 0 || memtable_test() != 0)
+        return EXIT_FAILURE;
+
     printf("successfully passed main function tests!\n");
     
     //give secondary thread time to finish -- you can adjust this time if necessary
@@ -0,0 +1,419 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <pthread.h>
+#include <string>
+#include <vector>
+#include <algorithm>
+#include "server.h"
+#include "wal.h"
+
+using namespace std;
+
+//frames longer than this are taken for garbage when replaying
+#define WAL_MAX_FRAME (64 << 20)
+
+//segment files are WAL_PREFIX and their start Lsn in hex
+#define WAL_PREFIX "wal."
+
+struct FrameHeader
+{
+    uint32_t len;
+    uint32_t checksum;
+};
+
+static std::string logDir;
+//start of every segment in order, the last one is written to
+static std::vector<Lsn> segments;
+static int logFd = -1;
+static WalDurability durability = WAL_GROUP;
+
+static pthread_mutex_t WAL_LOCK = PTHREAD_MUTEX_INITIALIZER;
+//signalled when a frame is appended or the log writer has to stop
+static pthread_cond_t WAL_APPENDED = PTHREAD_COND_INITIALIZER;
+//broadcast when a write+fsync finished
+static pthread_cond_t WAL_SYNCED = PTHREAD_COND_INITIALIZER;
+
+//frames appended but not written yet, all guarded by WAL_LOCK
+static std::string pending;
+static Lsn appendedLsn;
+static Lsn durableLsn;
+//a thread is writing out a batch, only one does at a time
+static int writing;
+static int failed;
+static int running;
+static pthread_t writer;
+static int exitHandler;
+
+static WalStats stats;
+
+static uint32_t p_checksum(const char *p, size_t len)
+{
+    uint32_t h = 2166136261u;
+    for (size_t i = 0; i < len; i++) {
+        h ^= (unsigned char) p[i];
+        h *= 16777619u;
+    }
+    return h;
+}
+
+static inline uint64_t p_nowNanos()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static std::string p_segmentPath(Lsn start)
+{
+    char name[64];
+    snprintf(name, sizeof(name), "/" WAL_PREFIX "%016llx", (unsigned long long) start);
+    return logDir + name;
+}
+
+/**
+ * Make a file created or removed in the log directory stick
+ */
+static void p_syncDir()
+{
+    int fd = open(logDir.c_str(), O_RDONLY);
+    if (fd >= 0) {
+        fsync(fd);
+        close(fd);
+    }
+}
+
+static int p_createSegment(Lsn start)
+{
+    int fd = open(p_segmentPath(start).c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd >= 0)
+        p_syncDir();
+    return fd;
+}
+
+static std::vector<Lsn> p_listSegments()
+{
+    std::vector<Lsn> out;
+    DIR *d = opendir(logDir.c_str());
+    if (d == NULL)
+        return out;
+    struct dirent *e;
+    while ((e = readdir(d)) != NULL) {
+        unsigned long long start;
+        char rest;
+        if (strncmp(e->d_name, WAL_PREFIX, strlen(WAL_PREFIX)) == 0
+                && sscanf(e->d_name + strlen(WAL_PREFIX), "%16llx%c", &start, &rest) == 1)
+            out.push_back(start);
+    }
+    closedir(d);
+    std::sort(out.begin(), out.end());
+    return out;
+}
+
+static bool p_writeAll(const char *p, size_t len)
+{
+    while (len > 0) {
+        ssize_t n = write(logFd, p, len);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            return false;
+        }
+        p += n;
+        len -= n;
+    }
+    return true;
+}
+
+/**
+ * Write and sync everything pending as one batch. Called with WAL_LOCK held
+ * and no other write running; drops the lock while writing.
+ */
+static void p_writeOut()
+{
+    std::string batch;
+    batch.swap(pending);
+    Lsn target = appendedLsn;
+    Lsn segStart = segments.back();
+    writing = 1;
+    pthread_mutex_unlock(&WAL_LOCK);
+
+    uint64_t start = p_nowNanos();
+    bool ok = p_writeAll(batch.data(), batch.size()) && (fdatasync(logFd) == 0);
+    uint64_t nanos = p_nowNanos() - start;
+
+    //frames never straddle segments, a full one is closed after a batch
+    if (ok && (target - segStart >= WAL_SEGMENT_BYTES)) {
+        int fd = p_createSegment(target);
+        if (fd >= 0) {
+            close(logFd);
+            logFd = fd;
+            pthread_mutex_lock(&WAL_LOCK);
+            segments.push_back(target);
+            pthread_mutex_unlock(&WAL_LOCK);
+        }
+    }
+
+    pthread_mutex_lock(&WAL_LOCK);
+    writing = 0;
+    if (ok)
+        durableLsn = target;
+    else
+        failed = 1;
+    stats.syncs++;
+    stats.syncNanos += nanos;
+    pthread_cond_broadcast(&WAL_SYNCED);
+}
+
+static void *p_logWriter(void *arg)
+{
+    pthread_mutex_lock(&WAL_LOCK);
+    for (;;) {
+        //under WAL_SYNC the committers write the log themselves
+        while (running && (pending.empty() || writing || durability == WAL_SYNC))
+            pthread_cond_wait(&WAL_APPENDED, &WAL_LOCK);
+        if (!running) {
+            if (writing) {
+                pthread_cond_wait(&WAL_SYNCED, &WAL_LOCK);
+                continue;
+            }
+            if (pending.empty())
+                break;
+        }
+        if (running && durability == WAL_ASYNC) {
+            //nobody waits, let the batch grow
+            pthread_mutex_unlock(&WAL_LOCK);
+            usleep(WAL_ASYNC_MS * 1000);
+            pthread_mutex_lock(&WAL_LOCK);
+        }
+        if (!pending.empty() && !writing && !failed)
+            p_writeOut();
+        else if (failed)
+            pending.clear();
+    }
+    pthread_mutex_unlock(&WAL_LOCK);
+    return NULL;
+}
+
+/**
+ * Hand every whole frame of the segment starting at segStart, from Lsn from
+ * on, to replay. Returns the Lsn just past the last whole frame and in size
+ * the length of the file.
+ */
+static Lsn p_replaySegment(Lsn segStart, Lsn from, WalReplayFn replay, void *arg, Lsn *size)
+{
+    *size = 0;
+    FILE *f = fopen(p_segmentPath(segStart).c_str(), "rb");
+    if (f == NULL)
+        return segStart;
+    fseeko(f, 0, SEEK_END);
+    *size = ftello(f);
+    //the segment ends before from
+    if (from > segStart + *size) {
+        fclose(f);
+        return segStart + *size;
+    }
+    if (fseeko(f, from - segStart, SEEK_SET) != 0) {
+        fclose(f);
+        return segStart;
+    }
+
+    Lsn valid = from;
+    std::string frame;
+    FrameHeader h;
+    while (fread(&h, sizeof(FrameHeader), 1, f) == 1) {
+        if (h.len > WAL_MAX_FRAME)
+            break;
+        frame.resize(h.len);
+        if (h.len > 0 && fread(&frame[0], h.len, 1, f) != 1)
+            break;
+        if (p_checksum(frame.data(), h.len) != h.checksum)
+            break;
+        replay(frame.data(), h.len, arg);
+        valid += sizeof(FrameHeader) + h.len;
+    }
+    fclose(f);
+    return valid;
+}
+
+ErrCode walOpen(const char *dir, Lsn start, WalDurability level, WalReplayFn replay, void *arg)
+{
+    logDir = dir;
+    std::vector<Lsn> segs = p_listSegments();
+    Lsn end = start;
+    int fd = -1;
+
+    for (size_t i = 0; i < segs.size(); i++) {
+        //wholly before start, kept until walTrim
+        if ((i + 1 < segs.size()) && (segs[i + 1] <= start))
+            continue;
+        Lsn size;
+        end = p_replaySegment(segs[i], std::max(segs[i], start), replay, arg, &size);
+        bool torn = (end < segs[i] + size);
+        bool gap = (i + 1 < segs.size()) && (segs[i + 1] != end);
+        if (torn || gap || (i + 1 == segs.size())) {
+            //whatever follows the last whole frame was never acknowledged
+            for (size_t j = i + 1; j < segs.size(); j++)
+                unlink(p_segmentPath(segs[j]).c_str());
+            segs.resize(i + 1);
+            if (end >= start) {
+                fd = open(p_segmentPath(segs[i]).c_str(), O_WRONLY);
+                if (fd >= 0 && (ftruncate(fd, end - segs[i]) != 0
+                            || lseek(fd, end - segs[i], SEEK_SET) != (off_t) (end - segs[i]))) {
+                    close(fd);
+                    return FAILURE;
+                }
+            }
+            break;
+        }
+    }
+    if (fd < 0) {
+        //no log yet, or it ends before start: what is missing was covered
+        //by whatever start came from
+        end = start;
+        if ((fd = p_createSegment(start)) < 0)
+            return FAILURE;
+        if (!segs.empty() && segs.back() == start)
+            segs.pop_back();
+        segs.push_back(start);
+    }
+
+    pthread_mutex_lock(&WAL_LOCK);
+    segments = segs;
+    logFd = fd;
+    durability = level;
+    appendedLsn = durableLsn = end;
+    failed = 0;
+    running = 1;
+    pthread_mutex_unlock(&WAL_LOCK);
+    if (pthread_create(&writer, NULL, p_logWriter, NULL) != 0) {
+        running = 0;
+        close(fd);
+        logFd = -1;
+        return FAILURE;
+    }
+    if (!exitHandler) {
+        exitHandler = 1;
+        atexit(walClose);
+    }
+    return SUCCESS;
+}
+
+void walSetDurability(WalDurability level)
+{
+    pthread_mutex_lock(&WAL_LOCK);
+    durability = level;
+    pthread_cond_signal(&WAL_APPENDED);
+    pthread_mutex_unlock(&WAL_LOCK);
+}
+
+/**
+ * Wait for lsn to be durable, writing the log in this thread when nobody
+ * else will. Called with WAL_LOCK held.
+ */
+static ErrCode p_syncTo(Lsn lsn)
+{
+    while (durableLsn < lsn && !failed) {
+        if (!writing && (durability == WAL_SYNC || !running))
+            p_writeOut();
+        else
+            pthread_cond_wait(&WAL_SYNCED, &WAL_LOCK);
+    }
+    return failed ? FAILURE : SUCCESS;
+}
+
+Lsn walAppend(const char *frame, size_t len)
+{
+    FrameHeader h;
+    h.len = (uint32_t) len;
+    h.checksum = p_checksum(frame, len);
+
+    pthread_mutex_lock(&WAL_LOCK);
+    pending.append((const char *) &h, sizeof(FrameHeader));
+    pending.append(frame, len);
+    appendedLsn += sizeof(FrameHeader) + len;
+    Lsn lsn = appendedLsn;
+    stats.frames++;
+    stats.bytes += sizeof(FrameHeader) + len;
+    if (durability != WAL_SYNC)
+        pthread_cond_signal(&WAL_APPENDED);
+    pthread_mutex_unlock(&WAL_LOCK);
+    return lsn;
+}
+
+Lsn walEnd()
+{
+    pthread_mutex_lock(&WAL_LOCK);
+    Lsn lsn = appendedLsn;
+    pthread_mutex_unlock(&WAL_LOCK);
+    return lsn;
+}
+
+ErrCode walWaitDurable(Lsn lsn)
+{
+    ErrCode ret = SUCCESS;
+
+    pthread_mutex_lock(&WAL_LOCK);
+    if (durability != WAL_ASYNC)
+        ret = p_syncTo(lsn);
+    pthread_mutex_unlock(&WAL_LOCK);
+    return ret;
+}
+
+void walTrim(Lsn lsn)
+{
+    std::vector<Lsn> gone;
+
+    pthread_mutex_lock(&WAL_LOCK);
+    while ((segments.size() >= 2) && (segments[1] <= lsn)) {
+        gone.push_back(segments.front());
+        segments.erase(segments.begin());
+    }
+    pthread_mutex_unlock(&WAL_LOCK);
+
+    for (size_t i = 0; i < gone.size(); i++)
+        unlink(p_segmentPath(gone[i]).c_str());
+    if (!gone.empty())
+        p_syncDir();
+}
+
+void walClose()
+{
+    pthread_mutex_lock(&WAL_LOCK);
+    if (!running) {
+        pthread_mutex_unlock(&WAL_LOCK);
+        return;
+    }
+    running = 0;
+    pthread_cond_signal(&WAL_APPENDED);
+    pthread_mutex_unlock(&WAL_LOCK);
+
+    //the writer drains what is pending before it stops
+    pthread_join(writer, NULL);
+    close(logFd);
+    logFd = -1;
+}
+
+void getWalStats(WalStats *out)
+{
+    pthread_mutex_lock(&WAL_LOCK);
+    *out = stats;
+    pthread_mutex_unlock(&WAL_LOCK);
+}
+
+void printWalStats(FILE *out)
+{
+    WalStats s;
+    getWalStats(&s);
+    fprintf(out, "wal: %llu frames, %llu bytes, %llu syncs\n",
+            (unsigned long long) s.frames, (unsigned long long) s.bytes,
+            (unsigned long long) s.syncs);
+    fprintf(out, "wal sync: avg %.1f us, %.1f frames per sync\n",
+            s.syncs ? (double) s.syncNanos / s.syncs / 1000.0 : 0.0,
+            s.syncs ? (double) s.frames / s.syncs : 0.0);
+}
@@ -0,0 +1,109 @@
+#ifndef _WAL_H_
+#define _WAL_H_
+
+#include <stdio.h>
+#include <stddef.h>
+#include <stdint.h>
+//server.h has no include guard, includers bring it in before this file
+
+/**
+ * Write-ahead log. The log is a sequence of frames, each one a length, a
+ * checksum and the bytes handed to walAppend. A frame is written whole or
+ * not at all as far as replay is concerned: a torn or corrupt frame ends
+ * the log, and it is cut off there.
+ *
+ * Frames are appended to a buffer in memory and written out by a log writer
+ * thread, so commits that come in while one write+fsync is running share
+ * the next one.
+ *
+ * The log is kept in segment files of about WAL_SEGMENT_BYTES, each named
+ * after the Lsn it starts at, so the part a checkpoint covers can be
+ * dropped with walTrim.
+ */
+
+typedef enum WalDurability {
+    //the committing thread writes and syncs the log itself before returning
+    WAL_SYNC,
+    //commits wait for the log writer, which syncs many of them at once
+    WAL_GROUP,
+    //commits do not wait, the log writer syncs every WAL_ASYNC_MS
+    WAL_ASYNC
+} WalDurability;
+
+//longest a commit can be lost for under WAL_ASYNC
+#define WAL_ASYNC_MS 10
+
+//a new segment is started once the current one is this long
+#define WAL_SEGMENT_BYTES (64 << 20)
+
+//position just past a frame in the log, what walWaitDurable waits for
+typedef uint64_t Lsn;
+
+/**
+ * Called for every frame found in the log by walOpen, in log order
+ */
+typedef void (*WalReplayFn)(const char *frame, size_t len, void *arg);
+
+struct WalStats
+{
+    //frames appended
+    uint64_t frames;
+    uint64_t bytes;
+    //write+fsync rounds of the log writer, frames / syncs is the group size
+    uint64_t syncs;
+    uint64_t syncNanos;
+};
+
+/**
+ Replay the log kept in directory dir through replay, starting with the
+ frame at start, cut off a torn tail and open it for appending. Starts an
+ empty log at start if there is none.
+
+ @return ErrCode
+ SUCCESS if the log is open.
+ FAILURE if it could not be read or created.
+ */
+ErrCode walOpen(const char *dir, Lsn start, WalDurability level, WalReplayFn replay, void *arg);
+
+/**
+ Change the durability of the commits appended from now on
+ */
+void walSetDurability(WalDurability level);
+
+/**
+ Append one frame and return the Lsn to pass to walWaitDurable. Never waits
+ for the disk, so it may be called with locks held.
+ */
+Lsn walAppend(const char *frame, size_t len);
+
+/**
+ Lsn just past the last frame appended
+ */
+Lsn walEnd();
+
+/**
+ Wait until everything appended up to lsn is on disk. Returns at once under
+ WAL_ASYNC.
+
+ @return ErrCode
+ SUCCESS once it is durable (or nobody waits for it).
+ FAILURE if writing the log failed; nothing appended after the failure is
+ made durable.
+ */
+ErrCode walWaitDurable(Lsn lsn);
+
+/**
+ Delete the segments that hold nothing at or after lsn
+ */
+void walTrim(Lsn lsn);
+
+/**
+ Write out and sync everything appended and stop the log writer. Also run at
+ exit.
+ */
+void walClose();
+
+void getWalStats(WalStats *stats);
+void printWalStats(FILE *out);
+
+#endif